@@ -0,0 +1,252 @@
+-- Fast accessors of task data
+--
+-- When rspamd is running with LuaJIT, these functions use flat C accessors via
+-- FFI and do not create intermediate tables and userdata for urls, headers
+-- and text parts. Otherwise they fall back to the methods of task object, so
+-- plugins can use this module unconditionally:
+--
+-- local task_ffi = require "rspamd_task_ffi"
+--
+-- for host, text in task_ffi.urls(task) do
+--   ...
+-- end
+
+local exports = {}
+
+-- Classic implementation using task methods
+local function classic_get_header(task, name, strong)
+	return task:get_header(name, strong)
+end
+
+local function classic_get_header_raw(task, name, strong)
+	return task:get_header_raw(name, strong)
+end
+
+local function classic_headers(task, name, strong)
+	local hdrs = task:get_header_full(name, strong) or {}
+	local i = 0
+
+	return function()
+		i = i + 1
+		local h = hdrs[i]
+		if h then
+			return h['name'], h['value'], h['decoded']
+		end
+	end
+end
+
+local function classic_urls_count(task)
+	return #task:get_urls()
+end
+
+local function classic_urls(task)
+	local urls = task:get_urls()
+	local i = 0
+
+	return function()
+		i = i + 1
+		local u = urls[i]
+		if u then
+			return u:get_host(), u:get_text()
+		end
+	end
+end
+
+local function classic_text_parts(task)
+	local parts = task:get_text_parts()
+	local i = 0
+
+	return function()
+		i = i + 1
+		local p = parts[i]
+		if p then
+			return p:get_content() or '', p:is_html(), p:get_language()
+		end
+	end
+end
+
+local function classic_get_from_ip(task)
+	local ip = task:get_from_ip()
+	if ip and ip:is_valid() then
+		return ip:to_string()
+	end
+	return nil
+end
+
+exports.ffi = false
+exports.get_header = classic_get_header
+exports.get_header_raw = classic_get_header_raw
+exports.headers = classic_headers
+exports.urls_count = classic_urls_count
+exports.urls = classic_urls
+exports.text_parts = classic_text_parts
+exports.get_from_ip = classic_get_from_ip
+
+-- Export classic implementation to compare both paths
+exports.classic = {
+	get_header = classic_get_header,
+	get_header_raw = classic_get_header_raw,
+	headers = classic_headers,
+	urls_count = classic_urls_count,
+	urls = classic_urls,
+	text_parts = classic_text_parts,
+	get_from_ip = classic_get_from_ip,
+}
+
+local has_ffi, ffi = pcall(require, 'ffi')
+if not has_ffi then
+	return exports
+end
+
+-- Must be kept in sync with src/lua/lua_task_ffi.h
+ffi.cdef[[
+struct rspamd_lua_ffi_header {
+	const char *name;
+	const char *value;
+	const char *decoded;
+	const char *separator;
+	int tab_separated;
+	int empty_separator;
+};
+
+struct rspamd_lua_ffi_url {
+	const char *string;
+	const char *host;
+	const char *user;
+	const char *data;
+	unsigned int hostlen;
+	unsigned int userlen;
+	unsigned int datalen;
+	int protocol;
+	int is_phished;
+};
+
+struct rspamd_lua_ffi_text_part {
+	const char *content;
+	size_t len;
+	const char *lang;
+	int is_html;
+	int is_empty;
+	int is_utf;
+};
+]]
+
+local api = require "rspamd_task_ffi_api"
+local C = {
+	get_header = ffi.cast('const char *(*)(void *, const char *, int, int)',
+		api.get_header),
+	get_headers = ffi.cast('unsigned int (*)(void *, const char *, int, ' ..
+		'struct rspamd_lua_ffi_header *, unsigned int)', api.get_headers),
+	urls_count = ffi.cast('unsigned int (*)(void *)', api.urls_count),
+	get_urls = ffi.cast('unsigned int (*)(void *, ' ..
+		'struct rspamd_lua_ffi_url *, unsigned int)', api.get_urls),
+	text_parts_count = ffi.cast('unsigned int (*)(void *)',
+		api.text_parts_count),
+	get_text_parts = ffi.cast('unsigned int (*)(void *, ' ..
+		'struct rspamd_lua_ffi_text_part *, unsigned int)', api.get_text_parts),
+	get_from_ip = ffi.cast('int (*)(void *, char *, size_t)', api.get_from_ip),
+}
+
+local header_t = ffi.typeof('struct rspamd_lua_ffi_header[?]')
+local url_t = ffi.typeof('struct rspamd_lua_ffi_url[?]')
+local part_t = ffi.typeof('struct rspamd_lua_ffi_text_part[?]')
+local ip_buf = ffi.new('char[?]', 64)
+
+local function cstring(s)
+	if s ~= nil then
+		return ffi.string(s)
+	end
+	return nil
+end
+
+local function empty_iter()
+	return nil
+end
+
+exports.get_header = function(task, name, strong)
+	return cstring(C.get_header(task, name, strong and 1 or 0, 0))
+end
+
+exports.get_header_raw = function(task, name, strong)
+	return cstring(C.get_header(task, name, strong and 1 or 0, 1))
+end
+
+exports.headers = function(task, name, strong)
+	local istrong = strong and 1 or 0
+	local nhdrs = C.get_headers(task, name, istrong, nil, 0)
+
+	if nhdrs == 0 then
+		return empty_iter
+	end
+
+	local hdrs = header_t(nhdrs)
+	C.get_headers(task, name, istrong, hdrs, nhdrs)
+	local i = -1
+
+	return function()
+		i = i + 1
+		if i < nhdrs then
+			local h = hdrs[i]
+			return cstring(h.name), cstring(h.value), cstring(h.decoded)
+		end
+	end
+end
+
+exports.urls_count = function(task)
+	return tonumber(C.urls_count(task))
+end
+
+exports.urls = function(task)
+	local nurls = C.urls_count(task)
+
+	if nurls == 0 then
+		return empty_iter
+	end
+
+	local urls = url_t(nurls)
+	nurls = C.get_urls(task, urls, nurls)
+	local i = -1
+
+	return function()
+		i = i + 1
+		if i < nurls then
+			local u = urls[i]
+			return ffi.string(u.host, u.hostlen), cstring(u.string)
+		end
+	end
+end
+
+exports.text_parts = function(task)
+	local nparts = C.text_parts_count(task)
+
+	if nparts == 0 then
+		return empty_iter
+	end
+
+	local parts = part_t(nparts)
+	nparts = C.get_text_parts(task, parts, nparts)
+	local i = -1
+
+	return function()
+		i = i + 1
+		if i < nparts then
+			local p = parts[i]
+			local content = ''
+			if p.content ~= nil then
+				content = ffi.string(p.content, p.len)
+			end
+			return content, p.is_html ~= 0, cstring(p.lang)
+		end
+	end
+end
+
+exports.get_from_ip = function(task)
+	if C.get_from_ip(task, ip_buf, 64) ~= 0 then
+		return ffi.string(ip_buf)
+	end
+	return nil
+end
+
+exports.ffi = true
+
+return exports
@@ -25,6 +25,7 @@
 #include "config.h"
 #include "util.h"
 #include "http.h"
+#include "msgpack.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -57,6 +58,9 @@ static gboolean json = FALSE;
 static gboolean headers = FALSE;
 static gboolean raw = FALSE;
 static gboolean extended_urls = FALSE;
+static gboolean msgpack = FALSE;
+static gboolean batch = FALSE;
+static gint batch_size = 100;
 
 static GOptionEntry entries[] =
 {
@@ -106,6 +110,12 @@ static GOptionEntry entries[] =
 	  "Maximum count of parallel requests to rspamd", NULL },
 	{ "extended-urls", 0, 0, G_OPTION_ARG_NONE, &extended_urls,
 	   "Output urls in extended format", NULL },
+	{ "msgpack", 0, 0, G_OPTION_ARG_NONE, &msgpack,
+	   "Request compact binary (msgpack) reply from rspamd", NULL },
+	{ "batch", 'B', 0, G_OPTION_ARG_NONE, &batch,
+	   "Scan directories and mbox files using batch requests", NULL },
+	{ "batch-size", 0, 0, G_OPTION_ARG_INT, &batch_size,
+	   "Maximum count of messages in a single batch request", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -124,6 +134,7 @@ enum rspamc_command_type {
 	RSPAMC_COMMAND_STAT,
 	RSPAMC_COMMAND_STAT_RESET,
 	RSPAMC_COMMAND_COUNTERS,
+	RSPAMC_COMMAND_COUNTERS_RESET,
 	RSPAMC_COMMAND_UPTIME,
 	RSPAMC_COMMAND_ADD_SYMBOL,
 	RSPAMC_COMMAND_ADD_ACTION
@@ -221,6 +232,16 @@ struct rspamc_command {
 		.need_input = FALSE,
 		.command_output_func = rspamc_counters_output
 	},
+	{
+		.cmd = RSPAMC_COMMAND_COUNTERS_RESET,
+		.name = "counters_reset",
+		.path = "countersreset",
+		.description = "display rspamd symbols statistics and reset latencies",
+		.is_controller = TRUE,
+		.is_privileged = TRUE,
+		.need_input = FALSE,
+		.command_output_func = rspamc_counters_output
+	},
 	{
 		.cmd = RSPAMC_COMMAND_UPTIME,
 		.name = "uptime",
@@ -256,6 +277,14 @@ struct rspamc_command {
 struct rspamc_callback_data {
 	struct rspamc_command *cmd;
 	gchar *filename;
+	GPtrArray *names;
+	gboolean headers_shown;
+};
+
+/* Messages collected for a batch request */
+struct rspamc_batch {
+	FILE *data;
+	GPtrArray *names;
 };
 
 /*
@@ -321,6 +350,9 @@ check_rspamc_command (const gchar *cmd)
 	else if (g_ascii_strcasecmp (cmd, "COUNTERS") == 0) {
 		ct = RSPAMC_COMMAND_COUNTERS;
 	}
+	else if (g_ascii_strcasecmp (cmd, "COUNTERS_RESET") == 0) {
+		ct = RSPAMC_COMMAND_COUNTERS_RESET;
+	}
 	else if (g_ascii_strcasecmp (cmd, "UPTIME") == 0) {
 		ct = RSPAMC_COMMAND_UPTIME;
 	}
@@ -406,6 +438,9 @@ add_options (GHashTable *opts)
 	if (extended_urls) {
 		g_hash_table_insert (opts, "URL-Format", "extended");
 	}
+	if (msgpack) {
+		g_hash_table_insert (opts, "Accept", RSPAMD_MSGPACK_CTYPE);
+	}
 }
 
 static void
@@ -575,9 +610,9 @@ rspamc_uptime_output (ucl_object_t *obj)
 static void
 rspamc_counters_output (ucl_object_t *obj)
 {
-	const ucl_object_t *cur, *sym, *weight, *freq, *tim;
+	const ucl_object_t *cur, *sym, *weight, *freq, *tim, *wall, *p99, *max;
 	ucl_object_iter_t iter = NULL;
-	gchar fmt_buf[64], dash_buf[82];
+	gchar fmt_buf[80], dash_buf[106];
 	gint l, max_len = INT_MIN, i;
 
 	if (obj->type != UCL_ARRAY) {
@@ -596,21 +631,23 @@ rspamc_counters_output (ucl_object_t *obj)
 	}
 
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3s | %%%ds | %%6s | %%9s | %%9s |\n", max_len);
-	memset (dash_buf, '-', 40 + max_len);
-	dash_buf[40 + max_len] = '\0';
+		"| %%3s | %%%ds | %%6s | %%9s | %%9s | %%9s | %%9s |\n", max_len);
+	memset (dash_buf, '-', 64 + max_len);
+	dash_buf[64 + max_len] = '\0';
 
 	printf ("Symbols cache\n");
 	printf (" %s \n", dash_buf);
 	if (tty) {
 		printf ("\033[1m");
 	}
-	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time");
+	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time",
+		"p99 (ms)", "Max (ms)");
 	if (tty) {
 		printf ("\033[0m");
 	}
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f |\n", max_len);
+		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f | %%9.3f | %%9.3f |\n",
+		max_len);
 
 	iter = NULL;
 	i = 0;
@@ -620,12 +657,18 @@ rspamc_counters_output (ucl_object_t *obj)
 		weight = ucl_object_find_key (cur, "weight");
 		freq = ucl_object_find_key (cur, "frequency");
 		tim = ucl_object_find_key (cur, "time");
+		/* Wall time includes waiting for DNS and other async events */
+		wall = ucl_object_find_key (cur, "wall");
+		p99 = wall ? ucl_object_find_key (wall, "p99") : NULL;
+		max = wall ? ucl_object_find_key (wall, "max") : NULL;
 		if (sym && weight && freq && tim) {
 			printf (fmt_buf, i,
 				ucl_object_tostring (sym),
 				ucl_object_todouble (weight),
 				(gint)ucl_object_toint (freq),
-				ucl_object_todouble (tim));
+				ucl_object_todouble (tim),
+				p99 ? ucl_object_toint (p99) / 1000.0 : 0.0,
+				max ? ucl_object_toint (max) / 1000.0 : 0.0);
 		}
 		i++;
 	}
@@ -747,57 +790,118 @@ rspamc_output_headers (struct rspamd_http_message *msg)
 	rspamd_fprintf (stdout, "\n");
 }
 
+static void
+rspamc_output_result (struct rspamc_command *cmd, ucl_object_t *result)
+{
+	gchar *out;
+
+	if (raw || cmd->command_output_func == NULL) {
+		if (json) {
+			out = ucl_object_emit (result, UCL_EMIT_JSON);
+		}
+		else {
+			out = ucl_object_emit (result, UCL_EMIT_CONFIG);
+		}
+		printf ("%s", out);
+		free (out);
+	}
+	else {
+		cmd->command_output_func (result);
+	}
+}
+
+/*
+ * Called for each result of a batch as soon as it is received
+ */
+static void
+rspamc_batch_chunk_cb (struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name, ucl_object_t *result,
+	gpointer ud)
+{
+	struct rspamc_callback_data *cbdata = (struct rspamc_callback_data *)ud;
+	const ucl_object_t *elt;
+	gint64 idx;
+
+	if (headers && !cbdata->headers_shown) {
+		rspamc_output_headers (msg);
+		cbdata->headers_shown = TRUE;
+	}
+
+	elt = ucl_object_find_key (result, "index");
+	idx = elt != NULL ? ucl_object_toint (elt) : -1;
+
+	if (idx >= 0 && idx < (gint64)cbdata->names->len) {
+		rspamd_fprintf (stdout, "Results for file: %s\n",
+			g_ptr_array_index (cbdata->names, idx));
+	}
+	else {
+		rspamd_fprintf (stdout, "Results for unknown file\n");
+	}
+
+	rspamc_output_result (cbdata->cmd, result);
+	rspamd_fprintf (stdout, "\n");
+	fflush (stdout);
+	ucl_object_unref (result);
+}
+
 static void
 rspamc_client_cb (struct rspamd_client_connection *conn,
 	struct rspamd_http_message *msg,
 	const gchar *name, ucl_object_t *result,
 	gpointer ud, GError *err)
 {
-	gchar *out;
 	struct rspamc_callback_data *cbdata = (struct rspamc_callback_data *)ud;
 	struct rspamc_command *cmd;
 
 	cmd = cbdata->cmd;
-	if (cmd->need_input) {
-		rspamd_fprintf (stdout, "Results for file: %s\n", cbdata->filename);
+
+	if (cbdata->names != NULL) {
+		/* Results have been printed by rspamc_batch_chunk_cb */
+		if (result != NULL) {
+			rspamc_output_result (cmd, result);
+			rspamd_fprintf (stdout, "\n");
+			ucl_object_unref (result);
+		}
+		else if (err != NULL) {
+			rspamd_fprintf (stdout, "Batch error: %s\n\n", err->message);
+		}
 	}
 	else {
-		rspamd_fprintf (stdout, "Results for command: %s\n", cmd->name);
-	}
-	if (result != NULL) {
-		if (headers && msg != NULL) {
-			rspamc_output_headers (msg);
+		if (cmd->need_input) {
+			rspamd_fprintf (stdout, "Results for file: %s\n",
+				cbdata->filename);
 		}
-		if (raw || cmd->command_output_func == NULL) {
-			if (json) {
-				out = ucl_object_emit (result, UCL_EMIT_JSON);
-			}
-			else {
-				out = ucl_object_emit (result, UCL_EMIT_CONFIG);
+		else {
+			rspamd_fprintf (stdout, "Results for command: %s\n", cmd->name);
+		}
+		if (result != NULL) {
+			if (headers && msg != NULL) {
+				rspamc_output_headers (msg);
 			}
-			printf ("%s", out);
-			free (out);
+			rspamc_output_result (cmd, result);
+			ucl_object_unref (result);
 		}
-		else {
-			cmd->command_output_func (result);
+		else if (err != NULL) {
+			rspamd_fprintf (stdout, "%s\n", err->message);
 		}
-		ucl_object_unref (result);
-	}
-	else if (err != NULL) {
-		rspamd_fprintf (stdout, "%s\n", err->message);
+
+		rspamd_fprintf (stdout, "\n");
 	}
 
-	rspamd_fprintf (stdout, "\n");
 	fflush (stdout);
 
 	rspamd_client_destroy (conn);
 	g_free (cbdata->filename);
+	if (cbdata->names != NULL) {
+		g_ptr_array_free (cbdata->names, TRUE);
+	}
 	g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
 }
 
 static void
 rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
-	FILE *in, const gchar *name, GHashTable *attrs)
+	FILE *in, const gchar *name, GPtrArray *names, GHashTable *attrs)
 {
 	struct rspamd_client_connection *conn;
 	gchar **connectv;
@@ -826,11 +930,21 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 	conn = rspamd_client_init (ev_base, connectv[0], port, timeout);
 	g_strfreev (connectv);
 
+	if (conn == NULL && names != NULL) {
+		g_ptr_array_free (names, TRUE);
+	}
+
 	if (conn != NULL) {
 		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
 		cbdata->cmd = cmd;
 		cbdata->filename = g_strdup (name);
-		if (cmd->need_input) {
+		cbdata->names = names;
+		cbdata->headers_shown = FALSE;
+		if (names != NULL) {
+			rspamd_client_batch_command (conn, attrs, in,
+				rspamc_batch_chunk_cb, rspamc_client_cb, cbdata, &err);
+		}
+		else if (cmd->need_input) {
 			rspamd_client_command (conn, cmd->path, attrs, in, rspamc_client_cb,
 				cbdata, &err);
 		}
@@ -877,7 +991,7 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 						fprintf (stderr, "cannot open file %s\n", filebuf);
 						exit (EXIT_FAILURE);
 					}
-					rspamc_process_input (ev_base, cmd, in, filebuf, attrs);
+					rspamc_process_input (ev_base, cmd, in, filebuf, NULL, attrs);
 					cur_req++;
 					fclose (in);
 					if (cur_req >= max_requests) {
@@ -898,6 +1012,159 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 	event_base_loop (ev_base, 0);
 }
 
+static void
+rspamc_batch_flush (struct event_base *ev_base, struct rspamc_command *cmd,
+	struct rspamc_batch *b, const gchar *name, GHashTable *attrs)
+{
+	static gint cur_req = 0;
+
+	if (b->names == NULL || b->names->len == 0) {
+		return;
+	}
+
+	rewind (b->data);
+	rspamc_process_input (ev_base, cmd, b->data, name, b->names, attrs);
+	fclose (b->data);
+	b->data = NULL;
+	b->names = NULL;
+
+	if (++cur_req >= max_requests) {
+		cur_req = 0;
+		/* Wait for completion */
+		event_base_loop (ev_base, 0);
+	}
+}
+
+static void
+rspamc_batch_add (struct event_base *ev_base, struct rspamc_command *cmd,
+	struct rspamc_batch *b, const gchar *name, const gchar *data, gsize len,
+	GHashTable *attrs)
+{
+	if (b->data == NULL) {
+		b->data = tmpfile ();
+		if (b->data == NULL) {
+			fprintf (stderr, "cannot create temporary file: %s\n",
+				strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+		b->names = g_ptr_array_new_with_free_func (g_free);
+	}
+
+	/* Each message is prefixed by its length */
+	rspamd_fprintf (b->data, "%z\n", len);
+	if (fwrite (data, 1, len, b->data) != len) {
+		fprintf (stderr, "cannot write temporary file: %s\n",
+			strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	g_ptr_array_add (b->names, g_strdup (name));
+
+	if ((gint)b->names->len >= batch_size) {
+		rspamc_batch_flush (ev_base, cmd, b, name, attrs);
+	}
+}
+
+/*
+ * Split mbox file to messages: each message starts with `From ` line at the
+ * beginning of the file or after an empty line
+ */
+static void
+rspamc_batch_mbox (struct event_base *ev_base, struct rspamc_command *cmd,
+	struct rspamc_batch *b, const gchar *name, const gchar *data, gsize len,
+	GHashTable *attrs)
+{
+	const gchar *p, *end, *msg_start = NULL, *eol;
+	gchar namebuf[PATH_MAX];
+	guint nmsg = 0;
+
+	p = data;
+	end = data + len;
+
+	while (p < end) {
+		if (end - p > 5 && memcmp (p, "From ", 5) == 0 &&
+			(p == data || (p - data >= 2 && p[-1] == '\n' &&
+			(p[-2] == '\n' || (p[-2] == '\r' && p - data >= 3 &&
+			p[-3] == '\n'))))) {
+			if (msg_start != NULL && p > msg_start) {
+				rspamd_snprintf (namebuf, sizeof (namebuf), "%s:%ud",
+					name, nmsg++);
+				rspamc_batch_add (ev_base, cmd, b, namebuf, msg_start,
+					p - msg_start, attrs);
+			}
+			/* Skip envelope line */
+			eol = memchr (p, '\n', end - p);
+			p = eol != NULL ? eol + 1 : end;
+			msg_start = p;
+			continue;
+		}
+
+		eol = memchr (p, '\n', end - p);
+		p = eol != NULL ? eol + 1 : end;
+	}
+
+	if (msg_start != NULL && end > msg_start) {
+		rspamd_snprintf (namebuf, sizeof (namebuf), "%s:%ud", name, nmsg);
+		rspamc_batch_add (ev_base, cmd, b, namebuf, msg_start,
+			end - msg_start, attrs);
+	}
+}
+
+static void
+rspamc_batch_file (struct event_base *ev_base, struct rspamc_command *cmd,
+	struct rspamc_batch *b, const gchar *name, GHashTable *attrs)
+{
+	gchar *data;
+	gsize len;
+	GError *err = NULL;
+
+	if (!g_file_get_contents (name, &data, &len, &err)) {
+		fprintf (stderr, "cannot read file %s: %s\n", name, err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (len == 0) {
+		g_free (data);
+		return;
+	}
+
+	if (len > 5 && memcmp (data, "From ", 5) == 0) {
+		rspamc_batch_mbox (ev_base, cmd, b, name, data, len, attrs);
+	}
+	else {
+		rspamc_batch_add (ev_base, cmd, b, name, data, len, attrs);
+	}
+
+	g_free (data);
+}
+
+static void
+rspamc_batch_dir (struct event_base *ev_base, struct rspamc_command *cmd,
+	struct rspamc_batch *b, const gchar *name, GHashTable *attrs)
+{
+	DIR *d;
+	struct dirent *ent;
+	struct stat sb;
+	char filebuf[PATH_MAX];
+
+	d = opendir (name);
+
+	if (d == NULL) {
+		fprintf (stderr, "cannot open directory %s\n", name);
+		exit (EXIT_FAILURE);
+	}
+
+	while ((ent = readdir (d))) {
+		rspamd_snprintf (filebuf, sizeof (filebuf), "%s%c%s",
+			name, G_DIR_SEPARATOR, ent->d_name);
+		if (stat (filebuf, &sb) == 0 && S_ISREG (sb.st_mode) &&
+			access (filebuf, R_OK) != -1) {
+			rspamc_batch_file (ev_base, cmd, b, filebuf, attrs);
+		}
+	}
+
+	closedir (d);
+}
+
 gint
 main (gint argc, gchar **argv, gchar **env)
 {
@@ -907,6 +1174,7 @@ main (gint argc, gchar **argv, gchar **env)
 	FILE *in = NULL;
 	struct event_base *ev_base;
 	struct stat st;
+	struct rspamc_batch b = { NULL, NULL };
 
 	kwattrs = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 
@@ -972,7 +1240,7 @@ main (gint argc, gchar **argv, gchar **env)
 
 	if (start_argc == argc) {
 		/* Do command without input or with stdin */
-		rspamc_process_input (ev_base, cmd, in, "stdin", kwattrs);
+		rspamc_process_input (ev_base, cmd, in, "stdin", NULL, kwattrs);
 	}
 	else {
 		for (i = start_argc; i < argc; i++) {
@@ -980,6 +1248,16 @@ main (gint argc, gchar **argv, gchar **env)
 				fprintf (stderr, "cannot stat file %s\n", argv[i]);
 				exit (EXIT_FAILURE);
 			}
+			if (batch && cmd->cmd == RSPAMC_COMMAND_SYMBOLS) {
+				/* Collect messages into batch requests */
+				if (S_ISDIR (st.st_mode)) {
+					rspamc_batch_dir (ev_base, cmd, &b, argv[i], kwattrs);
+				}
+				else {
+					rspamc_batch_file (ev_base, cmd, &b, argv[i], kwattrs);
+				}
+				continue;
+			}
 			if (S_ISDIR (st.st_mode)) {
 				/* Directories are processed with a separate limit */
 				rspamc_process_dir (ev_base, cmd, argv[i], kwattrs);
@@ -991,7 +1269,7 @@ main (gint argc, gchar **argv, gchar **env)
 					fprintf (stderr, "cannot open file %s\n", argv[i]);
 					exit (EXIT_FAILURE);
 				}
-				rspamc_process_input (ev_base, cmd, in, argv[i], kwattrs);
+				rspamc_process_input (ev_base, cmd, in, argv[i], NULL, kwattrs);
 				cur_req++;
 				fclose (in);
 			}
@@ -1003,6 +1281,7 @@ main (gint argc, gchar **argv, gchar **env)
 		}
 	}
 
+	rspamc_batch_flush (ev_base, cmd, &b, "batch", kwattrs);
 	event_base_loop (ev_base, 0);
 
 	g_hash_table_destroy (kwattrs);
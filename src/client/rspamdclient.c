@@ -24,6 +24,7 @@
 #include "rspamdclient.h"
 #include "util.h"
 #include "http.h"
+#include "msgpack.h"
 
 #ifdef HAVE_FETCH_H
 #include <fetch.h>
@@ -31,6 +32,9 @@
 #include <curl/curl.h>
 #endif
 
+/* Content type of streamed batch replies */
+#define RCLIENT_BATCH_CTYPE "application/x-rspamd-batch"
+
 struct rspamd_client_request;
 
 /*
@@ -50,6 +54,8 @@ struct rspamd_client_request {
 	struct rspamd_client_connection *conn;
 	struct rspamd_http_message *msg;
 	rspamd_client_callback cb;
+	rspamd_client_chunk_callback chunk_cb;
+	GError *err;
 	gpointer ud;
 };
 
@@ -60,12 +66,179 @@ rspamd_client_error_quark (void)
 	return g_quark_from_static_string ("rspamd-client-error");
 }
 
+static ucl_object_t *
+rspamd_client_parse_object (const gchar *data, gsize len, gboolean is_msgpack,
+	GError **err)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *obj;
+
+	if (is_msgpack) {
+		return rspamd_msgpack_to_ucl ((const guchar *)data, len, err);
+	}
+
+	parser = ucl_parser_new (0);
+	if (!ucl_parser_add_chunk (parser, data, len)) {
+		g_set_error (err, RCLIENT_ERROR, EINVAL, "Cannot parse UCL: %s",
+			ucl_parser_get_error (parser));
+		ucl_parser_free (parser);
+		return NULL;
+	}
+
+	obj = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+
+	return obj;
+}
+
+/*
+ * Batch reply is a sequence of records: `<index> <length>\n<reply>`.
+ * Returns the length of the parsed record, 0 if the record is not complete yet
+ * and -1 on error
+ */
+static gssize
+rspamd_client_parse_record (const gchar *data, gsize len, gboolean is_msgpack,
+	ucl_object_t **pobj, GError **err)
+{
+	ucl_object_t *obj;
+	const gchar *p, *end, *nl;
+	gchar *err_str;
+	gulong idx, rlen;
+
+	end = data + len;
+	nl = memchr (data, '\n', len);
+	if (nl == NULL) {
+		return 0;
+	}
+
+	idx = strtoul (data, &err_str, 10);
+	if (err_str == data || err_str >= nl || *err_str != ' ') {
+		goto err;
+	}
+	p = err_str + 1;
+	rlen = strtoul (p, &err_str, 10);
+	if (err_str == p || err_str != nl) {
+		goto err;
+	}
+	p = nl + 1;
+	if (rlen > (gulong)(end - p)) {
+		return 0;
+	}
+
+	obj = rspamd_client_parse_object (p, rlen, is_msgpack, err);
+	if (obj == NULL) {
+		return -1;
+	}
+	if (obj->type == UCL_OBJECT) {
+		ucl_object_insert_key (obj, ucl_object_fromint (idx), "index", 0,
+			false);
+	}
+	*pobj = obj;
+
+	return p + rlen - data;
+
+err:
+	g_set_error (err, RCLIENT_ERROR, EINVAL, "Cannot parse batch reply");
+
+	return -1;
+}
+
+static ucl_object_t *
+rspamd_client_parse_batch (const gchar *data, gsize len, gboolean is_msgpack,
+	GError **err)
+{
+	ucl_object_t *top, *obj;
+	gsize pos = 0;
+	gssize r;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	while (pos < len) {
+		r = rspamd_client_parse_record (data + pos, len - pos, is_msgpack,
+				&obj, err);
+		if (r <= 0) {
+			if (r == 0) {
+				g_set_error (err, RCLIENT_ERROR, EINVAL,
+					"Truncated batch reply");
+			}
+			ucl_object_unref (top);
+			return NULL;
+		}
+
+		ucl_array_append (top, obj);
+		pos += r;
+	}
+
+	return top;
+}
+
+/*
+ * Returns TRUE if a reply is a batch reply
+ */
+static gboolean
+rspamd_client_reply_type (struct rspamd_http_message *msg,
+	gboolean *is_msgpack)
+{
+	const gchar *ctype;
+
+	ctype = rspamd_http_message_find_header (msg, "Content-Type");
+	*is_msgpack = FALSE;
+
+	if (ctype != NULL) {
+		if (g_ascii_strncasecmp (ctype, RSPAMD_MSGPACK_CTYPE,
+			sizeof (RSPAMD_MSGPACK_CTYPE) - 1) == 0) {
+			*is_msgpack = TRUE;
+		}
+		else if (g_ascii_strncasecmp (ctype, RCLIENT_BATCH_CTYPE,
+			sizeof (RCLIENT_BATCH_CTYPE) - 1) == 0) {
+			*is_msgpack = (strstr (ctype, "format=msgpack") != NULL);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Records of a batch reply are passed to the chunk callback as soon as they
+ * are received, so the body keeps only the incomplete tail
+ */
 static gint
 rspamd_client_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
 	const gchar *chunk, gsize len)
 {
-	/* Do nothing here */
+	struct rspamd_client_request *req =
+		(struct rspamd_client_request *)conn->ud;
+	struct rspamd_client_connection *c;
+	ucl_object_t *obj;
+	gboolean is_msgpack;
+	gsize pos = 0;
+	gssize r;
+
+	c = req->conn;
+
+	if (req->chunk_cb == NULL || msg->code != 200 ||
+		!rspamd_client_reply_type (msg, &is_msgpack)) {
+		return 0;
+	}
+
+	while (pos < msg->body->len) {
+		r = rspamd_client_parse_record (msg->body->str + pos,
+				msg->body->len - pos, is_msgpack, &obj, &req->err);
+		if (r == -1) {
+			return -1;
+		}
+		else if (r == 0) {
+			break;
+		}
+
+		req->chunk_cb (c, msg, c->server_name->str, obj, req->ud);
+		pos += r;
+	}
+
+	g_string_erase (msg->body, 0, pos);
+
 	return 0;
 }
 
@@ -77,6 +250,10 @@ rspamd_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_client_connection *c;
 
 	c = req->conn;
+	if (req->err != NULL) {
+		/* Reply has been rejected by the body handler */
+		err = req->err;
+	}
 	req->cb (c, NULL, c->server_name->str, NULL, req->ud, err);
 }
 
@@ -87,8 +264,9 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_client_request *req =
 		(struct rspamd_client_request *)conn->ud;
 	struct rspamd_client_connection *c;
-	struct ucl_parser *parser;
-	GError *err;
+	ucl_object_t *obj;
+	gboolean is_msgpack, is_batch;
+	GError *err = NULL;
 
 	c = req->conn;
 
@@ -103,6 +281,22 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 	else {
+		is_batch = rspamd_client_reply_type (msg, &is_msgpack);
+
+		if (is_batch && req->chunk_cb != NULL && msg->code == 200) {
+			/* All records have been passed to the chunk callback */
+			if (msg->body != NULL && msg->body->len != 0) {
+				err = g_error_new (RCLIENT_ERROR, EINVAL,
+						"Truncated batch reply");
+				req->cb (c, msg, c->server_name->str, NULL, req->ud, err);
+				g_error_free (err);
+				return -1;
+			}
+
+			req->cb (c, msg, c->server_name->str, NULL, req->ud, NULL);
+			return -1;
+		}
+
 		if (msg->body == NULL || msg->body->len == 0 || msg->code != 200) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "HTTP error: %d, %s",
 					msg->code,
@@ -112,19 +306,22 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			return -1;
 		}
 
-		parser = ucl_parser_new (0);
-		if (!ucl_parser_add_chunk (parser, msg->body->str, msg->body->len)) {
-			err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
-					ucl_parser_get_error (parser));
-			ucl_parser_free (parser);
+		if (is_batch) {
+			obj = rspamd_client_parse_batch (msg->body->str, msg->body->len,
+					is_msgpack, &err);
+		}
+		else {
+			obj = rspamd_client_parse_object (msg->body->str, msg->body->len,
+					is_msgpack, &err);
+		}
+
+		if (obj == NULL) {
 			req->cb (c, msg, c->server_name->str, NULL, req->ud, err);
 			g_error_free (err);
 			return -1;
 		}
 
-		req->cb (c, msg, c->server_name->str, ucl_parser_get_object (
-				parser), req->ud, NULL);
-		ucl_parser_free (parser);
+		req->cb (c, msg, c->server_name->str, obj, req->ud, NULL);
 	}
 
 	return -1;
@@ -149,7 +346,7 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	conn->http_conn = rspamd_http_connection_new (rspamd_client_body_handler,
 			rspamd_client_error_handler,
 			rspamd_client_finish_handler,
-			0,
+			RSPAMD_HTTP_BODY_PARTIAL,
 			RSPAMD_HTTP_CLIENT);
 	conn->server_name = g_string_new (name);
 	if (port != 0) {
@@ -175,6 +372,8 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	req = g_slice_alloc (sizeof (struct rspamd_client_request));
 	req->conn = conn;
 	req->cb = cb;
+	req->chunk_cb = NULL;
+	req->err = NULL;
 	req->ud = ud;
 
 	req->msg = rspamd_http_new_message (HTTP_REQUEST);
@@ -224,12 +423,30 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	return TRUE;
 }
 
+gboolean
+rspamd_client_batch_command (struct rspamd_client_connection *conn,
+	GHashTable *attrs, FILE *in,
+	rspamd_client_chunk_callback chunk_cb, rspamd_client_callback cb,
+	gpointer ud, GError **err)
+{
+	if (!rspamd_client_command (conn, "batch", attrs, in, cb, ud, err)) {
+		return FALSE;
+	}
+
+	conn->req->chunk_cb = chunk_cb;
+
+	return TRUE;
+}
+
 void
 rspamd_client_destroy (struct rspamd_client_connection *conn)
 {
 	if (conn != NULL) {
 		rspamd_http_connection_unref (conn->http_conn);
 		if (conn->req != NULL) {
+			if (conn->req->err != NULL) {
+				g_error_free (conn->req->err);
+			}
 			g_slice_free1 (sizeof (struct rspamd_client_request), conn->req);
 		}
 		close (conn->fd);
@@ -46,6 +46,21 @@ typedef void (*rspamd_client_callback) (
 	gpointer ud,
 	GError *err);
 
+/**
+ * Callback is called for each result of a batch reply as soon as it is
+ * received, the result object is owned by the callback
+ * @param name name of server
+ * @param msg reply message
+ * @param result result object with `index` of the message in the batch
+ * @param ud opaque user data
+ */
+typedef void (*rspamd_client_chunk_callback) (
+	struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name,
+	ucl_object_t *result,
+	gpointer ud);
+
 /**
  * Start rspamd worker or controller command
  * @param ev_base event base
@@ -79,6 +94,25 @@ gboolean rspamd_client_command (
 	gpointer ud,
 	GError **err);
 
+/**
+ * Send a batch of messages and receive their results as they are ready
+ * @param conn connection object
+ * @param attrs additional attributes
+ * @param in input file with length prefixed messages
+ * @param chunk_cb callback to be called for each result
+ * @param cb callback to be called on command completion, result is NULL
+ * @param ud opaque user data
+ * @return
+ */
+gboolean rspamd_client_batch_command (
+	struct rspamd_client_connection *conn,
+	GHashTable *attrs,
+	FILE *in,
+	rspamd_client_chunk_callback chunk_cb,
+	rspamd_client_callback cb,
+	gpointer ud,
+	GError **err);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
@@ -56,6 +56,11 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_COUNTERS_RESET "/countersreset"
+#define PATH_UPSTREAMS "/upstreams"
+#define PATH_METRICS "/metrics"
+
+#define METRICS_CTYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
 
 /* Graph colors */
 #define COLOR_CLEAN "#58A458"
@@ -630,13 +635,68 @@ rspamd_controller_handle_pie_chart (
 	return 0;
 }
 
+static void
+rspamd_controller_history_row (const struct roll_history_row *row,
+	const gchar *symbols, gpointer ud)
+{
+	ucl_object_t *top = ud, *obj, *timings;
+	struct tm *tm;
+	gchar timebuf[32];
+	guint32 prev = 0;
+	gint i;
+
+	tm = localtime (&row->tv.tv_sec);
+	strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			timebuf),		  "time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			row->message_id), "id",	  0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			rspamd_inet_address_to_string (&row->from_addr)),
+			"ip", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromstring (rspamd_action_to_str (
+			row->action)), "action", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (
+			row->score),		  "score",			0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromdouble (
+			row->required_score), "required_score", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromlstring (
+			symbols, row->symbols_len), "symbols",		0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromint (
+			row->len),			  "size",			0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromint (
+			row->scan_time),	  "scan_time",		0, false);
+	if (row->user[0] != '\0') {
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->user), "user", 0, false);
+	}
+
+	/* Duration of each reached phase in microseconds */
+	timings = ucl_object_typed_new (UCL_OBJECT);
+	for (i = 0; i < RSPAMD_TASKLOG_PHASE_MAX; i++) {
+		if (row->phases[i] == 0) {
+			continue;
+		}
+		ucl_object_insert_key (timings,
+			ucl_object_fromint (row->phases[i] - prev),
+			rspamd_tasklog_phase_name (i), 0, false);
+		prev = row->phases[i];
+	}
+	ucl_object_insert_key (obj, timings, "timings", 0, false);
+
+	ucl_array_append (top, obj);
+}
+
 /*
  * History command handler:
  * request: /history
  * headers: Password
  * reply: json [
- *      { label: "Foo", data: 11 },
- *      { label: "Bar", data: 20 },
+ *      { time: "2015-01-01 00:00:00", id: "Foo", symbols: "A, B",
+ *        timings: { read: 10, mime: 200, ... }, ... },
  *      {...}
  * ]
  */
@@ -646,12 +706,7 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	struct roll_history copied_history;
-	gint i, rows_proc, row_num;
-	struct tm *tm;
-	gchar timebuf[32];
-	ucl_object_t *top, *obj;
+	ucl_object_t *top;
 
 	ctx = session->ctx;
 
@@ -661,54 +716,9 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 
 	top = ucl_object_typed_new (UCL_ARRAY);
 
-	/* Set lock on history */
-	rspamd_mempool_lock_mutex (ctx->srv->history->mtx);
-	ctx->srv->history->need_lock = TRUE;
-	/* Copy locked */
-	memcpy (&copied_history, ctx->srv->history, sizeof (copied_history));
-	rspamd_mempool_unlock_mutex (ctx->srv->history->mtx);
-
-	/* Go through all rows */
-	row_num = copied_history.cur_row;
-	for (i = 0, rows_proc = 0; i < HISTORY_MAX_ROWS; i++, row_num++) {
-		if (row_num == HISTORY_MAX_ROWS) {
-			row_num = 0;
-		}
-		row = &copied_history.rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			tm = localtime (&row->tv.tv_sec);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					rspamd_inet_address_to_string (&row->from_addr)),
-					"ip", 0, false);
-			ucl_object_insert_key (obj,
-				ucl_object_fromstring (rspamd_action_to_str (
-					row->action)), "action", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromdouble (
-					row->score),		  "score",			0, false);
-			ucl_object_insert_key (obj,
-				ucl_object_fromdouble (
-					row->required_score), "required_score", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->symbols),		  "symbols",		0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->len),			  "size",			0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->scan_time),	  "scan_time",		0, false);
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->user), "user", 0, false);
-			}
-			ucl_array_append (top, obj);
-			rows_proc++;
-		}
-	}
+	/* Rows of all workers' shards ordered by time, writers are not locked */
+	rspamd_roll_history_foreach (ctx->srv->history,
+		rspamd_controller_history_row, top);
 
 	rspamd_controller_send_ucl (conn_ent, top);
 	ucl_object_unref (top);
@@ -1265,6 +1275,7 @@ rspamd_controller_handle_stat_common (
 	struct rspamd_statfile_config *st;
 	GList *cur_cl, *cur_st;
 	struct rspamd_stat *stat, stat_copy;
+	struct rspamd_log_async_stat log_st;
 
 	rspamd_mempool_stat (&mem_st);
 	memcpy (&stat_copy, session->ctx->worker->srv->stat, sizeof (stat_copy));
@@ -1329,6 +1340,25 @@ rspamd_controller_handle_stat_common (
 		ucl_object_fromint (
 			stat->fuzzy_hashes_expired), "fuzzy_expired", 0, false);
 
+	if (rspamd_log_async_stat (session->ctx->worker->srv->logger, &log_st)) {
+		sub = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.lines), "lines", 0, false);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.bytes), "bytes", 0, false);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.dropped), "dropped", 0, false);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.truncated), "truncated", 0, false);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.errors), "errors", 0, false);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.size), "ring_size", 0, false);
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (log_st.used), "ring_used", 0, false);
+		ucl_object_insert_key (top, sub, "log", 0, false);
+	}
+
 	/* Now write statistics for each statfile */
 	cur_cl = g_list_first (session->ctx->cfg->classifiers);
 	sub = ucl_object_typed_new (UCL_ARRAY);
@@ -1416,6 +1446,26 @@ rspamd_controller_handle_statreset (
 	return rspamd_controller_handle_stat_common (conn_ent, msg, TRUE);
 }
 
+static ucl_object_t *
+rspamd_controller_histogram_to_ucl (const struct rspamd_histogram *h)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (h->count),
+		"count", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			rspamd_histogram_percentile (h, 50)), "p50", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			rspamd_histogram_percentile (h, 90)), "p90", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			rspamd_histogram_percentile (h, 99)), "p99", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (h->max),
+		"max", 0, false);
+
+	return obj;
+}
+
 static ucl_object_t *
 rspamd_controller_cache_item_to_ucl (struct cache_item *item)
 {
@@ -1430,15 +1480,66 @@ rspamd_controller_cache_item_to_ucl (struct cache_item *item)
 		"frequency", 0, false);
 	ucl_object_insert_key (obj, ucl_object_fromdouble (item->s->avg_time),
 		"time", 0, false);
+	ucl_object_insert_key (obj,
+		rspamd_controller_histogram_to_ucl (&item->latency->cpu),
+		"cpu", 0, false);
+	ucl_object_insert_key (obj,
+		rspamd_controller_histogram_to_ucl (&item->latency->wall),
+		"wall", 0, false);
 
 	return obj;
 }
 
+static void
+rspamd_controller_append_counters (ucl_object_t *top, GList *cur,
+	gboolean do_reset)
+{
+	struct cache_item *item;
+
+	while (cur) {
+		item = cur->data;
+		if (!item->is_callback) {
+			ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
+					item));
+		}
+		if (do_reset) {
+			rspamd_histogram_reset (&item->latency->cpu);
+			rspamd_histogram_reset (&item->latency->wall);
+		}
+		cur = g_list_next (cur);
+	}
+}
+
+static int
+rspamd_controller_handle_counters_common (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg,
+	gboolean do_reset)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+	struct symbols_cache *cache;
+
+	cache = session->ctx->cfg->cache;
+	top = ucl_object_typed_new (UCL_ARRAY);
+	if (cache != NULL) {
+		rspamd_controller_append_counters (top, cache->negative_items,
+			do_reset);
+		rspamd_controller_append_counters (top, cache->static_items,
+			do_reset);
+	}
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
 /*
  * Counters command handler:
  * request: /counters
  * headers: Password
- * reply: json array of all counters
+ * reply: json array of all counters, cpu and wall elements contain
+ * percentiles of symbol latency in microseconds
  */
 static int
 rspamd_controller_handle_counters (
@@ -1446,43 +1547,117 @@ rspamd_controller_handle_counters (
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	return rspamd_controller_handle_counters_common (conn_ent, msg, FALSE);
+}
+
+/*
+ * Counters reset command handler:
+ * request: /countersreset
+ * headers: Password
+ * reply: json array of all counters, latency histograms are reset after reply
+ */
+static int
+rspamd_controller_handle_countersreset (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	msg_info ("<%s> reset counters",
+			rspamd_inet_address_to_string (&session->from_addr));
+	return rspamd_controller_handle_counters_common (conn_ent, msg, TRUE);
+}
+
+static void
+rspamd_controller_upstream_stat_cb (const gchar *list_name,
+	const struct rspamd_upstream_stat *st, gpointer ud)
+{
+	ucl_object_t *top = ud, *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (list_name),
+		"list", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (st->name),
+		"name", 0, false);
+	ucl_object_insert_key (obj, ucl_object_frombool (st->alive),
+		"alive", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (st->latency),
+		"latency", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (st->max_latency),
+		"max_latency", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st->requests),
+		"requests", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st->errors),
+		"errors", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st->inflight),
+		"inflight", 0, false);
+
+	ucl_array_append (top, obj);
+}
+
+/*
+ * Upstreams command handler:
+ * request: /upstreams
+ * headers: Password
+ * reply: json array of upstreams with their latency statistics
+ */
+static int
+rspamd_controller_handle_upstreams (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top;
-	GList *cur;
-	struct cache_item *item;
-	struct symbols_cache *cache;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
 		return 0;
 	}
 
-	cache = session->ctx->cfg->cache;
 	top = ucl_object_typed_new (UCL_ARRAY);
-	if (cache != NULL) {
-		cur = cache->negative_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
-						item));
-			}
-			cur = g_list_next (cur);
-		}
-		cur = cache->static_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
-						item));
-			}
-			cur = g_list_next (cur);
-		}
-	}
+	rspamd_upstreams_foreach_stat (rspamd_controller_upstream_stat_cb, top);
 	rspamd_controller_send_ucl (conn_ent, top);
 	ucl_object_unref (top);
 
 	return 0;
 }
 
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * reply: metrics of all workers in OpenMetrics text format, password is not
+ * required to allow scraping by monitoring systems
+ */
+static int
+rspamd_controller_handle_metrics (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_http_message *reply;
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->body = rspamd_metrics_openmetrics (session->ctx->srv);
+
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn, reply, NULL,
+		METRICS_CTYPE, conn_ent, conn_ent->conn->fd,
+		conn_ent->rt->ptv, conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -1706,6 +1881,15 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 		rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+		PATH_COUNTERS_RESET,
+		rspamd_controller_handle_countersreset);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_UPSTREAMS,
+		rspamd_controller_handle_upstreams);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+		rspamd_controller_handle_metrics);
 
 	/* Attach plugins */
 	cur = g_list_first (ctx->cfg->filters);
@@ -198,6 +198,11 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	if (session->cmd->cmd == FUZZY_CHECK) {
 		rep = rspamd_fuzzy_backend_check (session->ctx->backend, session->cmd,
 				session->ctx->expire);
+		rspamd_metrics_inc (RSPAMD_METRIC_FUZZY_CHECKS, 1);
+
+		if (rep.prob > 0.5) {
+			rspamd_metrics_inc (RSPAMD_METRIC_FUZZY_HITS, 1);
+		}
 	}
 	else {
 		rep.flag = session->cmd->flag;
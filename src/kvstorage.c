@@ -31,26 +31,58 @@
 
 #define MAX_EXPIRE_STEPS 10
 
+static void
+rspamd_kv_shard_init (struct rspamd_kv_shard *shard,
+	cache_create cache_new,
+	expire_create expire_new)
+{
+	shard->elts = 0;
+	shard->memory = 0;
+	shard->cache = cache_new ();
+	shard->expire = expire_new ? expire_new () : NULL;
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	g_rw_lock_init (&shard->rwlock);
+#else
+	g_static_rw_lock_init (&shard->rwlock);
+#endif
+
+	if (shard->cache->init_func) {
+		shard->cache->init_func (shard->cache);
+	}
+	if (shard->expire && shard->expire->init_func) {
+		shard->expire->init_func (shard->expire);
+	}
+}
+
 /** Create new kv storage */
 struct rspamd_kv_storage *
 rspamd_kv_storage_new (gint id,
 	const gchar *name,
-	struct rspamd_kv_cache *cache,
+	cache_create cache_new,
 	struct rspamd_kv_backend *backend,
-	struct rspamd_kv_expire *expire,
+	expire_create expire_new,
+	guint nshards,
 	gsize max_elts,
 	gsize max_memory,
 	gboolean no_overwrite)
 {
 	struct rspamd_kv_storage *new;
+	guint i;
 
 	new = g_slice_alloc (sizeof (struct rspamd_kv_storage));
-	new->elts = 0;
-	new->memory = 0;
 
-	new->cache = cache;
+	if (nshards == 0) {
+		nshards = 1;
+	}
+	else if (nshards > RSPAMD_KV_MAX_SHARDS) {
+		nshards = RSPAMD_KV_MAX_SHARDS;
+	}
+
+	new->nshards = nshards;
+	new->shards = g_malloc (sizeof (struct rspamd_kv_shard) * nshards);
 	new->backend = backend;
-	new->expire = expire;
+	new->backend_mtx = rspamd_mutex_new ();
 
 	new->max_elts = max_elts;
 	new->max_memory = max_memory;
@@ -67,58 +99,88 @@ rspamd_kv_storage_new (gint id,
 		new->name = g_malloc (sizeof ("18446744073709551616"));
 		rspamd_snprintf (new->name, sizeof ("18446744073709551616"), "%d", id);
 	}
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	g_rw_lock_init (&new->rwlock);
-#else
-	g_static_rw_lock_init (&new->rwlock);
-#endif
-
 
 	/* Init structures */
-	if (new->cache->init_func) {
-		new->cache->init_func (new->cache);
+	for (i = 0; i < nshards; i++) {
+		rspamd_kv_shard_init (&new->shards[i], cache_new, expire_new);
+		/* Limits are split between shards */
+		new->shards[i].max_elts = max_elts > 0 ?
+			MAX (max_elts / nshards, 1) : 0;
+		new->shards[i].max_memory = max_memory > 0 ?
+			MAX (max_memory / nshards, 1) : 0;
 	}
 	if (new->backend && new->backend->init_func) {
 		new->backend->init_func (new->backend);
 	}
-	if (new->expire && new->expire->init_func) {
-		new->expire->init_func (new->expire);
-	}
 
 	return new;
 }
 
-/** Internal insertion to the kv storage from backend */
-gboolean
-rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
+/** Get shard for the specified key */
+struct rspamd_kv_shard *
+rspamd_kv_storage_get_shard (struct rspamd_kv_storage *storage,
 	gpointer key,
-	guint keylen,
-	gpointer data,
-	gsize len,
-	gint flags,
-	guint expire,
-	struct rspamd_kv_element **pelt)
+	guint keylen)
+{
+	struct rspamd_kv_element search_elt;
+
+	if (storage->nshards == 1) {
+		return &storage->shards[0];
+	}
+
+	search_elt.keylen = keylen;
+	search_elt.p = key;
+
+	/* Low bits of hash are used by caches inside shard */
+	return &storage->shards[(kv_elt_hash_func (&search_elt) >> 16) %
+		   storage->nshards];
+}
+
+/**
+ * Expire elements in shard until it has enough space for an element of
+ * length `len`, shard must be locked for writing
+ */
+static gboolean
+rspamd_kv_shard_make_room (struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
+	gsize len)
 {
 	gint steps = 0;
-	struct rspamd_kv_element *elt;
 
-	RW_W_LOCK (&storage->rwlock);
-	/* Hard limit */
-	if (storage->max_memory > 0) {
-		if (len > storage->max_memory) {
-			msg_info (
+	if (shard->max_memory > 0) {
+		if (len >= shard->max_memory) {
+			msg_warn (
 				"<%s>: trying to insert value of length %z while limit is %z",
 				storage->name,
 				len,
-				storage->max_memory);
-			RW_W_UNLOCK (&storage->rwlock);
+				shard->max_memory);
 			return FALSE;
 		}
 
 		/* Now check limits */
-		while (storage->memory + len > storage->max_memory) {
-			if (storage->expire) {
-				storage->expire->step_func (storage->expire, storage, time (
+		while (shard->memory + len > shard->max_memory) {
+			if (shard->expire) {
+				shard->expire->step_func (shard->expire, shard, time (
+						NULL), steps);
+			}
+			else {
+				msg_warn (
+					"<%s>: storage is full and no expire function is defined",
+					storage->name);
+			}
+			if (++steps > MAX_EXPIRE_STEPS) {
+				msg_warn ("<%s>: cannot expire enough keys in storage",
+					storage->name);
+				return FALSE;
+			}
+		}
+	}
+	if (shard->max_elts > 0 && shard->elts > shard->max_elts) {
+		/* More expire */
+		steps = 0;
+		while (shard->elts > shard->max_elts) {
+			if (shard->expire) {
+				shard->expire->step_func (shard->expire, shard, time (
 						NULL), steps);
 			}
 			else {
@@ -127,7 +189,6 @@ rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
 					storage->name);
 			}
 			if (++steps > MAX_EXPIRE_STEPS) {
-				RW_W_UNLOCK (&storage->rwlock);
 				msg_warn ("<%s>: cannot expire enough keys in storage",
 					storage->name);
 				return FALSE;
@@ -135,9 +196,35 @@ rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
 		}
 	}
 
+	return TRUE;
+}
+
+/** Internal insertion to the kv storage from backend */
+gboolean
+rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
+	gpointer key,
+	guint keylen,
+	gpointer data,
+	gsize len,
+	gint flags,
+	guint expire,
+	struct rspamd_kv_element **pelt)
+{
+	struct rspamd_kv_element *elt;
+	struct rspamd_kv_shard *shard;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+
+	RW_W_LOCK (&shard->rwlock);
+	/* Hard limit */
+	if (!rspamd_kv_shard_make_room (storage, shard, len)) {
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
+	}
+
 	/* Insert elt to the cache */
 
-	elt = storage->cache->insert_func (storage->cache, key, keylen, data, len);
+	elt = shard->cache->insert_func (shard->cache, key, keylen, data, len);
 
 
 	/* Copy data */
@@ -149,20 +236,21 @@ rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
 	}
 
 	/* Insert to the expire */
-	if (storage->expire) {
-		storage->expire->insert_func (storage->expire, elt);
+	if (shard->expire) {
+		shard->expire->insert_func (shard->expire, elt);
 	}
 
-	storage->elts++;
-	storage->memory += ELT_SIZE (elt);
-	RW_W_UNLOCK (&storage->rwlock);
+	shard->elts++;
+	shard->memory += ELT_SIZE (elt);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return TRUE;
 }
 
-/** Insert new element to the kv storage */
-gboolean
-rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
+/** Insert new element to the shard that is locked for writing */
+static gboolean
+rspamd_kv_shard_insert (struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
 	gpointer key,
 	guint keylen,
 	gpointer data,
@@ -170,77 +258,27 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 	gint flags,
 	guint expire)
 {
-	gint steps = 0;
 	struct rspamd_kv_element *elt;
 	gboolean res = TRUE;
 	glong longval;
 
 	/* Hard limit */
-	RW_W_LOCK (&storage->rwlock);
-	if (storage->max_memory > 0) {
-		if (len + sizeof (struct rspamd_kv_element) + keylen >=
-			storage->max_memory) {
-			msg_warn (
-				"<%s>: trying to insert value of length %z while limit is %z",
-				storage->name,
-				len,
-				storage->max_memory);
-			RW_W_UNLOCK (&storage->rwlock);
-			return FALSE;
-		}
-
-		/* Now check limits */
-		while (storage->memory + len + keylen > storage->max_memory) {
-			if (storage->expire) {
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				RW_W_UNLOCK (&storage->rwlock);
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
-	}
-	if (storage->max_elts > 0 && storage->elts > storage->max_elts) {
-		/* More expire */
-		steps = 0;
-		while (storage->elts > storage->max_elts) {
-			if (storage->expire) {
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				RW_W_UNLOCK (&storage->rwlock);
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
+	if (!rspamd_kv_shard_make_room (storage, shard,
+		len + sizeof (struct rspamd_kv_element) + keylen)) {
+		return FALSE;
 	}
 
 	/* First try to search it in cache */
 
-	elt = storage->cache->lookup_func (storage->cache, key, keylen);
+	elt = shard->cache->lookup_func (shard->cache, key, keylen);
 	if (elt) {
 		if (!storage->no_overwrite) {
 			/* Remove old elt */
-			if (storage->expire) {
-				storage->expire->delete_func (storage->expire, elt);
+			if (shard->expire) {
+				shard->expire->delete_func (shard->expire, elt);
 			}
-			storage->memory -= ELT_SIZE (elt);
-			storage->cache->steal_func (storage->cache, elt);
+			shard->memory -= ELT_SIZE (elt);
+			shard->cache->steal_func (shard->cache, elt);
 			if (elt->flags & KV_ELT_DIRTY) {
 				/* Element is in backend storage queue */
 				elt->flags |= KV_ELT_NEED_FREE;
@@ -252,15 +290,12 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 		else {
 			/* Just do incref and nothing more */
 			if (storage->backend && storage->backend->incref_func) {
-				if (storage->backend->incref_func (storage->backend, key,
-					keylen)) {
-					RW_W_UNLOCK (&storage->rwlock);
-					return TRUE;
-				}
-				else {
-					RW_W_UNLOCK (&storage->rwlock);
-					return FALSE;
-				}
+				rspamd_mutex_lock (storage->backend_mtx);
+				res = storage->backend->incref_func (storage->backend, key,
+						keylen);
+				rspamd_mutex_unlock (storage->backend_mtx);
+
+				return res;
 			}
 		}
 	}
@@ -269,7 +304,7 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 
 	/* First of all check element for integer */
 	if (rspamd_strtol (data, len, &longval)) {
-		elt = storage->cache->insert_func (storage->cache,
+		elt = shard->cache->insert_func (shard->cache,
 				key,
 				keylen,
 				&longval,
@@ -282,13 +317,12 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 		}
 	}
 	else {
-		elt = storage->cache->insert_func (storage->cache,
+		elt = shard->cache->insert_func (shard->cache,
 				key,
 				keylen,
 				data,
 				len);
 		if (elt == NULL) {
-			RW_W_UNLOCK (&storage->rwlock);
 			return FALSE;
 		}
 	}
@@ -301,18 +335,42 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 
 	/* Place to the backend */
 	if (storage->backend) {
+		rspamd_mutex_lock (storage->backend_mtx);
 		res =
 			storage->backend->insert_func (storage->backend, key, keylen, elt);
+		rspamd_mutex_unlock (storage->backend_mtx);
 	}
 
 	/* Insert to the expire */
-	if (storage->expire) {
-		storage->expire->insert_func (storage->expire, elt);
+	if (shard->expire) {
+		shard->expire->insert_func (shard->expire, elt);
 	}
 
-	storage->elts++;
-	storage->memory += ELT_SIZE (elt);
-	RW_W_UNLOCK (&storage->rwlock);
+	shard->elts++;
+	shard->memory += ELT_SIZE (elt);
+
+	return res;
+}
+
+/** Insert new element to the kv storage */
+gboolean
+rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
+	gpointer key,
+	guint keylen,
+	gpointer data,
+	gsize len,
+	gint flags,
+	guint expire)
+{
+	struct rspamd_kv_shard *shard;
+	gboolean res;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+
+	RW_W_LOCK (&shard->rwlock);
+	res = rspamd_kv_shard_insert (storage, shard, key, keylen, data, len,
+			flags, expire);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return res;
 }
@@ -324,51 +382,29 @@ rspamd_kv_storage_replace (struct rspamd_kv_storage *storage,
 	guint keylen,
 	struct rspamd_kv_element *elt)
 {
+	struct rspamd_kv_shard *shard;
 	gboolean res = TRUE;
-	gint steps = 0;
 
-	/* Hard limit */
-	if (storage->max_memory > 0) {
-		if (elt->size > storage->max_memory) {
-			msg_info (
-				"<%s>: trying to replace value of length %z while limit is %z",
-				storage->name,
-				elt->size,
-				storage->max_memory);
-			return FALSE;
-		}
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
 
-		/* Now check limits */
-		while (storage->memory + ELT_SIZE (elt) > storage->max_memory) {
-			if (storage->expire) {
-				RW_W_LOCK (&storage->rwlock);
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-				RW_W_UNLOCK (&storage->rwlock);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
+	RW_W_LOCK (&shard->rwlock);
+	/* Hard limit */
+	if (!rspamd_kv_shard_make_room (storage, shard, ELT_SIZE (elt))) {
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
 	}
 
-	RW_W_LOCK (&storage->rwlock);
 	/* Insert elt to the cache */
-	res = storage->cache->replace_func (storage->cache, key, keylen, elt);
+	res = shard->cache->replace_func (shard->cache, key, keylen, elt);
 
 	/* Place to the backend */
 	if (res && storage->backend) {
+		rspamd_mutex_lock (storage->backend_mtx);
 		res =
 			storage->backend->replace_func (storage->backend, key, keylen, elt);
+		rspamd_mutex_unlock (storage->backend_mtx);
 	}
-	RW_W_UNLOCK (&storage->rwlock);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return res;
 }
@@ -381,23 +417,29 @@ rspamd_kv_storage_increment (struct rspamd_kv_storage *storage,
 	glong *value)
 {
 	struct rspamd_kv_element *elt = NULL, *belt;
+	struct rspamd_kv_shard *shard;
+	gboolean res = TRUE;
 	glong *lp;
 
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+
 	/* First try to look at cache */
-	RW_W_LOCK (&storage->rwlock);
-	elt = storage->cache->lookup_func (storage->cache, key, keylen);
+	RW_W_LOCK (&shard->rwlock);
+	elt = shard->cache->lookup_func (shard->cache, key, keylen);
 
 	if (elt == NULL && storage->backend) {
+		rspamd_mutex_lock (storage->backend_mtx);
 		belt = storage->backend->lookup_func (storage->backend, key, keylen);
+		rspamd_mutex_unlock (storage->backend_mtx);
 		if (belt) {
 			/* Put this element into cache */
 			if ((belt->flags & KV_ELT_INTEGER) != 0) {
-				RW_W_UNLOCK (&storage->rwlock);
+				RW_W_UNLOCK (&shard->rwlock);
 				rspamd_kv_storage_insert_cache (storage, ELT_KEY (
 						belt), keylen, ELT_DATA (belt),
 					belt->size, belt->flags,
 					belt->expire, &elt);
-				RW_W_LOCK (&storage->rwlock);
+				RW_W_LOCK (&shard->rwlock);
 			}
 			if ((belt->flags & KV_ELT_DIRTY) == 0) {
 				g_free (belt);
@@ -416,30 +458,25 @@ rspamd_kv_storage_increment (struct rspamd_kv_storage *storage,
 		}
 		elt->age = time (NULL);
 		if (storage->backend) {
-			if (storage->backend->replace_func (storage->backend, key, keylen,
-				elt)) {
-				RW_W_UNLOCK (&storage->rwlock);
-				return TRUE;
-			}
-			else {
-				RW_W_UNLOCK (&storage->rwlock);
-				return FALSE;
-			}
-		}
-		else {
-			RW_W_UNLOCK (&storage->rwlock);
-			return TRUE;
+			rspamd_mutex_lock (storage->backend_mtx);
+			res = storage->backend->replace_func (storage->backend, key,
+					keylen, elt);
+			rspamd_mutex_unlock (storage->backend_mtx);
 		}
+		RW_W_UNLOCK (&shard->rwlock);
+
+		return res;
 	}
 
-	RW_W_UNLOCK (&storage->rwlock);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return FALSE;
 }
 
-/** Lookup an element inside kv storage */
-struct rspamd_kv_element *
-rspamd_kv_storage_lookup (struct rspamd_kv_storage *storage,
+/** Lookup an element inside shard that is locked for reading */
+static struct rspamd_kv_element *
+rspamd_kv_shard_lookup (struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
 	gpointer key,
 	guint keylen,
 	time_t now)
@@ -447,12 +484,17 @@ rspamd_kv_storage_lookup (struct rspamd_kv_storage *storage,
 	struct rspamd_kv_element *elt = NULL, *belt;
 
 	/* First try to look at cache */
-	RW_R_LOCK (&storage->rwlock);
-	elt = storage->cache->lookup_func (storage->cache, key, keylen);
+	elt = shard->cache->lookup_func (shard->cache, key, keylen);
+
+	if (elt != NULL && shard->expire && shard->expire->touch_func) {
+		shard->expire->touch_func (shard->expire, elt);
+	}
 
 	/* Next look at the backend */
 	if (elt == NULL && storage->backend) {
+		rspamd_mutex_lock (storage->backend_mtx);
 		belt = storage->backend->lookup_func (storage->backend, key, keylen);
+		rspamd_mutex_unlock (storage->backend_mtx);
 
 		if (belt) {
 			/* Put this element into cache */
@@ -475,10 +517,197 @@ rspamd_kv_storage_lookup (struct rspamd_kv_storage *storage,
 		}
 	}
 
-	/* RWlock is still locked */
 	return elt;
 }
 
+/** Lookup an element inside kv storage */
+struct rspamd_kv_element *
+rspamd_kv_storage_lookup (struct rspamd_kv_storage *storage,
+	gpointer key,
+	guint keylen,
+	time_t now)
+{
+	struct rspamd_kv_shard *shard;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+	RW_R_LOCK (&shard->rwlock);
+
+	/* RWlock is still locked */
+	return rspamd_kv_shard_lookup (storage, shard, key, keylen, now);
+}
+
+/** Release shard locked by lookup */
+void
+rspamd_kv_storage_release (struct rspamd_kv_storage *storage,
+	gpointer key,
+	guint keylen)
+{
+	struct rspamd_kv_shard *shard;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+	RW_R_UNLOCK (&shard->rwlock);
+}
+
+/* Key of a batch operation */
+struct rspamd_kv_batch_key {
+	struct rspamd_kv_shard *shard;
+	guint idx;
+};
+
+static gint
+rspamd_kv_batch_key_cmp (const void *a, const void *b)
+{
+	const struct rspamd_kv_batch_key *k1 = a, *k2 = b;
+
+	if (k1->shard != k2->shard) {
+		return k1->shard < k2->shard ? -1 : 1;
+	}
+
+	return (gint)k1->idx - (gint)k2->idx;
+}
+
+/* Sort keys of a batch by their shards */
+static struct rspamd_kv_batch_key *
+rspamd_kv_storage_group_keys (struct rspamd_kv_storage *storage,
+	guint nkeys,
+	gchar **keys,
+	guint *keylens)
+{
+	struct rspamd_kv_batch_key *bkeys;
+	guint i;
+
+	bkeys = g_malloc (nkeys * sizeof (struct rspamd_kv_batch_key));
+	for (i = 0; i < nkeys; i++) {
+		bkeys[i].shard = rspamd_kv_storage_get_shard (storage, keys[i],
+				keylens[i]);
+		bkeys[i].idx = i;
+	}
+
+	qsort (bkeys, nkeys, sizeof (struct rspamd_kv_batch_key),
+		rspamd_kv_batch_key_cmp);
+
+	return bkeys;
+}
+
+/** Lookup several elements locking each shard once */
+void
+rspamd_kv_storage_lookup_many (struct rspamd_kv_storage *storage,
+	guint nkeys,
+	gchar **keys,
+	guint *keylens,
+	time_t now,
+	rspamd_kv_lookup_cb cb,
+	gpointer ud)
+{
+	struct rspamd_kv_batch_key *bkeys;
+	struct rspamd_kv_element *elt;
+	struct rspamd_kv_shard *shard;
+	GPtrArray *loaded;
+	guint i, j, idx;
+
+	if (nkeys == 0) {
+		return;
+	}
+
+	bkeys = rspamd_kv_storage_group_keys (storage, nkeys, keys, keylens);
+	loaded = g_ptr_array_new ();
+
+	for (i = 0; i < nkeys; ) {
+		shard = bkeys[i].shard;
+		RW_R_LOCK (&shard->rwlock);
+		for (; i < nkeys && bkeys[i].shard == shard; i++) {
+			idx = bkeys[i].idx;
+			elt = rspamd_kv_shard_lookup (storage, shard, keys[idx],
+					keylens[idx], now);
+			cb (idx, elt, ud);
+			if (elt != NULL && (elt->flags & KV_ELT_NEED_INSERT) != 0) {
+				g_ptr_array_add (loaded, elt);
+			}
+		}
+		RW_R_UNLOCK (&shard->rwlock);
+
+		/* Elements loaded from backend are cached without read lock */
+		for (j = 0; j < loaded->len; j++) {
+			elt = g_ptr_array_index (loaded, j);
+			elt->flags &= ~KV_ELT_NEED_INSERT;
+			rspamd_kv_storage_insert_cache (storage, ELT_KEY (elt),
+				elt->keylen, ELT_DATA (elt), elt->size, elt->flags,
+				elt->expire, NULL);
+			g_free (elt);
+		}
+		g_ptr_array_set_size (loaded, 0);
+	}
+
+	g_ptr_array_free (loaded, TRUE);
+	g_free (bkeys);
+}
+
+/*
+ * Insert several elements: all shards of a batch are locked at once in order
+ * of their addresses, so concurrent batches cannot deadlock, and room for all
+ * elements is reserved before storing anything
+ */
+gboolean
+rspamd_kv_storage_insert_many (struct rspamd_kv_storage *storage,
+	guint nkeys,
+	gchar **keys,
+	guint *keylens,
+	gchar **values,
+	gsize *lens,
+	gint flags,
+	guint expire)
+{
+	struct rspamd_kv_batch_key *bkeys;
+	struct rspamd_kv_shard *shard;
+	guint i, idx, locked = 0;
+	gsize need;
+	gboolean res = TRUE;
+
+	if (nkeys == 0) {
+		return TRUE;
+	}
+
+	bkeys = rspamd_kv_storage_group_keys (storage, nkeys, keys, keylens);
+
+	while (locked < nkeys) {
+		shard = bkeys[locked].shard;
+		RW_W_LOCK (&shard->rwlock);
+		need = 0;
+		for (; locked < nkeys && bkeys[locked].shard == shard; locked++) {
+			idx = bkeys[locked].idx;
+			need += lens[idx] + sizeof (struct rspamd_kv_element) +
+				keylens[idx];
+		}
+
+		if (!rspamd_kv_shard_make_room (storage, shard, need)) {
+			res = FALSE;
+			break;
+		}
+	}
+
+	if (res) {
+		for (i = 0; i < nkeys; i++) {
+			idx = bkeys[i].idx;
+			if (!rspamd_kv_shard_insert (storage, bkeys[i].shard, keys[idx],
+				keylens[idx], values[idx], lens[idx], flags, expire)) {
+				/* Room is reserved, so it is a backend failure */
+				msg_warn ("<%s>: cannot insert element of a batch",
+					storage->name);
+			}
+		}
+	}
+
+	for (i = 0; i < locked; i++) {
+		if (i == 0 || bkeys[i].shard != bkeys[i - 1].shard) {
+			RW_W_UNLOCK (&bkeys[i].shard->rwlock);
+		}
+	}
+
+	g_free (bkeys);
+
+	return res;
+}
+
 /** Expire an element from kv storage */
 struct rspamd_kv_element *
 rspamd_kv_storage_delete (struct rspamd_kv_storage *storage,
@@ -486,22 +715,27 @@ rspamd_kv_storage_delete (struct rspamd_kv_storage *storage,
 	guint keylen)
 {
 	struct rspamd_kv_element *elt;
+	struct rspamd_kv_shard *shard;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
 
 	/* First delete key from cache */
-	RW_W_LOCK (&storage->rwlock);
-	elt = storage->cache->delete_func (storage->cache, key, keylen);
+	RW_W_LOCK (&shard->rwlock);
+	elt = shard->cache->delete_func (shard->cache, key, keylen);
 
 	/* Now delete from backend */
 	if (storage->backend) {
+		rspamd_mutex_lock (storage->backend_mtx);
 		storage->backend->delete_func (storage->backend, key, keylen);
+		rspamd_mutex_unlock (storage->backend_mtx);
 	}
 	/* Notify expire */
 	if (elt) {
-		if (storage->expire) {
-			storage->expire->delete_func (storage->expire, elt);
+		if (shard->expire) {
+			shard->expire->delete_func (shard->expire, elt);
 		}
-		storage->elts--;
-		storage->memory -= elt->size;
+		shard->elts--;
+		shard->memory -= elt->size;
 		if ((elt->flags & KV_ELT_DIRTY) != 0) {
 			elt->flags |= KV_ELT_NEED_FREE;
 		}
@@ -510,7 +744,7 @@ rspamd_kv_storage_delete (struct rspamd_kv_storage *storage,
 		}
 	}
 
-	RW_W_UNLOCK (&storage->rwlock);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return elt;
 }
@@ -519,20 +753,32 @@ rspamd_kv_storage_delete (struct rspamd_kv_storage *storage,
 void
 rspamd_kv_storage_destroy (struct rspamd_kv_storage *storage)
 {
-	RW_W_LOCK (&storage->rwlock);
+	struct rspamd_kv_shard *shard;
+	guint i;
+
+	rspamd_mutex_lock (storage->backend_mtx);
 	if (storage->backend && storage->backend->destroy_func) {
 		storage->backend->destroy_func (storage->backend);
 	}
-	if (storage->expire && storage->expire->destroy_func) {
-		storage->expire->destroy_func (storage->expire);
-	}
-	if (storage->cache && storage->cache->destroy_func) {
-		storage->cache->destroy_func (storage->cache);
+	rspamd_mutex_unlock (storage->backend_mtx);
+
+	for (i = 0; i < storage->nshards; i++) {
+		shard = &storage->shards[i];
+
+		RW_W_LOCK (&shard->rwlock);
+		if (shard->expire && shard->expire->destroy_func) {
+			shard->expire->destroy_func (shard->expire);
+		}
+		if (shard->cache && shard->cache->destroy_func) {
+			shard->cache->destroy_func (shard->cache);
+		}
+		RW_W_UNLOCK (&shard->rwlock);
 	}
 
 	g_free (storage->name);
+	g_free (storage->shards);
+	rspamd_mutex_free (storage->backend_mtx);
 
-	RW_W_UNLOCK (&storage->rwlock);
 	g_slice_free1 (sizeof (struct rspamd_kv_storage), storage);
 }
 
@@ -550,6 +796,7 @@ rspamd_kv_storage_insert_array (struct rspamd_kv_storage *storage,
 	struct rspamd_kv_element *elt;
 	guint *es;
 	gpointer arr_data;
+	gboolean res = TRUE;
 
 	/* Make temporary copy */
 	arr_data = g_slice_alloc (len + sizeof (guint));
@@ -568,11 +815,13 @@ rspamd_kv_storage_insert_array (struct rspamd_kv_storage *storage,
 	/* Place to the backend */
 
 	if (storage->backend) {
-		return storage->backend->insert_func (storage->backend, key, keylen,
-				   elt);
+		rspamd_mutex_lock (storage->backend_mtx);
+		res = storage->backend->insert_func (storage->backend, key, keylen,
+				elt);
+		rspamd_mutex_unlock (storage->backend_mtx);
 	}
 
-	return TRUE;
+	return res;
 }
 
 /** Set element inside array */
@@ -588,36 +837,34 @@ rspamd_kv_storage_set_array (struct rspamd_kv_storage *storage,
 	struct rspamd_kv_element *elt;
 	guint *es;
 	gpointer target;
+	gboolean res = FALSE;
 
 	elt = rspamd_kv_storage_lookup (storage, key, keylen, now);
-	if (elt == NULL) {
+	if (elt == NULL || (elt->flags & KV_ELT_ARRAY) == 0) {
+		rspamd_kv_storage_release (storage, key, keylen);
 		return FALSE;
 	}
 
-	if ((elt->flags & KV_ELT_ARRAY) == 0) {
-		return FALSE;
-	}
 	/* Get element size */
 	es = (guint *)ELT_DATA (elt);
-	if (elt_num > (elt->size - sizeof (guint)) / (*es)) {
-		/* Invalid index */
-		return FALSE;
-	}
-	target = (gchar *)ELT_DATA (elt) + sizeof (guint) + (*es) * elt_num;
-	if (len != *es) {
-		/* Invalid size */
-		return FALSE;
-	}
-	memcpy (target, data, len);
-	/* Place to the backend */
-	if (storage->backend) {
-		return storage->backend->replace_func (storage->backend,
-				   key,
-				   keylen,
-				   elt);
+	if (elt_num <= (elt->size - sizeof (guint)) / (*es) && len == *es) {
+		target = (gchar *)ELT_DATA (elt) + sizeof (guint) + (*es) * elt_num;
+		memcpy (target, data, len);
+		res = TRUE;
+		/* Place to the backend */
+		if (storage->backend) {
+			rspamd_mutex_lock (storage->backend_mtx);
+			res = storage->backend->replace_func (storage->backend,
+					key,
+					keylen,
+					elt);
+			rspamd_mutex_unlock (storage->backend_mtx);
+		}
 	}
 
-	return TRUE;
+	rspamd_kv_storage_release (storage, key, keylen);
+
+	return res;
 }
 
 /** Get element inside array */
@@ -633,27 +880,24 @@ rspamd_kv_storage_get_array (struct rspamd_kv_storage *storage,
 	struct rspamd_kv_element *elt;
 	guint *es;
 	gpointer target;
+	gboolean res = FALSE;
 
 	elt = rspamd_kv_storage_lookup (storage, key, keylen, now);
-	if (elt == NULL) {
-		return FALSE;
-	}
-
-	if ((elt->flags & KV_ELT_ARRAY) == 0) {
-		return FALSE;
-	}
-	/* Get element size */
-	es = (guint *)ELT_DATA (elt);
-	if (elt_num > (elt->size - sizeof (guint)) / (*es)) {
-		/* Invalid index */
-		return FALSE;
+	if (elt != NULL && (elt->flags & KV_ELT_ARRAY) != 0) {
+		/* Get element size */
+		es = (guint *)ELT_DATA (elt);
+		if (elt_num <= (elt->size - sizeof (guint)) / (*es)) {
+			target = ELT_DATA (elt) + sizeof (guint) + (*es) * elt_num;
+
+			*len = *es;
+			*data = target;
+			res = TRUE;
+		}
 	}
-	target = ELT_DATA (elt) + sizeof (guint) + (*es) * elt_num;
 
-	*len = *es;
-	*data = target;
+	rspamd_kv_storage_release (storage, key, keylen);
 
-	return TRUE;
+	return res;
 }
 
 /**
@@ -666,6 +910,7 @@ struct rspamd_kv_lru_expire {
 	expire_step step_func;                      /*< this callback is used when cache is full */
 	expire_delete delete_func;                  /*< this callback is called when an element is deleted */
 	expire_destroy destroy_func;                /*< this callback is used for destroying all elements inside expire */
+	expire_touch touch_func;                    /*< this callback is called on lookup */
 
 	TAILQ_HEAD (eltq, rspamd_kv_element) head;
 };
@@ -698,7 +943,7 @@ rspamd_lru_delete (struct rspamd_kv_expire *e, struct rspamd_kv_element *elt)
  */
 static gboolean
 rspamd_lru_expire_step (struct rspamd_kv_expire *e,
-	struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
 	time_t now,
 	gboolean forced)
 {
@@ -716,9 +961,9 @@ rspamd_lru_expire_step (struct rspamd_kv_expire *e,
 		}
 		else {
 			/* This element is already expired */
-			storage->cache->steal_func (storage->cache, elt);
-			storage->memory -= ELT_SIZE (elt);
-			storage->elts--;
+			shard->cache->steal_func (shard->cache, elt);
+			shard->memory -= ELT_SIZE (elt);
+			shard->elts--;
 			TAILQ_REMOVE (&expire->head, elt, entry);
 			/* Free memory */
 			if ((elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
@@ -736,9 +981,9 @@ rspamd_lru_expire_step (struct rspamd_kv_expire *e,
 					(gint)elt->expire < (now - elt->age)) {
 					break;
 				}
-				storage->memory -= ELT_SIZE (elt);
-				storage->elts--;
-				storage->cache->steal_func (storage->cache, elt);
+				shard->memory -= ELT_SIZE (elt);
+				shard->elts--;
+				shard->cache->steal_func (shard->cache, elt);
 				TAILQ_REMOVE (&expire->head, elt, entry);
 				/* Free memory */
 				if ((elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
@@ -753,9 +998,9 @@ rspamd_lru_expire_step (struct rspamd_kv_expire *e,
 	}
 
 	if (!res && oldest_elt != NULL) {
-		storage->memory -= ELT_SIZE (oldest_elt);
-		storage->elts--;
-		storage->cache->steal_func (storage->cache, oldest_elt);
+		shard->memory -= ELT_SIZE (oldest_elt);
+		shard->elts--;
+		shard->cache->steal_func (shard->cache, oldest_elt);
 		TAILQ_REMOVE (&expire->head, oldest_elt, entry);
 		/* Free memory */
 		if ((oldest_elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
@@ -797,6 +1042,372 @@ rspamd_lru_expire_new (void)
 	new->delete_func = rspamd_lru_delete;
 	new->step_func = rspamd_lru_expire_step;
 	new->destroy_func = rspamd_lru_destroy;
+	new->touch_func = NULL;
+
+	return (struct rspamd_kv_expire *)new;
+}
+
+/**
+ * W-TinyLFU expire functions
+ */
+
+/* Initial and maximum width of frequency sketch */
+#define TINYLFU_SKETCH_MIN_WIDTH 1024
+#define TINYLFU_SKETCH_MAX_WIDTH (1 << 24)
+/* Rows of sketch */
+#define TINYLFU_SKETCH_DEPTH 4
+/* Maximum value of counter */
+#define TINYLFU_SKETCH_MAX 15
+/* Percent of elements in window queue */
+#define TINYLFU_WINDOW_PERCENT 1
+
+struct rspamd_kv_tinylfu_expire {
+	expire_init init_func;                      /*< this callback is called on kv storage initialization */
+	expire_insert insert_func;                  /*< this callback is called when element is inserted */
+	expire_step step_func;                      /*< this callback is used when cache is full */
+	expire_delete delete_func;                  /*< this callback is called when an element is deleted */
+	expire_destroy destroy_func;                /*< this callback is used for destroying all elements inside expire */
+	expire_touch touch_func;                    /*< this callback is called on lookup */
+
+	TAILQ_HEAD (windowq, rspamd_kv_element) window;
+	TAILQ_HEAD (mainq, rspamd_kv_element) main;
+	guint window_len;
+	guint main_len;
+	gboolean full;                              /*< shard has been full once */
+
+	/* Count-min sketch of access frequencies */
+	guint8 *sketch;
+	guint width;
+	guint additions;
+};
+
+static const guint32 tinylfu_seeds[TINYLFU_SKETCH_DEPTH] = {
+	0x9E3779B1U, 0x85EBCA77U, 0xC2B2AE3DU, 0x27D4EB2FU
+};
+
+static inline guint
+rspamd_tinylfu_index (struct rspamd_kv_tinylfu_expire *expire,
+	guint32 h, guint row)
+{
+	h *= tinylfu_seeds[row];
+	h ^= h >> 15;
+
+	return row * expire->width + (h & (expire->width - 1));
+}
+
+static inline guint32
+rspamd_tinylfu_hash (struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_element search_elt;
+
+	search_elt.keylen = elt->keylen;
+	search_elt.p = ELT_KEY (elt);
+
+	return kv_elt_hash_func (&search_elt);
+}
+
+/**
+ * Halve all counters to let sketch forget old accesses
+ */
+static void
+rspamd_tinylfu_age (struct rspamd_kv_tinylfu_expire *expire)
+{
+	guint i;
+
+	for (i = 0; i < expire->width * TINYLFU_SKETCH_DEPTH; i++) {
+		expire->sketch[i] >>= 1;
+	}
+
+	expire->additions /= 2;
+}
+
+/**
+ * Count an access of element, this can be called concurrently under read lock
+ * and then some increments may be lost, which is fine for an estimation
+ */
+static void
+rspamd_tinylfu_increment (struct rspamd_kv_tinylfu_expire *expire,
+	struct rspamd_kv_element *elt)
+{
+	guint32 h;
+	guint i, idx;
+
+	h = rspamd_tinylfu_hash (elt);
+
+	for (i = 0; i < TINYLFU_SKETCH_DEPTH; i++) {
+		idx = rspamd_tinylfu_index (expire, h, i);
+		if (expire->sketch[idx] < TINYLFU_SKETCH_MAX) {
+			expire->sketch[idx]++;
+		}
+	}
+
+	expire->additions++;
+}
+
+static guint
+rspamd_tinylfu_frequency (struct rspamd_kv_tinylfu_expire *expire,
+	struct rspamd_kv_element *elt)
+{
+	guint32 h;
+	guint i, freq = TINYLFU_SKETCH_MAX;
+
+	h = rspamd_tinylfu_hash (elt);
+
+	for (i = 0; i < TINYLFU_SKETCH_DEPTH; i++) {
+		freq = MIN (freq, expire->sketch[rspamd_tinylfu_index (expire, h, i)]);
+	}
+
+	return freq;
+}
+
+/**
+ * Resize sketch to keep it wider than the number of elements, counters are
+ * reset as they cannot be rehashed
+ */
+static void
+rspamd_tinylfu_resize (struct rspamd_kv_tinylfu_expire *expire, guint width)
+{
+	g_free (expire->sketch);
+	expire->width = width;
+	expire->sketch = g_malloc0 (width * TINYLFU_SKETCH_DEPTH);
+	expire->additions = 0;
+}
+
+static void
+rspamd_tinylfu_admit (struct rspamd_kv_tinylfu_expire *expire,
+	struct rspamd_kv_element *elt)
+{
+	TAILQ_REMOVE (&expire->window, elt, entry);
+	expire->window_len--;
+	elt->flags |= KV_ELT_MAIN;
+	TAILQ_INSERT_TAIL (&expire->main, elt, entry);
+	expire->main_len++;
+}
+
+static inline guint
+rspamd_tinylfu_window_max (struct rspamd_kv_tinylfu_expire *expire)
+{
+	return MAX ((expire->window_len + expire->main_len) *
+		   TINYLFU_WINDOW_PERCENT / 100, 1);
+}
+
+/**
+ * Insert an element into window queue
+ */
+static void
+rspamd_tinylfu_insert (struct rspamd_kv_expire *e,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_tinylfu_expire *expire =
+		(struct rspamd_kv_tinylfu_expire *)e;
+	guint total;
+
+	total = expire->window_len + expire->main_len + 1;
+	if (total > expire->width && expire->width < TINYLFU_SKETCH_MAX_WIDTH) {
+		rspamd_tinylfu_resize (expire, expire->width * 2);
+	}
+
+	elt->flags &= ~(KV_ELT_REFERENCED | KV_ELT_MAIN);
+	TAILQ_INSERT_TAIL (&expire->window, elt, entry);
+	expire->window_len++;
+
+	if (!expire->full &&
+		expire->window_len > rspamd_tinylfu_window_max (expire)) {
+		/* Until the shard is full the main queue is filled without admission */
+		rspamd_tinylfu_admit (expire, TAILQ_FIRST (&expire->window));
+	}
+
+	rspamd_tinylfu_increment (expire, elt);
+	/* Sample size is 10 times larger than sketch width */
+	if (expire->additions >= expire->width * 10) {
+		rspamd_tinylfu_age (expire);
+	}
+}
+
+/**
+ * Delete an element from its queue
+ */
+static void
+rspamd_tinylfu_delete (struct rspamd_kv_expire *e,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_tinylfu_expire *expire =
+		(struct rspamd_kv_tinylfu_expire *)e;
+
+	if (elt->flags & KV_ELT_MAIN) {
+		TAILQ_REMOVE (&expire->main, elt, entry);
+		expire->main_len--;
+	}
+	else {
+		TAILQ_REMOVE (&expire->window, elt, entry);
+		expire->window_len--;
+	}
+}
+
+/**
+ * Set reference bit and count access, no queues are modified
+ */
+static void
+rspamd_tinylfu_touch (struct rspamd_kv_expire *e,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_tinylfu_expire *expire =
+		(struct rspamd_kv_tinylfu_expire *)e;
+
+	elt->flags |= KV_ELT_REFERENCED;
+	rspamd_tinylfu_increment (expire, elt);
+}
+
+/**
+ * Remove element from shard
+ */
+static void
+rspamd_tinylfu_evict (struct rspamd_kv_tinylfu_expire *expire,
+	struct rspamd_kv_shard *shard,
+	struct rspamd_kv_element *elt)
+{
+	rspamd_tinylfu_delete ((struct rspamd_kv_expire *)expire, elt);
+	shard->cache->steal_func (shard->cache, elt);
+	shard->memory -= ELT_SIZE (elt);
+	shard->elts--;
+
+	/* Free memory */
+	if ((elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
+		elt->flags |= KV_ELT_NEED_FREE;
+	}
+	else {
+		g_slice_free1 (ELT_SIZE (elt), elt);
+	}
+}
+
+static inline gboolean
+rspamd_tinylfu_is_expired (struct rspamd_kv_element *elt, time_t now)
+{
+	return (elt->flags & KV_ELT_PERSISTENT) == 0 && elt->expire > 0 &&
+		   now - elt->age > (gint)elt->expire;
+}
+
+/**
+ * Find victim in main queue by CLOCK: referenced elements get the second
+ * chance and are moved to the tail with reference bit cleared
+ */
+static struct rspamd_kv_element *
+rspamd_tinylfu_main_victim (struct rspamd_kv_tinylfu_expire *expire,
+	time_t now,
+	gboolean forced)
+{
+	struct rspamd_kv_element *elt;
+	guint i;
+
+	/* Two passes are enough to clear all reference bits */
+	for (i = 0; i < expire->main_len * 2; i++) {
+		elt = TAILQ_FIRST (&expire->main);
+
+		if (rspamd_tinylfu_is_expired (elt, now)) {
+			return elt;
+		}
+		if ((elt->flags & KV_ELT_REFERENCED) == 0 &&
+			(forced || (elt->flags & (KV_ELT_PERSISTENT | KV_ELT_DIRTY)) == 0)) {
+			return elt;
+		}
+
+		elt->flags &= ~KV_ELT_REFERENCED;
+		TAILQ_REMOVE (&expire->main, elt, entry);
+		TAILQ_INSERT_TAIL (&expire->main, elt, entry);
+	}
+
+	return NULL;
+}
+
+/**
+ * Expire elements: the oldest element of the window competes with the
+ * victim of the main queue and the less frequent one is evicted
+ */
+static gboolean
+rspamd_tinylfu_expire_step (struct rspamd_kv_expire *e,
+	struct rspamd_kv_shard *shard,
+	time_t now,
+	gboolean forced)
+{
+	struct rspamd_kv_tinylfu_expire *expire =
+		(struct rspamd_kv_tinylfu_expire *)e;
+	struct rspamd_kv_element *candidate = NULL, *victim = NULL;
+
+	expire->full = TRUE;
+
+	if (expire->window_len > rspamd_tinylfu_window_max (expire) ||
+		expire->main_len == 0) {
+		candidate = TAILQ_FIRST (&expire->window);
+	}
+	if (expire->main_len > 0) {
+		victim = rspamd_tinylfu_main_victim (expire, now, forced);
+	}
+
+	if (candidate == NULL) {
+		if (victim == NULL) {
+			return FALSE;
+		}
+		rspamd_tinylfu_evict (expire, shard, victim);
+
+		return TRUE;
+	}
+
+	if (!forced && !rspamd_tinylfu_is_expired (candidate, now) &&
+		(candidate->flags & (KV_ELT_PERSISTENT | KV_ELT_DIRTY)) != 0) {
+		/* Candidate cannot be evicted, so it always goes to the main queue */
+		rspamd_tinylfu_admit (expire, candidate);
+		if (victim == NULL) {
+			return FALSE;
+		}
+		rspamd_tinylfu_evict (expire, shard, victim);
+	}
+	else if (victim != NULL && !rspamd_tinylfu_is_expired (candidate, now) &&
+		(rspamd_tinylfu_is_expired (victim, now) ||
+		rspamd_tinylfu_frequency (expire, candidate) >
+		rspamd_tinylfu_frequency (expire, victim))) {
+		rspamd_tinylfu_evict (expire, shard, victim);
+		rspamd_tinylfu_admit (expire, candidate);
+	}
+	else {
+		rspamd_tinylfu_evict (expire, shard, candidate);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Destroy W-TinyLFU expire memory
+ */
+static void
+rspamd_tinylfu_destroy (struct rspamd_kv_expire *e)
+{
+	struct rspamd_kv_tinylfu_expire *expire =
+		(struct rspamd_kv_tinylfu_expire *)e;
+
+	g_free (expire->sketch);
+	g_slice_free1 (sizeof (struct rspamd_kv_tinylfu_expire), expire);
+}
+
+/**
+ * Create new W-TinyLFU expire
+ */
+struct rspamd_kv_expire *
+rspamd_tinylfu_expire_new (void)
+{
+	struct rspamd_kv_tinylfu_expire *new;
+
+	new = g_slice_alloc0 (sizeof (struct rspamd_kv_tinylfu_expire));
+	TAILQ_INIT (&new->window);
+	TAILQ_INIT (&new->main);
+	rspamd_tinylfu_resize (new, TINYLFU_SKETCH_MIN_WIDTH);
+
+	/* Set callbacks */
+	new->init_func = NULL;
+	new->insert_func = rspamd_tinylfu_insert;
+	new->delete_func = rspamd_tinylfu_delete;
+	new->step_func = rspamd_tinylfu_expire_step;
+	new->destroy_func = rspamd_tinylfu_destroy;
+	new->touch_func = rspamd_tinylfu_touch;
 
 	return (struct rspamd_kv_expire *)new;
 }
@@ -25,12 +25,14 @@
 #define KVSTORAGE_H_
 
 #include "config.h"
+#include "util.h"
 
 struct rspamd_kv_cache;
 struct rspamd_kv_backend;
 struct rspamd_kv_storage;
 struct rspamd_kv_expire;
 struct rspamd_kv_element;
+struct rspamd_kv_shard;
 
 /* Locking definitions */
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
@@ -59,6 +61,7 @@ typedef struct rspamd_kv_element * (*cache_delete)(struct rspamd_kv_cache *cache
 typedef void (*cache_steal)(struct rspamd_kv_cache *cache,
 	struct rspamd_kv_element * elt);
 typedef void (*cache_destroy)(struct rspamd_kv_cache *cache);
+typedef struct rspamd_kv_cache * (*cache_create)(void);
 
 /* Callbacks for backend */
 typedef void (*backend_init)(struct rspamd_kv_backend *backend);
@@ -85,9 +88,12 @@ typedef void (*expire_insert)(struct rspamd_kv_expire *expire,
 typedef void (*expire_delete)(struct rspamd_kv_expire *expire,
 	struct rspamd_kv_element *elt);
 typedef gboolean (*expire_step)(struct rspamd_kv_expire *expire,
-	struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
 	time_t now, gboolean forced);
 typedef void (*expire_destroy)(struct rspamd_kv_expire *expire);
+typedef void (*expire_touch)(struct rspamd_kv_expire *expire,
+	struct rspamd_kv_element *elt);
+typedef struct rspamd_kv_expire * (*expire_create)(void);
 
 
 /* Flags of element */
@@ -99,7 +105,9 @@ enum rspamd_kv_flags {
 	KV_ELT_NEED_FREE = 1 << 4,
 	KV_ELT_INTEGER = 1 << 5,
 	KV_ELT_NEED_INSERT = 1 << 6,
-	KV_ELT_NEED_EXPIRE = 1 << 7
+	KV_ELT_NEED_EXPIRE = 1 << 7,
+	KV_ELT_REFERENCED = 1 << 8,
+	KV_ELT_MAIN = 1 << 9
 };
 
 #define ELT_DATA(elt) (gchar *)(elt)->data + (elt)->keylen + 1
@@ -147,25 +155,22 @@ struct rspamd_kv_expire {
 	expire_step step_func;                      /*< this callback is used when cache is full */
 	expire_delete delete_func;                  /*< this callback is called when an element is deleted */
 	expire_destroy destroy_func;                /*< this callback is used for destroying all elements inside expire */
+	expire_touch touch_func;                    /*< this callback is called on lookup with read lock held, may be NULL */
 };
 
-/* Main kv storage structure */
+/* Maximum number of shards in a storage */
+#define RSPAMD_KV_MAX_SHARDS 256
 
-struct rspamd_kv_storage {
+/* Part of storage that holds keys with the same hash */
+struct rspamd_kv_shard {
 	struct rspamd_kv_cache *cache;
-	struct rspamd_kv_backend *backend;
 	struct rspamd_kv_expire *expire;
 
-	gsize elts;                                 /*< current elements count in a storage */
-	gsize max_elts;                             /*< maximum number of elements in a storage */
+	gsize elts;                                 /*< current elements count in a shard */
+	gsize max_elts;                             /*< maximum number of elements in a shard */
 
 	gsize memory;                               /*< memory eaten */
 	gsize max_memory;                           /*< memory limit */
-
-	gint id;                                    /* char ID */
-	gchar *name;                                /* numeric ID */
-
-	gboolean no_overwrite;                      /* do not overwrite data with the same keys */
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
 	GRWLock rwlock;                             /* rwlock in new glib */
 #else
@@ -173,12 +178,36 @@ struct rspamd_kv_storage {
 #endif
 };
 
-/** Create new kv storage */
+/* Main kv storage structure */
+
+struct rspamd_kv_storage {
+	struct rspamd_kv_shard *shards;             /*< array of shards */
+	guint nshards;                              /*< number of shards */
+
+	struct rspamd_kv_backend *backend;
+	rspamd_mutex_t *backend_mtx;                /*< backend is shared by all shards */
+
+	gsize max_elts;                             /*< maximum number of elements in a storage */
+	gsize max_memory;                           /*< memory limit */
+
+	gint id;                                    /* char ID */
+	gchar *name;                                /* numeric ID */
+
+	gboolean no_overwrite;                      /* do not overwrite data with the same keys */
+};
+
+/** Create new kv storage, cache and expire are created for each shard */
 struct rspamd_kv_storage * rspamd_kv_storage_new (gint id, const gchar *name,
-	struct rspamd_kv_cache *cache, struct rspamd_kv_backend *backend,
-	struct rspamd_kv_expire *expire,
+	cache_create cache_new, struct rspamd_kv_backend *backend,
+	expire_create expire_new, guint nshards,
 	gsize max_elts, gsize max_memory, gboolean no_overwrite);
 
+/** Get shard for the specified key */
+struct rspamd_kv_shard * rspamd_kv_storage_get_shard (
+	struct rspamd_kv_storage *storage,
+	gpointer key,
+	guint keylen);
+
 /** Insert new element to the kv storage */
 gboolean rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 	gpointer key,
@@ -210,13 +239,53 @@ gboolean rspamd_kv_storage_increment (struct rspamd_kv_storage *storage,
 	guint keylen,
 	glong *value);
 
-/** Lookup an element inside kv storage */
+/**
+ * Lookup an element inside kv storage, shard of the key is left locked for
+ * reading and must be released by `rspamd_kv_storage_release`
+ */
 struct rspamd_kv_element * rspamd_kv_storage_lookup (
 	struct rspamd_kv_storage *storage,
 	gpointer key,
 	guint keylen,
 	time_t now);
 
+/** Release shard locked by lookup */
+void rspamd_kv_storage_release (struct rspamd_kv_storage *storage,
+	gpointer key,
+	guint keylen);
+
+/** Called for every key of a batch lookup, element is NULL if not found */
+typedef void (*rspamd_kv_lookup_cb)(guint idx, struct rspamd_kv_element *elt,
+	gpointer ud);
+
+/**
+ * Lookup several elements acquiring lock of every shard once, callback is
+ * called with the shard locked and keys are visited in order of shards
+ */
+void rspamd_kv_storage_lookup_many (struct rspamd_kv_storage *storage,
+	guint nkeys,
+	gchar **keys,
+	guint *keylens,
+	time_t now,
+	rspamd_kv_lookup_cb cb,
+	gpointer ud);
+
+/**
+ * Insert several elements at once, the batch is stored completely or not at
+ * all: shards of all elements are locked together and room is reserved before
+ * any element is inserted
+ * @return TRUE if elements have been stored, FALSE if there is no room for
+ * them and nothing has been stored
+ */
+gboolean rspamd_kv_storage_insert_many (struct rspamd_kv_storage *storage,
+	guint nkeys,
+	gchar **keys,
+	guint *keylens,
+	gchar **values,
+	gsize *lens,
+	gint flags,
+	guint expire);
+
 /** Expire an element from kv storage */
 struct rspamd_kv_element * rspamd_kv_storage_delete (
 	struct rspamd_kv_storage *storage,
@@ -263,6 +332,12 @@ gboolean kv_elt_compare_func (gconstpointer e1, gconstpointer e2);
  */
 struct rspamd_kv_expire * rspamd_lru_expire_new (void);
 
+/**
+ * W-TinyLFU expire: small FIFO window and CLOCK main queue, admission to the
+ * main queue is decided by frequency sketch. Lookups only set a reference bit
+ */
+struct rspamd_kv_expire * rspamd_tinylfu_expire_new (void);
+
 /**
  * Ordinary hash
  */
@@ -31,6 +31,7 @@
 #include "kvstorage_sqlite.h"
 #endif
 #include "kvstorage_file.h"
+#include "kvstorage_log.h"
 
 #define FILE_STORAGE_LEVELS 3
 
@@ -52,6 +53,7 @@ struct kvstorage_config_parser {
 		KVSTORAGE_STATE_CACHE_MAX_ELTS,
 		KVSTORAGE_STATE_CACHE_MAX_MEM,
 		KVSTORAGE_STATE_CACHE_NO_OVERWRITE,
+		KVSTORAGE_STATE_CACHE_SHARDS,
 		KVSTORAGE_STATE_BACKEND_TYPE,
 		KVSTORAGE_STATE_BACKEND_FILENAME,
 		KVSTORAGE_STATE_BACKEND_SYNC_OPS,
@@ -88,20 +90,20 @@ kvstorage_init_callback (const gpointer key,
 	gpointer unused)
 {
 	struct kvstorage_config *kconf = value;
-	struct rspamd_kv_cache *cache;
+	cache_create cache_new;
 	struct rspamd_kv_backend *backend = NULL;
-	struct rspamd_kv_expire *expire = NULL;
+	expire_create expire_new = NULL;
 
 	switch (kconf->cache.type) {
 	case KVSTORAGE_TYPE_CACHE_HASH:
-		cache = rspamd_kv_hash_new ();
+		cache_new = rspamd_kv_hash_new;
 		break;
 	case KVSTORAGE_TYPE_CACHE_RADIX:
-		cache = rspamd_kv_radix_new ();
+		cache_new = rspamd_kv_radix_new;
 		break;
 #ifdef WITH_JUDY
 	case KVSTORAGE_TYPE_CACHE_JUDY:
-		cache = rspamd_kv_judy_new ();
+		cache_new = rspamd_kv_judy_new;
 		break;
 #endif
 	default:
@@ -121,6 +123,12 @@ kvstorage_init_callback (const gpointer key,
 				kconf->backend.do_fsync,
 				kconf->backend.do_ref);
 		break;
+	case KVSTORAGE_TYPE_BACKEND_LOG:
+		backend = rspamd_kv_log_new (kconf->backend.filename,
+				kconf->backend.sync_ops,
+				kconf->backend.do_fsync,
+				kconf->backend.do_ref);
+		break;
 #ifdef WITH_DB
 	case KVSTORAGE_TYPE_BACKEND_BDB:
 		backend = rspamd_kv_bdb_new (kconf->backend.filename,
@@ -137,15 +145,19 @@ kvstorage_init_callback (const gpointer key,
 
 	switch (kconf->expire.type) {
 	case KVSTORAGE_TYPE_EXPIRE_LRU:
-		expire = rspamd_lru_expire_new ();
+		expire_new = rspamd_lru_expire_new;
+		break;
+	case KVSTORAGE_TYPE_EXPIRE_TINYLFU:
+		expire_new = rspamd_tinylfu_expire_new;
 		break;
 	}
 
 	kconf->storage = rspamd_kv_storage_new (kconf->id,
 			kconf->name,
-			cache,
+			cache_new,
 			backend,
-			expire,
+			expire_new,
+			kconf->cache.shards,
 			kconf->cache.max_elements,
 			kconf->cache.max_memory,
 			kconf->cache.no_overwrite);
@@ -197,6 +209,10 @@ kvstorage_xml_start_element (GMarkupParseContext *context,
 			kv_parser->state = KVSTORAGE_STATE_CACHE_NO_OVERWRITE;
 			kv_parser->cur_elt = "no_overwrite";
 		}
+		else if (g_ascii_strcasecmp (element_name, "shards") == 0) {
+			kv_parser->state = KVSTORAGE_STATE_CACHE_SHARDS;
+			kv_parser->cur_elt = "shards";
+		}
 		else if (g_ascii_strcasecmp (element_name, "id") == 0) {
 			kv_parser->state = KVSTORAGE_STATE_ID;
 			kv_parser->cur_elt = "id";
@@ -315,6 +331,7 @@ kvstorage_xml_end_element (GMarkupParseContext *context,
 	case KVSTORAGE_STATE_CACHE_MAX_ELTS:
 	case KVSTORAGE_STATE_CACHE_MAX_MEM:
 	case KVSTORAGE_STATE_CACHE_NO_OVERWRITE:
+	case KVSTORAGE_STATE_CACHE_SHARDS:
 		CHECK_TAG (KVSTORAGE_STATE_PARAM);
 		break;
 	case KVSTORAGE_STATE_BACKEND_TYPE:
@@ -421,6 +438,18 @@ kvstorage_xml_text (GMarkupParseContext *context,
 		kv_parser->current_storage->cache.no_overwrite =
 			rspamd_config_parse_flag (text);
 		break;
+	case KVSTORAGE_STATE_CACHE_SHARDS:
+		kv_parser->current_storage->cache.shards = strtoul (text, &err_str, 10);
+		if ((gsize)(err_str - text) != text_len ||
+			kv_parser->current_storage->cache.shards > RSPAMD_KV_MAX_SHARDS) {
+			if (*error == NULL) {
+				*error = g_error_new (
+					xml_error_quark (), XML_EXTRA_ELEMENT, "invalid number of shards: %*s",
+					(int)text_len, text);
+			}
+			kv_parser->state = KVSTORAGE_STATE_ERROR;
+		}
+		break;
 	case KVSTORAGE_STATE_CACHE_TYPE:
 		if (g_ascii_strncasecmp (text, "hash",
 			MIN (text_len, sizeof ("hash") - 1)) == 0) {
@@ -456,6 +485,11 @@ kvstorage_xml_text (GMarkupParseContext *context,
 			kv_parser->current_storage->backend.type =
 				KVSTORAGE_TYPE_BACKEND_FILE;
 		}
+		else if (g_ascii_strncasecmp (text, "log",
+			MIN (text_len, sizeof ("log") - 1)) == 0) {
+			kv_parser->current_storage->backend.type =
+				KVSTORAGE_TYPE_BACKEND_LOG;
+		}
 #ifdef WITH_DB
 		else if (g_ascii_strncasecmp (text, "bdb",
 			MIN (text_len, sizeof ("bdb") - 1)) == 0) {
@@ -502,6 +536,11 @@ kvstorage_xml_text (GMarkupParseContext *context,
 			MIN (text_len, sizeof ("lru") - 1)) == 0) {
 			kv_parser->current_storage->expire.type = KVSTORAGE_TYPE_EXPIRE_LRU;
 		}
+		else if (g_ascii_strncasecmp (text, "tinylfu",
+			MIN (text_len, sizeof ("tinylfu") - 1)) == 0) {
+			kv_parser->current_storage->expire.type =
+				KVSTORAGE_TYPE_EXPIRE_TINYLFU;
+		}
 		else {
 			if (*error == NULL) {
 				*error = g_error_new (
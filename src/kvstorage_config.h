@@ -42,6 +42,7 @@ enum kvstorage_cache_type {
 enum kvstorage_backend_type {
 	KVSTORAGE_TYPE_BACKEND_NULL = 0,
 	KVSTORAGE_TYPE_BACKEND_FILE,
+	KVSTORAGE_TYPE_BACKEND_LOG,
 #ifdef WITH_DB
 	KVSTORAGE_TYPE_BACKEND_BDB,
 #endif
@@ -53,7 +54,8 @@ enum kvstorage_backend_type {
 
 /* Type of kvstorage expire */
 enum kvstorage_expire_type {
-	KVSTORAGE_TYPE_EXPIRE_LRU
+	KVSTORAGE_TYPE_EXPIRE_LRU,
+	KVSTORAGE_TYPE_EXPIRE_TINYLFU
 };
 
 /* Cache config */
@@ -61,6 +63,7 @@ struct kvstorage_cache_config {
 	gsize max_elements;
 	gsize max_memory;
 	gboolean no_overwrite;
+	guint shards;
 	enum kvstorage_cache_type type;
 };
 
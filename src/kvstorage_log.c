@@ -0,0 +1,1543 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+#include "kvstorage.h"
+#include "kvstorage_log.h"
+#include "util.h"
+#include "main.h"
+
+/* Active segment is sealed when it grows over this size */
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+/* Sealed segment is compacted when this percent of it is garbage */
+#define LOG_COMPACT_PERCENT 50
+/* Maximum number of records written by a single writev */
+#define LOG_BATCH_RECORDS 64
+/* Records are aligned to allow direct access to elements in mapped segments */
+#define LOG_ALIGN(len) (((len) + 7) & ~7)
+#define LOG_RECORD_LEN(len) (sizeof (struct rspamd_kv_log_record) + \
+	LOG_ALIGN (len))
+#define LOG_CHECKPOINT_MAGIC "rkvlidx"
+#define LOG_CHECKPOINT_VERSION 1
+
+enum rspamd_kv_log_record_type {
+	LOG_RECORD_PUT = 1,
+	LOG_RECORD_DEL,
+	LOG_RECORD_REF
+};
+
+/* On-disk record header, followed by element (put) or by key (del and ref) */
+struct rspamd_kv_log_record {
+	guint32 len;                                /*< length of body */
+	guint32 checksum;                           /*< hash of header and body */
+	guint32 type;                               /*< type of record */
+	guint32 keylen;                             /*< length of key */
+	guint32 ref;                                /*< reference count of key */
+	guint32 reserved;
+};
+
+/* Checkpoint header, followed by entries each followed by its key */
+struct rspamd_kv_log_checkpoint {
+	gchar magic[8];
+	guint32 version;
+	guint32 segment;                            /*< segment to resume replay from */
+	guint64 offset;                             /*< offset to resume replay from */
+	guint64 nentries;
+};
+
+struct rspamd_kv_log_checkpoint_entry {
+	guint32 keylen;
+	guint32 segment;
+	guint32 len;
+	guint32 ref;
+	guint64 offset;
+};
+
+struct rspamd_kv_log_segment {
+	guint32 id;
+	gint fd;
+	goffset size;                               /*< bytes written to segment */
+	goffset live;                               /*< bytes of records referenced by index */
+};
+
+/* Common prefix of index entries and queued operations */
+struct rspamd_kv_log_key {
+	gchar *key;
+	guint keylen;
+};
+
+/* Position of the last put record of a key */
+struct rspamd_kv_log_entry {
+	struct rspamd_kv_log_key k;
+	guint32 segment;
+	guint32 len;                                /*< length of record */
+	guint32 ref;
+	goffset offset;
+};
+
+struct log_op {
+	struct rspamd_kv_log_key k;
+	struct rspamd_kv_element *elt;
+	enum {
+		LOG_OP_PUT,
+		LOG_OP_DELETE,
+		LOG_OP_REF
+	} op;
+	guint32 ref;
+};
+
+/* Records collected for a single write */
+struct rspamd_kv_log_batch {
+	struct rspamd_kv_log_record hdrs[LOG_BATCH_RECORDS];
+	const gchar *keys[LOG_BATCH_RECORDS];
+	gpointer copies[LOG_BATCH_RECORDS];         /*< private copies of bodies */
+	struct iovec iov[LOG_BATCH_RECORDS * 3];
+	guint nrec;
+	guint niov;
+	gsize len;
+};
+
+/* Main log structure */
+struct rspamd_log_backend {
+	backend_init init_func;                     /*< this callback is called on kv storage initialization */
+	backend_insert insert_func;                 /*< this callback is called when element is inserted */
+	backend_replace replace_func;               /*< this callback is called when element is replaced */
+	backend_lookup lookup_func;                 /*< this callback is used for lookup of element */
+	backend_delete delete_func;                 /*< this callback is called when an element is deleted */
+	backend_sync sync_func;                     /*< this callback is called when backend need to be synced */
+	backend_incref incref_func;                 /*< this callback is called when element must be ref'd */
+	backend_destroy destroy_func;               /*< this callback is used for destroying all elements inside backend */
+	gchar *filename;
+	gchar *dirname;
+	gchar *basename;
+	guint sync_ops;
+	GQueue *ops_queue;
+	GHashTable *ops_hash;
+	GHashTable *index;
+	GHashTable *segments;
+	struct rspamd_kv_log_segment *active;
+	rspamd_mutex_t *mtx;                        /*< protects everything above against compactor */
+	GCond *cond;
+	GThread *compactor;
+	gboolean stop;
+	gboolean do_fsync;
+	gboolean do_ref;
+	gboolean initialized;
+};
+
+static const gchar log_padding[8];
+
+static void
+rspamd_kv_log_batch_reset (struct rspamd_kv_log_batch *batch)
+{
+	guint i;
+
+	for (i = 0; i < batch->nrec; i++) {
+		if (batch->copies[i] != NULL) {
+			g_free (batch->copies[i]);
+		}
+	}
+
+	batch->nrec = 0;
+	batch->niov = 0;
+	batch->len = 0;
+}
+
+static guint32
+rspamd_kv_log_hash (gconstpointer data, gsize len)
+{
+	struct rspamd_kv_element search_elt;
+
+	search_elt.keylen = len;
+	search_elt.p = (gpointer)data;
+
+	return kv_elt_hash_func (&search_elt);
+}
+
+static guint
+rspamd_kv_log_key_hash (gconstpointer p)
+{
+	const struct rspamd_kv_log_key *k = p;
+
+	return rspamd_kv_log_hash (k->key, k->keylen);
+}
+
+static gboolean
+rspamd_kv_log_key_equal (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_kv_log_key *k1 = a, *k2 = b;
+
+	if (k1->keylen != k2->keylen) {
+		return FALSE;
+	}
+
+	return memcmp (k1->key, k2->key, k1->keylen) == 0;
+}
+
+static void
+rspamd_kv_log_datasync (gint fd)
+{
+#ifdef HAVE_FDATASYNC
+	fdatasync (fd);
+#else
+	fsync (fd);
+#endif
+}
+
+static gboolean
+rspamd_kv_log_write_full (gint fd, gconstpointer data, gsize len)
+{
+	const gchar *p = data;
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, p, len);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+static guint32
+rspamd_kv_log_checksum (const struct rspamd_kv_log_record *hdr,
+	gconstpointer body)
+{
+	struct rspamd_kv_log_record tmp;
+
+	memcpy (&tmp, hdr, sizeof (tmp));
+	tmp.checksum = 0;
+
+	return rspamd_kv_log_hash (&tmp, sizeof (tmp)) ^
+		   rspamd_kv_log_hash (body, hdr->len);
+}
+
+/*
+ * Check record at the specified position of a mapped segment and return its
+ * key or NULL if the record is truncated or corrupted
+ */
+static const gchar *
+rspamd_kv_log_record_check (const struct rspamd_kv_log_record *hdr,
+	goffset remain)
+{
+	const gchar *body = (const gchar *)(hdr + 1);
+
+	if (remain < (goffset)sizeof (*hdr) ||
+		remain < (goffset)LOG_RECORD_LEN (hdr->len)) {
+		return NULL;
+	}
+
+	switch (hdr->type) {
+	case LOG_RECORD_PUT:
+		if (hdr->len < sizeof (struct rspamd_kv_element) + hdr->keylen) {
+			return NULL;
+		}
+		body = ELT_KEY ((struct rspamd_kv_element *)body);
+		break;
+	case LOG_RECORD_DEL:
+	case LOG_RECORD_REF:
+		if (hdr->len != hdr->keylen) {
+			return NULL;
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	if (rspamd_kv_log_checksum (hdr, hdr + 1) != hdr->checksum) {
+		return NULL;
+	}
+
+	return body;
+}
+
+static void
+rspamd_kv_log_segment_path (struct rspamd_log_backend *db, guint32 id,
+	gchar *buf, gsize len)
+{
+	rspamd_snprintf (buf, len, "%s.%ud", db->filename, id);
+}
+
+static struct rspamd_kv_log_segment *
+rspamd_kv_log_segment_open (struct rspamd_log_backend *db, guint32 id,
+	gboolean create)
+{
+	struct rspamd_kv_log_segment *seg;
+	gchar path[PATH_MAX];
+	struct stat st;
+	gint fd, flags = O_RDWR | O_APPEND;
+
+	rspamd_kv_log_segment_path (db, id, path, sizeof (path));
+
+	if (create) {
+		flags |= O_CREAT | O_EXCL;
+	}
+
+	if ((fd = open (path, flags, S_IRUSR | S_IWUSR | S_IRGRP)) == -1) {
+		msg_err ("cannot open segment %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		msg_err ("cannot stat segment %s: %s", path, strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	seg = g_slice_alloc0 (sizeof (struct rspamd_kv_log_segment));
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = st.st_size;
+	g_hash_table_insert (db->segments, GUINT_TO_POINTER (id), seg);
+
+	return seg;
+}
+
+static void
+rspamd_kv_log_segment_free (gpointer p)
+{
+	struct rspamd_kv_log_segment *seg = p;
+
+	close (seg->fd);
+	g_slice_free1 (sizeof (struct rspamd_kv_log_segment), seg);
+}
+
+/* Seal active segment and start a new one, must be called with lock held */
+static gboolean
+rspamd_kv_log_rollover (struct rspamd_log_backend *db)
+{
+	struct rspamd_kv_log_segment *seg;
+	guint32 id = 1;
+
+	if (db->active) {
+		if (db->do_fsync) {
+			rspamd_kv_log_datasync (db->active->fd);
+		}
+		id = db->active->id + 1;
+	}
+
+	if ((seg = rspamd_kv_log_segment_open (db, id, TRUE)) == NULL) {
+		return FALSE;
+	}
+
+	db->active = seg;
+	/* Sealed segment may be ready for compaction */
+	g_cond_signal (db->cond);
+
+	return TRUE;
+}
+
+static struct rspamd_kv_log_entry *
+rspamd_kv_log_entry_new (const gchar *key, guint keylen)
+{
+	struct rspamd_kv_log_entry *entry;
+
+	entry = g_malloc (sizeof (struct rspamd_kv_log_entry) + keylen);
+	entry->k.key = (gchar *)(entry + 1);
+	entry->k.keylen = keylen;
+	memcpy (entry->k.key, key, keylen);
+
+	return entry;
+}
+
+/* Forget record referenced by an index entry */
+static void
+rspamd_kv_log_entry_unlink (struct rspamd_log_backend *db,
+	struct rspamd_kv_log_entry *entry)
+{
+	struct rspamd_kv_log_segment *seg;
+
+	seg = g_hash_table_lookup (db->segments,
+			GUINT_TO_POINTER (entry->segment));
+	if (seg != NULL) {
+		seg->live -= entry->len;
+	}
+}
+
+/* Update index with a record located at the specified position */
+static void
+rspamd_kv_log_apply (struct rspamd_log_backend *db,
+	struct rspamd_kv_log_segment *seg,
+	goffset offset,
+	const struct rspamd_kv_log_record *hdr,
+	const gchar *key)
+{
+	struct rspamd_kv_log_entry *entry;
+	struct rspamd_kv_log_key search;
+
+	search.key = (gchar *)key;
+	search.keylen = hdr->keylen;
+	entry = g_hash_table_lookup (db->index, &search);
+
+	switch (hdr->type) {
+	case LOG_RECORD_PUT:
+		if (entry == NULL) {
+			entry = rspamd_kv_log_entry_new (key, hdr->keylen);
+			g_hash_table_insert (db->index, entry, entry);
+		}
+		else {
+			rspamd_kv_log_entry_unlink (db, entry);
+		}
+		entry->segment = seg->id;
+		entry->offset = offset;
+		entry->len = LOG_RECORD_LEN (hdr->len);
+		entry->ref = hdr->ref;
+		seg->live += entry->len;
+		break;
+	case LOG_RECORD_DEL:
+		if (entry != NULL) {
+			rspamd_kv_log_entry_unlink (db, entry);
+			g_hash_table_remove (db->index, entry);
+		}
+		break;
+	case LOG_RECORD_REF:
+		if (entry != NULL) {
+			entry->ref = hdr->ref;
+		}
+		break;
+	}
+}
+
+/* Write collected records to the active segment and index them */
+static gboolean
+rspamd_kv_log_batch_flush (struct rspamd_log_backend *db,
+	struct rspamd_kv_log_batch *batch)
+{
+	struct rspamd_kv_log_segment *seg = db->active;
+	goffset offset = seg->size;
+	guint i, niov = 0;
+	gssize r;
+
+	if (batch->nrec == 0) {
+		return TRUE;
+	}
+
+	while (niov < batch->niov) {
+		r = writev (seg->fd, &batch->iov[niov], batch->niov - niov);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r != -1) {
+			/* Skip fully written vectors, continue with the rest */
+			while (niov < batch->niov && (gsize)r >= batch->iov[niov].iov_len) {
+				r -= batch->iov[niov].iov_len;
+				niov++;
+			}
+			if (niov < batch->niov) {
+				batch->iov[niov].iov_base = (gchar *)batch->iov[niov].iov_base + r;
+				batch->iov[niov].iov_len -= r;
+			}
+			continue;
+		}
+
+		msg_err ("cannot write to segment %ud: %s", seg->id, strerror (errno));
+		/* Drop partial records */
+		if (ftruncate (seg->fd, seg->size) == -1) {
+			msg_err ("cannot truncate segment %ud: %s", seg->id,
+				strerror (errno));
+		}
+		rspamd_kv_log_batch_reset (batch);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < batch->nrec; i++) {
+		rspamd_kv_log_apply (db, seg, offset, &batch->hdrs[i], batch->keys[i]);
+		offset += LOG_RECORD_LEN (batch->hdrs[i].len);
+	}
+
+	seg->size = offset;
+	rspamd_kv_log_batch_reset (batch);
+
+	return TRUE;
+}
+
+/*
+ * Add record to the batch flushing it if needed, body is copied if it can be
+ * modified by other threads before the batch is written
+ */
+static gboolean
+rspamd_kv_log_batch_add (struct rspamd_log_backend *db,
+	struct rspamd_kv_log_batch *batch,
+	enum rspamd_kv_log_record_type type,
+	gconstpointer body,
+	gsize len,
+	const gchar *key,
+	guint keylen,
+	guint32 ref,
+	gboolean copy)
+{
+	struct rspamd_kv_log_record *hdr;
+	gsize reclen = LOG_RECORD_LEN (len);
+
+	if (batch->nrec == LOG_BATCH_RECORDS) {
+		if (!rspamd_kv_log_batch_flush (db, batch)) {
+			return FALSE;
+		}
+	}
+
+	if (db->active->size + batch->len > 0 &&
+		db->active->size + batch->len + reclen > LOG_SEGMENT_SIZE) {
+		if (!rspamd_kv_log_batch_flush (db, batch) ||
+			!rspamd_kv_log_rollover (db)) {
+			return FALSE;
+		}
+	}
+
+	if (copy) {
+		body = batch->copies[batch->nrec] = g_memdup (body, len);
+	}
+	else {
+		batch->copies[batch->nrec] = NULL;
+	}
+
+	hdr = &batch->hdrs[batch->nrec];
+	hdr->len = len;
+	hdr->type = type;
+	hdr->keylen = keylen;
+	hdr->ref = ref;
+	hdr->reserved = 0;
+	hdr->checksum = rspamd_kv_log_checksum (hdr, body);
+	batch->keys[batch->nrec] = key;
+
+	batch->iov[batch->niov].iov_base = hdr;
+	batch->iov[batch->niov++].iov_len = sizeof (*hdr);
+	batch->iov[batch->niov].iov_base = (gpointer)body;
+	batch->iov[batch->niov++].iov_len = len;
+	if (LOG_ALIGN (len) != len) {
+		batch->iov[batch->niov].iov_base = (gpointer)log_padding;
+		batch->iov[batch->niov++].iov_len = LOG_ALIGN (len) - len;
+	}
+
+	batch->nrec++;
+	batch->len += reclen;
+
+	return TRUE;
+}
+
+/* Group commit of the operations queue, must be called with lock held */
+static gboolean
+log_process_queue (struct rspamd_log_backend *db)
+{
+	struct rspamd_kv_log_batch batch;
+	struct rspamd_kv_log_entry *entry;
+	struct log_op *op;
+	GList *cur;
+	gboolean res = TRUE;
+
+	if (g_queue_get_length (db->ops_queue) == 0) {
+		/* Nothing to process */
+		return TRUE;
+	}
+
+	batch.nrec = 0;
+	batch.niov = 0;
+	batch.len = 0;
+
+	cur = db->ops_queue->head;
+	while (cur && res) {
+		op = cur->data;
+
+		switch (op->op) {
+		case LOG_OP_PUT:
+			res = rspamd_kv_log_batch_add (db, &batch, LOG_RECORD_PUT,
+					op->elt, ELT_SIZE (op->elt), op->k.key, op->k.keylen,
+					op->ref, TRUE);
+			break;
+		case LOG_OP_DELETE:
+			if (g_hash_table_lookup (db->index, &op->k) != NULL) {
+				res = rspamd_kv_log_batch_add (db, &batch, LOG_RECORD_DEL,
+						op->k.key, op->k.keylen, op->k.key, op->k.keylen, 0, FALSE);
+			}
+			break;
+		case LOG_OP_REF:
+			entry = g_hash_table_lookup (db->index, &op->k);
+			if (entry != NULL && entry->ref != op->ref) {
+				res = rspamd_kv_log_batch_add (db, &batch, LOG_RECORD_REF,
+						op->k.key, op->k.keylen, op->k.key, op->k.keylen,
+						op->ref, FALSE);
+			}
+			break;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	if (!res || !rspamd_kv_log_batch_flush (db, &batch)) {
+		/* Keep queue to retry on the next sync */
+		rspamd_kv_log_batch_reset (&batch);
+		return FALSE;
+	}
+
+	if (db->do_fsync) {
+		rspamd_kv_log_datasync (db->active->fd);
+	}
+
+	/* Clean the queue */
+	g_hash_table_remove_all (db->ops_hash);
+	cur = db->ops_queue->head;
+	while (cur) {
+		op = cur->data;
+		if (op->elt != NULL) {
+			if (op->op == LOG_OP_DELETE ||
+				((op->elt->flags & KV_ELT_NEED_FREE) != 0 &&
+				(op->elt->flags & KV_ELT_NEED_INSERT) == 0)) {
+				/* Also clean memory */
+				g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			}
+			else {
+				/* Unset dirty flag */
+				op->elt->flags &= ~KV_ELT_DIRTY;
+			}
+		}
+		g_free (op->k.key);
+		g_slice_free1 (sizeof (struct log_op), op);
+		cur = g_list_next (cur);
+	}
+
+	g_queue_clear (db->ops_queue);
+
+	return TRUE;
+}
+
+static struct log_op *
+log_op_new (struct rspamd_log_backend *db, gpointer key, guint keylen)
+{
+	struct log_op *op;
+
+	op = g_slice_alloc0 (sizeof (struct log_op));
+	op->k.key = g_malloc (keylen);
+	op->k.keylen = keylen;
+	memcpy (op->k.key, key, keylen);
+
+	g_queue_push_head (db->ops_queue, op);
+	g_hash_table_insert (db->ops_hash, op, op);
+
+	return op;
+}
+
+/* Queue new value of a key */
+static gboolean
+log_queue_put (struct rspamd_log_backend *db,
+	gpointer key,
+	guint keylen,
+	struct rspamd_kv_element *elt,
+	gboolean keep_ref)
+{
+	struct rspamd_kv_log_entry *entry;
+	struct rspamd_kv_log_key search;
+	struct log_op *op;
+
+	search.key = key;
+	search.keylen = keylen;
+
+	if ((op = g_hash_table_lookup (db->ops_hash, &search)) != NULL) {
+		/* We found another op with such key in this queue */
+		if (op->elt != NULL && op->elt != elt &&
+			(op->op == LOG_OP_DELETE ||
+			(op->elt->flags & KV_ELT_NEED_FREE) != 0)) {
+			/* Also clean memory */
+			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+		}
+		if (!keep_ref || op->ref == 0) {
+			op->ref = 1;
+		}
+	}
+	else {
+		op = log_op_new (db, key, keylen);
+		entry = g_hash_table_lookup (db->index, &search);
+		if (keep_ref && entry != NULL) {
+			op->ref = entry->ref;
+		}
+		else {
+			op->ref = 1;
+		}
+	}
+
+	op->op = LOG_OP_PUT;
+	op->elt = elt;
+	elt->flags |= KV_ELT_DIRTY;
+
+	if (db->sync_ops > 0 && g_queue_get_length (db->ops_queue) >=
+		db->sync_ops) {
+		return log_process_queue (db);
+	}
+
+	return TRUE;
+}
+
+/* Read element from the position specified by index entry */
+static struct rspamd_kv_element *
+rspamd_kv_log_read (struct rspamd_log_backend *db,
+	struct rspamd_kv_log_entry *entry)
+{
+	struct rspamd_kv_log_segment *seg;
+	struct rspamd_kv_log_record hdr;
+	struct rspamd_kv_element *elt;
+
+	seg = g_hash_table_lookup (db->segments, GUINT_TO_POINTER (entry->segment));
+	if (seg == NULL) {
+		return NULL;
+	}
+
+	if (pread (seg->fd, &hdr, sizeof (hdr), entry->offset) != sizeof (hdr) ||
+		hdr.type != LOG_RECORD_PUT || hdr.keylen != entry->k.keylen ||
+		LOG_RECORD_LEN (hdr.len) != entry->len) {
+		msg_err ("invalid record in segment %ud at offset %O", seg->id,
+			entry->offset);
+		return NULL;
+	}
+
+	elt = g_malloc (hdr.len);
+	if (pread (seg->fd, elt, hdr.len, entry->offset + sizeof (hdr)) !=
+		(gssize)hdr.len || rspamd_kv_log_checksum (&hdr, elt) != hdr.checksum) {
+		msg_err ("cannot read record in segment %ud at offset %O", seg->id,
+			entry->offset);
+		g_free (elt);
+		return NULL;
+	}
+
+	elt->flags &= ~(KV_ELT_DIRTY | KV_ELT_NEED_FREE);
+
+	return elt;
+}
+
+/*
+ * Replay records of a segment starting from `offset`, segment is truncated
+ * on the first broken record if it is the last one
+ */
+static void
+rspamd_kv_log_replay_segment (struct rspamd_log_backend *db,
+	struct rspamd_kv_log_segment *seg,
+	goffset offset,
+	gboolean last)
+{
+	const struct rspamd_kv_log_record *hdr;
+	const gchar *key;
+	gpointer map;
+
+	if (seg->size == 0 || offset >= seg->size) {
+		return;
+	}
+
+	map = mmap (NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0);
+	if (map == MAP_FAILED) {
+		msg_err ("cannot mmap segment %ud: %s", seg->id, strerror (errno));
+		return;
+	}
+
+	while (offset < seg->size) {
+		hdr = (const struct rspamd_kv_log_record *)((gchar *)map + offset);
+		if ((key = rspamd_kv_log_record_check (hdr, seg->size - offset)) ==
+			NULL) {
+			break;
+		}
+		rspamd_kv_log_apply (db, seg, offset, hdr, key);
+		offset += LOG_RECORD_LEN (hdr->len);
+	}
+
+	munmap (map, seg->size);
+
+	if (offset < seg->size) {
+		msg_warn ("broken record in segment %ud at offset %O", seg->id, offset);
+		if (last) {
+			if (ftruncate (seg->fd, offset) == -1) {
+				msg_err ("cannot truncate segment %ud: %s", seg->id,
+					strerror (errno));
+			}
+			else {
+				seg->size = offset;
+			}
+		}
+	}
+}
+
+static void
+rspamd_kv_log_checkpoint_path (struct rspamd_log_backend *db,
+	gchar *buf, gsize len, gboolean tmp)
+{
+	rspamd_snprintf (buf, len, "%s.index%s", db->filename, tmp ? ".tmp" : "");
+}
+
+/* Write index to disk, must be called with lock held */
+static gboolean
+rspamd_kv_log_checkpoint_write (struct rspamd_log_backend *db)
+{
+	struct rspamd_kv_log_checkpoint hdr;
+	struct rspamd_kv_log_checkpoint_entry ce;
+	struct rspamd_kv_log_entry *entry;
+	gchar path[PATH_MAX], tmp[PATH_MAX];
+	GHashTableIter it;
+	GByteArray *buf;
+	gpointer k, v;
+	gint fd;
+	gboolean res = TRUE;
+
+	rspamd_kv_log_checkpoint_path (db, path, sizeof (path), FALSE);
+	rspamd_kv_log_checkpoint_path (db, tmp, sizeof (tmp), TRUE);
+
+	if ((fd = open (tmp, O_CREAT | O_WRONLY | O_TRUNC,
+		S_IRUSR | S_IWUSR | S_IRGRP)) == -1) {
+		msg_err ("cannot open checkpoint %s: %s", tmp, strerror (errno));
+		return FALSE;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, LOG_CHECKPOINT_MAGIC, sizeof (hdr.magic));
+	hdr.version = LOG_CHECKPOINT_VERSION;
+	hdr.segment = db->active->id;
+	hdr.offset = db->active->size;
+	hdr.nentries = g_hash_table_size (db->index);
+
+	buf = g_byte_array_sized_new (BUFSIZ * 16);
+	g_byte_array_append (buf, (const guint8 *)&hdr, sizeof (hdr));
+
+	g_hash_table_iter_init (&it, db->index);
+	while (res && g_hash_table_iter_next (&it, &k, &v)) {
+		entry = v;
+		ce.keylen = entry->k.keylen;
+		ce.segment = entry->segment;
+		ce.len = entry->len;
+		ce.ref = entry->ref;
+		ce.offset = entry->offset;
+		g_byte_array_append (buf, (const guint8 *)&ce, sizeof (ce));
+		g_byte_array_append (buf, (const guint8 *)entry->k.key,
+			entry->k.keylen);
+
+		if (buf->len >= BUFSIZ * 16) {
+			res = rspamd_kv_log_write_full (fd, buf->data, buf->len);
+			g_byte_array_set_size (buf, 0);
+		}
+	}
+
+	if (res && buf->len > 0) {
+		res = rspamd_kv_log_write_full (fd, buf->data, buf->len);
+	}
+	g_byte_array_free (buf, TRUE);
+
+	if (res) {
+		rspamd_kv_log_datasync (fd);
+	}
+	close (fd);
+
+	if (!res || rename (tmp, path) == -1) {
+		msg_err ("cannot write checkpoint %s: %s", path, strerror (errno));
+		unlink (tmp);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Load index from checkpoint, returns position to resume replay from or
+ * FALSE if checkpoint is absent or does not match segments
+ */
+static gboolean
+rspamd_kv_log_checkpoint_load (struct rspamd_log_backend *db,
+	guint32 *psegment,
+	goffset *poffset)
+{
+	struct rspamd_kv_log_checkpoint hdr;
+	struct rspamd_kv_log_checkpoint_entry ce;
+	struct rspamd_kv_log_entry *entry;
+	struct rspamd_kv_log_segment *seg;
+	gchar path[PATH_MAX];
+	const gchar *p, *end;
+	gpointer map;
+	struct stat st;
+	guint64 i;
+	gint fd;
+	gboolean res = FALSE;
+
+	rspamd_kv_log_checkpoint_path (db, path, sizeof (path), FALSE);
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (hdr) ||
+		(map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+		MAP_FAILED) {
+		close (fd);
+		return FALSE;
+	}
+	close (fd);
+
+	p = map;
+	end = p + st.st_size;
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	if (memcmp (hdr.magic, LOG_CHECKPOINT_MAGIC, sizeof (hdr.magic)) != 0 ||
+		hdr.version != LOG_CHECKPOINT_VERSION) {
+		msg_warn ("invalid checkpoint %s, ignoring it", path);
+		goto out;
+	}
+
+	for (i = 0; i < hdr.nentries; i++) {
+		if (end - p < (gssize)sizeof (ce)) {
+			break;
+		}
+		memcpy (&ce, p, sizeof (ce));
+		p += sizeof (ce);
+		if (end - p < (gssize)ce.keylen) {
+			break;
+		}
+
+		seg = g_hash_table_lookup (db->segments, GUINT_TO_POINTER (ce.segment));
+		if (seg == NULL || (goffset)(ce.offset + ce.len) > seg->size) {
+			break;
+		}
+
+		entry = rspamd_kv_log_entry_new (p, ce.keylen);
+		entry->segment = ce.segment;
+		entry->offset = ce.offset;
+		entry->len = ce.len;
+		entry->ref = ce.ref;
+		g_hash_table_replace (db->index, entry, entry);
+		seg->live += ce.len;
+		p += ce.keylen;
+	}
+
+	if (i != hdr.nentries) {
+		msg_warn ("checkpoint %s does not match segments, replaying all of them",
+			path);
+		goto out;
+	}
+
+	*psegment = hdr.segment;
+	*poffset = hdr.offset;
+	res = TRUE;
+
+out:
+	munmap (map, st.st_size);
+
+	return res;
+}
+
+static gint
+rspamd_kv_log_id_cmp (gconstpointer a, gconstpointer b)
+{
+	guint32 id1 = GPOINTER_TO_UINT (a), id2 = GPOINTER_TO_UINT (b);
+
+	return id1 < id2 ? -1 : (id1 > id2 ? 1 : 0);
+}
+
+/* Return sealed segment that is worth compacting, must be called with lock */
+static struct rspamd_kv_log_segment *
+rspamd_kv_log_compact_candidate (struct rspamd_log_backend *db)
+{
+	struct rspamd_kv_log_segment *seg, *best = NULL;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, db->segments);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		seg = v;
+		if (seg == db->active || seg->size == 0 ||
+			(seg->size - seg->live) * 100 < seg->size * LOG_COMPACT_PERCENT) {
+			continue;
+		}
+		if (best == NULL || seg->live * best->size < best->live * seg->size) {
+			best = seg;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Copy live records of the most fragmented sealed segment to the active one
+ * and remove it, lock is acquired only for batches of records
+ */
+static gboolean
+rspamd_kv_log_compact (struct rspamd_log_backend *db)
+{
+	struct rspamd_kv_log_batch batch;
+	struct rspamd_kv_log_segment *seg;
+	struct rspamd_kv_log_entry *entry;
+	const struct rspamd_kv_log_record *hdr;
+	struct rspamd_kv_log_key search;
+	GHashTableIter it;
+	gpointer k, v, map;
+	gchar path[PATH_MAX];
+	guint32 id, first_id;
+	goffset offset = 0, size;
+	gboolean oldest = TRUE, res = TRUE;
+
+	rspamd_mutex_lock (db->mtx);
+	if ((seg = rspamd_kv_log_compact_candidate (db)) == NULL) {
+		rspamd_mutex_unlock (db->mtx);
+		return FALSE;
+	}
+
+	g_hash_table_iter_init (&it, db->segments);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (GPOINTER_TO_UINT (k) < seg->id) {
+			oldest = FALSE;
+		}
+	}
+
+	id = seg->id;
+	size = seg->size;
+	first_id = db->active->id;
+	/* Sealed segments are never written, so we can read without lock */
+	map = mmap (NULL, size, PROT_READ, MAP_SHARED, seg->fd, 0);
+	rspamd_mutex_unlock (db->mtx);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot mmap segment %ud: %s", id, strerror (errno));
+		return FALSE;
+	}
+
+	batch.nrec = 0;
+	batch.niov = 0;
+	batch.len = 0;
+
+	while (res && offset < size) {
+		rspamd_mutex_lock (db->mtx);
+
+		while (res && offset < size && batch.nrec < LOG_BATCH_RECORDS - 1) {
+			hdr = (const struct rspamd_kv_log_record *)((gchar *)map + offset);
+			if ((search.key = (gchar *)rspamd_kv_log_record_check (hdr,
+				size - offset)) == NULL) {
+				/* Records after a broken one have never been indexed */
+				offset = size;
+				break;
+			}
+			search.keylen = hdr->keylen;
+			entry = g_hash_table_lookup (db->index, &search);
+
+			switch (hdr->type) {
+			case LOG_RECORD_PUT:
+				if (entry != NULL && entry->segment == id &&
+					entry->offset == offset) {
+					res = rspamd_kv_log_batch_add (db, &batch, LOG_RECORD_PUT,
+							hdr + 1, hdr->len, search.key, search.keylen,
+							entry->ref, FALSE);
+				}
+				break;
+			case LOG_RECORD_REF:
+				/* Put records of older segments rely on this one */
+				if (entry != NULL && entry->segment < id) {
+					res = rspamd_kv_log_batch_add (db, &batch, LOG_RECORD_REF,
+							hdr + 1, hdr->len, search.key, search.keylen,
+							entry->ref, FALSE);
+				}
+				break;
+			case LOG_RECORD_DEL:
+				/* Older segments may still contain values of this key */
+				if (entry == NULL && !oldest) {
+					res = rspamd_kv_log_batch_add (db, &batch, LOG_RECORD_DEL,
+							hdr + 1, hdr->len, search.key, search.keylen, 0, FALSE);
+				}
+				break;
+			}
+
+			offset += LOG_RECORD_LEN (hdr->len);
+		}
+
+		if (res) {
+			res = rspamd_kv_log_batch_flush (db, &batch);
+		}
+		else {
+			rspamd_kv_log_batch_reset (&batch);
+		}
+		rspamd_mutex_unlock (db->mtx);
+	}
+
+	munmap (map, size);
+
+	if (!res) {
+		msg_err ("compaction of segment %ud failed", id);
+		return FALSE;
+	}
+
+	rspamd_mutex_lock (db->mtx);
+	/* Copies must be on disk before the original is removed */
+	g_hash_table_iter_init (&it, db->segments);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (GPOINTER_TO_UINT (k) >= first_id) {
+			rspamd_kv_log_datasync (((struct rspamd_kv_log_segment *)v)->fd);
+		}
+	}
+
+	if (rspamd_kv_log_checkpoint_write (db)) {
+		rspamd_kv_log_segment_path (db, id, path, sizeof (path));
+		g_hash_table_remove (db->segments, GUINT_TO_POINTER (id));
+		if (unlink (path) == -1) {
+			msg_err ("cannot unlink segment %s: %s", path, strerror (errno));
+		}
+		msg_info ("compacted segment %s", path);
+	}
+	else {
+		res = FALSE;
+	}
+	rspamd_mutex_unlock (db->mtx);
+
+	return res;
+}
+
+static gpointer
+rspamd_kv_log_compactor (gpointer ud)
+{
+	struct rspamd_log_backend *db = ud;
+	gboolean res;
+
+	rspamd_mutex_lock (db->mtx);
+	while (!db->stop) {
+		rspamd_mutex_unlock (db->mtx);
+		res = rspamd_kv_log_compact (db);
+		rspamd_mutex_lock (db->mtx);
+
+		if (!res && !db->stop) {
+			/* Wait for a new sealed segment */
+			rspamd_cond_wait (db->cond, db->mtx);
+		}
+	}
+	rspamd_mutex_unlock (db->mtx);
+
+	return NULL;
+}
+
+/* Backend callbacks */
+static void
+rspamd_log_init (struct rspamd_kv_backend *backend)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct rspamd_kv_log_segment *seg;
+	GList *ids = NULL, *cur;
+	GError *err = NULL;
+	GDir *dir;
+	const gchar *name;
+	gchar *end, path[PATH_MAX];
+	guint32 resume_id = 0, id;
+	goffset resume_offset = 0;
+	gsize baselen = strlen (db->basename);
+
+	if ((dir = g_dir_open (db->dirname, 0, &err)) == NULL) {
+		msg_err ("cannot open directory %s: %s", db->dirname, err->message);
+		g_error_free (err);
+		return;
+	}
+
+	/* Find segments named `basename.<id>` */
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (strncmp (name, db->basename, baselen) != 0 || name[baselen] != '.' ||
+			!g_ascii_isdigit (name[baselen + 1])) {
+			continue;
+		}
+		errno = 0;
+		id = strtoul (name + baselen + 1, &end, 10);
+		if (*end != '\0' || errno != 0 || id == 0) {
+			continue;
+		}
+		ids = g_list_prepend (ids, GUINT_TO_POINTER (id));
+	}
+	g_dir_close (dir);
+
+	ids = g_list_sort (ids, rspamd_kv_log_id_cmp);
+
+	rspamd_mutex_lock (db->mtx);
+	for (cur = ids; cur != NULL; cur = g_list_next (cur)) {
+		if (rspamd_kv_log_segment_open (db, GPOINTER_TO_UINT (cur->data),
+			FALSE) == NULL) {
+			goto err;
+		}
+	}
+
+	if (!rspamd_kv_log_checkpoint_load (db, &resume_id, &resume_offset)) {
+		g_hash_table_remove_all (db->index);
+		for (cur = ids; cur != NULL; cur = g_list_next (cur)) {
+			seg = g_hash_table_lookup (db->segments, cur->data);
+			seg->live = 0;
+		}
+		resume_id = 0;
+		resume_offset = 0;
+	}
+
+	for (cur = ids; cur != NULL; cur = g_list_next (cur)) {
+		id = GPOINTER_TO_UINT (cur->data);
+		seg = g_hash_table_lookup (db->segments, cur->data);
+		if (id > resume_id) {
+			rspamd_kv_log_replay_segment (db, seg, 0, cur->next == NULL);
+		}
+		else if (id == resume_id) {
+			rspamd_kv_log_replay_segment (db, seg, resume_offset,
+				cur->next == NULL);
+		}
+
+		if (seg->size == 0) {
+			/* Nothing has been written there before restart */
+			rspamd_kv_log_segment_path (db, id, path, sizeof (path));
+			g_hash_table_remove (db->segments, cur->data);
+			unlink (path);
+		}
+		else {
+			db->active = seg;
+		}
+	}
+
+	/* Always append to a fresh segment */
+	if (!rspamd_kv_log_rollover (db)) {
+		goto err;
+	}
+
+	msg_info ("loaded %ud keys from %ud segments of %s",
+		g_hash_table_size (db->index), g_list_length (ids), db->filename);
+
+	db->compactor = rspamd_create_thread ("kvlog",
+			rspamd_kv_log_compactor,
+			db,
+			&err);
+	if (db->compactor == NULL) {
+		msg_err ("cannot start compaction thread: %s, compaction is disabled",
+			err ? err->message : "unknown error");
+		if (err) {
+			g_error_free (err);
+		}
+	}
+
+	db->initialized = TRUE;
+	rspamd_mutex_unlock (db->mtx);
+	g_list_free (ids);
+
+	return;
+err:
+	rspamd_mutex_unlock (db->mtx);
+	g_list_free (ids);
+}
+
+static gboolean
+rspamd_log_insert (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	gboolean res;
+
+	if (!db->initialized) {
+		return FALSE;
+	}
+
+	rspamd_mutex_lock (db->mtx);
+	res = log_queue_put (db, key, keylen, elt, FALSE);
+	rspamd_mutex_unlock (db->mtx);
+
+	return res;
+}
+
+static gboolean
+rspamd_log_replace (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	gboolean res;
+
+	if (!db->initialized) {
+		return FALSE;
+	}
+
+	rspamd_mutex_lock (db->mtx);
+	res = log_queue_put (db, key, keylen, elt, TRUE);
+	rspamd_mutex_unlock (db->mtx);
+
+	return res;
+}
+
+static struct rspamd_kv_element *
+rspamd_log_lookup (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct rspamd_kv_element *elt = NULL;
+	struct rspamd_kv_log_entry *entry;
+	struct rspamd_kv_log_key search;
+	struct log_op *op;
+
+	if (!db->initialized) {
+		return NULL;
+	}
+
+	search.key = key;
+	search.keylen = keylen;
+
+	rspamd_mutex_lock (db->mtx);
+	/* First search in ops queue */
+	if ((op = g_hash_table_lookup (db->ops_hash, &search)) != NULL &&
+		op->op != LOG_OP_REF) {
+		if (op->op == LOG_OP_PUT) {
+			elt = op->elt;
+		}
+		rspamd_mutex_unlock (db->mtx);
+
+		return elt;
+	}
+
+	if ((entry = g_hash_table_lookup (db->index, &search)) != NULL) {
+		elt = rspamd_kv_log_read (db, entry);
+	}
+	rspamd_mutex_unlock (db->mtx);
+
+	return elt;
+}
+
+static void
+rspamd_log_delete (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct rspamd_kv_log_entry *entry;
+	struct rspamd_kv_log_key search;
+	struct log_op *op;
+
+	if (!db->initialized) {
+		return;
+	}
+
+	search.key = key;
+	search.keylen = keylen;
+
+	rspamd_mutex_lock (db->mtx);
+	if ((op = g_hash_table_lookup (db->ops_hash, &search)) == NULL) {
+		if ((entry = g_hash_table_lookup (db->index, &search)) == NULL) {
+			rspamd_mutex_unlock (db->mtx);
+			return;
+		}
+		op = log_op_new (db, key, keylen);
+		op->op = LOG_OP_REF;
+		op->ref = entry->ref;
+	}
+
+	if (db->do_ref && op->ref > 1) {
+		/* Refcount is enough to keep the key */
+		op->ref--;
+	}
+	else {
+		op->op = LOG_OP_DELETE;
+		op->ref = 0;
+	}
+
+	if (db->sync_ops > 0 && g_queue_get_length (db->ops_queue) >=
+		db->sync_ops) {
+		log_process_queue (db);
+	}
+	rspamd_mutex_unlock (db->mtx);
+}
+
+static gboolean
+rspamd_log_incref (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct rspamd_kv_log_entry *entry;
+	struct rspamd_kv_log_key search;
+	struct log_op *op;
+	gboolean res = TRUE;
+
+	if (!db->initialized) {
+		return FALSE;
+	}
+	if (!db->do_ref) {
+		return TRUE;
+	}
+
+	search.key = key;
+	search.keylen = keylen;
+
+	rspamd_mutex_lock (db->mtx);
+	if ((op = g_hash_table_lookup (db->ops_hash, &search)) == NULL) {
+		if ((entry = g_hash_table_lookup (db->index, &search)) == NULL) {
+			rspamd_mutex_unlock (db->mtx);
+			return FALSE;
+		}
+		op = log_op_new (db, key, keylen);
+		op->op = LOG_OP_REF;
+		op->ref = entry->ref;
+	}
+
+	op->ref++;
+	if (op->op == LOG_OP_DELETE) {
+		/* Deleted key is still on disk unless it has been queued only */
+		if (op->elt != NULL) {
+			op->op = LOG_OP_PUT;
+		}
+		else if (g_hash_table_lookup (db->index, &search) != NULL) {
+			op->op = LOG_OP_REF;
+		}
+		else {
+			op->ref = 0;
+			res = FALSE;
+		}
+	}
+
+	if (db->sync_ops > 0 && g_queue_get_length (db->ops_queue) >=
+		db->sync_ops) {
+		res = log_process_queue (db) && res;
+	}
+	rspamd_mutex_unlock (db->mtx);
+
+	return res;
+}
+
+static gboolean
+rspamd_log_sync (struct rspamd_kv_backend *backend)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	gboolean res;
+
+	if (!db->initialized) {
+		return FALSE;
+	}
+
+	rspamd_mutex_lock (db->mtx);
+	res = log_process_queue (db);
+	rspamd_mutex_unlock (db->mtx);
+
+	if (res && db->compactor == NULL) {
+		/* No thread, compact synchronously */
+		rspamd_kv_log_compact (db);
+	}
+
+	return res;
+}
+
+static void
+rspamd_log_destroy (struct rspamd_kv_backend *backend)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct log_op *op;
+
+	if (db->compactor) {
+		rspamd_mutex_lock (db->mtx);
+		db->stop = TRUE;
+		g_cond_signal (db->cond);
+		rspamd_mutex_unlock (db->mtx);
+		g_thread_join (db->compactor);
+	}
+
+	if (db->initialized) {
+		rspamd_mutex_lock (db->mtx);
+		if (log_process_queue (db)) {
+			rspamd_kv_log_datasync (db->active->fd);
+			rspamd_kv_log_checkpoint_write (db);
+		}
+		rspamd_mutex_unlock (db->mtx);
+	}
+
+	/* Drop operations that have not been written */
+	while ((op = g_queue_pop_head (db->ops_queue)) != NULL) {
+		g_free (op->k.key);
+		g_slice_free1 (sizeof (struct log_op), op);
+	}
+
+	g_free (db->filename);
+	g_free (db->dirname);
+	g_free (db->basename);
+	g_queue_free (db->ops_queue);
+	g_hash_table_unref (db->ops_hash);
+	g_hash_table_unref (db->index);
+	g_hash_table_unref (db->segments);
+	rspamd_mutex_free (db->mtx);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	g_cond_free (db->cond);
+#else
+	g_cond_clear (db->cond);
+	g_free (db->cond);
+#endif
+	g_slice_free1 (sizeof (struct rspamd_log_backend), db);
+}
+
+/* Create new log backend */
+struct rspamd_kv_backend *
+rspamd_kv_log_new (const gchar *filename,
+	guint sync_ops,
+	gboolean do_fsync,
+	gboolean do_ref)
+{
+	struct rspamd_log_backend *new;
+	struct stat st;
+	gchar *dirname;
+
+	if (filename == NULL) {
+		return NULL;
+	}
+
+	dirname = g_path_get_dirname (filename);
+	if (dirname == NULL || stat (dirname, &st) == -1 || !S_ISDIR (st.st_mode)) {
+		/* Inaccessible path */
+		if (dirname != NULL) {
+			g_free (dirname);
+		}
+		msg_err ("invalid file: %s", filename);
+		return NULL;
+	}
+
+	new = g_slice_alloc0 (sizeof (struct rspamd_log_backend));
+	new->dirname = dirname;
+	new->basename = g_path_get_basename (filename);
+	new->filename = g_strdup (filename);
+	new->sync_ops = sync_ops;
+	new->do_fsync = do_fsync;
+	new->do_ref = do_ref;
+	new->ops_queue = g_queue_new ();
+	new->ops_hash = g_hash_table_new (rspamd_kv_log_key_hash,
+			rspamd_kv_log_key_equal);
+	new->index = g_hash_table_new_full (rspamd_kv_log_key_hash,
+			rspamd_kv_log_key_equal, NULL, g_free);
+	new->segments = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, rspamd_kv_log_segment_free);
+	new->mtx = rspamd_mutex_new ();
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	new->cond = g_cond_new ();
+#else
+	new->cond = g_malloc0 (sizeof (GCond));
+	g_cond_init (new->cond);
+#endif
+
+	/* Init callbacks */
+	new->init_func = rspamd_log_init;
+	new->insert_func = rspamd_log_insert;
+	new->lookup_func = rspamd_log_lookup;
+	new->delete_func = rspamd_log_delete;
+	new->replace_func = rspamd_log_replace;
+	new->sync_func = rspamd_log_sync;
+	new->incref_func = rspamd_log_incref;
+	new->destroy_func = rspamd_log_destroy;
+
+	return (struct rspamd_kv_backend *)new;
+}
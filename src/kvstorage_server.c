@@ -141,6 +141,18 @@ config_kvstorage_worker (struct rspamd_worker *worker)
 	return TRUE;
 }
 
+/* Free arguments of a multi-key command */
+static void
+kvstorage_clear_args (struct kvstorage_session *session)
+{
+	guint i;
+
+	for (i = 0; i < session->args->len; i++) {
+		g_string_free (g_ptr_array_index (session->args, i), TRUE);
+	}
+	g_ptr_array_set_size (session->args, 0);
+}
+
 /*
  * Free kvstorage session
  */
@@ -148,6 +160,8 @@ static void
 free_kvstorage_session (struct kvstorage_session *session)
 {
 	rspamd_remove_dispatcher (session->dispather);
+	kvstorage_clear_args (session);
+	g_ptr_array_free (session->args, TRUE);
 	rspamd_mempool_delete (session->pool);
 	close (session->sock);
 	g_slice_free1 (sizeof (struct kvstorage_session), session);
@@ -203,6 +217,15 @@ parse_kvstorage_command (struct kvstorage_session *session, gchar *c, guint len)
 			4) == 0 || g_ascii_strncasecmp (c, "save", 4) == 0) {
 			session->command = KVSTORAGE_CMD_SYNC;
 		}
+		else if (g_ascii_strncasecmp (c, "mget", 4) == 0) {
+			session->command = KVSTORAGE_CMD_MGET;
+		}
+		else if (g_ascii_strncasecmp (c, "mset", 4) == 0) {
+			session->command = KVSTORAGE_CMD_MSET;
+		}
+		else {
+			return FALSE;
+		}
 	}
 	else if (len == 6) {
 		if ((c[0] == 'i' || c[0] == 'I')     &&
@@ -310,6 +333,10 @@ parse_kvstorage_line (struct kvstorage_session *session, rspamd_fstring_t *in)
 						state = 99;
 						next_state = 6;
 						break;
+					case KVSTORAGE_CMD_MGET:
+					case KVSTORAGE_CMD_MSET:
+						/* Multi-key commands are parsed in multi-bulk mode only */
+						return FALSE;
 					default:
 						/* Normal command, read key */
 						state = 99;
@@ -486,15 +513,176 @@ parse_kvstorage_line (struct kvstorage_session *session, rspamd_fstring_t *in)
 	return state == 100;
 }
 
+struct kvstorage_lookup_data {
+	GString **values;
+	gboolean is_redis;
+};
+
+/* Copy found element to a reply fragment while its shard is locked */
+static void
+kvstorage_lookup_cb (guint idx, struct rspamd_kv_element *elt, gpointer ud)
+{
+	struct kvstorage_lookup_data *ld = ud;
+	gchar intbuf[sizeof ("-9223372036854775808")];
+	GString *out;
+	const gchar *data;
+	gsize len;
+
+	if (elt == NULL) {
+		return;
+	}
+
+	if (elt->flags & KV_ELT_INTEGER) {
+		len = rspamd_snprintf (intbuf, sizeof (intbuf), "%l", ELT_LONG (elt));
+		data = intbuf;
+	}
+	else {
+		len = elt->size;
+		data = ELT_DATA (elt);
+	}
+
+	out = g_string_sized_new (len + 64);
+	if (!ld->is_redis) {
+		rspamd_printf_gstring (out, "VALUE %s %ud %z" CRLF, ELT_KEY (elt),
+			elt->flags, len);
+	}
+	else {
+		rspamd_printf_gstring (out, "$%z" CRLF, len);
+	}
+	g_string_append_len (out, data, len);
+	g_string_append_len (out, CRLF, sizeof (CRLF) - 1);
+
+	ld->values[idx] = out;
+}
+
+/*
+ * Lookup keys and queue a reply, values are copied so shards are unlocked
+ * before the reply is written
+ */
+static gboolean
+kvstorage_process_get (struct kvstorage_session *session,
+	gchar **keys,
+	guint *keylens,
+	guint nkeys,
+	gboolean is_redis)
+{
+	struct kvstorage_lookup_data ld;
+	GString *out;
+	guint i, found = 0;
+
+	ld.values = g_malloc0 (nkeys * sizeof (GString *));
+	ld.is_redis = is_redis;
+	rspamd_kv_storage_lookup_many (session->cf->storage, nkeys, keys, keylens,
+		session->now, kvstorage_lookup_cb, &ld);
+
+	out = g_string_sized_new (BUFSIZ);
+	if (session->command == KVSTORAGE_CMD_MGET) {
+		rspamd_printf_gstring (out, "*%ud" CRLF, nkeys);
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		if (ld.values[i] != NULL) {
+			g_string_append_len (out, ld.values[i]->str, ld.values[i]->len);
+			g_string_free (ld.values[i], TRUE);
+			found++;
+		}
+		else if (is_redis) {
+			g_string_append_len (out, "$-1" CRLF, sizeof ("$-1" CRLF) - 1);
+		}
+	}
+	g_free (ld.values);
+
+	if (!is_redis) {
+		if (found == 0) {
+			g_string_append_len (out, ERROR_NOT_FOUND,
+				sizeof (ERROR_NOT_FOUND) - 1);
+		}
+		else {
+			g_string_append_len (out, "END" CRLF, sizeof ("END" CRLF) - 1);
+		}
+	}
+
+	return rspamd_dispatcher_write_string (session->dispather, out, TRUE, TRUE);
+}
+
+/* Process MGET command, keys are stored in session arguments */
+static gboolean
+kvstorage_process_mget (struct kvstorage_session *session)
+{
+	gchar **keys;
+	guint *keylens, i, nkeys = session->args->len;
+	GString *arg;
+	gboolean res;
+
+	keys = g_malloc (nkeys * sizeof (gchar *));
+	keylens = g_malloc (nkeys * sizeof (guint));
+	for (i = 0; i < nkeys; i++) {
+		arg = g_ptr_array_index (session->args, i);
+		keys[i] = arg->str;
+		keylens[i] = arg->len;
+	}
+
+	res = kvstorage_process_get (session, keys, keylens, nkeys, TRUE);
+
+	g_free (keys);
+	g_free (keylens);
+	kvstorage_clear_args (session);
+
+	return res;
+}
+
+/* Process MSET command, keys and values are stored in session arguments */
+static gboolean
+kvstorage_process_mset (struct kvstorage_session *session)
+{
+	gchar **keys, **values;
+	guint *keylens, i, nkeys = session->args->len / 2;
+	gsize *lens;
+	GString *arg;
+	gboolean stored;
+
+	keys = g_malloc (nkeys * sizeof (gchar *));
+	keylens = g_malloc (nkeys * sizeof (guint));
+	values = g_malloc (nkeys * sizeof (gchar *));
+	lens = g_malloc (nkeys * sizeof (gsize));
+	for (i = 0; i < nkeys; i++) {
+		arg = g_ptr_array_index (session->args, i * 2);
+		keys[i] = arg->str;
+		keylens[i] = arg->len;
+		arg = g_ptr_array_index (session->args, i * 2 + 1);
+		values[i] = arg->str;
+		lens[i] = arg->len;
+	}
+
+	stored = rspamd_kv_storage_insert_many (session->cf->storage, nkeys, keys,
+			keylens, values, lens, 0, 0);
+
+	g_free (keys);
+	g_free (keylens);
+	g_free (values);
+	g_free (lens);
+	kvstorage_clear_args (session);
+
+	/* Like in redis MSET either sets all keys or fails without changes */
+	if (stored) {
+		return rspamd_dispatcher_write (session->dispather, "+OK" CRLF,
+				   sizeof ("+OK" CRLF) - 1, TRUE, TRUE);
+	}
+
+	return rspamd_dispatcher_write (session->dispather,
+			   "-ERR not stored" CRLF,
+			   sizeof ("-ERR not stored" CRLF) - 1,
+			   TRUE,
+			   TRUE);
+}
+
 /* Process normal kvstorage command */
 static gboolean
 kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 {
 	gint r;
-	gchar outbuf[BUFSIZ], intbuf[sizeof ("9223372036854775807")];
-	gboolean res;
+	gchar outbuf[BUFSIZ];
 	struct rspamd_kv_element *elt;
-	guint eltlen;
 	glong longval;
 
 	if (session->command == KVSTORAGE_CMD_SET) {
@@ -504,85 +692,14 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 			session->arg_data.length);
 	}
 	else if (session->command == KVSTORAGE_CMD_GET) {
-		elt = rspamd_kv_storage_lookup (session->cf->storage,
-				session->key,
-				session->keylen,
-				session->now);
-		if (elt == NULL) {
-			RW_R_UNLOCK (&session->cf->storage->rwlock);
-			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_NOT_FOUND,
-						   sizeof (ERROR_NOT_FOUND) - 1,
-						   FALSE,
-						   TRUE);
-			}
-			else {
-				return rspamd_dispatcher_write (session->dispather, "$-1" CRLF,
-						   sizeof ("$-1" CRLF) - 1, FALSE, TRUE);
-			}
-		}
-		else {
-			if (elt->flags & KV_ELT_INTEGER) {
-				eltlen = rspamd_snprintf (intbuf,
-						sizeof (intbuf),
-						"%l",
-						ELT_LONG (elt));
-
-			}
-			else {
-				eltlen = elt->size;
-			}
-
-			if (!is_redis) {
-				r = rspamd_snprintf (outbuf,
-						sizeof (outbuf),
-						"VALUE %s %ud %ud" CRLF,
-						ELT_KEY (elt),
-						elt->flags,
-						eltlen);
-			}
-			else {
-				r = rspamd_snprintf (outbuf, sizeof (outbuf), "$%ud" CRLF,
-						eltlen);
-			}
-			if (!rspamd_dispatcher_write (session->dispather, outbuf,
-				r, TRUE, FALSE)) {
-				RW_R_UNLOCK (&session->cf->storage->rwlock);
-				return FALSE;
-			}
-			if (elt->flags & KV_ELT_INTEGER) {
-				if (!rspamd_dispatcher_write (session->dispather, intbuf,
-					eltlen, TRUE, TRUE)) {
-					RW_R_UNLOCK (&session->cf->storage->rwlock);
-					return FALSE;
-				}
-			}
-			else {
-				if (!rspamd_dispatcher_write (session->dispather,
-					ELT_DATA (elt), eltlen, TRUE, TRUE)) {
-					RW_R_UNLOCK (&session->cf->storage->rwlock);
-					return FALSE;
-				}
-			}
-			session->elt = elt;
-			if (!is_redis) {
-				res = rspamd_dispatcher_write (session->dispather,
-						CRLF "END" CRLF,
-						sizeof (CRLF "END" CRLF) - 1,
-						FALSE,
-						TRUE);
-			}
-			else {
-				res = rspamd_dispatcher_write (session->dispather, CRLF,
-						sizeof (CRLF) - 1, FALSE, TRUE);
-			}
-			if (!res) {
-				RW_R_UNLOCK (&session->cf->storage->rwlock);
-			}
-
-			return res;
-		}
+		return kvstorage_process_get (session, &session->key, &session->keylen,
+				   1, is_redis);
+	}
+	else if (session->command == KVSTORAGE_CMD_MGET) {
+		return kvstorage_process_mget (session);
+	}
+	else if (session->command == KVSTORAGE_CMD_MSET) {
+		return kvstorage_process_mset (session);
 	}
 	else if (session->command == KVSTORAGE_CMD_DELETE) {
 		elt = rspamd_kv_storage_delete (session->cf->storage,
@@ -597,12 +714,12 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 				return rspamd_dispatcher_write (session->dispather,
 						   "DELETED" CRLF,
 						   sizeof ("DELETED" CRLF) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
 				return rspamd_dispatcher_write (session->dispather, ":1" CRLF,
-						   sizeof (":1" CRLF) - 1, FALSE, TRUE);
+						   sizeof (":1" CRLF) - 1, TRUE, TRUE);
 			}
 		}
 		else {
@@ -610,12 +727,12 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 				return rspamd_dispatcher_write (session->dispather,
 						   ERROR_NOT_FOUND,
 						   sizeof (ERROR_NOT_FOUND) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
 				return rspamd_dispatcher_write (session->dispather, ":0" CRLF,
-						   sizeof (":0" CRLF) - 1, FALSE, TRUE);
+						   sizeof (":0" CRLF) - 1, TRUE, TRUE);
 			}
 		}
 	}
@@ -628,14 +745,14 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 				return rspamd_dispatcher_write (session->dispather,
 						   ERROR_NOT_FOUND,
 						   sizeof (ERROR_NOT_FOUND) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
 				return rspamd_dispatcher_write (session->dispather,
 						   "-ERR not found" CRLF,
 						   sizeof ("-ERR not found" CRLF) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 		}
@@ -649,7 +766,7 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 						longval);
 			}
 			if (!rspamd_dispatcher_write (session->dispather, outbuf,
-				r, FALSE, FALSE)) {
+				r, TRUE, FALSE)) {
 				return FALSE;
 			}
 		}
@@ -661,14 +778,14 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 				return rspamd_dispatcher_write (session->dispather,
 						   ERROR_COMMON,
 						   sizeof (ERROR_COMMON) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
 				return rspamd_dispatcher_write (session->dispather,
 						   "-ERR unsupported" CRLF,
 						   sizeof ("-ERR unsupported" CRLF) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 		}
@@ -679,14 +796,14 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 					return rspamd_dispatcher_write (session->dispather,
 							   "SYNCED" CRLF,
 							   sizeof ("SYNCED" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 				else {
 					return rspamd_dispatcher_write (session->dispather,
 							   "+OK" CRLF,
 							   sizeof ("+OK" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 			}
@@ -695,14 +812,14 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 					return rspamd_dispatcher_write (session->dispather,
 							   "NOT_SYNCED" CRLF,
 							   sizeof ("NOT_SYNCED" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 				else {
 					return rspamd_dispatcher_write (session->dispather,
 							   "-ERR not synced" CRLF,
 							   sizeof ("-ERR not synced" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 			}
@@ -711,15 +828,19 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 	else if (session->command == KVSTORAGE_CMD_SELECT) {
 		if (!is_redis) {
 			return rspamd_dispatcher_write (session->dispather, "SELECTED" CRLF,
-					   sizeof ("SELECTED" CRLF) - 1, FALSE, TRUE);
+					   sizeof ("SELECTED" CRLF) - 1, TRUE, TRUE);
 		}
 		else {
 			return rspamd_dispatcher_write (session->dispather, "+OK" CRLF,
-					   sizeof ("+OK" CRLF) - 1, FALSE, TRUE);
+					   sizeof ("+OK" CRLF) - 1, TRUE, TRUE);
 		}
 	}
 	else if (session->command == KVSTORAGE_CMD_QUIT) {
-		/* Quit session */
+		if (session->dispather->out_buffers.pending > 0) {
+			/* Quit session once replies to previous commands are written */
+			session->quit = TRUE;
+			return FALSE;
+		}
 		free_kvstorage_session (session);
 		return FALSE;
 	}
@@ -781,6 +902,10 @@ kvstorage_check_argnum (struct kvstorage_session *session)
 	case KVSTORAGE_CMD_INCR:
 	case KVSTORAGE_CMD_DECR:
 		return session->argc == 2 || session->argc == 3;
+	case KVSTORAGE_CMD_MGET:
+		return session->argc >= 2;
+	case KVSTORAGE_CMD_MSET:
+		return session->argc >= 3 && session->argc % 2 == 1;
 	default:
 		return session->argc == 2;
 	}
@@ -823,7 +948,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 				return rspamd_dispatcher_write (session->dispather,
 						   ERROR_UNKNOWN_COMMAND,
 						   sizeof (ERROR_UNKNOWN_COMMAND) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
@@ -832,7 +957,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 						"-ERR unknown command '%V'" CRLF,
 						in);
 				return rspamd_dispatcher_write (session->dispather, outbuf,
-						   r, FALSE, TRUE);
+						   r, TRUE, FALSE);
 			}
 		}
 		else {
@@ -843,14 +968,14 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					return rspamd_dispatcher_write (session->dispather,
 							   ERROR_INVALID_KEYSTORAGE,
 							   sizeof (ERROR_INVALID_KEYSTORAGE) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 				else {
 					return rspamd_dispatcher_write (session->dispather,
 							   "-ERR unknown keystorage" CRLF,
 							   sizeof ("-ERR unknown keystorage" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 			}
@@ -867,7 +992,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					"-ERR unknown arglen '%V'" CRLF,
 					in);
 			return rspamd_dispatcher_write (session->dispather, outbuf,
-					   r, FALSE, TRUE);
+					   r, TRUE, FALSE);
 		}
 		else {
 			session->state = KVSTORAGE_STATE_READ_ARG;
@@ -877,8 +1002,24 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 		}
 		break;
 	case KVSTORAGE_STATE_READ_ARG:
-		if (session->argnum == 0) {
+		if (session->argnum > 0 && (session->command == KVSTORAGE_CMD_MGET ||
+			session->command == KVSTORAGE_CMD_MSET)) {
+			/* All arguments of multi-key commands are keys and values */
+			g_ptr_array_add (session->args, g_string_new_len (in->begin,
+				in->len));
+			rspamd_set_dispatcher_policy (session->dispather,
+				BUFFER_LINE,
+				-1);
+			if (session->argnum == session->argc - 1) {
+				session->state = KVSTORAGE_STATE_READ_CMD;
+				return kvstorage_process_command (session, TRUE);
+			}
+			session->argnum++;
+			session->state = KVSTORAGE_STATE_READ_ARGLEN;
+		}
+		else if (session->argnum == 0) {
 			/* Read command */
+			kvstorage_clear_args (session);
 			if (!parse_kvstorage_command (session, in->begin, in->len)) {
 				session->state = KVSTORAGE_STATE_READ_CMD;
 				r = rspamd_snprintf (outbuf,
@@ -886,7 +1027,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 						"-ERR unknown command '%V'" CRLF,
 						in);
 				return rspamd_dispatcher_write (session->dispather, outbuf,
-						   r, FALSE, TRUE);
+						   r, TRUE, FALSE);
 			}
 			else {
 				if (!kvstorage_check_argnum (session)) {
@@ -897,7 +1038,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 							in,
 							session->argc);
 					return rspamd_dispatcher_write (session->dispather, outbuf,
-							   r, FALSE, TRUE);
+							   r, TRUE, FALSE);
 				}
 				else {
 					if (session->argnum == session->argc - 1) {
@@ -963,14 +1104,14 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					return rspamd_dispatcher_write (session->dispather,
 							   "+OK" CRLF,
 							   sizeof ("+OK" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 				else {
 					return rspamd_dispatcher_write (session->dispather,
 							   "-ERR not stored" CRLF,
 							   sizeof ("-ERR not stored" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 			}
@@ -1011,14 +1152,14 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					return rspamd_dispatcher_write (session->dispather,
 							   "+OK" CRLF,
 							   sizeof ("+OK" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 				else {
 					return rspamd_dispatcher_write (session->dispather,
 							   "-ERR not stored" CRLF,
 							   sizeof ("-ERR not stored" CRLF) - 1,
-							   FALSE,
+							   TRUE,
 							   TRUE);
 				}
 			}
@@ -1035,12 +1176,12 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 				return rspamd_dispatcher_write (session->dispather,
 						   "STORED" CRLF,
 						   sizeof ("STORED" CRLF) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
 				return rspamd_dispatcher_write (session->dispather, "+OK" CRLF,
-						   sizeof ("+OK" CRLF) - 1, FALSE, TRUE);
+						   sizeof ("+OK" CRLF) - 1, TRUE, TRUE);
 			}
 		}
 		else {
@@ -1048,14 +1189,14 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 				return rspamd_dispatcher_write (session->dispather,
 						   ERROR_NOT_STORED,
 						   sizeof (ERROR_NOT_STORED) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 			else {
 				return rspamd_dispatcher_write (session->dispather,
 						   "-ERR not stored" CRLF,
 						   sizeof ("-ERR not stored" CRLF) - 1,
-						   FALSE,
+						   TRUE,
 						   TRUE);
 			}
 		}
@@ -1074,23 +1215,10 @@ kvstorage_write_socket (void *arg)
 {
 	struct kvstorage_session *session = (struct kvstorage_session *) arg;
 
-	if (session->elt) {
-		if ((session->elt->flags & KV_ELT_NEED_INSERT) != 0) {
-			/* Insert to cache and free element */
-			session->elt->flags &= ~KV_ELT_NEED_INSERT;
-			RW_R_UNLOCK (&session->cf->storage->rwlock);
-			rspamd_kv_storage_insert_cache (session->cf->storage,
-				ELT_KEY (session->elt),
-				session->elt->keylen, ELT_DATA (session->elt),
-				session->elt->size, session->elt->flags,
-				session->elt->expire, NULL);
-			g_free (session->elt);
-			session->elt = NULL;
-			return TRUE;
-		}
-		RW_R_UNLOCK (&session->cf->storage->rwlock);
-		session->elt = NULL;
-
+	if (session->quit) {
+		/* All replies are written, so we can close session now */
+		free_kvstorage_session (session);
+		return FALSE;
 	}
 
 	return TRUE;
@@ -1111,11 +1239,6 @@ kvstorage_err_socket (GError * err, void *arg)
 			thr->id, inet_ntoa (session->client_addr), err->message);
 	}
 
-	if (session->elt) {
-		RW_R_UNLOCK (&session->cf->storage->rwlock);
-		session->elt = NULL;
-	}
-
 	g_error_free (err);
 	free_kvstorage_session (session);
 }
@@ -1131,18 +1254,28 @@ thr_accept_socket (gint fd, short what, void *arg)
 	socklen_t addrlen = sizeof (su.ss);
 	gint nfd;
 	struct kvstorage_session *session;
+	gboolean shared;
+
+	/* Socket of the worker is shared unless thread has its own */
+	shared = (fd == thr->worker->cf->listen_sock);
 
-	g_mutex_lock (thr->accept_mtx);
+	if (shared) {
+		g_mutex_lock (thr->accept_mtx);
+	}
 	if ((nfd =
 		accept_from_socket (fd, (struct sockaddr *)&su.ss, &addrlen)) == -1) {
 		thr_warn ("%ud: accept failed: %s", thr->id, strerror (errno));
-		g_mutex_unlock (thr->accept_mtx);
+		if (shared) {
+			g_mutex_unlock (thr->accept_mtx);
+		}
 		return;
 	}
 
 	/* Check for EAGAIN */
 	if (nfd == 0) {
-		g_mutex_unlock (thr->accept_mtx);
+		if (shared) {
+			g_mutex_unlock (thr->accept_mtx);
+		}
 		return;
 	}
 
@@ -1160,8 +1293,10 @@ thr_accept_socket (gint fd, short what, void *arg)
 			thr->tv,
 			session);
 
-	g_mutex_unlock (thr->accept_mtx);
-	session->elt = NULL;
+	if (shared) {
+		g_mutex_unlock (thr->accept_mtx);
+	}
+	session->args = g_ptr_array_new ();
 
 	if (su.ss.ss_family == AF_UNIX) {
 		session->client_addr.s_addr = INADDR_NONE;
@@ -1191,6 +1326,71 @@ thr_term_socket (gint fd, short what, void *arg)
 	event_del (&thr->bind_ev);
 }
 
+/**
+ * Create listening socket for a thread bound to the same address as the
+ * socket of worker, so the kernel distributes connections between threads
+ * @return new socket or -1 if it cannot be created
+ */
+static gint
+kvstorage_thread_socket (struct kvstorage_worker_thread *thr)
+{
+#ifdef SO_REUSEPORT
+	union sa_union su;
+	socklen_t slen = sizeof (su.ss);
+	gint fd, on = 1;
+
+	if (getsockname (thr->worker->cf->listen_sock, &su.sa, &slen) == -1) {
+		return -1;
+	}
+	if (su.ss.ss_family != AF_INET && su.ss.ss_family != AF_INET6) {
+		return -1;
+	}
+
+	fd = socket (su.ss.ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) == -1 ||
+		setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) == -1 ||
+		bind (fd, &su.sa, slen) == -1 ||
+		listen (fd, -1) == -1) {
+		thr_warn ("%ud: cannot create own listening socket: %s", thr->id,
+			strerror (errno));
+		close (fd);
+		return -1;
+	}
+
+	rspamd_socket_nonblocking (fd);
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Allow binding other sockets to the address of worker's socket
+ */
+static gboolean
+kvstorage_enable_reuseport (struct rspamd_worker *worker)
+{
+#ifdef SO_REUSEPORT
+	gint on = 1;
+
+	if (setsockopt (worker->cf->listen_sock, SOL_SOCKET, SO_REUSEPORT, &on,
+		sizeof (on)) == -1) {
+		msg_info ("cannot set SO_REUSEPORT, threads will share socket: %s",
+			strerror (errno));
+		return FALSE;
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
 /**
  * Thread main worker function
  */
@@ -1204,8 +1404,20 @@ kvstorage_thread (gpointer ud)
 	/* Init thread specific events */
 	thr->ev_base = event_init ();
 
+	/*
+	 * The first thread uses the socket of worker, others have their own ones
+	 * if possible and do not serialize on accept mutex
+	 */
+	thr->listen_sock = -1;
+	if (thr->ctx->reuseport && thr->id > 0) {
+		thr->listen_sock = kvstorage_thread_socket (thr);
+	}
+	if (thr->listen_sock == -1) {
+		thr->listen_sock = thr->worker->cf->listen_sock;
+	}
+
 	event_set (&thr->bind_ev,
-		thr->worker->cf->listen_sock,
+		thr->listen_sock,
 		EV_READ | EV_PERSIST,
 		thr_accept_socket,
 		(void *)thr);
@@ -1222,6 +1434,10 @@ kvstorage_thread (gpointer ud)
 
 	event_base_loop (thr->ev_base, 0);
 
+	if (thr->listen_sock != thr->worker->cf->listen_sock) {
+		close (thr->listen_sock);
+	}
+
 	return NULL;
 }
 
@@ -1336,6 +1552,9 @@ start_keystorage (struct rspamd_worker *worker)
 	g_mutex_init (ctx->accept_mtx);
 #endif
 
+	ctx->reuseport = worker->cf->count > 1 && kvstorage_enable_reuseport (
+		worker);
+
 	/* Start workers threads */
 	for (i = 0; i < worker->cf->count; i++) {
 		thr = create_kvstorage_thread (worker, ctx, i, &signals.sa_mask);
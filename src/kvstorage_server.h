@@ -40,6 +40,7 @@ struct kvstorage_worker_ctx {
 	struct event_base *ev_base;
 	GMutex *log_mtx;
 	GMutex *accept_mtx;
+	gboolean reuseport;
 };
 
 struct kvstorage_worker_thread {
@@ -55,6 +56,7 @@ struct kvstorage_worker_thread {
 	guint id;
 	sigset_t *signals;
 	gint term_sock[2];
+	gint listen_sock;
 };
 
 struct kvstorage_session {
@@ -73,6 +75,8 @@ struct kvstorage_session {
 		KVSTORAGE_CMD_SELECT,
 		KVSTORAGE_CMD_INCR,
 		KVSTORAGE_CMD_DECR,
+		KVSTORAGE_CMD_MGET,
+		KVSTORAGE_CMD_MSET,
 		KVSTORAGE_CMD_QUIT
 	} command;
 	guint id;
@@ -83,7 +87,7 @@ struct kvstorage_session {
 	guint keylen;
 	struct kvstorage_config *cf;
 	struct kvstorage_worker_thread *thr;
-	struct rspamd_kv_element *elt;
+	GPtrArray *args;
 	struct in_addr client_addr;
 	gint sock;
 	guint flags;
@@ -93,6 +97,7 @@ struct kvstorage_session {
 		guint length;
 	} arg_data;
 	time_t now;
+	gboolean quit;
 };
 
 #endif /* KVSTORAGE_SERVER_H_ */
@@ -61,8 +61,9 @@ filter_error_quark (void)
 	return g_quark_from_static_string ("g-filter-error-quark");
 }
 
-struct metric_result *
-rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
+static struct metric_result *
+rspamd_create_metric_result_unlocked (struct rspamd_task *task,
+	const gchar *name)
 {
 	struct metric_result *metric_res;
 	struct metric *metric;
@@ -97,6 +98,18 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	return metric_res;
 }
 
+struct metric_result *
+rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
+{
+	struct metric_result *metric_res;
+
+	rspamd_mutex_lock (task->results_mtx);
+	metric_res = rspamd_create_metric_result_unlocked (task, name);
+	rspamd_mutex_unlock (task->results_mtx);
+
+	return metric_res;
+}
+
 static void
 insert_metric_result (struct rspamd_task *task,
 	struct metric *metric,
@@ -111,7 +124,7 @@ insert_metric_result (struct rspamd_task *task,
 	struct rspamd_symbol_def *sdef;
 	const ucl_object_t *mobj, *sobj;
 
-	metric_res = rspamd_create_metric_result (task, metric->name);
+	metric_res = rspamd_create_metric_result_unlocked (task, metric->name);
 
 	sdef = g_hash_table_lookup (metric->symbols, symbol);
 	if (sdef == NULL) {
@@ -209,12 +222,6 @@ insert_metric_result (struct rspamd_task *task,
 
 }
 
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-static GStaticMutex result_mtx = G_STATIC_MUTEX_INIT;
-#else
-G_LOCK_DEFINE (result_mtx);
-#endif
-
 static void
 insert_result_common (struct rspamd_task *task,
 	const gchar *symbol,
@@ -226,12 +233,11 @@ insert_result_common (struct rspamd_task *task,
 	struct cache_item *item;
 	GList *cur, *metric_list;
 
-	/* Avoid concurrenting inserting of results */
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_lock (&result_mtx);
-#else
-	G_LOCK (result_mtx);
-#endif
+	/*
+	 * Results may be inserted by threaded symbols (lua and regexp) at the
+	 * same time as by symbols running in the main thread
+	 */
+	rspamd_mutex_lock (task->results_mtx);
 	metric_list = g_hash_table_lookup (task->cfg->metrics_symbols, symbol);
 	if (metric_list) {
 		cur = metric_list;
@@ -264,11 +270,7 @@ insert_result_common (struct rspamd_task *task,
 		/* XXX: it is not wise to destroy them here */
 		g_list_free (opts);
 	}
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_unlock (&result_mtx);
-#else
-	G_UNLOCK (result_mtx);
-#endif
+	rspamd_mutex_unlock (task->results_mtx);
 }
 
 /* Insert result that may be increased on next insertions */
@@ -326,29 +328,17 @@ check_metric_is_spam (struct rspamd_task *task, struct metric *metric)
 	double ms;
 
 	/* Avoid concurrency while checking results */
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_lock (&result_mtx);
-#else
-	G_LOCK (result_mtx);
-#endif
+	rspamd_mutex_lock (task->results_mtx);
 	res = g_hash_table_lookup (task->results, metric->name);
 	if (res) {
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-		g_static_mutex_unlock (&result_mtx);
-#else
-		G_UNLOCK (result_mtx);
-#endif
+		rspamd_mutex_unlock (task->results_mtx);
 		if (!check_metric_settings (task, metric, &ms)) {
 			ms = metric->actions[METRIC_ACTION_REJECT].score;
 		}
 		return (ms > 0 && res->score >= ms);
 	}
 
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_unlock (&result_mtx);
-#else
-	G_UNLOCK (result_mtx);
-#endif
+	rspamd_mutex_unlock (task->results_mtx);
 
 	return FALSE;
 }
@@ -394,6 +384,17 @@ rspamd_process_filters (struct rspamd_task *task)
 	return 1;
 }
 
+gint
+rspamd_process_header_filters (struct rspamd_task *task)
+{
+	/* Insert default metric to be sure that it exists all the time */
+	rspamd_create_metric_result (task, DEFAULT_METRIC);
+
+	call_header_symbols_callbacks (task, task->cfg->cache);
+
+	return 1;
+}
+
 
 struct composites_data {
 	struct rspamd_task *task;
@@ -880,7 +881,7 @@ rspamd_process_statistic_threaded (gpointer data, gpointer user_data)
 	struct classifiers_cbdata cbdata;
 
 	if (task->is_skipped) {
-		remove_async_thread (task->s);
+		remove_async_thread (task->s, NULL);
 		return;
 	}
 
@@ -893,7 +894,7 @@ rspamd_process_statistic_threaded (gpointer data, gpointer user_data)
 	cbdata.task = task;
 	cbdata.nL = nL;
 	g_list_foreach (task->cfg->classifiers, classifiers_callback, &cbdata);
-	remove_async_thread (task->s);
+	remove_async_thread (task->s, NULL);
 }
 
 static void
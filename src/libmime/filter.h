@@ -95,6 +95,13 @@ struct metric_result * rspamd_create_metric_result (struct rspamd_task *task,
  */
 gint rspamd_process_filters (struct rspamd_task *task);
 
+/**
+ * Process filters that depend on message headers only
+ * @param task worker's task with parsed headers block
+ * @return 0 - if there is non-finished tasks and 1 if processing is completed
+ */
+gint rspamd_process_header_filters (struct rspamd_task *task);
+
 /**
  * Process message with statfiles
  * @param task worker's task that present message from user
@@ -108,7 +115,8 @@ void rspamd_process_statistics (struct rspamd_task *task);
 void rspamd_process_statistic_threaded (gpointer data, gpointer user_data);
 
 /**
- * Insert a result to task
+ * Insert a result to task, this function may be called from threads as
+ * results are inserted under the task's results mutex
  * @param task worker's task that present message from user
  * @param metric_name metric's name to which we need to insert result
  * @param symbol symbol to insert
@@ -1448,6 +1448,69 @@ destroy_message (void *pointer)
 	g_object_unref (msg);
 }
 
+static void
+process_received_headers (struct rspamd_task *task)
+{
+	GList *first, *cur;
+	struct received_header *recv;
+
+	first =
+		message_get_header (task, "Received", FALSE);
+	cur = first;
+	while (cur) {
+		recv =
+			rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (struct received_header));
+		parse_recv_header (task->task_pool, cur->data, recv);
+		task->received = g_list_prepend (task->received, recv);
+		cur = g_list_next (cur);
+	}
+}
+
+gint
+process_message_headers (struct rspamd_task *task,
+	const gchar *begin,
+	gsize len)
+{
+	GList *cur;
+	struct raw_header *rh;
+	const gchar *sender;
+
+	if (!task->is_mime || task->headers_processed) {
+		return -1;
+	}
+
+	/* Raw headers parser requires zero terminated string */
+	task->raw_headers_str = rspamd_mempool_alloc (task->task_pool, len + 1);
+	rspamd_strlcpy (task->raw_headers_str, begin, len + 1);
+	process_raw_headers (task->raw_headers, task->task_pool,
+		task->raw_headers_str);
+	process_received_headers (task);
+
+	cur = message_get_header (task, "From", FALSE);
+	if (cur != NULL) {
+		rh = cur->data;
+		sender = rh->decoded ? rh->decoded : rh->value;
+		task->from_mime = internet_address_list_parse_string (sender);
+		if (task->from_mime) {
+#ifdef GMIME24
+			rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) g_object_unref,
+				task->from_mime);
+#else
+			rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) internet_address_list_destroy,
+				task->from_mime);
+#endif
+		}
+	}
+
+	task->headers_processed = TRUE;
+	debug_task ("processed headers block of length %z", len);
+
+	return 0;
+}
+
 gint
 process_message (struct rspamd_task *task)
 {
@@ -1455,10 +1518,9 @@ process_message (struct rspamd_task *task)
 	GMimeParser *parser;
 	GMimeStream *stream;
 	GByteArray *tmp;
-	GList *first, *cur;
+	GList *cur;
 	GMimePart *part;
 	GMimeDataWrapper *wrapper;
-	struct received_header *recv;
 	gchar *mid, *url_str, *p, *end, *url_end;
 	struct uri *subject_url;
 	gsize len;
@@ -1519,33 +1581,24 @@ process_message (struct rspamd_task *task)
 			task->queue_id = "undef";
 		}
 
+		if (!task->headers_processed) {
 #ifdef GMIME24
-		task->raw_headers_str =
-			g_mime_object_get_headers (GMIME_OBJECT (task->message));
+			task->raw_headers_str =
+				g_mime_object_get_headers (GMIME_OBJECT (task->message));
 #else
-		task->raw_headers_str = g_mime_message_get_headers (task->message);
+			task->raw_headers_str = g_mime_message_get_headers (task->message);
 #endif
 
-		if (task->raw_headers_str) {
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t) g_free, task->raw_headers_str);
-			process_raw_headers (task->raw_headers, task->task_pool,
-					task->raw_headers_str);
-		}
-		process_images (task);
+			if (task->raw_headers_str) {
+				rspamd_mempool_add_destructor (task->task_pool,
+						(rspamd_mempool_destruct_t) g_free, task->raw_headers_str);
+				process_raw_headers (task->raw_headers, task->task_pool,
+						task->raw_headers_str);
+			}
 
-		/* Parse received headers */
-		first =
-			message_get_header (task, "Received", FALSE);
-		cur = first;
-		while (cur) {
-			recv =
-				rspamd_mempool_alloc0 (task->task_pool,
-					sizeof (struct received_header));
-			parse_recv_header (task->task_pool, cur->data, recv);
-			task->received = g_list_prepend (task->received, recv);
-			cur = g_list_next (cur);
+			process_received_headers (task);
 		}
+		process_images (task);
 
 		/* free the parser (and the stream) */
 		g_object_unref (parser);
@@ -1611,18 +1664,21 @@ process_message (struct rspamd_task *task)
 			task->rcpt_mime);
 #endif
 	}
-	task->from_mime = internet_address_list_parse_string(
-			g_mime_message_get_sender (message));
-	if (task->from_mime) {
+	/* Sender might be already parsed from the headers block */
+	if (task->from_mime == NULL) {
+		task->from_mime = internet_address_list_parse_string (
+				g_mime_message_get_sender (message));
+		if (task->from_mime) {
 #ifdef GMIME24
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t) g_object_unref,
-				task->from_mime);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t) g_object_unref,
+					task->from_mime);
 #else
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t) internet_address_list_destroy,
-				task->from_mime);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t) internet_address_list_destroy,
+					task->from_mime);
 #endif
+		}
 	}
 
 	/* Parse urls inside Subject header */
@@ -69,6 +69,17 @@ struct raw_header {
  */
 gint process_message (struct rspamd_task *task);
 
+/**
+ * Process headers block of a message that is not completely received yet
+ * @param task worker_task object
+ * @param begin start of headers block
+ * @param len length of headers block
+ * @return 0 if headers have been processed and -1 otherwise
+ */
+gint process_message_headers (struct rspamd_task *task,
+	const gchar *begin,
+	gsize len);
+
 
 /*
  * Get a list of header's values with specified header's name using raw headers
@@ -255,6 +255,8 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	gboolean log_async;                             /**< write log via shared ring in the main process		*/
+	guint32 log_async_size;                         /**< size of shared log ring							*/
 	gchar *debug_ip_map;                            /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -311,16 +313,23 @@ struct rspamd_config {
 	gchar * checksum;                                /**< real checksum of config file						*/
 	gchar * dump_checksum;                           /**< dump checksum of config file						*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
+	guint32 lua_threads;                            /**< number of threads for threaded lua symbols			*/
 
 	gchar * rrd_file;                                /**< rrd file to store statistics						*/
 
 	gchar * history_file;                            /**< file to save rolling history						*/
+	guint32 history_rows;                           /**< rows of rolling history per worker				*/
+	gchar * task_log;                                /**< prefix of binary task log files					*/
+	gsize task_log_size;                            /**< size of task log file before rotation				*/
 
 	gdouble dns_timeout;                            /**< timeout in milliseconds for waiting for dns reply	*/
 	guint32 dns_retransmits;                        /**< maximum retransmits count							*/
 	guint32 dns_throttling_errors;                  /**< maximum errors for starting resolver throttling	*/
 	guint32 dns_throttling_time;                    /**< time in seconds for DNS throttling					*/
 	guint32 dns_io_per_server;                      /**< number of sockets per DNS server					*/
+	gsize dns_cache_size;                           /**< size of shared DNS cache							*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to cache DNS answers					*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache negative DNS answers				*/
 	GList *nameservers;                             /**< list of nameservers or NULL to parse resolv.conf	*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
@@ -1160,6 +1160,16 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 		0);
+	rspamd_rcl_add_default_handler (sub,
+		"log_async",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, log_async),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"log_async_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, log_async_size),
+		0);
 	rspamd_rcl_add_default_handler (sub,
 		"log_urls",
 		rspamd_rcl_parse_struct_boolean,
@@ -1239,6 +1249,21 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, dns_io_per_server),
 		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_max_ttl",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_negative_ttl",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
 
 	/* New upstreams configuration */
 	ssub = rspamd_rcl_add_section (&sub->subsections, "upstream", NULL,
@@ -1322,6 +1347,26 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_string,
 		G_STRUCT_OFFSET (struct rspamd_config, history_file),
 		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"history_rows",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, history_rows),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (sub,
+		"task_log",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, task_log),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"task_log_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, task_log_size),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"lua_threads",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, lua_threads),
+		RSPAMD_CL_FLAG_INT_32);
 	rspamd_rcl_add_default_handler (sub,
 		"use_mlock",
 		rspamd_rcl_parse_struct_boolean,
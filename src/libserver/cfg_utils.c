@@ -147,6 +147,12 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	/* Shared DNS cache: 4Mb, 1 hour maximum, 1 minute for negative */
+	cfg->dns_cache_size = 4 * 1024 * 1024;
+	cfg->dns_cache_max_ttl = 3600;
+	cfg->dns_cache_negative_ttl = 60;
+
+	cfg->history_rows = HISTORY_DEFAULT_ROWS;
 
 	cfg->statfile_sync_interval = 60000;
 	cfg->statfile_sync_timeout = 20000;
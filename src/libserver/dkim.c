@@ -778,13 +778,14 @@ rspamd_create_dkim_context (const gchar *sig,
 		DKIM_DNSKEYNAME,
 		new->domain);
 
-	/* Create checksums for further operations */
+	/*
+	 * Create checksum for headers, body hash is shared by all signatures of
+	 * a task and is created on demand
+	 */
 	if (new->sig_alg == DKIM_SIGN_RSASHA1) {
-		new->body_hash = g_checksum_new (G_CHECKSUM_SHA1);
 		new->headers_hash = g_checksum_new (G_CHECKSUM_SHA1);
 	}
 	else if (new->sig_alg == DKIM_SIGN_RSASHA256) {
-		new->body_hash = g_checksum_new (G_CHECKSUM_SHA256);
 		new->headers_hash = g_checksum_new (G_CHECKSUM_SHA256);
 	}
 	else {
@@ -795,9 +796,6 @@ rspamd_create_dkim_context (const gchar *sig,
 		return NULL;
 	}
 
-	rspamd_mempool_add_destructor (new->pool,
-		(rspamd_mempool_destruct_t)g_checksum_free,
-		new->body_hash);
 	rspamd_mempool_add_destructor (new->pool,
 		(rspamd_mempool_destruct_t)g_checksum_free,
 		new->headers_hash);
@@ -812,29 +810,8 @@ struct rspamd_dkim_key_cbdata {
 };
 
 static rspamd_dkim_key_t *
-rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
+rspamd_dkim_load_key (rspamd_dkim_key_t *key, GError **err)
 {
-	rspamd_dkim_key_t *key = NULL;
-
-	if (keylen < 3) {
-		msg_err ("DKIM key is too short to be valid");
-		return NULL;
-	}
-	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
-	key->keydata = g_slice_alloc (keylen + 1);
-	rspamd_strlcpy (key->keydata, keydata, keylen + 1);
-	key->keylen = keylen + 1;
-	key->decoded_len = keylen + 1;
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION < 20))
-	gchar *tmp;
-	gsize tmp_len = keylen;
-	tmp = g_base64_decode (key->keydata, &tmp_len);
-	rspamd_strlcpy (key->keydata, tmp, tmp_len + 1);
-	g_free (tmp);
-	key->decoded_len = tmp_len;
-#else
-	g_base64_decode_inplace (key->keydata, &key->decoded_len);
-#endif
 #ifdef HAVE_OPENSSL
 	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
 	if (key->key_bio == NULL) {
@@ -871,6 +848,57 @@ rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
 	return key;
 }
 
+rspamd_dkim_key_t *
+rspamd_dkim_make_key_der (const guchar *der, gsize len, guint ttl,
+	GError **err)
+{
+	rspamd_dkim_key_t *key;
+
+	if (len == 0) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"empty key");
+		return NULL;
+	}
+
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (len + 1);
+	memcpy (key->keydata, der, len);
+	key->keylen = len + 1;
+	key->decoded_len = len;
+	key->ttl = ttl;
+
+	return rspamd_dkim_load_key (key, err);
+}
+
+static rspamd_dkim_key_t *
+rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
+{
+	rspamd_dkim_key_t *key = NULL;
+
+	if (keylen < 3) {
+		msg_err ("DKIM key is too short to be valid");
+		return NULL;
+	}
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (keylen + 1);
+	rspamd_strlcpy (key->keydata, keydata, keylen + 1);
+	key->keylen = keylen + 1;
+	key->decoded_len = keylen + 1;
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION < 20))
+	gchar *tmp;
+	gsize tmp_len = keylen;
+	tmp = g_base64_decode (key->keydata, &tmp_len);
+	rspamd_strlcpy (key->keydata, tmp, tmp_len + 1);
+	g_free (tmp);
+	key->decoded_len = tmp_len;
+#else
+	g_base64_decode_inplace (key->keydata, &key->decoded_len);
+#endif
+	return rspamd_dkim_load_key (key, err);
+}
+
 /**
  * Free DKIM key
  * @param key
@@ -1146,6 +1174,7 @@ rspamd_dkim_simple_body_step (GChecksum *ck, const gchar **start, guint size,
 
 static gboolean
 rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
+	GChecksum *ck,
 	const gchar *start,
 	const gchar *end)
 {
@@ -1155,10 +1184,10 @@ rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 	if (start == NULL) {
 		/* Empty body */
 		if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-			g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
+			g_checksum_update (ck, CRLF, sizeof (CRLF) - 1);
 		}
 		else {
-			g_checksum_update (ctx->body_hash, "", 0);
+			g_checksum_update (ck, "", 0);
 		}
 	}
 	else {
@@ -1182,20 +1211,20 @@ rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 		if (end == start) {
 			/* Empty body */
 			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
+				g_checksum_update (ck, CRLF, sizeof (CRLF) - 1);
 			}
 			else {
-				g_checksum_update (ctx->body_hash, "", 0);
+				g_checksum_update (ck, "", 0);
 			}
 		}
 		else {
 			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
 				/* Simple canonization */
-				while (rspamd_dkim_simple_body_step (ctx->body_hash, &start,
+				while (rspamd_dkim_simple_body_step (ck, &start,
 					end - start, &remain)) ;
 			}
 			else {
-				while (rspamd_dkim_relaxed_body_step (ctx->body_hash, &start,
+				while (rspamd_dkim_relaxed_body_step (ck, &start,
 					end - start, &remain)) ;
 			}
 		}
@@ -1566,36 +1595,30 @@ rspamd_dkim_canonize_header (rspamd_dkim_context_t *ctx,
 	return FALSE;
 }
 
-/**
- * Check task for dkim context using dkim key
- * @param ctx dkim verify context
- * @param key dkim key (from cache or from dns request)
- * @param task task to check
- * @return
+/*
+ * Body hashes computed for a task, signatures with the same body
+ * canonicalization, algorithm and length share a single hash
  */
-gint
-rspamd_dkim_check (rspamd_dkim_context_t *ctx,
-	rspamd_dkim_key_t *key,
-	struct rspamd_task *task)
+struct rspamd_dkim_body_cache {
+	const gchar *body_start;
+	GHashTable *hashes;
+};
+
+struct rspamd_dkim_body_hash {
+	guint8 *digest;
+	gsize len;
+};
+
+#define DKIM_BODY_CACHE_VARIABLE "dkim_body_cache"
+
+/* Find the beginning of message body, NULL is returned for empty body */
+static const gchar *
+rspamd_dkim_find_body (struct rspamd_task *task)
 {
-	const gchar *p, *headers_end = NULL, *end, *body_end;
+	const gchar *p, *headers_end = NULL, *end;
 	gboolean got_cr = FALSE, got_crlf = FALSE, got_lf = FALSE;
-	gchar *digest;
-	gsize dlen;
-	gint res = DKIM_CONTINUE;
-	guint i;
-	struct rspamd_dkim_header *dh;
-#ifdef HAVE_OPENSSL
-	gint nid;
-#endif
 
-	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
-	g_return_val_if_fail (key != NULL,		 DKIM_ERROR);
-	g_return_val_if_fail (task->msg != NULL, DKIM_ERROR);
-
-	/* First of all find place of body */
 	p = task->msg->str;
-
 	end = task->msg->str + task->msg->len;
 
 	while (p <= end) {
@@ -1660,11 +1683,132 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		p++;
 	}
 
-	/* Start canonization of body part */
-	body_end = end;
-	if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
+	return headers_end;
+}
+
+static struct rspamd_dkim_body_cache *
+rspamd_dkim_get_body_cache (struct rspamd_task *task)
+{
+	struct rspamd_dkim_body_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool,
+			DKIM_BODY_CACHE_VARIABLE);
+
+	if (cache == NULL) {
+		cache = rspamd_mempool_alloc (task->task_pool, sizeof (*cache));
+		cache->body_start = rspamd_dkim_find_body (task);
+		cache->hashes = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_destroy,
+			cache->hashes);
+		rspamd_mempool_set_variable (task->task_pool, DKIM_BODY_CACHE_VARIABLE,
+			cache, NULL);
+	}
+
+	return cache;
+}
+
+static const guint8 *
+rspamd_dkim_get_body_hash (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	gsize *dlen)
+{
+	struct rspamd_dkim_body_cache *cache;
+	struct rspamd_dkim_body_hash *bh;
+	GChecksum *ck;
+	gchar *key;
+
+	cache = rspamd_dkim_get_body_cache (task);
+	key = rspamd_mempool_alloc (task->task_pool, 64);
+	rspamd_snprintf (key, 64, "%d:%d:%z", ctx->body_canon_type, ctx->sig_alg,
+		ctx->len);
+
+	bh = g_hash_table_lookup (cache->hashes, key);
+
+	if (bh == NULL) {
+		if (ctx->sig_alg == DKIM_SIGN_RSASHA1) {
+			ck = g_checksum_new (G_CHECKSUM_SHA1);
+		}
+		else {
+			ck = g_checksum_new (G_CHECKSUM_SHA256);
+		}
+
+		if (!rspamd_dkim_canonize_body (ctx, ck, cache->body_start,
+			task->msg->str + task->msg->len)) {
+			g_checksum_free (ck);
+			return NULL;
+		}
+
+		bh = rspamd_mempool_alloc (task->task_pool, sizeof (*bh));
+		bh->len = g_checksum_type_get_length (ctx->sig_alg ==
+				DKIM_SIGN_RSASHA1 ? G_CHECKSUM_SHA1 : G_CHECKSUM_SHA256);
+		bh->digest = rspamd_mempool_alloc (task->task_pool, bh->len);
+		g_checksum_get_digest (ck, bh->digest, &bh->len);
+		g_checksum_free (ck);
+		g_hash_table_insert (cache->hashes, key, bh);
+	}
+	else {
+		msg_debug ("reuse body hash for signature of %s", ctx->domain);
+	}
+
+	*dlen = bh->len;
+
+	return bh->digest;
+}
+
+const guint8 *
+rspamd_dkim_prepare_body (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	gsize *dlen)
+{
+	g_return_val_if_fail (ctx != NULL, NULL);
+
+	if (task->msg == NULL) {
+		return NULL;
+	}
+
+	return rspamd_dkim_get_body_hash (ctx, task, dlen);
+}
+
+/**
+ * Check task for dkim context using dkim key
+ * @param ctx dkim verify context
+ * @param key dkim key (from cache or from dns request)
+ * @param task task to check
+ * @return
+ */
+gint
+rspamd_dkim_check (rspamd_dkim_context_t *ctx,
+	rspamd_dkim_key_t *key,
+	struct rspamd_task *task)
+{
+	const guint8 *bh;
+	gchar *digest;
+	gsize dlen;
+	gint res = DKIM_CONTINUE;
+	guint i;
+	struct rspamd_dkim_header *dh;
+#ifdef HAVE_OPENSSL
+	gint nid;
+#endif
+
+	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
+	g_return_val_if_fail (key != NULL,		 DKIM_ERROR);
+	g_return_val_if_fail (task->msg != NULL, DKIM_ERROR);
+
+	/* Get body hash shared with other signatures of this task */
+	bh = rspamd_dkim_get_body_hash (ctx, task, &dlen);
+	if (bh == NULL) {
 		return DKIM_RECORD_ERROR;
 	}
+
+	/* Check bh field */
+	if (dlen != ctx->bhlen || memcmp (ctx->bh, bh, dlen) != 0) {
+		msg_debug ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
+				dlen, bh);
+		return DKIM_REJECT;
+	}
+
 	/* Now canonize headers */
 	for (i = 0; i < ctx->hlist->len; i++) {
 		dh = g_ptr_array_index (ctx->hlist, i);
@@ -1676,15 +1820,6 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 
 	dlen = ctx->bhlen;
 	digest = g_alloca (dlen);
-	g_checksum_get_digest (ctx->body_hash, digest, &dlen);
-
-	/* Check bh field */
-	if (memcmp (ctx->bh, digest, dlen) != 0) {
-		msg_debug ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
-				dlen, digest);
-		return DKIM_REJECT;
-	}
-
 	g_checksum_get_digest (ctx->headers_hash, digest, &dlen);
 #ifdef HAVE_OPENSSL
 	/* Check headers signature */
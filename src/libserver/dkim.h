@@ -148,7 +148,6 @@ typedef struct rspamd_dkim_context_s {
 	guint ver;
 	gchar *dns_key;
 	GChecksum *headers_hash;
-	GChecksum *body_hash;
 } rspamd_dkim_context_t;
 
 typedef struct rspamd_dkim_key_s {
@@ -207,10 +206,34 @@ gint rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_key_t *key,
 	struct rspamd_task *task);
 
+/**
+ * Compute body hash for the context in advance, e.g. while its key is being
+ * requested. Body hashes are cached in the task and shared by all signatures
+ * with the same body canonicalization, algorithm and length
+ * @param ctx dkim verify context
+ * @param task task to check
+ * @param dlen output length of hash
+ * @return body hash owned by the task or NULL if the body is not received yet
+ */
+const guint8 * rspamd_dkim_prepare_body (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	gsize *dlen);
+
 /**
  * Free DKIM key
  * @param key
  */
 void rspamd_dkim_key_free (rspamd_dkim_key_t *key);
 
+/**
+ * Make DKIM key from the decoded (DER) public key data
+ * @param der key data
+ * @param len length of key data
+ * @param ttl time to live of key
+ * @param err output error
+ * @return new key allocated by slice allocator or NULL
+ */
+rspamd_dkim_key_t * rspamd_dkim_make_key_der (const guchar *der, gsize len,
+	guint ttl, GError **err);
+
 #endif /* DKIM_H_ */
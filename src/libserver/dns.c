@@ -29,44 +29,483 @@
 #include "utlist.h"
 #include "uthash.h"
 #include "rdns_event.h"
+#include "shm_cache.h"
+
+/* Maximum size of serialized reply stored in the shared cache */
+#define DNS_CACHE_MAX_DATA 2048
+/* Type prefix and the longest DNS name */
+#define DNS_CACHE_KEY_LEN 264
+
+/*
+ * Answers cache is stored in a shared memory cache, keys are lowercased
+ * "type:name" strings and values are replies serialized by
+ * rspamd_dns_cache_serialize
+ */
+struct rspamd_dns_cache {
+	rspamd_shm_cache_t *shm;
+	gdouble max_ttl;
+	gdouble negative_ttl;
+};
+
+/* Header of serialized reply */
+struct rspamd_dns_cache_hdr {
+	guint16 rcode;
+	guint16 nentries;
+};
+
+/* Serialized reply entry header */
+struct rspamd_dns_cache_elt {
+	guint16 type;
+	guint16 len;
+};
+
+/*
+ * Identical requests issued by different tasks of the same worker are sent
+ * once and all callers are notified when the reply arrives
+ */
+struct rspamd_dns_inflight {
+	gchar *key;
+	gchar *name;
+	enum rdns_request_type type;
+	struct rdns_request *req;
+	struct rspamd_dns_resolver *resolver;
+	GList *waiters;
+	guint64 start;
+};
 
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
-	rspamd_mempool_t *pool;
-	struct rdns_request *req;
+	struct rspamd_dns_inflight *inflight;
+	/* Watcher of session that has been active when request was made */
+	struct rspamd_async_watcher *w;
+	gboolean cancelled;
+};
+
+/*
+ * Reply restored from the shared cache, it is delivered to the caller from
+ * the event loop just like a normal reply
+ */
+struct rspamd_dns_cached_reply {
+	struct rdns_reply reply;
+	enum rdns_request_type type;
+	gchar *name;
+	struct rspamd_dns_request_ud *reqdata;
+	struct event ev;
+	/* Reply is being passed to the callback */
+	gboolean dispatching;
 };
 
+static gboolean
+rspamd_dns_cache_key (const gchar *name, enum rdns_request_type type,
+	gchar *buf, gsize buflen)
+{
+	gsize r;
+
+	r = rspamd_snprintf (buf, buflen, "%d:%s", (gint)type, name);
+
+	if (r >= buflen - 1) {
+		return FALSE;
+	}
+
+	rspamd_str_lc (buf, r);
+
+	return TRUE;
+}
+
+struct rspamd_dns_cache *
+rspamd_dns_cache_new (struct rspamd_config *cfg)
+{
+	struct rspamd_dns_cache *cache;
+	rspamd_shm_cache_t *shm;
+
+	if (cfg->dns_cache_size == 0) {
+		return NULL;
+	}
+
+	shm = rspamd_shm_cache_new (cfg->dns_cache_size);
+
+	if (shm == NULL) {
+		msg_err ("cannot allocate %z bytes for DNS cache",
+			cfg->dns_cache_size);
+		return NULL;
+	}
+
+	/* Structure itself is copied to workers on fork */
+	cache = g_slice_alloc (sizeof (*cache));
+	cache->shm = shm;
+	cache->max_ttl = cfg->dns_cache_max_ttl;
+	cache->negative_ttl = cfg->dns_cache_negative_ttl;
+
+	return cache;
+}
+
+/*
+ * Lookup serialized reply in the shared cache
+ * @return reply that must be freed by g_free or NULL
+ */
+static guchar *
+rspamd_dns_cache_lookup (struct rspamd_dns_cache *cache, const gchar *name,
+	enum rdns_request_type type, gsize *len, guint *ttl)
+{
+	gchar key[DNS_CACHE_KEY_LEN];
+	guchar *data;
+
+	if (!rspamd_dns_cache_key (name, type, key, sizeof (key))) {
+		return NULL;
+	}
+
+	data = rspamd_shm_cache_lookup (cache->shm, key, time (NULL), len, ttl);
+
+	if (data != NULL && *len < sizeof (struct rspamd_dns_cache_hdr)) {
+		g_free (data);
+		return NULL;
+	}
+
+	return data;
+}
+
+/*
+ * Serialize reply entries to the buffer, only replies with entries of simple
+ * types are cached
+ */
+static gboolean
+rspamd_dns_cache_serialize (struct rdns_reply *reply,
+	guchar *buf, gsize *off, gint *ttl)
+{
+	struct rdns_reply_entry *elt;
+	struct rspamd_dns_cache_elt hdr;
+	struct rspamd_dns_cache_hdr *rhdr = (struct rspamd_dns_cache_hdr *)buf;
+	const gchar *str;
+	guint16 prio;
+	gsize len;
+
+	LL_FOREACH (reply->entries, elt)
+	{
+		str = NULL;
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			len = sizeof (struct in_addr);
+			break;
+		case RDNS_REQUEST_AAAA:
+			len = sizeof (struct in6_addr);
+			break;
+		case RDNS_REQUEST_PTR:
+			str = elt->content.ptr.name;
+			len = strlen (str);
+			break;
+		case RDNS_REQUEST_MX:
+			str = elt->content.mx.name;
+			len = strlen (str) + sizeof (prio);
+			break;
+		case RDNS_REQUEST_TXT:
+			str = elt->content.txt.data;
+			len = strlen (str);
+			break;
+		default:
+			return FALSE;
+		}
+
+		if (*off + sizeof (hdr) + len > DNS_CACHE_MAX_DATA) {
+			return FALSE;
+		}
+
+		hdr.type = elt->type;
+		hdr.len = len;
+		memcpy (buf + *off, &hdr, sizeof (hdr));
+		*off += sizeof (hdr);
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			memcpy (buf + *off, &elt->content.a.addr, len);
+			break;
+		case RDNS_REQUEST_AAAA:
+			memcpy (buf + *off, &elt->content.aaa.addr, len);
+			break;
+		case RDNS_REQUEST_MX:
+			prio = elt->content.mx.priority;
+			memcpy (buf + *off, &prio, sizeof (prio));
+			memcpy (buf + *off + sizeof (prio), str, len - sizeof (prio));
+			break;
+		default:
+			memcpy (buf + *off, str, len);
+			break;
+		}
+
+		*off += len;
+		rhdr->nentries++;
+
+		if (*ttl == 0 || (elt->ttl > 0 && elt->ttl < *ttl)) {
+			*ttl = elt->ttl;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_dns_cache_insert (struct rspamd_dns_cache *cache, const gchar *name,
+	enum rdns_request_type type, struct rdns_reply *reply)
+{
+	guchar buf[DNS_CACHE_MAX_DATA];
+	gchar key[DNS_CACHE_KEY_LEN];
+	struct rspamd_dns_cache_hdr *rhdr = (struct rspamd_dns_cache_hdr *)buf;
+	gsize off = sizeof (*rhdr);
+	gint ttl = 0;
+
+	if (!rspamd_dns_cache_key (name, type, key, sizeof (key))) {
+		return;
+	}
+
+	rhdr->rcode = reply->code;
+	rhdr->nentries = 0;
+
+	if (reply->code == RDNS_RC_NXDOMAIN ||
+		(reply->code == RDNS_RC_NOERROR && reply->entries == NULL)) {
+		/* Negative caching */
+		ttl = cache->negative_ttl;
+	}
+	else if (reply->code == RDNS_RC_NOERROR) {
+		if (!rspamd_dns_cache_serialize (reply, buf, &off, &ttl)) {
+			return;
+		}
+
+		if (cache->max_ttl > 0 && ttl > cache->max_ttl) {
+			ttl = cache->max_ttl;
+		}
+	}
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	rspamd_shm_cache_insert (cache->shm, key, buf, off, time (NULL), ttl);
+}
+
+static void
+rspamd_dns_cached_reply_free (struct rspamd_dns_cached_reply *cached)
+{
+	struct rdns_reply_entry *elt, *tmp;
+
+	LL_FOREACH_SAFE (cached->reply.entries, elt, tmp)
+	{
+		switch (elt->type) {
+		case RDNS_REQUEST_PTR:
+			g_free (elt->content.ptr.name);
+			break;
+		case RDNS_REQUEST_MX:
+			g_free (elt->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+			g_free (elt->content.txt.data);
+			break;
+		default:
+			break;
+		}
+		g_slice_free1 (sizeof (*elt), elt);
+	}
+
+	g_free (cached->name);
+	g_slice_free1 (sizeof (*cached->reqdata), cached->reqdata);
+	g_slice_free1 (sizeof (*cached), cached);
+}
+
+static struct rspamd_dns_cached_reply *
+rspamd_dns_cached_reply_new (const guchar *data, gsize len, guint ttl,
+	const gchar *name, enum rdns_request_type type)
+{
+	struct rspamd_dns_cached_reply *cached;
+	struct rdns_reply_entry *elt;
+	struct rspamd_dns_cache_hdr rhdr;
+	struct rspamd_dns_cache_elt hdr;
+	guint16 prio;
+	gsize off = sizeof (rhdr);
+
+	memcpy (&rhdr, data, sizeof (rhdr));
+	cached = g_slice_alloc0 (sizeof (*cached));
+	cached->type = type;
+	cached->name = g_strdup (name);
+	cached->reply.code = rhdr.rcode;
+
+	while (off + sizeof (hdr) <= len) {
+		memcpy (&hdr, data + off, sizeof (hdr));
+		off += sizeof (hdr);
+
+		if (off + hdr.len > len) {
+			break;
+		}
+
+		elt = g_slice_alloc0 (sizeof (*elt));
+		elt->type = hdr.type;
+		elt->ttl = ttl > 0 ? ttl : 1;
+
+		switch (hdr.type) {
+		case RDNS_REQUEST_A:
+			memcpy (&elt->content.a.addr, data + off,
+				sizeof (struct in_addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			memcpy (&elt->content.aaa.addr, data + off,
+				sizeof (struct in6_addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			elt->content.ptr.name = g_strndup ((const gchar *)data + off,
+					hdr.len);
+			break;
+		case RDNS_REQUEST_MX:
+			memcpy (&prio, data + off, sizeof (prio));
+			elt->content.mx.priority = prio;
+			elt->content.mx.name = g_strndup (
+					(const gchar *)data + off + sizeof (prio),
+					hdr.len - sizeof (prio));
+			break;
+		case RDNS_REQUEST_TXT:
+			elt->content.txt.data = g_strndup ((const gchar *)data + off,
+					hdr.len);
+			break;
+		}
+
+		off += hdr.len;
+		DL_APPEND (cached->reply.entries, elt);
+	}
+
+	return cached;
+}
+
+static void
+rspamd_dns_cached_fin_cb (gpointer arg)
+{
+	struct rspamd_dns_cached_reply *cached = arg;
+
+	if (cached->dispatching) {
+		/* Session is destroyed by the callback, reply is freed after it */
+		cached->reqdata->cancelled = TRUE;
+		return;
+	}
+
+	event_del (&cached->ev);
+	rspamd_dns_cached_reply_free (cached);
+}
+
+static void
+rspamd_dns_cached_callback (gint fd, short what, gpointer arg)
+{
+	struct rspamd_dns_cached_reply *cached = arg;
+	struct rspamd_dns_request_ud *reqdata = cached->reqdata;
+	struct rspamd_async_session *session = reqdata->session;
+	struct rspamd_async_watcher *prev;
+
+	prev = rspamd_session_watcher_push (session, reqdata->w);
+	cached->dispatching = TRUE;
+	reqdata->cb (&cached->reply, reqdata->ud);
+	cached->dispatching = FALSE;
+
+	if (session && !reqdata->cancelled) {
+		rspamd_session_watcher_pop (session, reqdata->w, prev);
+		remove_normal_event (session, rspamd_dns_cached_fin_cb, cached);
+	}
+	else {
+		rspamd_dns_cached_reply_free (cached);
+	}
+}
+
+/* Inflight request must be already removed from the resolver */
+static void
+rspamd_dns_inflight_free (struct rspamd_dns_inflight *inflight)
+{
+	g_list_free (inflight->waiters);
+	g_free (inflight->key);
+	g_free (inflight->name);
+	g_slice_free1 (sizeof (*inflight), inflight);
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	struct rspamd_dns_inflight *inflight = reqdata->inflight;
 
-	rdns_request_release (reqdata->req);
-	if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+	if (inflight == NULL) {
+		/* Reply is being dispatched, it will free this waiter */
+		reqdata->cancelled = TRUE;
+		reqdata->session = NULL;
+		return;
+	}
+
+	/* Session is destroyed before reply is received */
+	inflight->waiters = g_list_remove (inflight->waiters, reqdata);
+	g_slice_free1 (sizeof (*reqdata), reqdata);
+
+	if (inflight->waiters == NULL) {
+		/* Nobody waits for this request, so cancel it */
+		if (inflight->key) {
+			g_hash_table_remove (inflight->resolver->inflight, inflight->key);
+		}
+		rdns_request_release (inflight->req);
+		rspamd_dns_inflight_free (inflight);
 	}
 }
 
 static void
 rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_request_ud *reqdata;
+	struct rspamd_async_watcher *prev;
+	GList *waiters, *cur;
+
+	rspamd_metrics_observe (RSPAMD_METRIC_DNS_TIME,
+		rspamd_metrics_timestamp () - inflight->start);
+
+	if (reply->code != RDNS_RC_NOERROR && reply->code != RDNS_RC_NXDOMAIN) {
+		rspamd_metrics_inc (RSPAMD_METRIC_DNS_ERRORS, 1);
+	}
+
+	if (inflight->resolver->cache) {
+		rspamd_dns_cache_insert (inflight->resolver->cache, inflight->name,
+			inflight->type, reply);
+	}
 
-	reqdata->cb (reply, reqdata->ud);
+	/*
+	 * Callbacks may repeat the same request, it must be sent again instead of
+	 * waiting for the reply that is being dispatched
+	 */
+	if (inflight->key) {
+		g_hash_table_remove (inflight->resolver->inflight, inflight->key);
+	}
+
+	/* Detach waiters as callbacks may destroy sessions of other waiters */
+	waiters = inflight->waiters;
+	inflight->waiters = NULL;
 
-	if (reqdata->session) {
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
-		remove_normal_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
+	for (cur = waiters; cur != NULL; cur = g_list_next (cur)) {
+		reqdata = cur->data;
+		reqdata->inflight = NULL;
 	}
-	else if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+
+	for (cur = waiters; cur != NULL; cur = g_list_next (cur)) {
+		reqdata = cur->data;
+
+		if (!reqdata->cancelled) {
+			/* Requests made by callback are accounted to the same watcher */
+			prev = rspamd_session_watcher_push (reqdata->session, reqdata->w);
+			reqdata->cb (reply, reqdata->ud);
+
+			if (reqdata->session) {
+				rspamd_session_watcher_pop (reqdata->session, reqdata->w, prev);
+				remove_normal_event (reqdata->session, rspamd_dns_fin_cb,
+					reqdata);
+			}
+		}
+
+		g_slice_free1 (sizeof (*reqdata), reqdata);
 	}
+
+	g_list_free (waiters);
+	/* Request itself is released by the resolver after this callback */
+	rspamd_dns_inflight_free (inflight);
 }
 
 gboolean
@@ -80,43 +519,149 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_cached_reply *cached;
+	struct timeval tv;
+	guchar *data;
+	gsize len;
+	guint ttl;
+	gchar key[DNS_CACHE_KEY_LEN];
 
-	if (pool != NULL) {
-		reqdata =
-			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
-	}
-	else {
-		reqdata = g_slice_alloc (sizeof (struct rspamd_dns_request_ud));
-	}
-	reqdata->pool = pool;
+	reqdata = g_slice_alloc0 (sizeof (struct rspamd_dns_request_ud));
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
+	reqdata->w = rspamd_session_get_watcher (session);
+	rspamd_metrics_inc (RSPAMD_METRIC_DNS_REQUESTS, 1);
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
+	if (resolver->cache && (data = rspamd_dns_cache_lookup (resolver->cache,
+		name, type, &len, &ttl)) != NULL) {
+		rspamd_metrics_inc (RSPAMD_METRIC_DNS_CACHE_HITS, 1);
+		cached = rspamd_dns_cached_reply_new (data, len, ttl, name, type);
+		g_free (data);
+		cached->reqdata = reqdata;
+		event_set (&cached->ev, -1, EV_TIMEOUT, rspamd_dns_cached_callback,
+			cached);
+		event_base_set (resolver->ev_base, &cached->ev);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add (&cached->ev, &tv);
 
-	if (session) {
-		if (req != NULL) {
+		if (session) {
 			register_async_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
+				(event_finalizer_t)rspamd_dns_cached_fin_cb,
+				cached,
+				g_quark_from_static_string ("dns resolver"));
 		}
+
+		return TRUE;
+	}
+
+	/*
+	 * Names are case insensitive, so requests are coalesced by the same key
+	 * as they are cached, too long names are never coalesced
+	 */
+	if (rspamd_dns_cache_key (name, type, key, sizeof (key))) {
+		inflight = g_hash_table_lookup (resolver->inflight, key);
+	}
+	else {
+		key[0] = '\0';
+		inflight = NULL;
 	}
 
-	if (req == NULL) {
-		if (pool == NULL) {
+	if (inflight == NULL) {
+		inflight = g_slice_alloc0 (sizeof (*inflight));
+		inflight->key = key[0] != '\0' ? g_strdup (key) : NULL;
+		inflight->name = g_strdup (name);
+		inflight->type = type;
+		inflight->resolver = resolver;
+		inflight->start = rspamd_metrics_timestamp ();
+
+		req = rdns_make_request_full (resolver->r, rspamd_dns_callback,
+				inflight, resolver->request_timeout, resolver->max_retransmits,
+				1, name, type);
+
+		if (req == NULL) {
+			g_free (inflight->key);
+			g_free (inflight->name);
+			g_slice_free1 (sizeof (*inflight), inflight);
 			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+
+			return FALSE;
 		}
-		return FALSE;
+
+		inflight->req = req;
+
+		if (inflight->key) {
+			g_hash_table_insert (resolver->inflight, inflight->key, inflight);
+		}
+	}
+
+	reqdata->inflight = inflight;
+	inflight->waiters = g_list_append (inflight->waiters, reqdata);
+
+	if (session) {
+		register_async_event (session,
+			(event_finalizer_t)rspamd_dns_fin_cb,
+			reqdata,
+			g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
 }
 
+gboolean
+rspamd_dns_reply_has_type (struct rdns_reply *reply,
+	enum rdns_request_type type)
+{
+	struct rspamd_dns_cached_reply *cached;
+
+	if (reply->request != NULL) {
+		return rdns_request_has_type (reply->request, type);
+	}
+
+	cached = (struct rspamd_dns_cached_reply *)reply;
+
+	return cached->type == type;
+}
+
+const gchar *
+rspamd_dns_reply_name (struct rdns_reply *reply)
+{
+	struct rspamd_dns_cached_reply *cached;
+	const struct rdns_request_name *req_name;
+
+	if (reply->request != NULL) {
+		req_name = rdns_request_get_name (reply->request, NULL);
+
+		return req_name != NULL ? req_name[0].name : NULL;
+	}
+
+	cached = (struct rspamd_dns_cached_reply *)reply;
+
+	return cached->name;
+}
+
+gboolean
+rspamd_dns_cached_negative (struct rspamd_dns_resolver *resolver,
+	enum rdns_request_type type,
+	const gchar *name)
+{
+	struct rspamd_dns_cache_hdr rhdr;
+	guchar *data;
+	gsize len;
+	guint ttl;
+
+	if (resolver->cache == NULL || (data = rspamd_dns_cache_lookup (
+		resolver->cache, name, type, &len, &ttl)) == NULL) {
+		return FALSE;
+	}
+
+	memcpy (&rhdr, data, sizeof (rhdr));
+	g_free (data);
+
+	return rhdr.rcode != RDNS_RC_NOERROR || rhdr.nentries == 0;
+}
 
 struct rspamd_dns_resolver *
 dns_resolver_init (rspamd_logger_t *logger,
@@ -130,6 +675,11 @@ dns_resolver_init (rspamd_logger_t *logger,
 
 	new = g_slice_alloc0 (sizeof (struct rspamd_dns_resolver));
 	new->ev_base = ev_base;
+	new->inflight = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+
+	if (rspamd_main != NULL) {
+		new->cache = rspamd_main->dns_cache;
+	}
 	if (cfg != NULL) {
 		new->request_timeout = cfg->dns_timeout;
 		new->max_retransmits = cfg->dns_retransmits;
@@ -155,6 +705,7 @@ dns_resolver_init (rspamd_logger_t *logger,
 			msg_err (
 				"cannot parse resolv.conf and no nameservers defined, so no ways to resolve addresses");
 			rdns_resolver_release (new->r);
+			g_hash_table_unref (new->inflight);
 			g_slice_free1 (sizeof (struct rspamd_dns_resolver), new);
 			return NULL;
 		}
@@ -32,11 +32,15 @@
 #include "logger.h"
 #include "rdns.h"
 
+struct rspamd_dns_cache;
+
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
 	gdouble request_timeout;
 	guint max_retransmits;
+	GHashTable *inflight;
+	struct rspamd_dns_cache *cache;
 };
 
 /* Rspamd DNS API */
@@ -48,15 +52,26 @@ struct rspamd_dns_resolver * dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base, struct rspamd_config *cfg);
 
 /**
- * Make a DNS request
+ * Create DNS answers cache in shared memory, it must be called in the main
+ * process before workers are spawned
+ * @return new cache or NULL if cache is disabled
+ */
+struct rspamd_dns_cache * rspamd_dns_cache_new (struct rspamd_config *cfg);
+
+/**
+ * Make a DNS request. If the same request is already in progress in this
+ * resolver, the callback is attached to it instead of sending a new one;
+ * replies found in the shared cache are delivered without sending a request.
  * @param resolver resolver object
  * @param session async session to register event
- * @param pool memory pool for storage
+ * @param pool unused: request data is not allocated from the pool, as it may
+ * outlive the session when identical requests are shared, the argument is
+ * kept for compatibility
  * @param cb callback to call on resolve completing
  * @param ud user data for callback
  * @param type request type
  * @param ... string or ip address based on a request type
- * @return TRUE if request was sent.
+ * @return TRUE if request was sent or scheduled.
  */
 gboolean make_dns_request (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
@@ -66,4 +81,26 @@ gboolean make_dns_request (struct rspamd_dns_resolver *resolver,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Check the type of request for a reply passed to the DNS callback, this
+ * function should be used instead of `rdns_request_has_type` as replies
+ * obtained from the cache have no request attached
+ */
+gboolean rspamd_dns_reply_has_type (struct rdns_reply *reply,
+	enum rdns_request_type type);
+
+/**
+ * Get the requested name for a reply passed to the DNS callback
+ */
+const gchar * rspamd_dns_reply_name (struct rdns_reply *reply);
+
+/**
+ * Check whether the shared answers cache holds a negative (NXDOMAIN or empty)
+ * answer for the specified name, so callers can avoid issuing the request
+ * @return TRUE if the name is known to be absent
+ */
+gboolean rspamd_dns_cached_negative (struct rspamd_dns_resolver *resolver,
+	enum rdns_request_type type,
+	const gchar *name);
+
 #endif
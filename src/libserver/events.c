@@ -77,6 +77,7 @@ new_async_session (rspamd_mempool_t * pool, session_finalizer_t fin,
 	new->cleanup = cleanup;
 	new->user_data = user_data;
 	new->wanna_die = FALSE;
+	new->cur_watcher = NULL;
 	new->events = g_hash_table_new (rspamd_event_hash, rspamd_event_equal);
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
 	new->mtx = g_mutex_new ();
@@ -127,6 +128,11 @@ register_async_event (struct rspamd_async_session *session,
 	new->fin = fin;
 	new->user_data = user_data;
 	new->subsystem = subsystem;
+	new->w = session->cur_watcher;
+
+	if (new->w != NULL) {
+		g_atomic_int_inc ((gint *)&new->w->remain);
+	}
 
 	g_hash_table_insert (session->events, new, new);
 
@@ -144,6 +150,7 @@ remove_normal_event (struct rspamd_async_session *session,
 	void *ud)
 {
 	struct rspamd_async_event search_ev, *found_ev;
+	struct rspamd_async_watcher *w = NULL;
 
 	if (session == NULL) {
 		msg_info ("session is NULL");
@@ -162,16 +169,22 @@ remove_normal_event (struct rspamd_async_session *session,
 			g_hash_table_size (session->events));
 		/* Remove event */
 		fin (ud);
+		w = found_ev->w;
 	}
 	g_mutex_unlock (session->mtx);
 
+	if (w != NULL && g_atomic_int_dec_and_test ((gint *)&w->remain)) {
+		w->cb (session->user_data, w->ud);
+	}
+
 	check_session_pending (session);
 }
 
 static gboolean
-rspamd_session_destroy (gpointer k, gpointer v, gpointer unused)
+rspamd_session_destroy (gpointer k, gpointer v, gpointer ud)
 {
 	struct rspamd_async_event *ev = v;
+	struct rspamd_async_session *session = ud;
 
 	/* Call event's finalizer */
 	msg_debug ("removed event on destroy: %p, subsystem: %s", ev->user_data,
@@ -181,6 +194,11 @@ rspamd_session_destroy (gpointer k, gpointer v, gpointer unused)
 		ev->fin (ev->user_data);
 	}
 
+	/* Aborted events are finished for watchers as well */
+	if (ev->w != NULL && g_atomic_int_dec_and_test ((gint *)&ev->w->remain)) {
+		ev->w->cb (session->user_data, ev->w->ud);
+	}
+
 	return TRUE;
 }
 
@@ -251,11 +269,19 @@ check_session_pending (struct rspamd_async_session *session)
  * Add new async thread to session
  * @param session session object
  */
-void
+struct rspamd_async_watcher *
 register_async_thread (struct rspamd_async_session *session)
 {
+	struct rspamd_async_watcher *w = session->cur_watcher;
+
+	if (w != NULL) {
+		g_atomic_int_inc ((gint *)&w->remain);
+	}
+
 	g_atomic_int_inc (&session->threads);
 	msg_debug ("added thread: pending %d thread", session->threads);
+
+	return w;
 }
 
 /**
@@ -263,8 +289,14 @@ register_async_thread (struct rspamd_async_session *session)
  * @param session session object
  */
 void
-remove_async_thread (struct rspamd_async_session *session)
+remove_async_thread (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w)
 {
+	/* Session cannot be destroyed before the watcher is called */
+	if (w != NULL && g_atomic_int_dec_and_test ((gint *)&w->remain)) {
+		w->cb (session->user_data, w->ud);
+	}
+
 	if (g_atomic_int_dec_and_test (&session->threads)) {
 		/* Signal if there are any sessions waiting */
 		g_mutex_lock (session->mtx);
@@ -273,3 +305,82 @@ remove_async_thread (struct rspamd_async_session *session)
 	}
 	msg_debug ("removed thread: pending %d thread", session->threads);
 }
+
+void
+rspamd_session_watch_start (struct rspamd_async_session *session,
+	event_watcher_t cb, void *ud)
+{
+	struct rspamd_async_watcher *w;
+
+	if (session == NULL) {
+		return;
+	}
+
+	w = rspamd_mempool_alloc (session->pool, sizeof (*w));
+	w->cb = cb;
+	w->ud = ud;
+	/* Watcher is not finished until rspamd_session_watch_stop is called */
+	w->remain = 1;
+	w->prev = session->cur_watcher;
+	session->cur_watcher = w;
+}
+
+guint
+rspamd_session_watch_stop (struct rspamd_async_session *session)
+{
+	struct rspamd_async_watcher *w;
+
+	if (session == NULL || session->cur_watcher == NULL) {
+		return 0;
+	}
+
+	w = session->cur_watcher;
+	session->cur_watcher = w->prev;
+
+	/* Threads of watcher can finish concurrently */
+	return g_atomic_int_dec_and_test ((gint *)&w->remain) ? 0 : 1;
+}
+
+struct rspamd_async_watcher *
+rspamd_session_get_watcher (struct rspamd_async_session *session)
+{
+	if (session == NULL) {
+		return NULL;
+	}
+
+	return session->cur_watcher;
+}
+
+struct rspamd_async_watcher *
+rspamd_session_watcher_push (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w)
+{
+	struct rspamd_async_watcher *prev;
+
+	if (session == NULL) {
+		return NULL;
+	}
+
+	prev = session->cur_watcher;
+
+	if (w != NULL) {
+		g_atomic_int_inc ((gint *)&w->remain);
+		session->cur_watcher = w;
+	}
+
+	return prev;
+}
+
+void
+rspamd_session_watcher_pop (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w,
+	struct rspamd_async_watcher *prev)
+{
+	if (w != NULL) {
+		session->cur_watcher = prev;
+
+		if (g_atomic_int_dec_and_test ((gint *)&w->remain)) {
+			w->cb (session->user_data, w->ud);
+		}
+	}
+}
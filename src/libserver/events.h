@@ -8,12 +8,26 @@ struct rspamd_async_event;
 
 typedef void (*event_finalizer_t)(void *user_data);
 typedef gboolean (*session_finalizer_t)(void *user_data);
+typedef void (*event_watcher_t)(void *session_data, void *ud);
+
+/*
+ * Watcher is called when all events and threads registered while it was active
+ * are finished (e.g. to find out how long a symbol has been waiting for DNS).
+ * If the last of them is a thread, the callback is called from that thread.
+ */
+struct rspamd_async_watcher {
+	event_watcher_t cb;
+	guint remain;
+	void *ud;
+	struct rspamd_async_watcher *prev;
+};
 
 struct rspamd_async_event {
 	GQuark subsystem;
 	event_finalizer_t fin;
 	void *user_data;
 	guint ref;
+	struct rspamd_async_watcher *w;
 };
 
 struct rspamd_async_session {
@@ -27,6 +41,7 @@ struct rspamd_async_session {
 	guint threads;
 	GMutex *mtx;
 	GCond *cond;
+	struct rspamd_async_watcher *cur_watcher;
 };
 
 /**
@@ -75,16 +90,58 @@ gboolean destroy_session (struct rspamd_async_session *session);
  */
 gboolean check_session_pending (struct rspamd_async_session *session);
 
+/**
+ * Start watching for events registered in session
+ * @param session session object
+ * @param cb callback called when all watched events are finished
+ * @param ud user data for callback
+ */
+void rspamd_session_watch_start (struct rspamd_async_session *session,
+	event_watcher_t cb, void *ud);
+
+/**
+ * Stop registering new events in the current watcher and restore the watcher
+ * that has been current before rspamd_session_watch_start
+ * @return zero if no events are pending, so watcher is never called
+ */
+guint rspamd_session_watch_stop (struct rspamd_async_session *session);
+
+/**
+ * Get the current watcher of session (may be NULL)
+ */
+struct rspamd_async_watcher * rspamd_session_get_watcher (
+	struct rspamd_async_session *session);
+
+/**
+ * Make watcher current while callback of its event is called, so events
+ * registered by callback are watched too
+ * @return previous watcher of session
+ */
+struct rspamd_async_watcher * rspamd_session_watcher_push (
+	struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w);
+
+/**
+ * Restore watcher that has been current before rspamd_session_watcher_push
+ */
+void rspamd_session_watcher_pop (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w,
+	struct rspamd_async_watcher *prev);
+
 /**
  * Add new async thread to session
  * @param session session object
+ * @return the current watcher that waits for the thread (may be NULL)
  */
-void register_async_thread (struct rspamd_async_session *session);
+struct rspamd_async_watcher * register_async_thread (
+	struct rspamd_async_session *session);
 
 /**
  * Remove async thread from session and check whether session can be terminated
  * @param session session object
+ * @param w watcher returned by register_async_thread
  */
-void remove_async_thread (struct rspamd_async_session *session);
+void remove_async_thread (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w);
 
 #endif /* RSPAMD_EVENTS_H */
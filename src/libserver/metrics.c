@@ -0,0 +1,484 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "metrics.h"
+#include "main.h"
+#include "histogram.h"
+
+/* Slots are aligned to cache lines to avoid false sharing between workers */
+#define METRICS_SLOT_ALIGN 64
+#define METRICS_SLOT_SIZE \
+	((sizeof (struct rspamd_worker_metrics) + METRICS_SLOT_ALIGN - 1) & \
+	~(METRICS_SLOT_ALIGN - 1))
+
+enum rspamd_metrics_slot_state {
+	RSPAMD_METRICS_SLOT_FREE = 0,
+	RSPAMD_METRICS_SLOT_BUSY
+};
+
+struct rspamd_worker_metrics {
+	gint state;
+	gchar type[32];
+	guint64 counters[RSPAMD_METRIC_COUNTER_MAX];
+	gint64 gauges[RSPAMD_METRIC_GAUGE_MAX];
+	struct rspamd_histogram histograms[RSPAMD_METRIC_HISTOGRAM_MAX];
+};
+
+struct rspamd_metrics {
+	guint nslots;
+	gsize size;
+	guchar *slots;
+};
+
+struct rspamd_metric_descr {
+	const gchar *name;
+	const gchar *help;
+};
+
+/*
+ * Histograms are exposed with buckets of power of two bounds in range
+ * [2 ^ min_bits, 2 ^ max_bits], values are divided by scale to get base units
+ */
+struct rspamd_metric_hist_descr {
+	const gchar *name;
+	const gchar *help;
+	const gchar *unit;
+	gdouble scale;
+	guint min_bits;
+	guint max_bits;
+};
+
+static const struct rspamd_metric_descr counters_descr[] = {
+	[RSPAMD_METRIC_TASKS] = {
+		.name = "rspamd_tasks",
+		.help = "Tasks processed"
+	},
+	[RSPAMD_METRIC_DNS_REQUESTS] = {
+		.name = "rspamd_dns_requests",
+		.help = "DNS requests made"
+	},
+	[RSPAMD_METRIC_DNS_CACHE_HITS] = {
+		.name = "rspamd_dns_cache_hits",
+		.help = "DNS requests answered from the shared cache"
+	},
+	[RSPAMD_METRIC_DNS_ERRORS] = {
+		.name = "rspamd_dns_errors",
+		.help = "DNS requests failed or timed out"
+	},
+	[RSPAMD_METRIC_FUZZY_CHECKS] = {
+		.name = "rspamd_fuzzy_checks",
+		.help = "Fuzzy hashes checked"
+	},
+	[RSPAMD_METRIC_FUZZY_HITS] = {
+		.name = "rspamd_fuzzy_hits",
+		.help = "Fuzzy hashes found"
+	},
+	[RSPAMD_METRIC_STATFILE_LOOKUPS] = {
+		.name = "rspamd_statfile_lookups",
+		.help = "Tokens looked up in statfiles"
+	},
+	[RSPAMD_METRIC_STATFILE_HITS] = {
+		.name = "rspamd_statfile_hits",
+		.help = "Tokens found in statfiles"
+	}
+};
+
+static const struct rspamd_metric_descr gauges_descr[] = {
+	[RSPAMD_METRIC_TASKS_ACTIVE] = {
+		.name = "rspamd_tasks_active",
+		.help = "Tasks being processed"
+	}
+};
+
+static const struct rspamd_metric_hist_descr histograms_descr[] = {
+	[RSPAMD_METRIC_SCAN_TIME] = {
+		.name = "rspamd_scan_duration_seconds",
+		.help = "Time from accepting connection to finishing task",
+		.unit = "seconds",
+		.scale = 1000000.0,
+		.min_bits = 10,
+		.max_bits = 25
+	},
+	[RSPAMD_METRIC_MESSAGE_SIZE] = {
+		.name = "rspamd_message_size_bytes",
+		.help = "Size of scanned messages",
+		.unit = "bytes",
+		.scale = 1.0,
+		.min_bits = 10,
+		.max_bits = 26
+	},
+	[RSPAMD_METRIC_DNS_TIME] = {
+		.name = "rspamd_dns_duration_seconds",
+		.help = "Time to get reply from DNS server",
+		.unit = "seconds",
+		.scale = 1000000.0,
+		.min_bits = 8,
+		.max_bits = 23
+	}
+};
+
+/* Slot of the current process */
+static struct rspamd_worker_metrics *local_metrics = NULL;
+
+static inline struct rspamd_worker_metrics *
+rspamd_metrics_slot (struct rspamd_metrics *metrics, guint idx)
+{
+	return (struct rspamd_worker_metrics *)(metrics->slots +
+		idx * METRICS_SLOT_SIZE);
+}
+
+struct rspamd_metrics *
+rspamd_metrics_new (void)
+{
+	struct rspamd_metrics *metrics;
+	gpointer map;
+	gsize size;
+
+	size = RSPAMD_METRICS_MAX_WORKERS * METRICS_SLOT_SIZE;
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for metrics: %s", size,
+			strerror (errno));
+		return NULL;
+	}
+
+	memset (map, 0, size);
+	metrics = g_slice_alloc0 (sizeof (*metrics));
+	metrics->nslots = RSPAMD_METRICS_MAX_WORKERS;
+	metrics->size = size;
+	metrics->slots = map;
+
+	return metrics;
+}
+
+struct rspamd_worker_metrics *
+rspamd_metrics_acquire (struct rspamd_metrics *metrics, const gchar *type)
+{
+	struct rspamd_worker_metrics *slot;
+	guint i;
+
+	if (metrics == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < metrics->nslots; i++) {
+		slot = rspamd_metrics_slot (metrics, i);
+
+		if (g_atomic_int_get (&slot->state) == RSPAMD_METRICS_SLOT_FREE) {
+			memset (slot, 0, sizeof (*slot));
+			rspamd_strlcpy (slot->type, type, sizeof (slot->type));
+			/* Readers must not see slot until it is initialized */
+			g_atomic_int_set (&slot->state, RSPAMD_METRICS_SLOT_BUSY);
+
+			return slot;
+		}
+	}
+
+	msg_warn ("no free metrics slots for %s worker", type);
+
+	return NULL;
+}
+
+void
+rspamd_metrics_release (struct rspamd_worker_metrics *slot)
+{
+	if (slot != NULL) {
+		g_atomic_int_set (&slot->state, RSPAMD_METRICS_SLOT_FREE);
+	}
+}
+
+void
+rspamd_metrics_set_local (struct rspamd_worker_metrics *slot)
+{
+	local_metrics = slot;
+}
+
+void
+rspamd_metrics_inc (enum rspamd_metric_counter counter, guint64 value)
+{
+	if (local_metrics != NULL && counter < RSPAMD_METRIC_COUNTER_MAX) {
+		__sync_fetch_and_add (&local_metrics->counters[counter], value);
+	}
+}
+
+void
+rspamd_metrics_gauge_add (enum rspamd_metric_gauge gauge, gint64 value)
+{
+	if (local_metrics != NULL && gauge < RSPAMD_METRIC_GAUGE_MAX) {
+		__sync_fetch_and_add (&local_metrics->gauges[gauge], value);
+	}
+}
+
+void
+rspamd_metrics_observe (enum rspamd_metric_histogram hist, guint64 value)
+{
+	if (local_metrics != NULL && hist < RSPAMD_METRIC_HISTOGRAM_MAX) {
+		rspamd_histogram_add (&local_metrics->histograms[hist],
+			MIN (value, G_MAXUINT32));
+	}
+}
+
+guint64
+rspamd_metrics_timestamp (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+# ifdef CLOCK_MONOTONIC
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+# else
+	clock_gettime (CLOCK_REALTIME, &ts);
+# endif
+
+	return (guint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return (guint64)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void
+rspamd_metrics_write_header (GString *out, const gchar *name,
+	const gchar *type, const gchar *help, const gchar *unit)
+{
+	rspamd_printf_gstring (out, "# TYPE %s %s\n", name, type);
+
+	if (unit != NULL) {
+		rspamd_printf_gstring (out, "# UNIT %s %s\n", name, unit);
+	}
+
+	rspamd_printf_gstring (out, "# HELP %s %s\n", name, help);
+}
+
+static void
+rspamd_metrics_write_value (GString *out, const gchar *name,
+	const gchar *suffix, const gchar *labels, guint64 value)
+{
+	rspamd_printf_gstring (out, "%s%s%s %uL\n", name, suffix, labels, value);
+}
+
+/*
+ * Legacy counters of struct rspamd_stat and memory pools statistics
+ * are shared by all processes, so they have no worker labels
+ */
+static void
+rspamd_metrics_write_global (struct rspamd_main *srv, GString *out)
+{
+	struct rspamd_stat stat;
+	rspamd_mempool_stat_t mem_st;
+	gint i;
+
+	memcpy (&stat, srv->stat, sizeof (stat));
+	rspamd_mempool_stat (&mem_st);
+
+	rspamd_metrics_write_header (out, "rspamd_actions", "counter",
+		"Messages scanned by resulting action", NULL);
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
+		rspamd_printf_gstring (out, "rspamd_actions_total{action=\"%s\"} %ud\n",
+			rspamd_action_to_str (i), stat.actions_stat[i]);
+	}
+
+	rspamd_metrics_write_header (out, "rspamd_learned", "counter",
+		"Messages learned", NULL);
+	rspamd_metrics_write_value (out, "rspamd_learned", "_total", "",
+		stat.messages_learned);
+	rspamd_metrics_write_header (out, "rspamd_connections", "counter",
+		"Connections accepted by scanning workers", NULL);
+	rspamd_metrics_write_value (out, "rspamd_connections", "_total", "",
+		stat.connections_count);
+	rspamd_metrics_write_header (out, "rspamd_control_connections", "counter",
+		"Connections accepted by controller", NULL);
+	rspamd_metrics_write_value (out, "rspamd_control_connections", "_total",
+		"", stat.control_connections_count);
+	rspamd_metrics_write_header (out, "rspamd_fuzzy_stored", "gauge",
+		"Fuzzy hashes stored", NULL);
+	rspamd_metrics_write_value (out, "rspamd_fuzzy_stored", "", "",
+		stat.fuzzy_hashes);
+	rspamd_metrics_write_header (out, "rspamd_fuzzy_expired", "counter",
+		"Fuzzy hashes expired", NULL);
+	rspamd_metrics_write_value (out, "rspamd_fuzzy_expired", "_total", "",
+		stat.fuzzy_hashes_expired);
+
+	rspamd_metrics_write_header (out, "rspamd_mempool_allocated_bytes", "gauge",
+		"Bytes allocated by memory pools", "bytes");
+	rspamd_metrics_write_value (out, "rspamd_mempool_allocated_bytes", "", "",
+		mem_st.bytes_allocated);
+	rspamd_metrics_write_header (out, "rspamd_mempool_pools_allocated",
+		"counter", "Memory pools allocated", NULL);
+	rspamd_metrics_write_value (out, "rspamd_mempool_pools_allocated",
+		"_total", "", mem_st.pools_allocated);
+	rspamd_metrics_write_header (out, "rspamd_mempool_pools_freed", "counter",
+		"Memory pools freed", NULL);
+	rspamd_metrics_write_value (out, "rspamd_mempool_pools_freed", "_total",
+		"", mem_st.pools_freed);
+	rspamd_metrics_write_header (out, "rspamd_mempool_chunks_allocated",
+		"counter", "Memory pool chunks allocated", NULL);
+	rspamd_metrics_write_value (out, "rspamd_mempool_chunks_allocated",
+		"_total", "", mem_st.chunks_allocated);
+	rspamd_metrics_write_header (out, "rspamd_mempool_chunks_freed", "counter",
+		"Memory pool chunks freed", NULL);
+	rspamd_metrics_write_value (out, "rspamd_mempool_chunks_freed", "_total",
+		"", mem_st.chunks_freed);
+	rspamd_metrics_write_header (out, "rspamd_mempool_chunks_oversized",
+		"counter", "Memory pool chunks larger than pool page", NULL);
+	rspamd_metrics_write_value (out, "rspamd_mempool_chunks_oversized",
+		"_total", "", mem_st.oversized_chunks);
+}
+
+static void
+rspamd_metrics_write_histogram (GString *out,
+	const struct rspamd_metric_hist_descr *d,
+	const struct rspamd_histogram *h, const gchar *labels)
+{
+	guint32 buckets[RSPAMD_HISTOGRAM_BUCKETS];
+	guint64 cum = 0, sum;
+	guint i = 0, last, bits;
+	gchar le[32];
+
+	/* Take snapshot as the owner may update histogram concurrently */
+	memcpy (buckets, h->buckets, sizeof (buckets));
+	sum = h->sum;
+
+	for (bits = d->min_bits; bits <= d->max_bits; bits++) {
+		/* The last bucket of range that ends with 2 ^ bits - 1 */
+		last = (bits - RSPAMD_HISTOGRAM_SUB_BITS + 1) *
+			RSPAMD_HISTOGRAM_SUB_BUCKETS - 1;
+
+		for (; i <= last; i++) {
+			cum += buckets[i];
+		}
+
+		if (d->scale == 1.0) {
+			rspamd_snprintf (le, sizeof (le), "%uD",
+				rspamd_histogram_bucket_bound (last));
+		}
+		else {
+			rspamd_snprintf (le, sizeof (le), "%.6f",
+				rspamd_histogram_bucket_bound (last) / d->scale);
+		}
+
+		rspamd_printf_gstring (out, "%s_bucket{%s,le=\"%s\"} %uL\n",
+			d->name, labels, le, cum);
+	}
+
+	for (; i < RSPAMD_HISTOGRAM_BUCKETS; i++) {
+		cum += buckets[i];
+	}
+
+	rspamd_printf_gstring (out, "%s_bucket{%s,le=\"+Inf\"} %uL\n",
+		d->name, labels, cum);
+	rspamd_printf_gstring (out, "%s_count{%s} %uL\n", d->name, labels, cum);
+
+	if (d->scale == 1.0) {
+		rspamd_printf_gstring (out, "%s_sum{%s} %uL\n", d->name, labels, sum);
+	}
+	else {
+		rspamd_printf_gstring (out, "%s_sum{%s} %.6f\n", d->name, labels,
+			sum / d->scale);
+	}
+}
+
+static gboolean
+rspamd_metrics_slot_labels (struct rspamd_metrics *metrics, guint idx,
+	gchar *buf, gsize len)
+{
+	struct rspamd_worker_metrics *slot = rspamd_metrics_slot (metrics, idx);
+
+	if (g_atomic_int_get (&slot->state) != RSPAMD_METRICS_SLOT_BUSY) {
+		return FALSE;
+	}
+
+	rspamd_snprintf (buf, len, "worker=\"%s\",slot=\"%ud\"", slot->type, idx);
+
+	return TRUE;
+}
+
+GString *
+rspamd_metrics_openmetrics (struct rspamd_main *srv)
+{
+	struct rspamd_metrics *metrics = srv->metrics;
+	struct rspamd_worker_metrics *slot;
+	const struct rspamd_metric_descr *d;
+	GString *out;
+	gchar labels[128];
+	guint i, j;
+
+	out = g_string_sized_new (BUFSIZ);
+	rspamd_metrics_write_global (srv, out);
+
+	if (metrics != NULL) {
+		for (i = 0; i < RSPAMD_METRIC_COUNTER_MAX; i++) {
+			d = &counters_descr[i];
+			rspamd_metrics_write_header (out, d->name, "counter", d->help,
+				NULL);
+
+			for (j = 0; j < metrics->nslots; j++) {
+				if (rspamd_metrics_slot_labels (metrics, j, labels,
+					sizeof (labels))) {
+					slot = rspamd_metrics_slot (metrics, j);
+					rspamd_printf_gstring (out, "%s_total{%s} %uL\n", d->name,
+						labels, slot->counters[i]);
+				}
+			}
+		}
+
+		for (i = 0; i < RSPAMD_METRIC_GAUGE_MAX; i++) {
+			d = &gauges_descr[i];
+			rspamd_metrics_write_header (out, d->name, "gauge", d->help, NULL);
+
+			for (j = 0; j < metrics->nslots; j++) {
+				if (rspamd_metrics_slot_labels (metrics, j, labels,
+					sizeof (labels))) {
+					slot = rspamd_metrics_slot (metrics, j);
+					rspamd_printf_gstring (out, "%s{%s} %L\n", d->name,
+						labels, slot->gauges[i]);
+				}
+			}
+		}
+
+		for (i = 0; i < RSPAMD_METRIC_HISTOGRAM_MAX; i++) {
+			rspamd_metrics_write_header (out, histograms_descr[i].name,
+				"histogram", histograms_descr[i].help,
+				histograms_descr[i].unit);
+
+			for (j = 0; j < metrics->nslots; j++) {
+				if (rspamd_metrics_slot_labels (metrics, j, labels,
+					sizeof (labels))) {
+					slot = rspamd_metrics_slot (metrics, j);
+					rspamd_metrics_write_histogram (out, &histograms_descr[i],
+						&slot->histograms[i], labels);
+				}
+			}
+		}
+	}
+
+	g_string_append (out, "# EOF\n");
+
+	return out;
+}
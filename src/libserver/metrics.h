@@ -0,0 +1,120 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Registry of runtime metrics. Each worker owns a slot in a shared memory
+ * area that is allocated by the main process before forking, so the
+ * controller can read slots of all workers. Only the owner updates its slot
+ * and all updates are atomic, hence metrics are collected without locks.
+ */
+
+#define RSPAMD_METRICS_MAX_WORKERS 128
+
+enum rspamd_metric_counter {
+	RSPAMD_METRIC_TASKS = 0,
+	RSPAMD_METRIC_DNS_REQUESTS,
+	RSPAMD_METRIC_DNS_CACHE_HITS,
+	RSPAMD_METRIC_DNS_ERRORS,
+	RSPAMD_METRIC_FUZZY_CHECKS,
+	RSPAMD_METRIC_FUZZY_HITS,
+	RSPAMD_METRIC_STATFILE_LOOKUPS,
+	RSPAMD_METRIC_STATFILE_HITS,
+	RSPAMD_METRIC_COUNTER_MAX
+};
+
+enum rspamd_metric_gauge {
+	RSPAMD_METRIC_TASKS_ACTIVE = 0,
+	RSPAMD_METRIC_GAUGE_MAX
+};
+
+enum rspamd_metric_histogram {
+	RSPAMD_METRIC_SCAN_TIME = 0,
+	RSPAMD_METRIC_MESSAGE_SIZE,
+	RSPAMD_METRIC_DNS_TIME,
+	RSPAMD_METRIC_HISTOGRAM_MAX
+};
+
+struct rspamd_metrics;
+struct rspamd_worker_metrics;
+struct rspamd_main;
+
+/**
+ * Allocate shared metrics area for all workers
+ * @return new metrics area or NULL in case of error
+ */
+struct rspamd_metrics * rspamd_metrics_new (void);
+
+/**
+ * Acquire free slot for a worker, must be called by the main process
+ * @param metrics metrics area
+ * @param type type of worker
+ * @return zeroed slot or NULL if all slots are used
+ */
+struct rspamd_worker_metrics * rspamd_metrics_acquire (
+	struct rspamd_metrics *metrics, const gchar *type);
+
+/**
+ * Return slot to the free list when its worker is terminated
+ */
+void rspamd_metrics_release (struct rspamd_worker_metrics *slot);
+
+/**
+ * Set slot where metrics of the current process are collected
+ */
+void rspamd_metrics_set_local (struct rspamd_worker_metrics *slot);
+
+/**
+ * Increase counter of the current process
+ */
+void rspamd_metrics_inc (enum rspamd_metric_counter counter, guint64 value);
+
+/**
+ * Add value (possibly negative) to gauge of the current process
+ */
+void rspamd_metrics_gauge_add (enum rspamd_metric_gauge gauge, gint64 value);
+
+/**
+ * Add value to histogram of the current process
+ */
+void rspamd_metrics_observe (enum rspamd_metric_histogram hist,
+	guint64 value);
+
+/**
+ * Get monotonic timestamp in microseconds suitable to measure durations
+ */
+guint64 rspamd_metrics_timestamp (void);
+
+/**
+ * Write all metrics in OpenMetrics text format
+ * @param srv main server structure
+ * @return new string that must be freed by caller
+ */
+GString * rspamd_metrics_openmetrics (struct rspamd_main *srv);
+
+#endif /* METRICS_H_ */
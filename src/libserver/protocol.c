@@ -27,6 +27,7 @@
 #include "util.h"
 #include "cfg_file.h"
 #include "message.h"
+#include "msgpack.h"
 #include "utlist.h"
 
 /* Max line size */
@@ -62,6 +63,10 @@
  * Process this message as described above and return modified message
  */
 #define MSG_CMD_PROCESS "process"
+/*
+ * Check several length prefixed messages and return results as they are ready
+ */
+#define MSG_CMD_BATCH "batch"
 
 /*
  * Learn specified statfile using message
@@ -96,6 +101,7 @@
 #define HOSTNAME_HEADER "Hostname"
 #define DELIVER_TO_HEADER "Deliver-To"
 #define NO_LOG_HEADER "Log"
+#define ACCEPT_HEADER "Accept"
 
 static GList *custom_commands = NULL;
 
@@ -187,6 +193,16 @@ rspamd_protocol_handle_url (struct rspamd_task *task,
 			goto err;
 		}
 		break;
+	case 'b':
+	case 'B':
+		/* batch */
+		if (g_ascii_strcasecmp (p + 1, MSG_CMD_BATCH + 1) == 0) {
+			task->cmd = CMD_BATCH;
+		}
+		else {
+			goto err;
+		}
+		break;
 	case 'r':
 	case 'R':
 		/* report, report_ifspam */
@@ -395,6 +411,19 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 				validh = FALSE;
 			}
 			break;
+		case 'a':
+		case 'A':
+			if (g_ascii_strcasecmp (headern, ACCEPT_HEADER) == 0) {
+				if (rspamd_strncasestr (h->value->str, RSPAMD_MSGPACK_CTYPE,
+					h->value->len) != NULL) {
+					task->is_msgpack = TRUE;
+					debug_task ("client accepts msgpack reply");
+				}
+			}
+			else {
+				validh = FALSE;
+			}
+			break;
 		case 'l':
 		case 'L':
 			if (g_ascii_strcasecmp (headern, NO_LOG_HEADER) == 0) {
@@ -482,9 +511,23 @@ write_hashes_to_log (struct rspamd_task *task, GString *logbuf)
 /* Structure for writing tree data */
 struct tree_cb_data {
 	ucl_object_t *top;
+	GString *out;
 	struct rspamd_task *task;
 };
 
+static void
+rspamd_protocol_log_url (struct rspamd_task *task, struct uri *url)
+{
+	if (task->cfg->log_urls) {
+		msg_info ("<%s> URL: %s - %s: %s",
+			task->message_id,
+			task->user ?
+			task->user : "unknown",
+			rspamd_inet_address_to_string (&task->from_addr),
+			struri (url));
+	}
+}
+
 /*
  * Callback for writing urls
  */
@@ -518,15 +561,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 		ucl_object_insert_key (obj, elt, "phished", 0, false);
 	}
 	ucl_array_append (cb->top, obj);
-
-	if (cb->task->cfg->log_urls) {
-		msg_info ("<%s> URL: %s - %s: %s",
-			cb->task->message_id,
-			cb->task->user ?
-			cb->task->user : "unknown",
-			rspamd_inet_address_to_string (&cb->task->from_addr),
-			struri (url));
-	}
+	rspamd_protocol_log_url (cb->task, url);
 
 	return FALSE;
 }
@@ -658,20 +693,14 @@ rspamd_metric_symbol_ucl (struct rspamd_task *task, struct metric *m,
 	return obj;
 }
 
-static ucl_object_t *
-rspamd_metric_result_ucl (struct rspamd_task *task,
+static enum rspamd_metric_action
+rspamd_metric_result_log_start (struct rspamd_task *task,
 	struct metric_result *mres,
+	gdouble *required_score,
 	GString *logbuf)
 {
-	GHashTableIter hiter;
-	struct symbol *sym;
 	struct metric *m;
-	gboolean is_spam;
-	enum rspamd_metric_action action = METRIC_ACTION_NOACTION;
-	ucl_object_t *obj = NULL, *sobj;;
-	gpointer h, v;
-	double required_score;
-	const gchar *subject;
+	enum rspamd_metric_action action;
 	gchar action_char;
 
 	m = mres->metric;
@@ -679,18 +708,17 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 	/* XXX: handle settings */
 	if (mres->action == METRIC_ACTION_MAX) {
 		mres->action = rspamd_check_action_metric (task, mres->score,
-				&required_score, m);
+				required_score, m);
 	}
 	else {
-		required_score = mres->metric->actions[mres->action].score;
+		*required_score = mres->metric->actions[mres->action].score;
 	}
 	action = mres->action;
-	is_spam = (action == METRIC_ACTION_REJECT);
 
 	if (task->is_skipped) {
 		action_char = 'S';
 	}
-	else if (is_spam) {
+	else if (action == METRIC_ACTION_REJECT) {
 		action_char = 'T';
 	}
 	else {
@@ -700,7 +728,51 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 	rspamd_printf_gstring (logbuf, "(%s: %c (%s): [%.2f/%.2f] [",
 		m->name, action_char,
 		rspamd_action_to_str (action),
-		mres->score, required_score);
+		mres->score, *required_score);
+
+	return action;
+}
+
+static void
+rspamd_metric_result_log_finish (struct rspamd_task *task, GString *logbuf)
+{
+	/* Cut the trailing comma if needed */
+	if (logbuf->str[logbuf->len - 1] == ',') {
+		logbuf->len--;
+	}
+
+#ifdef HAVE_CLOCK_GETTIME
+	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
+		task->msg->len, calculate_check_time (&task->tv, &task->ts,
+		task->cfg->clock_res, &task->scan_milliseconds), task->dns_requests);
+#else
+	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
+		task->msg->len,
+		calculate_check_time (&task->tv, task->cfg->clock_res,
+		&task->scan_milliseconds),
+		task->dns_requests);
+#endif
+}
+
+static ucl_object_t *
+rspamd_metric_result_ucl (struct rspamd_task *task,
+	struct metric_result *mres,
+	GString *logbuf)
+{
+	GHashTableIter hiter;
+	struct symbol *sym;
+	struct metric *m;
+	gboolean is_spam;
+	enum rspamd_metric_action action = METRIC_ACTION_NOACTION;
+	ucl_object_t *obj = NULL, *sobj;;
+	gpointer h, v;
+	double required_score;
+	const gchar *subject;
+
+	m = mres->metric;
+	action = rspamd_metric_result_log_start (task, mres, &required_score,
+			logbuf);
+	is_spam = (action == METRIC_ACTION_REJECT);
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (obj,	  ucl_object_frombool (is_spam),
@@ -728,24 +800,197 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 		ucl_object_insert_key (obj, sobj, h, 0, false);
 	}
 
-	/* Cut the trailing comma if needed */
-	if (logbuf->str[logbuf->len - 1] == ',') {
-		logbuf->len--;
+	rspamd_metric_result_log_finish (task, logbuf);
+
+	return obj;
+}
+
+/*
+ * Compact binary output: the same structure as JSON reply but written
+ * directly to the output buffer without intermediate UCL objects
+ */
+static void
+rspamd_str_list_msgpack (GList *str_list, GString *out)
+{
+	GList *cur;
+
+	rspamd_msgpack_write_array (out, g_list_length (str_list));
+	cur = str_list;
+	while (cur) {
+		rspamd_msgpack_write_string (out, cur->data);
+		cur = g_list_next (cur);
 	}
+}
 
-#ifdef HAVE_CLOCK_GETTIME
-	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
-		task->msg->len, calculate_check_time (&task->tv, &task->ts,
-		task->cfg->clock_res, &task->scan_milliseconds), task->dns_requests);
-#else
-	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
-		task->msg->len,
-		calculate_check_time (&task->tv, task->cfg->clock_res,
-		&task->scan_milliseconds),
-		task->dns_requests);
-#endif
+static void
+rspamd_metric_symbol_msgpack (struct rspamd_task *task, struct metric *m,
+	struct symbol *sym, GString *logbuf, GString *out)
+{
+	const gchar *description = NULL;
 
-	return obj;
+	rspamd_printf_gstring (logbuf, "%s,", sym->name);
+	description = g_hash_table_lookup (m->descriptions, sym->name);
+
+	rspamd_msgpack_write_map (out, 2 + (description != NULL ? 1 : 0) +
+		(sym->options != NULL ? 1 : 0));
+	rspamd_msgpack_write_string (out, "name");
+	rspamd_msgpack_write_string (out, sym->name);
+	rspamd_msgpack_write_string (out, "score");
+	rspamd_msgpack_write_double (out, sym->score);
+	if (description) {
+		rspamd_msgpack_write_string (out, "description");
+		rspamd_msgpack_write_string (out, description);
+	}
+	if (sym->options != NULL) {
+		rspamd_msgpack_write_string (out, "options");
+		rspamd_str_list_msgpack (sym->options, out);
+	}
+}
+
+static void
+rspamd_metric_result_msgpack (struct rspamd_task *task,
+	struct metric_result *mres,
+	GString *logbuf,
+	GString *out)
+{
+	GHashTableIter hiter;
+	struct symbol *sym;
+	struct metric *m;
+	enum rspamd_metric_action action;
+	gpointer h, v;
+	double required_score;
+	const gchar *subject = NULL;
+
+	m = mres->metric;
+	action = rspamd_metric_result_log_start (task, mres, &required_score,
+			logbuf);
+
+	if (action == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = make_rewritten_subject (m, task);
+	}
+
+	rspamd_msgpack_write_map (out, 5 + (subject != NULL ? 1 : 0) +
+		g_hash_table_size (mres->symbols));
+	rspamd_msgpack_write_string (out, "is_spam");
+	rspamd_msgpack_write_bool (out, action == METRIC_ACTION_REJECT);
+	rspamd_msgpack_write_string (out, "is_skipped");
+	rspamd_msgpack_write_bool (out, task->is_skipped);
+	rspamd_msgpack_write_string (out, "score");
+	rspamd_msgpack_write_double (out, mres->score);
+	rspamd_msgpack_write_string (out, "required_score");
+	rspamd_msgpack_write_double (out, required_score);
+	rspamd_msgpack_write_string (out, "action");
+	rspamd_msgpack_write_string (out, rspamd_action_to_str (action));
+
+	if (subject != NULL) {
+		rspamd_msgpack_write_string (out, "subject");
+		rspamd_msgpack_write_string (out, subject);
+	}
+
+	g_hash_table_iter_init (&hiter, mres->symbols);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		sym = (struct symbol *)v;
+		rspamd_msgpack_write_string (out, h);
+		rspamd_metric_symbol_msgpack (task, m, sym, logbuf, out);
+	}
+
+	rspamd_metric_result_log_finish (task, logbuf);
+}
+
+static gboolean
+urls_protocol_msgpack_cb (gpointer key, gpointer value, gpointer ud)
+{
+	struct tree_cb_data *cb = ud;
+	struct uri *url = value;
+	GString *out = cb->out;
+
+	if (!cb->task->extended_urls) {
+		rspamd_msgpack_write_lstring (out, url->host, url->hostlen);
+	}
+	else {
+		rspamd_msgpack_write_map (out, 2 + (url->hostlen > 0 ? 1 : 0) +
+			(url->surbllen > 0 ? 1 : 0));
+		rspamd_msgpack_write_string (out, "url");
+		rspamd_msgpack_write_string (out, url->string);
+
+		if (url->hostlen > 0) {
+			rspamd_msgpack_write_string (out, "host");
+			rspamd_msgpack_write_lstring (out, url->host, url->hostlen);
+		}
+
+		if (url->surbllen > 0) {
+			rspamd_msgpack_write_string (out, "surbl");
+			rspamd_msgpack_write_lstring (out, url->surbl, url->surbllen);
+		}
+
+		rspamd_msgpack_write_string (out, "phished");
+		rspamd_msgpack_write_bool (out, url->is_phished);
+	}
+
+	rspamd_protocol_log_url (cb->task, url);
+
+	return FALSE;
+}
+
+static gboolean
+emails_protocol_msgpack_cb (gpointer key, gpointer value, gpointer ud)
+{
+	struct tree_cb_data *cb = ud;
+	struct uri *url = value;
+
+	rspamd_msgpack_write_lstring (cb->out, url->user,
+		url->userlen + url->hostlen + 1);
+
+	return FALSE;
+}
+
+static void
+rspamd_protocol_msgpack_output (struct rspamd_task *task, GString *logbuf,
+	GString *out)
+{
+	struct metric_result *metric_res;
+	struct tree_cb_data cb;
+	GHashTableIter hiter;
+	gpointer h, v;
+	guint nurls, nemails;
+
+	nurls = g_tree_nnodes (task->urls);
+	nemails = g_tree_nnodes (task->emails);
+
+	rspamd_msgpack_write_map (out, g_hash_table_size (task->results) +
+		(task->messages != NULL ? 1 : 0) +
+		(nurls > 0 ? 1 : 0) +
+		(nemails > 0 ? 1 : 0) + 1);
+
+	g_hash_table_iter_init (&hiter, task->results);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		metric_res = (struct metric_result *)v;
+		rspamd_msgpack_write_string (out, h);
+		rspamd_metric_result_msgpack (task, metric_res, logbuf, out);
+	}
+
+	if (task->messages != NULL) {
+		rspamd_msgpack_write_string (out, "messages");
+		rspamd_str_list_msgpack (task->messages, out);
+	}
+
+	cb.task = task;
+	cb.top = NULL;
+	cb.out = out;
+
+	if (nurls > 0) {
+		rspamd_msgpack_write_string (out, "urls");
+		rspamd_msgpack_write_array (out, nurls);
+		g_tree_foreach (task->urls, urls_protocol_msgpack_cb, &cb);
+	}
+	if (nemails > 0) {
+		rspamd_msgpack_write_string (out, "emails");
+		rspamd_msgpack_write_array (out, nemails);
+		g_tree_foreach (task->emails, emails_protocol_msgpack_cb, &cb);
+	}
+
+	rspamd_msgpack_write_string (out, "message-id");
+	rspamd_msgpack_write_string (out, task->message_id);
 }
 
 static void
@@ -840,31 +1085,49 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		rspamd_http_message_add_header (msg, hn->str, hv->str);
 	}
 
-	g_hash_table_iter_init (&hiter, task->results);
-
-	top = ucl_object_typed_new (UCL_OBJECT);
-	/* Convert results to an ucl object */
-	while (g_hash_table_iter_next (&hiter, &h, &v)) {
-		metric_res = (struct metric_result *)v;
-		obj = rspamd_metric_result_ucl (task, metric_res, logbuf);
-		ucl_object_insert_key (top, obj, h, 0, false);
+	if (task->is_msgpack && msg->method < HTTP_SYMBOLS) {
+		/* Guess the size of reply to avoid reallocations */
+		msg->body = g_string_sized_new (BUFSIZ +
+			g_tree_nnodes (task->urls) * 64);
+		rspamd_protocol_msgpack_output (task, logbuf, msg->body);
 	}
+	else {
+		g_hash_table_iter_init (&hiter, task->results);
 
-	if (task->messages != NULL) {
-		ucl_object_insert_key (top, rspamd_str_list_ucl (
-				task->messages), "messages", 0, false);
-	}
-	if (g_tree_nnodes (task->urls) > 0) {
-		ucl_object_insert_key (top, rspamd_urls_tree_ucl (task->urls,
-			task), "urls", 0, false);
-	}
-	if (g_tree_nnodes (task->emails) > 0) {
-		ucl_object_insert_key (top, rspamd_emails_tree_ucl (task->emails, task),
-			"emails", 0, false);
-	}
+		top = ucl_object_typed_new (UCL_OBJECT);
+		/* Convert results to an ucl object */
+		while (g_hash_table_iter_next (&hiter, &h, &v)) {
+			metric_res = (struct metric_result *)v;
+			obj = rspamd_metric_result_ucl (task, metric_res, logbuf);
+			ucl_object_insert_key (top, obj, h, 0, false);
+		}
+
+		if (task->messages != NULL) {
+			ucl_object_insert_key (top, rspamd_str_list_ucl (
+					task->messages), "messages", 0, false);
+		}
+		if (g_tree_nnodes (task->urls) > 0) {
+			ucl_object_insert_key (top, rspamd_urls_tree_ucl (task->urls,
+				task), "urls", 0, false);
+		}
+		if (g_tree_nnodes (task->emails) > 0) {
+			ucl_object_insert_key (top, rspamd_emails_tree_ucl (task->emails,
+				task), "emails", 0, false);
+		}
+
+		ucl_object_insert_key (top, ucl_object_fromstring (task->message_id),
+			"message-id", 0, false);
 
-	ucl_object_insert_key (top, ucl_object_fromstring (task->message_id),
-		"message-id", 0, false);
+		msg->body = g_string_sized_new (BUFSIZ);
+
+		if (msg->method < HTTP_SYMBOLS) {
+			rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, msg->body);
+		}
+		else {
+			rspamd_ucl_tolegacy_output (task, top, msg->body);
+		}
+		ucl_object_unref (top);
+	}
 
 	write_hashes_to_log (task, logbuf);
 	if (!task->no_log) {
@@ -872,16 +1135,6 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 	g_string_free (logbuf, TRUE);
 
-	msg->body = g_string_sized_new (BUFSIZ);
-
-	if (msg->method < HTTP_SYMBOLS) {
-		rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, msg->body);
-	}
-	else {
-		rspamd_ucl_tolegacy_output (task, top, msg->body);
-	}
-	ucl_object_unref (top);
-
 	/* Update stat for default metric */
 	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 	if (metric_res != NULL) {
@@ -933,11 +1186,15 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		case CMD_PROCESS:
 		case CMD_SKIP:
 			rspamd_protocol_http_reply (msg, task);
+			if (task->is_msgpack && msg->method < HTTP_SYMBOLS) {
+				ctype = RSPAMD_MSGPACK_CTYPE;
+			}
 			break;
 		case CMD_PING:
 			msg->body = g_string_new ("pong" CRLF);
 			ctype = "text/plain";
 			break;
+		case CMD_BATCH:
 		case CMD_OTHER:
 			msg_err ("BROKEN");
 			break;
@@ -18,6 +18,9 @@
 #define RSPAMD_LENGTH_ERROR RSPAMD_BASE_ERROR + 4
 #define RSPAMD_STATFILE_ERROR RSPAMD_BASE_ERROR + 5
 
+/* Content type of streamed batch replies */
+#define RSPAMD_BATCH_CTYPE "application/x-rspamd-batch"
+
 struct metric;
 
 /**
@@ -22,50 +22,192 @@
  */
 
 
-
 #include "config.h"
 #include "main.h"
 #include "roll_history.h"
 
+#define HISTORY_MAGIC "rsphist"
+#define HISTORY_VERSION 2
+#define HISTORY_ALIGN(len) (((len) + 63) & ~63)
+
+/*
+ * Shard is owned by a single worker. Rows are protected by sequence counters:
+ * the writer makes counter odd while updating a row and readers skip rows
+ * which counters are odd or have changed during copying. Symbols are stored
+ * in a ring of bytes: the writer reserves space before overwriting old data,
+ * so readers can check whether symbols of a row are still intact.
+ */
+struct roll_history_shard {
+	gint used;
+	guint nrows;
+	gsize strings_size;
+	guint64 cur_row;             /* number of rows written					*/
+	guint64 strings_pos;         /* number of bytes reserved in ring		*/
+};
+
+struct roll_history_file_header {
+	gchar magic[8];
+	guint32 version;
+	guint32 row_size;
+	guint32 nrows;
+	guint32 reserved;
+};
+
+/* Copy of row with its symbols used for merging shards */
+struct roll_history_elt {
+	struct roll_history_row row;
+	gchar *symbols;
+};
+
+static inline struct roll_history_shard *
+rspamd_roll_history_shard (struct roll_history *history, guint idx)
+{
+	return (struct roll_history_shard *)(history->shards +
+		idx * history->shard_size);
+}
+
+static inline struct roll_history_row *
+rspamd_roll_history_row (struct roll_history_shard *shard, guint64 idx)
+{
+	struct roll_history_row *rows;
+
+	rows = (struct roll_history_row *)((guchar *)shard +
+		HISTORY_ALIGN (sizeof (*shard)));
+
+	return &rows[idx % shard->nrows];
+}
+
+static inline guchar *
+rspamd_roll_history_strings (struct roll_history_shard *shard)
+{
+	return (guchar *)rspamd_roll_history_row (shard, 0) +
+		shard->nrows * sizeof (struct roll_history_row);
+}
 
 /**
- * Returns new roll history
- * @param pool pool for shared memory
+ * Returns new roll history placed in shared memory
+ * @param nshards number of shards
+ * @param nrows number of rows in each shard
  * @return new structure
  */
 struct roll_history *
-rspamd_roll_history_new (rspamd_mempool_t *pool)
+rspamd_roll_history_new (guint nshards, guint nrows)
 {
 	struct roll_history *new;
+	struct roll_history_shard *shard;
+	gpointer map;
+	gsize size, shard_size, strings_size;
+	guint i;
 
-	if (pool == NULL) {
+	if (nshards == 0 || nrows == 0) {
 		return NULL;
 	}
 
-	new = rspamd_mempool_alloc0_shared (pool, sizeof (struct roll_history));
-	new->pool = pool;
-	new->mtx = rspamd_mempool_get_mutex (pool);
+	strings_size = (gsize)nrows * HISTORY_SYMBOLS_PER_ROW;
+	shard_size = HISTORY_ALIGN (HISTORY_ALIGN (sizeof (*shard)) +
+			(gsize)nrows * sizeof (struct roll_history_row) + strings_size);
+	size = shard_size * nshards;
+	/* Pages are zero filled and allocated when they are touched */
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for history: %s", size,
+			strerror (errno));
+		return NULL;
+	}
+
+	new = g_slice_alloc0 (sizeof (*new));
+	new->nshards = nshards;
+	new->nrows = nrows;
+	new->strings_size = strings_size;
+	new->shard_size = shard_size;
+	new->shards = map;
+
+	for (i = 0; i < nshards; i++) {
+		shard = rspamd_roll_history_shard (new, i);
+		shard->nrows = nrows;
+		shard->strings_size = strings_size;
+	}
 
 	return new;
 }
 
-struct history_metric_callback_data {
-	gchar *pos;
-	gint remain;
-};
+struct roll_history_shard *
+rspamd_roll_history_acquire (struct roll_history *history)
+{
+	struct roll_history_shard *shard;
+	guint i;
+
+	if (history == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < history->nshards; i++) {
+		shard = rspamd_roll_history_shard (history, i);
+
+		if (g_atomic_int_compare_and_exchange (&shard->used, 0, 1)) {
+			return shard;
+		}
+	}
+
+	msg_warn ("no free history shards, history of worker is not written");
+
+	return NULL;
+}
+
+void
+rspamd_roll_history_release (struct roll_history_shard *shard)
+{
+	if (shard != NULL) {
+		g_atomic_int_set (&shard->used, 0);
+	}
+}
+
+/*
+ * Write row to shard, the only writer of a shard is its owner
+ */
+static void
+rspamd_roll_history_write_row (struct roll_history_shard *shard,
+	const struct roll_history_row *src, const gchar *symbols, gsize len)
+{
+	struct roll_history_row *row;
+	guchar *strings;
+	guint64 pos;
+	gsize off, part, start;
+
+	row = rspamd_roll_history_row (shard, shard->cur_row);
+	strings = rspamd_roll_history_strings (shard);
+	/* A single row must not wipe symbols of all other rows */
+	len = MIN (len, shard->strings_size / 4);
+
+	/* Sequence counter stays odd until the row is written completely */
+	__sync_fetch_and_add (&row->seq, 1);
+	start = G_STRUCT_OFFSET (struct roll_history_row, tv);
+	memcpy ((guchar *)row + start, (const guchar *)src + start,
+		sizeof (*row) - start);
+
+	/* Reserve space before overwriting symbols of old rows */
+	pos = __sync_fetch_and_add (&shard->strings_pos, len);
+	off = pos % shard->strings_size;
+	part = MIN (len, shard->strings_size - off);
+	memcpy (strings + off, symbols, part);
+	memcpy (strings, symbols + part, len - part);
+	row->symbols_pos = pos;
+	row->symbols_len = len;
+	row->completed = TRUE;
+
+	__sync_fetch_and_add (&row->seq, 1);
+	__sync_fetch_and_add (&shard->cur_row, 1);
+}
 
 static void
 roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
 {
-	struct history_metric_callback_data *cb = user_data;
+	GString *buf = user_data;
 	struct symbol *s = value;
-	guint wr;
 
-	if (cb->remain > 0) {
-		wr = rspamd_snprintf (cb->pos, cb->remain, "%s, ", s->name);
-		cb->pos += wr;
-		cb->remain -= wr;
-	}
+	rspamd_printf_gstring (buf, "%s, ", s->name);
 }
 
 /**
@@ -77,77 +219,154 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	gint row_num;
-	struct roll_history_row *row;
+	struct roll_history_shard *shard;
+	struct roll_history_row row;
 	struct metric_result *metric_res;
-	struct history_metric_callback_data cbdata;
-
-	if (history->need_lock) {
-		/* Some process is getting history, so wait on a mutex */
-		rspamd_mempool_lock_mutex (history->mtx);
-		history->need_lock = FALSE;
-		rspamd_mempool_unlock_mutex (history->mtx);
-	}
-
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, HISTORY_MAX_ROWS, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
-#endif
+	GString *symbols;
 
-	if (row_num < HISTORY_MAX_ROWS) {
-		row = &history->rows[row_num];
-		row->completed = FALSE;
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
+	if (history == NULL || task->worker == NULL ||
+		(shard = task->worker->history) == NULL) {
 		return;
 	}
 
+	memset (&row, 0, sizeof (row));
+	symbols = g_string_sized_new (HISTORY_SYMBOLS_PER_ROW);
+
 	/* Add information from task to roll history */
-	memcpy (&row->from_addr, &task->from_addr, sizeof (row->from_addr));
-	memcpy (&row->tv,		 &task->tv,		   sizeof (row->tv));
+	memcpy (&row.from_addr, &task->from_addr, sizeof (row.from_addr));
+	memcpy (&row.tv, &task->tv, sizeof (row.tv));
+	memcpy (row.phases, task->phases, sizeof (row.phases));
 
 	/* Strings */
-	rspamd_strlcpy (row->message_id, task->message_id,
-		sizeof (row->message_id));
+	rspamd_strlcpy (row.message_id, task->message_id,
+		sizeof (row.message_id));
 	if (task->user) {
-		rspamd_strlcpy (row->user, task->user, sizeof (row->message_id));
-	}
-	else {
-		row->user[0] = '\0';
+		rspamd_strlcpy (row.user, task->user, sizeof (row.user));
 	}
 
 	/* Get default metric */
 	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
-		row->action = METRIC_ACTION_NOACTION;
+		row.action = METRIC_ACTION_NOACTION;
 	}
 	else {
-		row->score = metric_res->score;
-		row->action = rspamd_check_action_metric (task, metric_res->score,
-				&row->required_score,
+		row.score = metric_res->score;
+		row.action = rspamd_check_action_metric (task, metric_res->score,
+				&row.required_score,
 				metric_res->metric);
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof (row->symbols);
 		g_hash_table_foreach (metric_res->symbols,
 			roll_history_symbols_callback,
-			&cbdata);
-		if (cbdata.remain > 0) {
+			symbols);
+		if (symbols->len > 0) {
 			/* Remove last whitespace and comma */
-			*cbdata.pos-- = '\0';
-			*cbdata.pos-- = '\0';
-			*cbdata.pos = '\0';
+			g_string_truncate (symbols, symbols->len - 2);
 		}
 	}
 
-	row->scan_time = task->scan_milliseconds;
-	row->len = (task->msg == NULL ? 0 : task->msg->len);
-	row->completed = TRUE;
+	row.scan_time = task->scan_milliseconds;
+	row.len = (task->msg == NULL ? 0 : task->msg->len);
+
+	rspamd_roll_history_write_row (shard, &row, symbols->str, symbols->len);
+	g_string_free (symbols, TRUE);
+}
+
+/*
+ * Copy completed rows of shard skipping rows that are modified concurrently
+ */
+static void
+rspamd_roll_history_copy_shard (struct roll_history_shard *shard,
+	GArray *res)
+{
+	struct roll_history_row *row;
+	struct roll_history_elt elt;
+	guchar *strings;
+	guint64 cur, i, end;
+	gsize off, part;
+	guint seq;
+
+	strings = rspamd_roll_history_strings (shard);
+	cur = shard->cur_row;
+	__sync_synchronize ();
+	i = cur > shard->nrows ? cur - shard->nrows : 0;
+
+	for (; i < cur; i++) {
+		row = rspamd_roll_history_row (shard, i);
+		seq = g_atomic_int_get (&row->seq);
+
+		if (seq & 1) {
+			continue;
+		}
+
+		memcpy (&elt.row, row, sizeof (elt.row));
+		__sync_synchronize ();
+
+		if (g_atomic_int_get (&row->seq) != seq || !elt.row.completed ||
+			elt.row.symbols_len > shard->strings_size) {
+			continue;
+		}
+
+		elt.symbols = g_malloc (elt.row.symbols_len + 1);
+		off = elt.row.symbols_pos % shard->strings_size;
+		part = MIN (elt.row.symbols_len, shard->strings_size - off);
+		memcpy (elt.symbols, strings + off, part);
+		memcpy (elt.symbols + part, strings, elt.row.symbols_len - part);
+		elt.symbols[elt.row.symbols_len] = '\0';
+		__sync_synchronize ();
+		end = shard->strings_pos;
+
+		if (end > elt.row.symbols_pos + shard->strings_size) {
+			/* Symbols have been overwritten by newer rows */
+			g_free (elt.symbols);
+			continue;
+		}
+
+		g_array_append_val (res, elt);
+	}
+}
+
+static gint
+rspamd_roll_history_elt_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct roll_history_elt *e1 = a, *e2 = b;
+
+	if (e1->row.tv.tv_sec != e2->row.tv.tv_sec) {
+		return e1->row.tv.tv_sec < e2->row.tv.tv_sec ? -1 : 1;
+	}
+	if (e1->row.tv.tv_usec != e2->row.tv.tv_usec) {
+		return e1->row.tv.tv_usec < e2->row.tv.tv_usec ? -1 : 1;
+	}
+
+	return 0;
+}
+
+void
+rspamd_roll_history_foreach (struct roll_history *history,
+	roll_history_row_cb cb, gpointer ud)
+{
+	struct roll_history_elt *elt;
+	GArray *res;
+	guint i;
+
+	if (history == NULL) {
+		return;
+	}
+
+	res = g_array_new (FALSE, FALSE, sizeof (struct roll_history_elt));
+
+	for (i = 0; i < history->nshards; i++) {
+		rspamd_roll_history_copy_shard (rspamd_roll_history_shard (history, i),
+			res);
+	}
+
+	g_array_sort (res, rspamd_roll_history_elt_cmp);
+
+	for (i = 0; i < res->len; i++) {
+		elt = &g_array_index (res, struct roll_history_elt, i);
+		cb (&elt->row, elt->symbols, ud);
+		g_free (elt->symbols);
+	}
+
+	g_array_free (res, TRUE);
 }
 
 /**
@@ -159,17 +378,14 @@ rspamd_roll_history_update (struct roll_history *history,
 gboolean
 rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 {
+	struct roll_history_file_header hdr;
+	struct roll_history_row row;
+	struct roll_history_shard *shard;
+	gchar *symbols;
 	gint fd;
-	struct stat st;
+	guint i;
 
-	if (stat (filename, &st) == -1) {
-		msg_info ("cannot load history from %s: %s", filename,
-			strerror (errno));
-		return FALSE;
-	}
-
-	if (st.st_size != sizeof (history->rows)) {
-		msg_info ("cannot load history from %s: size mismatch", filename);
+	if (history == NULL) {
 		return FALSE;
 	}
 
@@ -179,18 +395,73 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 		return FALSE;
 	}
 
-	if (read (fd, history->rows, sizeof (history->rows)) == -1) {
+	if (read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+		memcmp (hdr.magic, HISTORY_MAGIC, sizeof (HISTORY_MAGIC)) != 0 ||
+		hdr.version != HISTORY_VERSION || hdr.row_size != sizeof (row)) {
 		close (fd);
-		msg_info ("cannot read history from %s: %s", filename,
-			strerror (errno));
+		msg_info ("cannot load history from %s: invalid format", filename);
 		return FALSE;
 	}
 
+	/* Saved rows are placed to the first shard before workers are started */
+	shard = rspamd_roll_history_shard (history, 0);
+
+	for (i = 0; i < hdr.nrows; i++) {
+		if (read (fd, &row, sizeof (row)) != sizeof (row) ||
+			row.symbols_len > shard->strings_size) {
+			break;
+		}
+
+		symbols = g_malloc (row.symbols_len + 1);
+
+		if (read (fd, symbols, row.symbols_len) != (gssize)row.symbols_len) {
+			g_free (symbols);
+			break;
+		}
+
+		rspamd_roll_history_write_row (shard, &row, symbols, row.symbols_len);
+		g_free (symbols);
+	}
+
 	close (fd);
 
+	if (i < hdr.nrows) {
+		msg_info ("cannot read history from %s: file is truncated", filename);
+	}
+
 	return TRUE;
 }
 
+struct roll_history_save_cbdata {
+	gint fd;
+	guint nrows;
+	gboolean error;
+};
+
+static void
+rspamd_roll_history_save_row (const struct roll_history_row *row,
+	const gchar *symbols, gpointer ud)
+{
+	struct roll_history_save_cbdata *cbdata = ud;
+	struct iovec iov[2];
+
+	if (cbdata->error) {
+		return;
+	}
+
+	iov[0].iov_base = (void *)row;
+	iov[0].iov_len = sizeof (*row);
+	iov[1].iov_base = (void *)symbols;
+	iov[1].iov_len = row->symbols_len;
+
+	if (writev (cbdata->fd, iov, G_N_ELEMENTS (iov)) == -1) {
+		cbdata->error = TRUE;
+	}
+	else {
+		cbdata->nrows++;
+	}
+}
+
 /**
  * Save history to file
  * @param history roll history object
@@ -200,20 +471,46 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 gboolean
 rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 {
-	gint fd;
+	struct roll_history_file_header hdr;
+	struct roll_history_save_cbdata cbdata;
 
-	if ((fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 00600)) == -1) {
+	if (history == NULL) {
+		return FALSE;
+	}
+
+	if ((cbdata.fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 00600)) == -1) {
 		msg_info ("cannot save history to %s: %s", filename, strerror (errno));
 		return FALSE;
 	}
 
-	if (write (fd, history->rows, sizeof (history->rows)) == -1) {
-		close (fd);
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, HISTORY_MAGIC, sizeof (HISTORY_MAGIC));
+	hdr.version = HISTORY_VERSION;
+	hdr.row_size = sizeof (struct roll_history_row);
+	cbdata.nrows = 0;
+	cbdata.error = FALSE;
+
+	/* Number of rows is written when all rows are saved */
+	if (write (cbdata.fd, &hdr, sizeof (hdr)) == -1) {
+		cbdata.error = TRUE;
+	}
+	else {
+		rspamd_roll_history_foreach (history, rspamd_roll_history_save_row,
+			&cbdata);
+		hdr.nrows = cbdata.nrows;
+
+		if (!cbdata.error && pwrite (cbdata.fd, &hdr, sizeof (hdr), 0) == -1) {
+			cbdata.error = TRUE;
+		}
+	}
+
+	if (cbdata.error) {
+		close (cbdata.fd);
 		msg_info ("cannot write history to %s: %s", filename, strerror (errno));
 		return FALSE;
 	}
 
-	close (fd);
+	close (cbdata.fd);
 
 	return TRUE;
 }
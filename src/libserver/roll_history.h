@@ -27,47 +27,78 @@
 
 #include "config.h"
 #include "mem_pool.h"
+#include "tasklog.h"
 
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
- * and displaying them in webui
+ * and displaying them in webui. Each worker writes to its own shard, so writers never contend, and readers
+ * merge all shards.
  */
 
 #define HISTORY_MAX_ID 100
-#define HISTORY_MAX_SYMBOLS 200
 #define HISTORY_MAX_USER 20
-#define HISTORY_MAX_ROWS 200
+#define HISTORY_DEFAULT_ROWS 1024
+/* Space reserved for symbols of a row in average */
+#define HISTORY_SYMBOLS_PER_ROW 256
 
 struct rspamd_task;
 
 struct roll_history_row {
+	guint seq;                   /**< odd while the row is being written	*/
 	struct timeval tv;
 	gchar message_id[HISTORY_MAX_ID];
-	gchar symbols[HISTORY_MAX_SYMBOLS];
 	gchar user[HISTORY_MAX_USER];
 	rspamd_inet_addr_t from_addr;
 	gsize len;
 	guint scan_time;
+	guint32 phases[RSPAMD_TASKLOG_PHASE_MAX]; /**< usec since start of task	*/
 	gint action;
 	gdouble score;
 	gdouble required_score;
+	guint64 symbols_pos;         /**< offset of symbols in the shard's ring	*/
+	guint32 symbols_len;
 	guint8 completed;
 };
 
+struct roll_history_shard;
+
 struct roll_history {
-	struct roll_history_row rows[HISTORY_MAX_ROWS];
-	gint cur_row;
-	rspamd_mempool_t *pool;
-	gboolean need_lock;
-	rspamd_mempool_mutex_t *mtx;
+	guint nshards;
+	guint nrows;                 /**< rows per shard							*/
+	gsize strings_size;          /**< size of symbols ring of a shard		*/
+	gsize shard_size;
+	guchar *shards;
 };
 
 /**
- * Returns new roll history
- * @param pool pool for shared memory
+ * Callback for rows of history
+ * @param row copy of row
+ * @param symbols symbols of row, `symbols_len` bytes terminated by zero
+ * @param ud user data
+ */
+typedef void (*roll_history_row_cb)(const struct roll_history_row *row,
+	const gchar *symbols, gpointer ud);
+
+/**
+ * Returns new roll history placed in shared memory
+ * @param nshards number of shards
+ * @param nrows number of rows in each shard
  * @return new structure
  */
-struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool);
+struct roll_history * rspamd_roll_history_new (guint nshards, guint nrows);
+
+/**
+ * Acquire free shard for a worker, must be called by the main process
+ * @param history roll history object
+ * @return shard or NULL if all shards are used
+ */
+struct roll_history_shard * rspamd_roll_history_acquire (
+	struct roll_history *history);
+
+/**
+ * Return shard when its worker is terminated, rows of shard are preserved
+ */
+void rspamd_roll_history_release (struct roll_history_shard *shard);
 
 /**
  * Update roll history with data from task
@@ -77,6 +108,15 @@ struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool);
 void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
+/**
+ * Call function for all completed rows of all shards ordered by time
+ * @param history roll history object
+ * @param cb callback
+ * @param ud user data
+ */
+void rspamd_roll_history_foreach (struct roll_history *history,
+	roll_history_row_cb cb, gpointer ud);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
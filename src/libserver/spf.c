@@ -663,7 +663,7 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
 	else if (reply->code == RDNS_RC_NXDOMAIN) {
 		switch (cb->cur_action) {
 		case SPF_RESOLVE_MX:
-			if (rdns_request_has_type (reply->request, RDNS_REQUEST_MX)) {
+			if (rspamd_dns_reply_has_type (reply, RDNS_REQUEST_MX)) {
 				msg_info (
 					"<%s>: spf error for domain %s: cannot find MX record for %s",
 					task->message_id,
@@ -683,14 +683,14 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
 			}
 			break;
 		case SPF_RESOLVE_A:
-			if (rdns_request_has_type (reply->request, RDNS_REQUEST_A)) {
+			if (rspamd_dns_reply_has_type (reply, RDNS_REQUEST_A)) {
 				cb->addr->data.normal.d.in4.s_addr = INADDR_NONE;
 				cb->addr->data.normal.mask = 32;
 			}
 			break;
 #ifdef HAVE_INET_PTON
 		case SPF_RESOLVE_AAA:
-			if (rdns_request_has_type (reply->request, RDNS_REQUEST_AAAA)) {
+			if (rspamd_dns_reply_has_type (reply, RDNS_REQUEST_AAAA)) {
 				memset (&cb->addr->data.normal.d.in6, 0xff,
 					sizeof (struct in6_addr));
 				cb->addr->data.normal.mask = 32;
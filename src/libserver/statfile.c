@@ -628,6 +628,7 @@ statfile_pool_get_block (statfile_pool_t * pool,
 		return 0;
 	}
 
+	rspamd_metrics_inc (RSPAMD_METRIC_STATFILE_LOOKUPS, 1);
 	blocknum = h1 % file->cur_section.length;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
 		sizeof (struct stat_file_block);
@@ -638,6 +639,7 @@ statfile_pool_get_block (statfile_pool_t * pool,
 			break;
 		}
 		if (block->hash1 == h1 && block->hash2 == h2) {
+			rspamd_metrics_inc (RSPAMD_METRIC_STATFILE_HITS, 1);
 			return block->value;
 		}
 		c += sizeof (struct stat_file_block);
@@ -28,6 +28,7 @@
 #include "message.h"
 #include "symbols_cache.h"
 #include "cfg_file.h"
+#include "tasklog.h"
 
 #define WEIGHT_MULT 4.0
 #define FREQUENCY_MULT 10.0
@@ -334,6 +335,8 @@ register_symbol_common (struct symbols_cache **cache,
 			sizeof (struct saved_cache_item));
 	item->cd = rspamd_mempool_alloc0_shared (pcache->static_pool,
 			sizeof (struct counter_data));
+	item->latency = rspamd_mempool_alloc0_shared (pcache->static_pool,
+			sizeof (struct rspamd_symbol_latency));
 
 	item->mtx = rspamd_mempool_get_mutex (pcache->static_pool);
 
@@ -784,17 +787,104 @@ struct symbol_callback_data {
 	GList *list_pointer;
 };
 
-gboolean
-call_symbol_callback (struct rspamd_task * task,
-	struct symbols_cache * cache,
-	gpointer *save)
+/* Symbol call waiting for its async events */
+struct rspamd_symbol_watch {
+	struct cache_item *item;
+	guint64 start;
+};
+
+static void
+rspamd_symbols_cache_add_wall (struct rspamd_symbol_watch *sw)
+{
+	guint64 diff;
+
+	diff = rspamd_metrics_timestamp () - sw->start;
+	rspamd_histogram_add (&sw->item->latency->wall, MIN (diff, G_MAXUINT32));
+}
+
+static void
+rspamd_symbols_cache_watcher_cb (gpointer session_data, gpointer ud)
+{
+	/* All async events of symbol are finished */
+	rspamd_symbols_cache_add_wall (ud);
+}
+
+static void
+rspamd_symbols_cache_call_item (struct rspamd_task *task,
+	struct cache_item *item)
 {
 #ifdef HAVE_CLOCK_GETTIME
 	struct timespec ts1, ts2;
 #else
 	struct timeval tv1, tv2;
 #endif
+	struct rspamd_symbol_watch *sw;
 	guint64 diff;
+
+	sw = rspamd_mempool_alloc (task->task_pool, sizeof (*sw));
+	sw->item = item;
+	sw->start = rspamd_metrics_timestamp ();
+	rspamd_session_watch_start (task->s, rspamd_symbols_cache_watcher_cb, sw);
+
+#ifdef HAVE_CLOCK_GETTIME
+# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts1);
+# elif defined(HAVE_CLOCK_VIRTUAL)
+	clock_gettime (CLOCK_VIRTUAL,			 &ts1);
+# else
+	clock_gettime (CLOCK_REALTIME,			 &ts1);
+# endif
+#else
+	if (gettimeofday (&tv1, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
+#endif
+	if (G_UNLIKELY (check_debug_symbol (task->cfg, item->s->symbol))) {
+		rspamd_log_debug (rspamd_main->logger);
+		item->func (task, item->user_data);
+		rspamd_log_nodebug (rspamd_main->logger);
+	}
+	else {
+		item->func (task, item->user_data);
+	}
+
+	if (rspamd_session_watch_stop (task->s) == 0) {
+		/* Symbol has not started any async events */
+		rspamd_symbols_cache_add_wall (sw);
+	}
+
+#ifdef HAVE_CLOCK_GETTIME
+# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts2);
+# elif defined(HAVE_CLOCK_VIRTUAL)
+	clock_gettime (CLOCK_VIRTUAL,			 &ts2);
+# else
+	clock_gettime (CLOCK_REALTIME,			 &ts2);
+# endif
+#else
+	if (gettimeofday (&tv2, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
+#endif
+
+#ifdef HAVE_CLOCK_GETTIME
+	diff =
+		(ts2.tv_sec -
+		ts1.tv_sec) * 1000000 + (ts2.tv_nsec - ts1.tv_nsec) / 1000;
+#else
+	diff =
+		(tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+#endif
+	item->s->avg_time = rspamd_set_counter (item, diff);
+	rspamd_histogram_add (&item->latency->cpu, MIN (diff, G_MAXUINT32));
+	rspamd_tasklog_symbol (task, item->s->symbol, diff);
+}
+
+gboolean
+call_symbol_callback (struct rspamd_task * task,
+	struct symbols_cache * cache,
+	gpointer *save)
+{
 	struct cache_item *item = NULL;
 	struct symbol_callback_data *s = *save;
 
@@ -867,57 +957,75 @@ call_symbol_callback (struct rspamd_task * task,
 	if (!item) {
 		return FALSE;
 	}
-	if (!item->is_virtual && !item->is_skipped) {
-#ifdef HAVE_CLOCK_GETTIME
-# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts1);
-# elif defined(HAVE_CLOCK_VIRTUAL)
-		clock_gettime (CLOCK_VIRTUAL,			 &ts1);
-# else
-		clock_gettime (CLOCK_REALTIME,			 &ts1);
-# endif
-#else
-		if (gettimeofday (&tv1, NULL) == -1) {
-			msg_warn ("gettimeofday failed: %s", strerror (errno));
-		}
-#endif
-		if (G_UNLIKELY (check_debug_symbol (task->cfg, item->s->symbol))) {
-			rspamd_log_debug (rspamd_main->logger);
-			item->func (task, item->user_data);
-			rspamd_log_nodebug (rspamd_main->logger);
-		}
-		else {
-			item->func (task, item->user_data);
-		}
+	if (!item->is_virtual && !item->is_skipped &&
+		!(item->is_header && task->headers_processed)) {
+		rspamd_symbols_cache_call_item (task, item);
+	}
 
+	s->saved_item = item;
 
-#ifdef HAVE_CLOCK_GETTIME
-# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts2);
-# elif defined(HAVE_CLOCK_VIRTUAL)
-		clock_gettime (CLOCK_VIRTUAL,			 &ts2);
-# else
-		clock_gettime (CLOCK_REALTIME,			 &ts2);
-# endif
-#else
-		if (gettimeofday (&tv2, NULL) == -1) {
-			msg_warn ("gettimeofday failed: %s", strerror (errno));
-		}
-#endif
+	return TRUE;
 
-#ifdef HAVE_CLOCK_GETTIME
-		diff =
-			(ts2.tv_sec -
-			ts1.tv_sec) * 1000000 + (ts2.tv_nsec - ts1.tv_nsec) / 1000;
-#else
-		diff =
-			(tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
-#endif
-		item->s->avg_time = rspamd_set_counter (item, diff);
+}
+
+gboolean
+set_header_symbol (struct symbols_cache *cache, const gchar *name)
+{
+	struct cache_item *item;
+
+	if (cache == NULL) {
+		return FALSE;
 	}
 
-	s->saved_item = item;
+	item = g_hash_table_lookup (cache->items_by_symbol, name);
+	if (item == NULL) {
+		msg_warn ("cannot find symbol %s to mark it as header only", name);
+		return FALSE;
+	}
+
+	item->is_header = TRUE;
 
 	return TRUE;
+}
+
+gboolean
+is_symbol_enabled (struct symbols_cache *cache, const gchar *name)
+{
+	struct cache_item *item;
 
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	item = g_hash_table_lookup (cache->items_by_symbol, name);
+
+	return item != NULL && !item->is_skipped;
+}
+
+void
+call_header_symbols_callbacks (struct rspamd_task *task,
+	struct symbols_cache *cache)
+{
+	GList *cur;
+	struct cache_item *item;
+	GList *lists[2];
+	guint i;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	lists[0] = cache->negative_items;
+	lists[1] = cache->static_items;
+
+	for (i = 0; i < G_N_ELEMENTS (lists); i++) {
+		cur = lists[i];
+		while (cur) {
+			item = cur->data;
+			if (item->is_header && !item->is_virtual && !item->is_skipped) {
+				rspamd_symbols_cache_call_item (task, item);
+			}
+			cur = g_list_next (cur);
+		}
+	}
 }
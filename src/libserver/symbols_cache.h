@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "radix.h"
+#include "histogram.h"
 
 #define MAX_SYMBOL 128
 
@@ -29,10 +30,21 @@ struct counter_data {
 	gint number;
 };
 
+/*
+ * Latencies of symbol in microseconds, they are stored in shared memory and
+ * updated by all workers. Wall time includes waiting for async events
+ * (e.g. DNS requests) started by symbol.
+ */
+struct rspamd_symbol_latency {
+	struct rspamd_histogram cpu;
+	struct rspamd_histogram wall;
+};
+
 struct cache_item {
 	/* Static item's data */
 	struct saved_cache_item *s;
 	struct counter_data *cd;
+	struct rspamd_symbol_latency *latency;
 
 	rspamd_mempool_mutex_t *mtx;
 
@@ -50,6 +62,8 @@ struct cache_item {
 	/* Flags of virtual symbols */
 	gboolean is_virtual;
 	gboolean is_callback;
+	/* Symbol depends on message headers only */
+	gboolean is_header;
 
 	/* Priority */
 	gint priority;
@@ -179,6 +193,32 @@ gboolean call_symbol_callback (struct rspamd_task *task,
 	struct symbols_cache *cache,
 	gpointer *save);
 
+/**
+ * Mark symbol as depending on message headers only, so it could be checked
+ * before the message's body is received (streaming mode)
+ * @param cache symbols cache
+ * @param name name of symbol
+ * @return TRUE if symbol has been found in the cache
+ */
+gboolean set_header_symbol (struct symbols_cache *cache, const gchar *name);
+
+/**
+ * Check whether symbol's callback is called for tasks, symbols that are not
+ * registered in any metric are skipped
+ * @param cache symbols cache
+ * @param name name of symbol
+ * @return TRUE if symbol is registered in the cache and is not skipped
+ */
+gboolean is_symbol_enabled (struct symbols_cache *cache, const gchar *name);
+
+/**
+ * Call all symbols that depend on message headers only
+ * @param task task object
+ * @param cache symbols cache
+ */
+void call_header_symbols_callbacks (struct rspamd_task *task,
+	struct symbols_cache *cache);
+
 /**
  * Remove all dynamic rules from cache
  * @param cache symbols cache
@@ -26,6 +26,7 @@
 #include "filter.h"
 #include "protocol.h"
 #include "message.h"
+#include "tasklog.h"
 #include "lua/lua_common.h"
 
 static void
@@ -36,6 +37,15 @@ gstring_destruct (gpointer ptr)
 	g_string_free (s, TRUE);
 }
 
+static void
+rspamd_task_free_body_callbacks (gpointer ptr)
+{
+	struct rspamd_task *task = (struct rspamd_task *)ptr;
+
+	g_list_free (task->body_callbacks);
+	task->body_callbacks = NULL;
+}
+
 /*
  * Create new task
  */
@@ -71,6 +81,10 @@ rspamd_task_new (struct rspamd_worker *worker)
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->results);
+	new_task->results_mtx = rspamd_mutex_new ();
+	rspamd_mempool_add_destructor (new_task->task_pool,
+		(rspamd_mempool_destruct_t) rspamd_mutex_free,
+		new_task->results_mtx);
 	new_task->re_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
@@ -104,6 +118,7 @@ rspamd_task_new (struct rspamd_worker *worker)
 	new_task->pre_result.action = METRIC_ACTION_NOACTION;
 
 	new_task->message_id = new_task->queue_id = "undef";
+	rspamd_metrics_gauge_add (RSPAMD_METRIC_TASKS_ACTIVE, 1);
 
 	return new_task;
 }
@@ -112,6 +127,8 @@ rspamd_task_new (struct rspamd_worker *worker)
 static void
 rspamd_task_reply (struct rspamd_task *task)
 {
+	rspamd_tasklog_mark (task, RSPAMD_TASKLOG_REPLY);
+
 	if (task->fin_callback) {
 		task->fin_callback (task->fin_arg);
 	}
@@ -120,12 +137,8 @@ rspamd_task_reply (struct rspamd_task *task)
 	}
 }
 
-/*
- * Called if all filters are processed
- * @return TRUE if session should be terminated
- */
-gboolean
-rspamd_task_fin (void *arg)
+static gboolean
+rspamd_task_fin_stage (void *arg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) arg;
 	gint r;
@@ -139,6 +152,7 @@ rspamd_task_fin (void *arg)
 
 	/* We processed all filters and want to process statfiles */
 	if (task->state != WAIT_POST_FILTER && task->state != WAIT_PRE_FILTER) {
+		rspamd_tasklog_mark (task, RSPAMD_TASKLOG_EVENTS);
 		/* Process all statfiles */
 		if (task->classify_pool == NULL) {
 			/* Non-threaded version */
@@ -148,6 +162,7 @@ rspamd_task_fin (void *arg)
 			/* Just process composites */
 			rspamd_make_composites (task);
 		}
+		rspamd_tasklog_mark (task, RSPAMD_TASKLOG_CLASSIFY);
 		if (task->cfg->post_filters) {
 			/* More to process */
 			/* Special state */
@@ -174,6 +189,7 @@ rspamd_task_fin (void *arg)
 		else {
 			task->state = WAIT_FILTER;
 			r = rspamd_process_filters (task);
+			rspamd_tasklog_mark (task, RSPAMD_TASKLOG_FILTERS);
 			if (r == -1) {
 				task->last_error = "Filter processing error";
 				task->error_code = RSPAMD_FILTER_ERROR;
@@ -187,7 +203,7 @@ rspamd_task_fin (void *arg)
 				g_thread_pool_push (task->classify_pool, task, &err);
 				if (err != NULL) {
 					msg_err ("cannot pull task to the pool: %s", err->message);
-					remove_async_thread (task->s);
+					remove_async_thread (task->s, NULL);
 					g_error_free (err);
 				}
 			}
@@ -203,6 +219,23 @@ rspamd_task_fin (void *arg)
 	return TRUE;
 }
 
+/*
+ * Called if all filters are processed
+ * @return TRUE if session should be terminated
+ */
+gboolean
+rspamd_task_fin (void *arg)
+{
+	struct rspamd_task *task = (struct rspamd_task *) arg;
+	gboolean ret;
+
+	rspamd_tasklog_cpu_enter (task);
+	ret = rspamd_task_fin_stage (task);
+	rspamd_tasklog_cpu_leave (task);
+
+	return ret;
+}
+
 /*
  * Called if session was restored inside fin callback
  */
@@ -211,11 +244,13 @@ rspamd_task_restore (void *arg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) arg;
 
+	rspamd_tasklog_cpu_enter (task);
 	/* Call post filters */
 	if (task->state == WAIT_POST_FILTER && !task->skip_extra_filters) {
 		rspamd_lua_call_post_filters (task);
 	}
 	task->s->wanna_die = TRUE;
+	rspamd_tasklog_cpu_leave (task);
 }
 
 /*
@@ -227,9 +262,22 @@ rspamd_task_free (struct rspamd_task *task, gboolean is_soft)
 	GList *part;
 	struct mime_part *p;
 	struct mime_text_part *tp;
+	struct timeval tv;
+	gint64 diff;
 
 	if (task) {
 		debug_task ("free pointer %p", task);
+		rspamd_tasklog_task_finish (task);
+		rspamd_metrics_gauge_add (RSPAMD_METRIC_TASKS_ACTIVE, -1);
+
+		if (task->msg != NULL) {
+			gettimeofday (&tv, NULL);
+			diff = (tv.tv_sec - task->tv.tv_sec) * 1000000LL +
+				(tv.tv_usec - task->tv.tv_usec);
+			rspamd_metrics_inc (RSPAMD_METRIC_TASKS, 1);
+			rspamd_metrics_observe (RSPAMD_METRIC_SCAN_TIME, MAX (diff, 0));
+		}
+
 		while ((part = g_list_first (task->parts))) {
 			task->parts = g_list_remove_link (task->parts, part);
 			p = (struct mime_part *) part->data;
@@ -288,8 +336,113 @@ rspamd_task_free_soft (gpointer ud)
 }
 
 
+struct rspamd_task_body_callback {
+	rspamd_task_body_cb cb;
+	gpointer ud;
+};
+
+void
+rspamd_task_add_body_callback (struct rspamd_task *task,
+	rspamd_task_body_cb cb, gpointer ud)
+{
+	struct rspamd_task_body_callback *bcb;
+
+	if (task->msg != NULL) {
+		/* We have the whole message, no need to delay anything */
+		cb (task, ud);
+		return;
+	}
+
+	bcb = rspamd_mempool_alloc (task->task_pool, sizeof (*bcb));
+	bcb->cb = cb;
+	bcb->ud = ud;
+
+	if (task->body_callbacks == NULL) {
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_task_free_body_callbacks,
+			task);
+	}
+
+	task->body_callbacks = g_list_append (task->body_callbacks, bcb);
+}
+
+static void
+rspamd_task_call_body_callbacks (struct rspamd_task *task)
+{
+	GList *cur;
+	struct rspamd_task_body_callback *bcb;
+
+	cur = task->body_callbacks;
+	while (cur) {
+		bcb = cur->data;
+		bcb->cb (task, bcb->ud);
+		cur = g_list_next (cur);
+	}
+}
+
+/*
+ * Search for the end of headers block taking into account that the
+ * separator could be split between several portions of data
+ */
+static const gchar *
+rspamd_task_find_headers_end (const gchar *begin, gsize len, gsize offset)
+{
+	const gchar *p, *end;
+
+	end = begin + len;
+	p = begin + (offset > 3 ? offset - 3 : 0);
+
+	while (p < end) {
+		if (*p == '\n') {
+			if (p + 1 < end && p[1] == '\n') {
+				return p + 1;
+			}
+			else if (p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+				return p + 2;
+			}
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
 gboolean
-rspamd_task_process (struct rspamd_task *task,
+rspamd_task_process_headers (struct rspamd_task *task,
+	struct rspamd_http_message *msg, gsize chunk_len)
+{
+	const gchar *hdr_end;
+
+	if (task->headers_processed || !task->is_mime) {
+		return FALSE;
+	}
+
+	hdr_end = rspamd_task_find_headers_end (msg->body->str, msg->body->len,
+			msg->body->len - chunk_len);
+
+	if (hdr_end == NULL) {
+		/* Wait for more data */
+		return FALSE;
+	}
+
+	rspamd_tasklog_cpu_enter (task);
+	rspamd_protocol_handle_headers (task, msg);
+
+	if (process_message_headers (task, msg->body->str,
+		hdr_end - msg->body->str) == -1) {
+		rspamd_tasklog_cpu_leave (task);
+		return FALSE;
+	}
+
+	debug_task ("headers block has been received, start header symbols");
+	rspamd_process_header_filters (task);
+	rspamd_tasklog_cpu_leave (task);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_task_process_stage (struct rspamd_task *task,
 	struct rspamd_http_message *msg, GThreadPool *classify_pool,
 	gboolean process_extra_filters)
 {
@@ -303,13 +456,17 @@ rspamd_task_process (struct rspamd_task *task,
 	}
 
 	task->msg = msg->body;
+	rspamd_tasklog_mark (task, RSPAMD_TASKLOG_READ);
+	rspamd_metrics_observe (RSPAMD_METRIC_MESSAGE_SIZE, task->msg->len);
 
 	debug_task ("got string of length %z", task->msg->len);
 
 	/* We got body, set wanna_die flag */
 	task->s->wanna_die = TRUE;
 
-	rspamd_protocol_handle_headers (task, msg);
+	if (!task->headers_processed) {
+		rspamd_protocol_handle_headers (task, msg);
+	}
 
 	r = process_message (task);
 	if (r == -1) {
@@ -319,9 +476,13 @@ rspamd_task_process (struct rspamd_task *task,
 		task->state = WRITE_REPLY;
 		return FALSE;
 	}
+
+	rspamd_tasklog_mark (task, RSPAMD_TASKLOG_MIME);
+	rspamd_task_call_body_callbacks (task);
 	task->skip_extra_filters = !process_extra_filters;
 	if (!process_extra_filters || task->cfg->pre_filters == NULL) {
 		r = rspamd_process_filters (task);
+		rspamd_tasklog_mark (task, RSPAMD_TASKLOG_FILTERS);
 		if (r == -1) {
 			task->last_error = "filter processing error";
 			task->error_code = RSPAMD_FILTER_ERROR;
@@ -334,7 +495,7 @@ rspamd_task_process (struct rspamd_task *task,
 			g_thread_pool_push (classify_pool, task, &err);
 			if (err != NULL) {
 				msg_err ("cannot pull task to the pool: %s", err->message);
-				remove_async_thread (task->s);
+				remove_async_thread (task->s, NULL);
 				g_error_free (err);
 			}
 			else {
@@ -357,6 +518,21 @@ rspamd_task_process (struct rspamd_task *task,
 	return TRUE;
 }
 
+gboolean
+rspamd_task_process (struct rspamd_task *task,
+	struct rspamd_http_message *msg, GThreadPool *classify_pool,
+	gboolean process_extra_filters)
+{
+	gboolean ret;
+
+	rspamd_tasklog_cpu_enter (task);
+	ret = rspamd_task_process_stage (task, msg, classify_pool,
+			process_extra_filters);
+	rspamd_tasklog_cpu_leave (task);
+
+	return ret;
+}
+
 const gchar *
 rspamd_task_get_sender (struct rspamd_task *task)
 {
@@ -28,6 +28,7 @@
 #include "events.h"
 #include "util.h"
 #include "mem_pool.h"
+#include "tasklog.h"
 #include "dns.h"
 
 enum rspamd_command {
@@ -38,6 +39,7 @@ enum rspamd_command {
 	CMD_SKIP,
 	CMD_PING,
 	CMD_PROCESS,
+	CMD_BATCH,
 	CMD_OTHER
 };
 
@@ -52,12 +54,15 @@ enum rspamd_metric_action {
 };
 
 typedef gint (*protocol_reply_func)(struct rspamd_task *task);
+typedef void (*rspamd_task_body_cb)(struct rspamd_task *task, gpointer ud);
 
 struct custom_command {
 	const gchar *name;
 	protocol_reply_func func;
 };
 
+struct rspamd_tasklog_entry;
+
 /**
  * Worker task structure
  */
@@ -77,9 +82,11 @@ struct rspamd_task {
 	gint sock;                                                  /**< socket descriptor								*/
 	gboolean is_mime;                                           /**< if this task is mime task                      */
 	gboolean is_json;                                           /**< output is JSON									*/
+	gboolean is_msgpack;                                        /**< output is compact binary (msgpack)				*/
 	gboolean skip_extra_filters;                                /**< skip pre and post filters						*/
 	gboolean is_skipped;                                        /**< whether message was skipped by configuration   */
 	gboolean extended_urls;										/**< output URLs in details							*/
+	gboolean headers_processed;                                 /**< headers were processed before the body			*/
 
 	gchar *helo;                                                    /**< helo header value								*/
 	gchar *queue_id;                                                /**< queue id if specified							*/
@@ -109,6 +116,7 @@ struct rspamd_task {
 	GHashTable *raw_headers;                                    /**< list of raw headers							*/
 	GHashTable *results;                                        /**< hash table of metric_result indexed by
 	                                                             *    metric's name									*/
+	rspamd_mutex_t *results_mtx;                                /**< guards results inserted from threads			*/
 	GHashTable *tokens;                                         /**< hash table of tokens indexed by tokenizer
 	                                                             *    pointer                                       */
 
@@ -128,6 +136,7 @@ struct rspamd_task {
 #endif
 	struct timeval tv;                                          /**< time of connection								*/
 	guint32 scan_milliseconds;                                  /**< how much milliseconds passed					*/
+	guint32 phases[RSPAMD_TASKLOG_PHASE_MAX];                   /**< usec since start when phases were reached		*/
 	gboolean pass_all_filters;                                  /**< pass task throught every rule					*/
 	gboolean no_log;                                            /**< do not log or write this task to the history	*/
 	guint32 parser_recursion;                                   /**< for avoiding recursion stack overflow			*/
@@ -140,6 +149,7 @@ struct rspamd_task {
 	struct event_base *ev_base;                                 /**< Event base										*/
 
 	GThreadPool *classify_pool;                                 /**< A pool of classify threads                     */
+	GList *body_callbacks;                                      /**< callbacks delayed till the body is received	*/
 
 	struct {
 		enum rspamd_metric_action action;                       /**< Action of pre filters							*/
@@ -147,6 +157,7 @@ struct rspamd_task {
 	} pre_result;                                               /**< Result of pre-filters							*/
 
 	ucl_object_t *settings;                                     /**< Settings applied to task						*/
+	struct rspamd_tasklog_entry *tasklog;                       /**< Timings to be written to the task log			*/
 };
 
 /**
@@ -183,6 +194,28 @@ gboolean rspamd_task_process (struct rspamd_task *task,
 	struct rspamd_http_message *msg, GThreadPool *classify_pool,
 	gboolean process_extra_filters);
 
+/**
+ * Process message headers if the whole headers block has been received and
+ * call symbols that depend on headers only. This function is intended to be
+ * called for each portion of the body received in streaming mode.
+ * @param task task to process
+ * @param msg incoming http message (partially read)
+ * @param chunk_len length of the last portion of data appended to the body
+ * @return TRUE if headers have been processed
+ */
+gboolean rspamd_task_process_headers (struct rspamd_task *task,
+	struct rspamd_http_message *msg, gsize chunk_len);
+
+/**
+ * Register callback to be called when the whole message is received and parsed,
+ * if the message is already here, the callback is called immediately
+ * @param task task object
+ * @param cb callback
+ * @param ud opaque data for callback
+ */
+void rspamd_task_add_body_callback (struct rspamd_task *task,
+	rspamd_task_body_cb cb, gpointer ud);
+
 /**
  * Return address of sender or NULL
  * @param task
@@ -0,0 +1,460 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "tasklog.h"
+#include "main.h"
+#include "filter.h"
+#include "task.h"
+
+#define TASKLOG_DEFAULT_SIZE (64 * 1024 * 1024)
+#define TASKLOG_ALIGN(len) (((len) + 7) & ~7)
+
+static const gchar *phase_names[RSPAMD_TASKLOG_PHASE_MAX] = {
+	[RSPAMD_TASKLOG_READ] = "read",
+	[RSPAMD_TASKLOG_MIME] = "mime",
+	[RSPAMD_TASKLOG_FILTERS] = "filters",
+	[RSPAMD_TASKLOG_EVENTS] = "events",
+	[RSPAMD_TASKLOG_CLASSIFY] = "classify",
+	[RSPAMD_TASKLOG_REPLY] = "reply"
+};
+
+struct rspamd_tasklog_s {
+	gchar *path;
+	gint fd;
+	guchar *map;
+	gsize size;
+	gsize pos;
+	/* Symbols defined in the current file: name -> id */
+	GHashTable *symbols;
+	guint32 last_id;
+};
+
+struct rspamd_tasklog_symbol_elt {
+	const gchar *symbol;
+	guint32 usec;
+};
+
+struct rspamd_tasklog_entry {
+	rspamd_tasklog_t *log;
+	GArray *symbols;
+	/* CPU time spent in the processing stages of the task */
+	guint64 cpu_usec;
+	guint cpu_depth;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec cpu_ts;
+#endif
+};
+
+static gboolean
+rspamd_tasklog_map_file (rspamd_tasklog_t *log)
+{
+	struct rspamd_tasklog_file_header *hdr;
+
+	log->fd = open (log->path, O_RDWR | O_CREAT | O_TRUNC,
+			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+
+	if (log->fd == -1) {
+		msg_err ("cannot open task log %s: %s", log->path, strerror (errno));
+		return FALSE;
+	}
+
+	if (ftruncate (log->fd, log->size) == -1) {
+		msg_err ("cannot truncate task log %s: %s", log->path,
+			strerror (errno));
+		close (log->fd);
+		log->fd = -1;
+		return FALSE;
+	}
+
+	log->map = mmap (NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			log->fd, 0);
+
+	if (log->map == MAP_FAILED) {
+		msg_err ("cannot mmap task log %s: %s", log->path, strerror (errno));
+		close (log->fd);
+		log->fd = -1;
+		log->map = NULL;
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_tasklog_file_header *)log->map;
+	memcpy (hdr->magic, RSPAMD_TASKLOG_MAGIC, sizeof (hdr->magic));
+	hdr->version = RSPAMD_TASKLOG_VERSION;
+	hdr->pid = getpid ();
+	hdr->created = time (NULL);
+
+	log->pos = sizeof (*hdr);
+	log->last_id = 0;
+	g_hash_table_remove_all (log->symbols);
+
+	return TRUE;
+}
+
+static void
+rspamd_tasklog_unmap_file (rspamd_tasklog_t *log)
+{
+	if (log->map != NULL) {
+		munmap (log->map, log->size);
+		log->map = NULL;
+	}
+
+	if (log->fd != -1) {
+		/* Drop unused tail of file */
+		if (ftruncate (log->fd, log->pos) == -1) {
+			msg_warn ("cannot truncate task log %s: %s", log->path,
+				strerror (errno));
+		}
+
+		close (log->fd);
+		log->fd = -1;
+	}
+}
+
+static gboolean
+rspamd_tasklog_rotate (rspamd_tasklog_t *log)
+{
+	gchar *rotated;
+	struct timeval tv;
+
+	rspamd_tasklog_unmap_file (log);
+	gettimeofday (&tv, NULL);
+	rotated = g_strdup_printf ("%s.%ld.%06ld", log->path, (glong)tv.tv_sec,
+			(glong)tv.tv_usec);
+
+	if (rename (log->path, rotated) == -1) {
+		msg_err ("cannot rename task log %s to %s: %s", log->path, rotated,
+			strerror (errno));
+	}
+
+	g_free (rotated);
+
+	return rspamd_tasklog_map_file (log);
+}
+
+rspamd_tasklog_t *
+rspamd_tasklog_open (const gchar *path, gsize size)
+{
+	rspamd_tasklog_t *log;
+
+	log = g_slice_alloc0 (sizeof (*log));
+	log->fd = -1;
+	log->size = size != 0 ? size : TASKLOG_DEFAULT_SIZE;
+	log->path = g_strdup_printf ("%s.%d", path, (gint)getpid ());
+	log->symbols = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, NULL);
+
+	if (log->size < sizeof (struct rspamd_tasklog_file_header) * 2 ||
+		!rspamd_tasklog_map_file (log)) {
+		g_hash_table_unref (log->symbols);
+		g_free (log->path);
+		g_slice_free1 (sizeof (*log), log);
+
+		return NULL;
+	}
+
+	return log;
+}
+
+void
+rspamd_tasklog_close (rspamd_tasklog_t *log)
+{
+	if (log != NULL) {
+		rspamd_tasklog_unmap_file (log);
+		g_hash_table_unref (log->symbols);
+		g_free (log->path);
+		g_slice_free1 (sizeof (*log), log);
+	}
+}
+
+static void
+rspamd_tasklog_entry_dtor (gpointer ud)
+{
+	struct rspamd_tasklog_entry *entry = ud;
+
+	g_array_free (entry->symbols, TRUE);
+}
+
+void
+rspamd_tasklog_task_start (rspamd_tasklog_t *log, struct rspamd_task *task)
+{
+	struct rspamd_tasklog_entry *entry;
+
+	if (log == NULL || log->map == NULL) {
+		return;
+	}
+
+	entry = rspamd_mempool_alloc0 (task->task_pool, sizeof (*entry));
+	entry->log = log;
+	entry->symbols = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_tasklog_symbol_elt), 32);
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_tasklog_entry_dtor,
+		entry);
+	task->tasklog = entry;
+}
+
+void
+rspamd_tasklog_mark (struct rspamd_task *task, enum rspamd_tasklog_phase phase)
+{
+	struct timeval tv;
+	gint64 diff;
+
+	if (phase >= RSPAMD_TASKLOG_PHASE_MAX) {
+		return;
+	}
+
+	gettimeofday (&tv, NULL);
+	diff = (tv.tv_sec - task->tv.tv_sec) * 1000000LL +
+		(tv.tv_usec - task->tv.tv_usec);
+	/* Zero means that phase has not been reached */
+	task->phases[phase] = MAX (diff, 1);
+}
+
+#ifdef HAVE_CLOCK_GETTIME
+static inline void
+rspamd_tasklog_cpu_time (struct timespec *ts)
+{
+# ifdef HAVE_CLOCK_THREAD_CPUTIME_ID
+	/* Time of classifier threads is not counted */
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, ts);
+# elif defined(HAVE_CLOCK_PROCESS_CPUTIME_ID)
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, ts);
+# elif defined(HAVE_CLOCK_VIRTUAL)
+	clock_gettime (CLOCK_VIRTUAL, ts);
+# else
+	clock_gettime (CLOCK_REALTIME, ts);
+# endif
+}
+#endif
+
+void
+rspamd_tasklog_cpu_enter (struct rspamd_task *task)
+{
+	struct rspamd_tasklog_entry *entry = task->tasklog;
+
+	if (entry == NULL) {
+		return;
+	}
+
+	/* Stages can be nested, e.g. finalizer is called from filters */
+	if (entry->cpu_depth++ == 0) {
+#ifdef HAVE_CLOCK_GETTIME
+		rspamd_tasklog_cpu_time (&entry->cpu_ts);
+#endif
+	}
+}
+
+void
+rspamd_tasklog_cpu_leave (struct rspamd_task *task)
+{
+	struct rspamd_tasklog_entry *entry = task->tasklog;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	gint64 diff;
+#endif
+
+	if (entry == NULL || entry->cpu_depth == 0) {
+		return;
+	}
+
+	if (--entry->cpu_depth == 0) {
+#ifdef HAVE_CLOCK_GETTIME
+		rspamd_tasklog_cpu_time (&ts);
+		diff = (ts.tv_sec - entry->cpu_ts.tv_sec) * 1000000LL +
+			(ts.tv_nsec - entry->cpu_ts.tv_nsec) / 1000;
+
+		if (diff > 0) {
+			entry->cpu_usec += diff;
+		}
+#endif
+	}
+}
+
+void
+rspamd_tasklog_symbol (struct rspamd_task *task, const gchar *symbol,
+	guint64 usec)
+{
+	struct rspamd_tasklog_symbol_elt elt;
+
+	if (task->tasklog == NULL) {
+		return;
+	}
+
+	elt.symbol = symbol;
+	elt.usec = MIN (usec, G_MAXUINT32);
+	g_array_append_val (task->tasklog->symbols, elt);
+}
+
+static gsize
+rspamd_tasklog_symbol_len (const gchar *symbol)
+{
+	return TASKLOG_ALIGN (sizeof (struct rspamd_tasklog_record_header) +
+		sizeof (guint32) + strlen (symbol) + 1);
+}
+
+/*
+ * Calculate the space required for the task record including definitions of
+ * symbols that are not yet written to the current file
+ */
+static gsize
+rspamd_tasklog_record_len (rspamd_tasklog_t *log,
+	struct rspamd_tasklog_entry *entry)
+{
+	struct rspamd_tasklog_symbol_elt *elt;
+	gsize len;
+	guint i;
+
+	len = sizeof (struct rspamd_tasklog_record_header) +
+		sizeof (struct rspamd_tasklog_task) +
+		entry->symbols->len * sizeof (struct rspamd_tasklog_symbol);
+
+	for (i = 0; i < entry->symbols->len; i++) {
+		elt = &g_array_index (entry->symbols,
+				struct rspamd_tasklog_symbol_elt, i);
+
+		if (g_hash_table_lookup (log->symbols, elt->symbol) == NULL) {
+			/* Duplicates are rare, so we can overestimate here */
+			len += rspamd_tasklog_symbol_len (elt->symbol);
+		}
+	}
+
+	return TASKLOG_ALIGN (len);
+}
+
+static guint32
+rspamd_tasklog_symbol_id (rspamd_tasklog_t *log, const gchar *symbol)
+{
+	struct rspamd_tasklog_record_header *hdr;
+	guint32 id, *pid;
+	gsize len;
+
+	id = GPOINTER_TO_UINT (g_hash_table_lookup (log->symbols, symbol));
+
+	if (id == 0) {
+		/* Write symbol definition */
+		id = ++log->last_id;
+		len = rspamd_tasklog_symbol_len (symbol);
+		hdr = (struct rspamd_tasklog_record_header *)(log->map + log->pos);
+		hdr->type = RSPAMD_TASKLOG_RECORD_SYMBOL;
+		hdr->reserved = 0;
+		hdr->len = len;
+		pid = (guint32 *)(hdr + 1);
+		*pid = id;
+		memcpy (pid + 1, symbol, strlen (symbol) + 1);
+		log->pos += len;
+		g_hash_table_insert (log->symbols, g_strdup (symbol),
+			GUINT_TO_POINTER (id));
+	}
+
+	return id;
+}
+
+void
+rspamd_tasklog_task_finish (struct rspamd_task *task)
+{
+	struct rspamd_tasklog_entry *entry = task->tasklog;
+	rspamd_tasklog_t *log;
+	struct rspamd_tasklog_record_header *hdr;
+	struct rspamd_tasklog_task *rec;
+	struct rspamd_tasklog_symbol *syms;
+	struct rspamd_tasklog_symbol_elt *elt;
+	struct metric_result *metric_res;
+	gdouble required_score;
+	gsize len, start;
+	guint i;
+
+	if (entry == NULL) {
+		return;
+	}
+
+	task->tasklog = NULL;
+	log = entry->log;
+
+	if (log->map == NULL) {
+		return;
+	}
+
+	len = rspamd_tasklog_record_len (log, entry);
+
+	if (log->pos + len > log->size) {
+		if (len + sizeof (struct rspamd_tasklog_file_header) > log->size ||
+			!rspamd_tasklog_rotate (log)) {
+			return;
+		}
+
+		len = rspamd_tasklog_record_len (log, entry);
+	}
+
+	/* Symbol identifiers must be defined before the task record */
+	for (i = 0; i < entry->symbols->len; i++) {
+		elt = &g_array_index (entry->symbols,
+				struct rspamd_tasklog_symbol_elt, i);
+		rspamd_tasklog_symbol_id (log, elt->symbol);
+	}
+
+	start = log->pos;
+	hdr = (struct rspamd_tasklog_record_header *)(log->map + start);
+	hdr->type = RSPAMD_TASKLOG_RECORD_TASK;
+	hdr->reserved = 0;
+	rec = (struct rspamd_tasklog_task *)(hdr + 1);
+	rec->start = task->tv.tv_sec * 1000000ULL + task->tv.tv_usec;
+	memcpy (rec->phases, task->phases, sizeof (rec->phases));
+	rec->cpu_usec = MIN (entry->cpu_usec, G_MAXUINT32);
+	rec->bytes = task->msg ? task->msg->len : 0;
+	rec->dns_requests = task->dns_requests;
+	rec->nsymbols = entry->symbols->len;
+
+	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+	if (metric_res != NULL) {
+		rec->score = metric_res->score;
+		rec->action = rspamd_check_action_metric (task, metric_res->score,
+				&required_score, metric_res->metric);
+	}
+	else {
+		rec->score = 0;
+		rec->action = METRIC_ACTION_NOACTION;
+	}
+
+	syms = (struct rspamd_tasklog_symbol *)(rec + 1);
+	for (i = 0; i < entry->symbols->len; i++) {
+		elt = &g_array_index (entry->symbols,
+				struct rspamd_tasklog_symbol_elt, i);
+		syms[i].id = GPOINTER_TO_UINT (g_hash_table_lookup (log->symbols,
+				elt->symbol));
+		syms[i].usec = elt->usec;
+	}
+
+	hdr->len = TASKLOG_ALIGN (sizeof (*hdr) + sizeof (*rec) +
+			entry->symbols->len * sizeof (*syms));
+	log->pos = start + hdr->len;
+}
+
+const gchar *
+rspamd_tasklog_phase_name (enum rspamd_tasklog_phase phase)
+{
+	if (phase >= RSPAMD_TASKLOG_PHASE_MAX) {
+		return "unknown";
+	}
+
+	return phase_names[phase];
+}
@@ -0,0 +1,147 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TASKLOG_H_
+#define TASKLOG_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Task log is a compact append-only binary log that contains timings of each
+ * processed task. Every worker writes its own file `<path>.<pid>` that is
+ * mapped to memory and rotated when it is full.
+ *
+ * File format (host byte order):
+ * - file header: struct rspamd_tasklog_file_header
+ * - records, each of them starts with struct rspamd_tasklog_record_header
+ *   and is aligned to 8 bytes; a record with zero length marks the end of data
+ * - symbol records define numeric identifiers for symbols names and are
+ *   written once per file before the first task record referring them
+ * - task records contain fixed part (struct rspamd_tasklog_task) followed
+ *   by an array of struct rspamd_tasklog_symbol
+ */
+
+#define RSPAMD_TASKLOG_MAGIC "rsptlog"
+#define RSPAMD_TASKLOG_VERSION 1
+
+enum rspamd_tasklog_phase {
+	RSPAMD_TASKLOG_READ = 0,     /**< message has been received			*/
+	RSPAMD_TASKLOG_MIME,         /**< message has been parsed				*/
+	RSPAMD_TASKLOG_FILTERS,      /**< sync part of filters is processed	*/
+	RSPAMD_TASKLOG_EVENTS,       /**< all async events (DNS etc) finished	*/
+	RSPAMD_TASKLOG_CLASSIFY,     /**< classifiers have been processed		*/
+	RSPAMD_TASKLOG_REPLY,        /**< reply has been sent					*/
+	RSPAMD_TASKLOG_PHASE_MAX
+};
+
+enum rspamd_tasklog_record_type {
+	RSPAMD_TASKLOG_RECORD_SYMBOL = 1,
+	RSPAMD_TASKLOG_RECORD_TASK = 2
+};
+
+struct rspamd_tasklog_file_header {
+	gchar magic[8];
+	guint32 version;
+	guint32 pid;
+	guint64 created;
+};
+
+struct rspamd_tasklog_record_header {
+	guint16 type;
+	guint16 reserved;
+	guint32 len;                 /**< length of the whole record			*/
+};
+
+struct rspamd_tasklog_symbol {
+	guint32 id;
+	guint32 usec;                /**< CPU time of symbol					*/
+};
+
+struct rspamd_tasklog_task {
+	guint64 start;               /**< start of task (usec since epoch)		*/
+	guint32 phases[RSPAMD_TASKLOG_PHASE_MAX]; /**< usec since start		*/
+	guint32 cpu_usec;            /**< CPU time of task processing stages	*/
+	guint32 bytes;               /**< size of message						*/
+	guint32 dns_requests;
+	guint32 nsymbols;
+	gint32 action;
+	gfloat score;
+};
+
+typedef struct rspamd_tasklog_s rspamd_tasklog_t;
+struct rspamd_task;
+
+/**
+ * Open task log for the current process
+ * @param path path prefix of log file (pid is appended)
+ * @param size size of mapped file, the file is rotated when it is full
+ * @return task log object or NULL in case of error
+ */
+rspamd_tasklog_t * rspamd_tasklog_open (const gchar *path, gsize size);
+
+/**
+ * Close task log and truncate file to the actual size of data
+ */
+void rspamd_tasklog_close (rspamd_tasklog_t *log);
+
+/**
+ * Start collecting of timings for a task, the record is written when
+ * the task is destroyed
+ */
+void rspamd_tasklog_task_start (rspamd_tasklog_t *log, struct rspamd_task *task);
+
+/**
+ * Mark that task has reached the specified phase, marks are stored in the task
+ * even if task log is disabled
+ */
+void rspamd_tasklog_mark (struct rspamd_task *task,
+	enum rspamd_tasklog_phase phase);
+
+/**
+ * Start and stop counting CPU time of a processing stage of the task: parsing,
+ * filters, statistics and post filters. Only the time of the current thread
+ * is counted (if the system supports it), so other tasks processed
+ * concurrently and classifier threads do not contribute to the result.
+ * Callbacks of asynchronous events run outside of stages and are not counted
+ */
+void rspamd_tasklog_cpu_enter (struct rspamd_task *task);
+void rspamd_tasklog_cpu_leave (struct rspamd_task *task);
+
+/**
+ * Add CPU time of symbol
+ */
+void rspamd_tasklog_symbol (struct rspamd_task *task, const gchar *symbol,
+	guint64 usec);
+
+/**
+ * Write task record to the log
+ */
+void rspamd_tasklog_task_finish (struct rspamd_task *task);
+
+/**
+ * Get name of the phase
+ */
+const gchar * rspamd_tasklog_phase_name (enum rspamd_tasklog_phase phase);
+
+#endif /* TASKLOG_H_ */
@@ -0,0 +1,127 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "histogram.h"
+
+static inline guint
+rspamd_histogram_bucket (guint32 value)
+{
+	guint e;
+
+	if (value < RSPAMD_HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+
+	/* Position of the highest bit selects range, the next bits select bucket */
+	e = g_bit_storage (value) - 1;
+
+	return (e - RSPAMD_HISTOGRAM_SUB_BITS + 1) * RSPAMD_HISTOGRAM_SUB_BUCKETS +
+		((value >> (e - RSPAMD_HISTOGRAM_SUB_BITS)) &
+		(RSPAMD_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+guint32
+rspamd_histogram_bucket_bound (guint bucket)
+{
+	guint e, sub;
+	guint64 bound;
+
+	if (bucket < RSPAMD_HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	e = bucket / RSPAMD_HISTOGRAM_SUB_BUCKETS + RSPAMD_HISTOGRAM_SUB_BITS - 1;
+	sub = bucket % RSPAMD_HISTOGRAM_SUB_BUCKETS;
+	bound = ((guint64)(RSPAMD_HISTOGRAM_SUB_BUCKETS + sub + 1) <<
+		(e - RSPAMD_HISTOGRAM_SUB_BITS)) - 1;
+
+	return MIN (bound, G_MAXUINT32);
+}
+
+void
+rspamd_histogram_add (struct rspamd_histogram *h, guint32 value)
+{
+	guint32 max;
+
+	g_atomic_int_inc ((gint *)&h->buckets[rspamd_histogram_bucket (value)]);
+	__sync_fetch_and_add (&h->count, 1);
+	__sync_fetch_and_add (&h->sum, value);
+
+	do {
+		max = g_atomic_int_get ((gint *)&h->max);
+
+		if (value <= max) {
+			break;
+		}
+	} while (!g_atomic_int_compare_and_exchange ((gint *)&h->max, max, value));
+}
+
+guint32
+rspamd_histogram_percentile (const struct rspamd_histogram *h,
+	gdouble percentile)
+{
+	guint64 total = 0, target, cur = 0;
+	guint32 bound;
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i++) {
+		total += h->buckets[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	target = total * percentile / 100.0 + 0.5;
+
+	if (target == 0) {
+		target = 1;
+	}
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i++) {
+		cur += h->buckets[i];
+
+		if (cur >= target) {
+			break;
+		}
+	}
+
+	bound = rspamd_histogram_bucket_bound (MIN (i, RSPAMD_HISTOGRAM_BUCKETS - 1));
+
+	return MIN (bound, h->max);
+}
+
+void
+rspamd_histogram_reset (struct rspamd_histogram *h)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i++) {
+		g_atomic_int_set ((gint *)&h->buckets[i], 0);
+	}
+
+	g_atomic_int_set ((gint *)&h->max, 0);
+	h->count = 0;
+	h->sum = 0;
+}
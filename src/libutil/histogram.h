@@ -0,0 +1,73 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include "config.h"
+
+/*
+ * Log-linear histogram of integer values, e.g. latencies in microseconds.
+ * Every power of two range is split to 8 linear buckets, so percentiles are
+ * calculated with relative error less than 12.5%. Updates are lock free, so
+ * histogram can be placed to shared memory and updated by several processes.
+ */
+
+#define RSPAMD_HISTOGRAM_SUB_BITS 3
+#define RSPAMD_HISTOGRAM_SUB_BUCKETS (1 << RSPAMD_HISTOGRAM_SUB_BITS)
+#define RSPAMD_HISTOGRAM_BUCKETS \
+	((32 - RSPAMD_HISTOGRAM_SUB_BITS + 1) * RSPAMD_HISTOGRAM_SUB_BUCKETS)
+
+struct rspamd_histogram {
+	guint32 buckets[RSPAMD_HISTOGRAM_BUCKETS];
+	guint32 max;
+	guint64 count;
+	guint64 sum;
+};
+
+/**
+ * Add value to histogram
+ */
+void rspamd_histogram_add (struct rspamd_histogram *h, guint32 value);
+
+/**
+ * Get percentile of values in histogram
+ * @param h histogram
+ * @param percentile percentile (0 - 100)
+ * @return upper bound of bucket with the specified percentile or 0 if
+ * histogram is empty
+ */
+guint32 rspamd_histogram_percentile (const struct rspamd_histogram *h,
+	gdouble percentile);
+
+/**
+ * Get the maximum value stored in bucket
+ */
+guint32 rspamd_histogram_bucket_bound (guint bucket);
+
+/**
+ * Reset all values of histogram
+ */
+void rspamd_histogram_reset (struct rspamd_histogram *h);
+
+#endif /* HISTOGRAM_H_ */
@@ -48,6 +48,8 @@ struct rspamd_http_connection_private {
 	guint outlen;
 	gsize wr_pos;
 	gsize wr_total;
+	gboolean chunked;
+	gboolean chunked_done;
 };
 
 enum http_magic_type {
@@ -575,6 +577,52 @@ rspamd_http_simple_client_helper (struct rspamd_http_connection *conn)
 			conn->priv->ptv, base);
 }
 
+static void
+rspamd_http_write_chunked_helper (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv;
+	GString *buf;
+	gssize r;
+	GError *err;
+
+	priv = conn->priv;
+	buf = priv->buf->data;
+
+	while (priv->wr_pos < buf->len) {
+		r = write (conn->fd, buf->str + priv->wr_pos, buf->len - priv->wr_pos);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				event_add (&priv->ev, priv->ptv);
+				return;
+			}
+
+			err = g_error_new (HTTP_ERROR, errno, "IO write error: %s",
+					strerror (errno));
+			rspamd_http_connection_ref (conn);
+			conn->error_handler (conn, err);
+			rspamd_http_connection_unref (conn);
+			g_error_free (err);
+			return;
+		}
+
+		priv->wr_pos += r;
+	}
+
+	g_string_truncate (buf, 0);
+	priv->wr_pos = 0;
+
+	if (priv->chunked_done) {
+		rspamd_http_connection_ref (conn);
+		conn->finished = TRUE;
+		conn->finish_handler (conn, priv->msg);
+		rspamd_http_connection_unref (conn);
+	}
+}
+
 static void
 rspamd_http_write_helper (struct rspamd_http_connection *conn)
 {
@@ -590,6 +638,11 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 
 	priv = conn->priv;
 
+	if (priv->chunked) {
+		rspamd_http_write_chunked_helper (conn);
+		return;
+	}
+
 	if (priv->wr_pos == priv->wr_total) {
 		goto call_finish_handler;
 	}
@@ -819,7 +872,10 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 	event_del (&priv->ev);
 	if (priv->buf != NULL) {
 		REF_RELEASE (priv->buf);
+		priv->buf = NULL;
 	}
+	priv->chunked = FALSE;
+	priv->chunked_done = FALSE;
 
 	rspamd_http_parser_reset (conn);
 
@@ -1032,6 +1088,103 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	event_add (&priv->ev, priv->ptv);
 }
 
+void
+rspamd_http_connection_write_chunked (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg, const gchar *mime_type,
+	gpointer ud, gint fd, struct timeval *timeout, struct event_base *base)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	struct rspamd_http_header *hdr;
+	struct tm t, *ptm;
+	gchar datebuf[64];
+	GString *buf;
+
+	conn->fd = fd;
+	conn->ud = ud;
+
+	if (timeout == NULL) {
+		priv->ptv = NULL;
+	}
+	else {
+		memcpy (&priv->tv, timeout, sizeof (struct timeval));
+		priv->ptv = &priv->tv;
+	}
+	/* Buffer of the request is no longer needed */
+	if (priv->buf != NULL) {
+		REF_RELEASE (priv->buf);
+	}
+	priv->header = NULL;
+	priv->buf = g_slice_alloc0 (sizeof (*priv->buf));
+	REF_INIT_RETAIN (priv->buf, rspamd_http_privbuf_dtor);
+	priv->buf->data = g_string_sized_new (BUFSIZ);
+	buf = priv->buf->data;
+	priv->chunked = TRUE;
+	priv->chunked_done = FALSE;
+	priv->wr_pos = 0;
+
+	ptm = gmtime (&msg->date);
+	t = *ptm;
+	rspamd_snprintf (datebuf,
+		sizeof (datebuf),
+		"%s, %02d %s %4d %02d:%02d:%02d GMT",
+		http_week[t.tm_wday],
+		t.tm_mday,
+		http_month[t.tm_mon],
+		t.tm_year + 1900,
+		t.tm_hour,
+		t.tm_min,
+		t.tm_sec);
+	if (mime_type == NULL) {
+		mime_type = "text/plain";
+	}
+	rspamd_printf_gstring (buf, "HTTP/1.1 %d %s\r\n"
+		"Connection: close\r\n"
+		"Server: %s\r\n"
+		"Date: %s\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"Content-Type: %s\r\n",
+		msg->code,
+		msg->status ? msg->status->str : rspamd_http_code_to_str (msg->code),
+		"rspamd/" RVERSION,
+		datebuf,
+		mime_type);
+	LL_FOREACH (msg->headers, hdr)
+	{
+		rspamd_printf_gstring (buf, "%v: %v\r\n", hdr->name, hdr->value);
+	}
+	g_string_append_len (buf, "\r\n", 2);
+
+	event_set (&priv->ev, fd, EV_WRITE, rspamd_http_event_handler, conn);
+	if (base != NULL) {
+		event_base_set (base, &priv->ev);
+	}
+	event_add (&priv->ev, priv->ptv);
+}
+
+void
+rspamd_http_connection_write_chunk (struct rspamd_http_connection *conn,
+	const gchar *data, gsize len)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	GString *buf;
+
+	g_assert (priv->chunked && !priv->chunked_done);
+
+	buf = priv->buf->data;
+	rspamd_printf_gstring (buf, "%xz\r\n", len);
+	if (len > 0) {
+		g_string_append_len (buf, data, len);
+	}
+	else {
+		priv->chunked_done = TRUE;
+	}
+	g_string_append_len (buf, "\r\n", 2);
+
+	if (!event_pending (&priv->ev, EV_WRITE, NULL)) {
+		event_add (&priv->ev, priv->ptv);
+	}
+}
+
 struct rspamd_http_message *
 rspamd_http_new_message (enum http_parser_type type)
 {
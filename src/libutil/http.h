@@ -176,6 +176,37 @@ void rspamd_http_connection_write_message (
 	struct timeval *timeout,
 	struct event_base *base);
 
+/**
+ * Start a reply with chunked transfer encoding, the body of `msg` is ignored
+ * and should be sent by `rspamd_http_connection_write_chunk`. Finish handler
+ * is called when the final chunk has been written
+ * @param conn connection structure
+ * @param msg HTTP message (code, status and headers are copied, so it is
+ * not retained by the connection)
+ * @param mime_type content type of reply
+ * @param ud opaque user data
+ * @param fd fd to write
+ */
+void rspamd_http_connection_write_chunked (
+	struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *mime_type,
+	gpointer ud,
+	gint fd,
+	struct timeval *timeout,
+	struct event_base *base);
+
+/**
+ * Queue a chunk of a chunked reply, data is copied
+ * @param conn connection structure
+ * @param data chunk data
+ * @param len length of chunk, zero length chunk terminates reply
+ */
+void rspamd_http_connection_write_chunk (
+	struct rspamd_http_connection *conn,
+	const gchar *data,
+	gsize len);
+
 /**
  * Free connection structure
  * @param conn
@@ -34,6 +34,66 @@
 #define REPEATS_MIN 3
 #define REPEATS_MAX 300
 
+/* Asynchronous logging ring parameters */
+#define LOG_RING_CELL_SIZE 256
+#define LOG_RING_MAX_CELLS 64
+#define LOG_RING_DEFAULT_SIZE (4 * 1024 * 1024)
+#define LOG_RING_IOV LOG_RING_MAX_CELLS
+/* Writer wait interval when ring is empty (milliseconds) */
+#define LOG_RING_IDLE_TIMEOUT 1000
+/* Time after which an unpublished record is skipped (seconds) */
+#define LOG_RING_STALE_TIMEOUT 5
+
+/*
+ * A cell of the log ring: each log line occupies one or more consecutive
+ * cells, the first one stores the length of the whole record and the
+ * producer that has reserved it.
+ *
+ * `seq` of a cell at position `pos` is equal to `pos` while it is free or
+ * reserved, the first cell of a record becomes `pos + 1` when the record is
+ * published. The writer sets `seq` to the position of the next lap when it
+ * releases a cell, so both publishing and skipping a record is a CAS from
+ * `pos` that cannot succeed for a record of another lap. `rpos` is the
+ * position of the record that owns the cell.
+ */
+struct rspamd_log_ring_cell {
+	gint seq;
+	gint rpos;
+	pid_t pid;
+	guint16 len;
+	guint16 ncells;
+	gchar data[LOG_RING_CELL_SIZE - 2 * sizeof (gint) -
+		sizeof (pid_t) - 2 * sizeof (guint16)];
+};
+
+/*
+ * Multiple producers/single consumer ring placed in shared memory:
+ * workers reserve cells by moving `head` and the writer thread in the main
+ * process drains published records moving `tail`
+ */
+struct rspamd_log_ring {
+	gint head;
+	gchar pad1[64 - sizeof (gint)];
+	gint tail;
+	gchar pad2[64 - sizeof (gint)];
+	guint mask;
+	pid_t owner;
+	gint active;
+	gint stop;
+	gint generation;
+	/* Writer waits for a wakeup on the pipe */
+	gint sleeping;
+	gint wakeup_pipe[2];
+	uid_t uid;
+	gid_t gid;
+	guint64 lines;
+	guint64 bytes;
+	gint dropped;
+	gint truncated;
+	gint errors;
+	struct rspamd_log_ring_cell *cells;
+};
+
 /**
  * Static structure that store logging parameters
  * It is NOT shared between processes and is created by main process
@@ -63,10 +123,15 @@ struct rspamd_logger_s {
 	gchar *saved_function;
 	rspamd_mempool_t *pool;
 	rspamd_mempool_mutex_t *mtx;
+	struct rspamd_log_ring *ring;
+	GThread *ring_writer;
+	gchar *ring_file;
 };
 
 static const gchar lf_chr = '\n';
 
+static void rspamd_log_ring_wakeup (struct rspamd_log_ring *ring);
+
 static rspamd_logger_t *default_logger = NULL;
 
 
@@ -247,6 +312,12 @@ rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 gint
 rspamd_log_reopen_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 {
+	if (rspamd_log->ring != NULL && rspamd_log->ring->owner == getpid ()) {
+		/* Ask writer thread to reopen its descriptor as well */
+		g_atomic_int_inc (&rspamd_log->ring->generation);
+		rspamd_log_ring_wakeup (rspamd_log->ring);
+	}
+
 	rspamd_log_close_priv (rspamd_log, uid, gid);
 	if (rspamd_log_open_priv (rspamd_log, uid, gid) == 0) {
 		msg_info ("log file reopened");
@@ -453,6 +524,493 @@ rspamd_default_log_function (GLogLevelFlags log_level,
 }
 
 
+/*
+ * Wake writer thread if it waits for new records
+ */
+static void
+rspamd_log_ring_wakeup (struct rspamd_log_ring *ring)
+{
+	gchar c = '\0';
+
+	if (g_atomic_int_get (&ring->sleeping) &&
+		g_atomic_int_compare_and_exchange (&ring->sleeping, 1, 0)) {
+		/* Pipe is non-blocking, if it is full the writer is awake anyway */
+		if (write (ring->wakeup_pipe[1], &c, 1) == -1) {
+			return;
+		}
+	}
+}
+
+/*
+ * Put log line to the shared ring, this function never blocks: if there is
+ * no free space in the ring, the line is dropped
+ */
+static gboolean
+rspamd_log_ring_push (struct rspamd_log_ring *ring,
+	const struct iovec *iov,
+	gint iovcnt)
+{
+	struct rspamd_log_ring_cell *cell;
+	gsize len = 0, remain, cur_len, iov_off = 0, to_copy;
+	guint ncells, pos, last, k;
+	gint i, diff;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	if (len > LOG_RING_MAX_CELLS * sizeof (cell->data)) {
+		len = LOG_RING_MAX_CELLS * sizeof (cell->data);
+		g_atomic_int_inc (&ring->truncated);
+	}
+
+	ncells = (len + sizeof (cell->data) - 1) / sizeof (cell->data);
+
+	if (ncells == 0) {
+		return TRUE;
+	}
+
+	/* Reserve ncells consecutive cells */
+	for (;; ) {
+		pos = g_atomic_int_get (&ring->head);
+		last = pos + ncells - 1;
+		cell = &ring->cells[last & ring->mask];
+		diff = (gint)((guint)g_atomic_int_get (&cell->seq) - last);
+
+		if (diff == 0) {
+			/*
+			 * The last cell is free, as the writer releases cells in order,
+			 * all the previous cells are free as well
+			 */
+			if (g_atomic_int_compare_and_exchange (&ring->head,
+				(gint)pos, (gint)(pos + ncells))) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			/* Ring is full */
+			g_atomic_int_inc (&ring->dropped);
+			return FALSE;
+		}
+	}
+
+	/*
+	 * Let the writer skip this record if we die before publishing it, the
+	 * first cell is stamped last, so the writer sees a complete header
+	 */
+	cell = &ring->cells[pos & ring->mask];
+	cell->ncells = ncells;
+	cell->pid = getpid ();
+
+	for (k = ncells; k > 0; k--) {
+		cell = &ring->cells[(pos + k - 1) & ring->mask];
+		g_atomic_int_set (&cell->rpos, (gint)pos);
+	}
+
+	/* Copy data */
+	remain = len;
+	i = 0;
+
+	for (k = 0; k < ncells; k++) {
+		cell = &ring->cells[(pos + k) & ring->mask];
+		cur_len = 0;
+
+		if (g_atomic_int_get (&cell->rpos) != (gint)pos) {
+			/*
+			 * Writer has considered this record stale and the cell is
+			 * reused by another producer, the record is accounted as dropped
+			 */
+			return FALSE;
+		}
+
+		while (cur_len < sizeof (cell->data) && remain > 0) {
+			to_copy = MIN (iov[i].iov_len - iov_off, sizeof (cell->data) - cur_len);
+			to_copy = MIN (to_copy, remain);
+			memcpy (cell->data + cur_len, (const gchar *)iov[i].iov_base + iov_off,
+				to_copy);
+			cur_len += to_copy;
+			remain -= to_copy;
+			iov_off += to_copy;
+
+			if (iov_off == iov[i].iov_len) {
+				iov_off = 0;
+				i++;
+			}
+		}
+	}
+
+	cell = &ring->cells[pos & ring->mask];
+
+	if (g_atomic_int_get (&cell->rpos) != (gint)pos) {
+		return FALSE;
+	}
+
+	cell->len = len;
+
+	/* Publish the record, this fails if the writer has skipped it */
+	if (!g_atomic_int_compare_and_exchange (&cell->seq, (gint)pos,
+		(gint)(pos + 1))) {
+		return FALSE;
+	}
+
+	rspamd_log_ring_wakeup (ring);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_log_ring_writev (gint fd, struct iovec *iov, guint niov)
+{
+	gssize r;
+
+	while (niov > 0) {
+		r = writev (fd, iov, niov);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+
+		/* Skip written data */
+		while (niov > 0 && (gsize)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+
+		if (niov > 0) {
+			iov->iov_base = (gchar *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return TRUE;
+}
+
+static gint
+rspamd_log_ring_open_file (struct rspamd_log_ring *ring, const gchar *path)
+{
+	gint fd;
+
+	fd = open (path, O_CREAT | O_WRONLY | O_APPEND,
+			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+
+	if (fd != -1 && fchown (fd, ring->uid, ring->gid) == -1) {
+		close (fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+/* Release cells for the next lap */
+static void
+rspamd_log_ring_release (struct rspamd_log_ring *ring, guint from, guint to)
+{
+	guint k;
+
+	for (k = from; k != to; k++) {
+		g_atomic_int_set (&ring->cells[k & ring->mask].seq,
+			(gint)(k + ring->mask + 1));
+	}
+
+	ring->tail = to;
+}
+
+/*
+ * Check whether the record at the tail is reserved by a producer that has
+ * died or has not published it for too long and skip it, the producer
+ * drops the record if it tries to publish it later
+ * @return TRUE if the record has been skipped
+ */
+static gboolean
+rspamd_log_ring_skip_stale (struct rspamd_log_ring *ring, guint pos,
+	gboolean expired)
+{
+	struct rspamd_log_ring_cell *cell = &ring->cells[pos & ring->mask];
+	guint ncells;
+
+	if (g_atomic_int_get (&cell->rpos) != (gint)pos) {
+		/* Producer has not stamped the record yet */
+		return FALSE;
+	}
+
+	ncells = cell->ncells;
+
+	if (!expired && !(kill (cell->pid, 0) == -1 && errno == ESRCH)) {
+		return FALSE;
+	}
+
+	/* Move the first cell to the next lap unless the record is published */
+	if (ncells == 0 || ncells > LOG_RING_MAX_CELLS ||
+		!g_atomic_int_compare_and_exchange (&cell->seq, (gint)pos,
+		(gint)(pos + ring->mask + 1))) {
+		return FALSE;
+	}
+
+	g_atomic_int_inc (&ring->dropped);
+	rspamd_log_ring_release (ring, pos + 1, pos + ncells);
+
+	return TRUE;
+}
+
+/*
+ * Writer thread: collects published records into a single vector and writes
+ * them at once. This thread must not allocate memory or log anything.
+ */
+static gpointer
+rspamd_log_ring_writer (gpointer ud)
+{
+	rspamd_logger_t *rspamd_log = ud;
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+	struct rspamd_log_ring_cell *cell, *cur;
+	struct iovec iov[LOG_RING_IOV];
+	guint tail, pos, k, niov, nrec, remain, stuck_pos = 0;
+	gint fd = -1, generation = -1, stop;
+	time_t stuck_since = 0, now;
+	gchar drain[64];
+	gsize bytes;
+
+	for (;; ) {
+		stop = g_atomic_int_get (&ring->stop);
+
+		if (g_atomic_int_get (&ring->generation) != generation) {
+			generation = g_atomic_int_get (&ring->generation);
+
+			if (fd != -1) {
+				fsync (fd);
+				close (fd);
+			}
+
+			fd = rspamd_log_ring_open_file (ring, rspamd_log->ring_file);
+		}
+
+		tail = ring->tail;
+		pos = tail;
+		niov = 0;
+		nrec = 0;
+		bytes = 0;
+
+		for (;; ) {
+			cell = &ring->cells[pos & ring->mask];
+
+			if (g_atomic_int_get (&cell->seq) != (gint)(pos + 1) ||
+				niov + cell->ncells > G_N_ELEMENTS (iov)) {
+				break;
+			}
+
+			remain = cell->len;
+
+			for (k = 0; k < cell->ncells; k++) {
+				cur = &ring->cells[(pos + k) & ring->mask];
+				iov[niov].iov_base = cur->data;
+				iov[niov].iov_len = MIN (remain, sizeof (cur->data));
+				remain -= iov[niov].iov_len;
+				niov++;
+			}
+
+			bytes += cell->len;
+			pos += cell->ncells;
+			nrec++;
+		}
+
+		if (niov == 0) {
+			if ((guint)g_atomic_int_get (&ring->head) != tail) {
+				/* Record at the tail is reserved but not published */
+				now = time (NULL);
+
+				if (stuck_since == 0 || stuck_pos != tail) {
+					stuck_pos = tail;
+					stuck_since = now;
+				}
+
+				if (rspamd_log_ring_skip_stale (ring, tail,
+					now - stuck_since >= LOG_RING_STALE_TIMEOUT)) {
+					stuck_since = 0;
+					continue;
+				}
+			}
+			else {
+				stuck_since = 0;
+			}
+
+			if (stop) {
+				break;
+			}
+
+			/*
+			 * Producers wake us if they see the flag, so check the ring once
+			 * more after setting it to avoid missing a record
+			 */
+			g_atomic_int_set (&ring->sleeping, 1);
+
+			if (g_atomic_int_get (&ring->cells[tail & ring->mask].seq) !=
+				(gint)(tail + 1) && !g_atomic_int_get (&ring->stop)) {
+				if (rspamd_socket_poll (ring->wakeup_pipe[0],
+					LOG_RING_IDLE_TIMEOUT, POLLIN) > 0) {
+					while (read (ring->wakeup_pipe[0], drain,
+						sizeof (drain)) > 0) ;
+				}
+			}
+
+			g_atomic_int_set (&ring->sleeping, 0);
+			continue;
+		}
+
+		if (fd != -1 && rspamd_log_ring_writev (fd, iov, niov)) {
+			ring->lines += nrec;
+			ring->bytes += bytes;
+		}
+		else {
+			g_atomic_int_add (&ring->errors, nrec);
+		}
+
+		rspamd_log_ring_release (ring, tail, pos);
+	}
+
+	if (fd != -1) {
+		fsync (fd);
+		close (fd);
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_log_async_start (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
+{
+	struct rspamd_log_ring *ring;
+	struct rspamd_config *cfg = rspamd_log->cfg;
+	GError *err = NULL;
+	gsize size, ncells, i;
+	gpointer map;
+
+	if (!cfg->log_async || cfg->log_type != RSPAMD_LOG_FILE ||
+		rspamd_log->ring != NULL) {
+		return FALSE;
+	}
+
+	size = cfg->log_async_size != 0 ? cfg->log_async_size :
+		LOG_RING_DEFAULT_SIZE;
+	/* Number of cells must be power of two */
+	ncells = LOG_RING_MAX_CELLS;
+
+	while (ncells * LOG_RING_CELL_SIZE < size) {
+		ncells <<= 1;
+	}
+
+	map = mmap (NULL, sizeof (*ring) + ncells * LOG_RING_CELL_SIZE,
+			PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for log ring: %s",
+			sizeof (*ring) + ncells * LOG_RING_CELL_SIZE, strerror (errno));
+		return FALSE;
+	}
+
+	ring = map;
+	memset (ring, 0, sizeof (*ring));
+	ring->cells = (struct rspamd_log_ring_cell *)((gchar *)map + sizeof (*ring));
+	ring->mask = ncells - 1;
+	ring->owner = getpid ();
+	ring->uid = uid;
+	ring->gid = gid;
+
+	for (i = 0; i < ncells; i++) {
+		ring->cells[i].seq = i;
+		ring->cells[i].rpos = -1;
+	}
+
+	if (pipe (ring->wakeup_pipe) == -1) {
+		msg_err ("cannot create log writer pipe: %s", strerror (errno));
+		munmap (map, sizeof (*ring) + ncells * LOG_RING_CELL_SIZE);
+
+		return FALSE;
+	}
+
+	rspamd_socket_nonblocking (ring->wakeup_pipe[0]);
+	rspamd_socket_nonblocking (ring->wakeup_pipe[1]);
+
+	rspamd_log->ring = ring;
+	rspamd_log->ring_file = g_strdup (cfg->log_file);
+	rspamd_log->ring_writer = rspamd_create_thread ("log",
+			rspamd_log_ring_writer,
+			rspamd_log,
+			&err);
+
+	if (rspamd_log->ring_writer == NULL) {
+		msg_err ("cannot start log writer: %s", err ? err->message : "unknown");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		rspamd_log->ring = NULL;
+		g_free (rspamd_log->ring_file);
+		rspamd_log->ring_file = NULL;
+		close (ring->wakeup_pipe[0]);
+		close (ring->wakeup_pipe[1]);
+		munmap (map, sizeof (*ring) + ncells * LOG_RING_CELL_SIZE);
+
+		return FALSE;
+	}
+
+	g_atomic_int_set (&ring->active, 1);
+	msg_info ("started asynchronous log writer, ring size: %z bytes",
+		ncells * LOG_RING_CELL_SIZE);
+
+	return TRUE;
+}
+
+void
+rspamd_log_async_stop (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+
+	if (ring == NULL || rspamd_log->ring_writer == NULL ||
+		ring->owner != getpid ()) {
+		return;
+	}
+
+	/* Write further lines directly and drain the rest of the ring */
+	g_atomic_int_set (&ring->active, 0);
+	g_atomic_int_set (&ring->stop, 1);
+	rspamd_log_ring_wakeup (ring);
+	g_thread_join (rspamd_log->ring_writer);
+	close (ring->wakeup_pipe[0]);
+	close (ring->wakeup_pipe[1]);
+
+	rspamd_log->ring_writer = NULL;
+	rspamd_log->ring = NULL;
+	munmap (ring, sizeof (*ring) + (ring->mask + 1) * LOG_RING_CELL_SIZE);
+	g_free (rspamd_log->ring_file);
+	rspamd_log->ring_file = NULL;
+}
+
+gboolean
+rspamd_log_async_stat (rspamd_logger_t *rspamd_log,
+	struct rspamd_log_async_stat *st)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+
+	if (ring == NULL || !g_atomic_int_get (&ring->active)) {
+		return FALSE;
+	}
+
+	st->lines = ring->lines;
+	st->bytes = ring->bytes;
+	st->dropped = (guint)g_atomic_int_get (&ring->dropped);
+	st->truncated = (guint)g_atomic_int_get (&ring->truncated);
+	st->errors = (guint)g_atomic_int_get (&ring->errors);
+	st->size = (ring->mask + 1) * LOG_RING_CELL_SIZE;
+	st->used = ((guint)g_atomic_int_get (&ring->head) - (guint)ring->tail) *
+		LOG_RING_CELL_SIZE;
+
+	return TRUE;
+}
+
 /**
  * Fill buffer with message (limits must be checked BEFORE this call)
  */
@@ -481,6 +1039,13 @@ file_log_helper (rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	gint i;
 
+	if (rspamd_log->ring != NULL && rspamd_log->type == RSPAMD_LOG_FILE &&
+		g_atomic_int_get (&rspamd_log->ring->active)) {
+		/* Pass line to the writer in the main process */
+		rspamd_log_ring_push (rspamd_log->ring, iov, iovcnt);
+		return;
+	}
+
 	if (!rspamd_log->is_buffered) {
 		/* Write string directly */
 		direct_write_log_line (rspamd_log, (void *)iov, iovcnt, TRUE);
@@ -45,6 +45,33 @@ void rspamd_log_close_priv (rspamd_logger_t *logger, uid_t uid, gid_t gid);
  */
 gint rspamd_log_reopen_priv (rspamd_logger_t *logger, uid_t uid, gid_t gid);
 
+/**
+ * Start asynchronous writer in the main process: after this call log lines of
+ * all processes are passed via shared ring to a dedicated writer thread
+ * @return TRUE if asynchronous logging has been started
+ */
+gboolean rspamd_log_async_start (rspamd_logger_t *logger, uid_t uid, gid_t gid);
+/**
+ * Write all pending lines and stop asynchronous writer
+ */
+void rspamd_log_async_stop (rspamd_logger_t *logger);
+
+struct rspamd_log_async_stat {
+	guint64 lines;          /**< lines written								*/
+	guint64 bytes;          /**< bytes written								*/
+	guint dropped;          /**< lines dropped due to overflow or stale records	*/
+	guint truncated;        /**< lines truncated as being too long			*/
+	guint errors;           /**< lines lost due to write errors			*/
+	gsize size;             /**< size of ring								*/
+	gsize used;             /**< bytes currently queued					*/
+};
+/**
+ * Get statistics of asynchronous logging
+ * @return FALSE if asynchronous logging is not active
+ */
+gboolean rspamd_log_async_stat (rspamd_logger_t *logger,
+	struct rspamd_log_async_stat *st);
+
 /**
  * Set log pid
  */
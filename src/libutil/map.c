@@ -74,6 +74,312 @@ struct http_callback_data {
 #define HTTP_CONNECT_TIMEOUT 2
 #define HTTP_READ_TIMEOUT 10
 
+/* How long to wait on start for a map compiled by another process */
+#define MAP_IMAGE_WAIT_ATTEMPTS 500
+#define MAP_IMAGE_WAIT_USEC 10000
+/* Changes are published as delta while they are less than 1/10 of map */
+#define MAP_DELTA_RATIO 10
+
+static void
+rspamd_map_image_path (struct rspamd_map *map, gchar *buf, gsize len,
+	gboolean delta)
+{
+	rspamd_snprintf (buf, len, "%s/rspamd-map-%P-%ud.img%s", map->cfg->temp_dir,
+		map->owner, map->id, delta ? ".delta" : "");
+}
+
+static gboolean
+rspamd_map_image_changed (struct rspamd_map *map)
+{
+	return map->shared != NULL &&
+		   g_atomic_int_get (&map->shared->generation) != map->generation;
+}
+
+static gpointer
+rspamd_map_read_image (const gchar *path, gsize *len)
+{
+	struct stat st;
+	gpointer image;
+	gint fd, flags = O_RDONLY;
+
+#ifdef O_NOFOLLOW
+	/* Images are placed to the temporary directory */
+	flags |= O_NOFOLLOW;
+#endif
+
+	if ((fd = open (path, flags)) == -1) {
+		msg_err ("cannot open map image %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size == 0) {
+		msg_err ("cannot stat map image %s: %s", path, strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	image = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (image == MAP_FAILED) {
+		msg_err ("cannot mmap map image %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	*len = st.st_size;
+
+	return image;
+}
+
+static gboolean
+rspamd_map_write_all (gint fd, const guint8 *data, gsize len)
+{
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, data, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+
+		data += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Write image to file atomically and map it
+ */
+static gpointer
+rspamd_map_write_image (const gchar *path, GByteArray *image)
+{
+	gchar tmp[PATH_MAX];
+	gpointer mapped = NULL;
+	gint fd;
+
+	/* Temporary directory is shared, so the name must not be predictable */
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+
+#ifdef HAVE_MKSTEMP
+	fd = mkstemp (tmp);
+#else
+	fd = g_mkstemp_full (tmp, O_RDWR, S_IWUSR | S_IRUSR);
+#endif
+
+	if (fd == -1) {
+		msg_warn ("cannot create map image %s: %s", tmp, strerror (errno));
+		return NULL;
+	}
+
+	if (!rspamd_map_write_all (fd, image->data, image->len) ||
+		rename (tmp, path) == -1) {
+		msg_warn ("cannot write map image %s: %s", path, strerror (errno));
+		unlink (tmp);
+	}
+	else if ((mapped = mmap (NULL, image->len, PROT_READ, MAP_SHARED, fd,
+		0)) == MAP_FAILED) {
+		msg_warn ("cannot mmap map image %s: %s", path, strerror (errno));
+		mapped = NULL;
+	}
+
+	close (fd);
+
+	return mapped;
+}
+
+/**
+ * Replace map data with the image compiled by another process
+ */
+static void
+rspamd_map_load_image (struct rspamd_map *map)
+{
+	gchar path[PATH_MAX];
+	gpointer image, data, prev;
+	gsize len;
+	gint generation, base_generation;
+	gboolean has_delta;
+	time_t mtime;
+
+	generation = g_atomic_int_get (&map->shared->generation);
+	base_generation = map->shared->base_generation;
+	has_delta = map->shared->delta;
+	mtime = map->shared->mtime;
+	data = *map->user_data;
+	/*
+	 * Do not try to load the same broken image again, if images are being
+	 * replaced by another process, generation is changed once more
+	 */
+	map->generation = generation;
+
+	if (base_generation != map->base_generation || data == NULL) {
+		rspamd_map_image_path (map, path, sizeof (path), FALSE);
+
+		if ((image = rspamd_map_read_image (path, &len)) == NULL) {
+			return;
+		}
+
+		if ((data = map->load_callback (image, len, TRUE)) == NULL) {
+			munmap (image, len);
+			return;
+		}
+	}
+
+	if (map->delta_callback != NULL) {
+		if (has_delta) {
+			rspamd_map_image_path (map, path, sizeof (path), TRUE);
+			image = rspamd_map_read_image (path, &len);
+
+			if (image == NULL ||
+				!map->delta_callback (data, image, len, TRUE)) {
+				if (image != NULL) {
+					munmap (image, len);
+				}
+				if (data != *map->user_data) {
+					map->free_callback (data);
+				}
+				return;
+			}
+		}
+		else {
+			map->delta_callback (data, NULL, 0, FALSE);
+		}
+	}
+
+	if (data != *map->user_data) {
+		prev = *map->user_data;
+		*map->user_data = data;
+
+		if (prev != NULL) {
+			map->free_callback (prev);
+		}
+	}
+
+	map->base_generation = base_generation;
+
+	/* Image is built from this version of source, so skip it while checking */
+	if (map->protocol == MAP_PROTO_FILE) {
+		((struct file_map_data *)map->map_data)->st.st_mtime = mtime;
+	}
+	else {
+		((struct http_map_data *)map->map_data)->last_checked = mtime;
+	}
+
+	msg_info ("loaded map %s compiled by another process, generation %d%s",
+		map->uri, generation, has_delta ? " (delta)" : "");
+}
+
+gpointer
+rspamd_map_publish_image (struct rspamd_map *map, GByteArray *image)
+{
+	gchar path[PATH_MAX];
+	gpointer data = NULL, mapped;
+	guint8 *raw;
+	gsize len = image->len;
+
+	if (map->load_callback == NULL) {
+		msg_err ("map %s cannot be loaded from image", map->uri);
+		g_byte_array_free (image, TRUE);
+		return NULL;
+	}
+
+	if (map->shared != NULL && map->cfg->temp_dir != NULL) {
+		rspamd_map_image_path (map, path, sizeof (path), FALSE);
+
+		if ((mapped = rspamd_map_write_image (path, image)) != NULL) {
+			if ((data = map->load_callback (mapped, len, TRUE)) == NULL) {
+				munmap (mapped, len);
+			}
+			else {
+				/* Now other processes can switch to the new image */
+				map->shared->mtime = map->source_mtime;
+				map->shared->delta = FALSE;
+				map->generation = g_atomic_int_get (&map->shared->generation) +
+					1;
+				map->base_generation = map->generation;
+				map->shared->base_generation = map->generation;
+				g_atomic_int_set (&map->shared->generation, map->generation);
+				rspamd_map_image_path (map, path, sizeof (path), TRUE);
+				unlink (path);
+				msg_info ("compiled map %s to %z bytes image, generation %d",
+					map->uri, len, map->generation);
+			}
+		}
+	}
+
+	if (data == NULL) {
+		/* Use private image */
+		raw = g_byte_array_free (image, FALSE);
+
+		if ((data = map->load_callback (raw, len, FALSE)) == NULL) {
+			g_free (raw);
+		}
+	}
+	else {
+		g_byte_array_free (image, TRUE);
+	}
+
+	return data;
+}
+
+gboolean
+rspamd_map_publish_delta (struct rspamd_map *map, gpointer data,
+	GByteArray *image)
+{
+	gchar path[PATH_MAX];
+	gpointer mapped;
+	gsize len = image->len;
+	gboolean res = FALSE;
+
+	/* Other processes must have the same base image */
+	if (map->delta_callback != NULL && map->shared != NULL &&
+		map->cfg->temp_dir != NULL && map->base_generation != 0 &&
+		map->base_generation == map->shared->base_generation) {
+		rspamd_map_image_path (map, path, sizeof (path), TRUE);
+
+		if ((mapped = rspamd_map_write_image (path, image)) != NULL) {
+			if (!map->delta_callback (data, mapped, len, TRUE)) {
+				munmap (mapped, len);
+			}
+			else {
+				map->shared->mtime = map->source_mtime;
+				map->shared->delta = TRUE;
+				map->generation = g_atomic_int_get (&map->shared->generation) +
+					1;
+				g_atomic_int_set (&map->shared->generation, map->generation);
+				msg_info ("compiled changes of map %s to %z bytes delta, "
+					"generation %d", map->uri, len, map->generation);
+				res = TRUE;
+			}
+		}
+	}
+
+	g_byte_array_free (image, TRUE);
+
+	return res;
+}
+
+/**
+ * Call fin callback and set new map data
+ */
+static void
+rspamd_map_finish_read (struct rspamd_map *map, struct map_cb_data *cbdata)
+{
+	map->fin_callback (map->pool, cbdata);
+	*map->user_data = cbdata->cur_data;
+
+	if (map->load_callback != NULL) {
+		/* Parsed strings are copied to image, so drop them */
+		rspamd_mempool_delete (map->pool);
+		map->pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	}
+}
+
 /**
  * Helper for HTTP connection establishment
  */
@@ -113,6 +419,11 @@ write_http_request (struct http_callback_data *cbd)
 		strftime (datebuf, sizeof (datebuf), "%a, %d %b %Y %H:%M:%S %Z", tm);
 
 		rspamd_http_message_add_header (msg, "If-Modified-Since", datebuf);
+
+		if (cbd->map->delta_callback != NULL && *cbd->map->user_data != NULL) {
+			/* Server may reply with changes since the date only */
+			rspamd_http_message_add_header (msg, "Map-Delta", "1");
+		}
 	}
 
 	rspamd_http_connection_write_message (cbd->data->conn, msg, cbd->data->host,
@@ -163,8 +474,11 @@ http_map_finish (struct rspamd_http_connection *conn,
 					cbd->remain_buf->len, &cbd->cbdata);
 		}
 
-		map->fin_callback (map->pool, &cbd->cbdata);
-		*map->user_data = cbd->cbdata.cur_data;
+		map->source_mtime = msg->date;
+		cbd->cbdata.delta = cbd->cbdata.prev_data != NULL &&
+			map->delta_callback != NULL &&
+			rspamd_http_message_find_header (msg, "Map-Delta") != NULL;
+		rspamd_map_finish_read (map, &cbd->cbdata);
 		cbd->data->last_checked = msg->date;
 		msg_info ("read map data from %s", cbd->data->host);
 	}
@@ -254,6 +568,7 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data)
 	cbdata.prev_data = *map->user_data;
 	cbdata.cur_data = NULL;
 	cbdata.map = map;
+	cbdata.delta = FALSE;
 
 	rlen = 0;
 	while ((r = read (fd, buf + rlen, sizeof (buf) - rlen - 1)) > 0) {
@@ -269,8 +584,7 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data)
 
 	close (fd);
 
-	map->fin_callback (map->pool, &cbdata);
-	*map->user_data = cbdata.cur_data;
+	rspamd_map_finish_read (map, &cbdata);
 }
 
 static void
@@ -304,15 +618,28 @@ file_callback (gint fd, short what, void *ud)
 	struct file_map_data *data = map->map_data;
 	struct stat st;
 
-	if (g_atomic_int_get (map->locked)) {
+	if (rspamd_map_image_changed (map)) {
+		/* Map has been compiled by another process */
+		jitter_timeout_event (map, FALSE, FALSE);
+		rspamd_map_load_image (map);
+		return;
+	}
+
+	if (!g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
 		msg_info (
 			"don't try to reread map as it is locked by other process, will reread it later");
 		jitter_timeout_event (map, TRUE, FALSE);
 		return;
 	}
 
-	g_atomic_int_inc (map->locked);
 	jitter_timeout_event (map, FALSE, FALSE);
+
+	if (rspamd_map_image_changed (map)) {
+		rspamd_map_load_image (map);
+		g_atomic_int_set (map->locked, 0);
+		return;
+	}
+
 	if (stat (data->filename,
 		&st) != -1 &&
 		(st.st_mtime > data->st.st_mtime || data->st.st_mtime == -1)) {
@@ -325,6 +652,7 @@ file_callback (gint fd, short what, void *ud)
 	}
 
 	msg_info ("rereading map file %s", data->filename);
+	map->source_mtime = st.st_mtime;
 	read_map_file (map, data);
 	g_atomic_int_set (map->locked, 0);
 }
@@ -340,7 +668,14 @@ http_callback (gint fd, short what, void *ud)
 	gint sock;
 	struct http_callback_data *cbd;
 
-	if (g_atomic_int_get (map->locked)) {
+	if (rspamd_map_image_changed (map)) {
+		/* Map has been compiled by another process */
+		jitter_timeout_event (map, FALSE, FALSE);
+		rspamd_map_load_image (map);
+		return;
+	}
+
+	if (!g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
 		msg_info (
 			"don't try to reread map as it is locked by other process, will reread it later");
 		if (data->conn->ud == NULL) {
@@ -352,8 +687,14 @@ http_callback (gint fd, short what, void *ud)
 		return;
 	}
 
-	g_atomic_int_inc (map->locked);
 	jitter_timeout_event (map, FALSE, FALSE);
+
+	if (rspamd_map_image_changed (map)) {
+		rspamd_map_load_image (map);
+		g_atomic_int_set (map->locked, 0);
+		return;
+	}
+
 	/* Connect asynced */
 	if ((sock = connect_http (map, data, TRUE)) == -1) {
 		g_atomic_int_set (map->locked, 0);
@@ -370,6 +711,7 @@ http_callback (gint fd, short what, void *ud)
 		cbd->cbdata.prev_data = *cbd->map->user_data;
 		cbd->cbdata.cur_data = NULL;
 		cbd->cbdata.map = cbd->map;
+		cbd->cbdata.delta = FALSE;
 		cbd->tv.tv_sec = HTTP_CONNECT_TIMEOUT;
 		cbd->tv.tv_usec = 0;
 		cbd->fd = sock;
@@ -379,6 +721,41 @@ http_callback (gint fd, short what, void *ud)
 	}
 }
 
+/*
+ * Load map compiled by another process or compile it on start, returns FALSE
+ * if map is still locked by another process after waiting
+ */
+static gboolean
+rspamd_map_wait_image (struct rspamd_map *map)
+{
+	struct file_map_data *fdata = map->map_data;
+	guint i;
+
+	for (i = 0; i < MAP_IMAGE_WAIT_ATTEMPTS; i++) {
+		if (rspamd_map_image_changed (map)) {
+			rspamd_map_load_image (map);
+			return TRUE;
+		}
+
+		if (g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
+			if (rspamd_map_image_changed (map)) {
+				rspamd_map_load_image (map);
+			}
+			else {
+				map->source_mtime = fdata->st.st_mtime;
+				read_map_file (map, fdata);
+			}
+
+			g_atomic_int_set (map->locked, 0);
+			return TRUE;
+		}
+
+		usleep (MAP_IMAGE_WAIT_USEC);
+	}
+
+	return FALSE;
+}
+
 /* Start watching event for all maps */
 void
 rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
@@ -398,7 +775,10 @@ rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 			fdata = map->map_data;
 			if (fdata->st.st_mtime != -1) {
 				/* Do not try to read non-existent file */
-				read_map_file (map, map->map_data);
+				if (map->shared == NULL || !rspamd_map_wait_image (map)) {
+					map->source_mtime = fdata->st.st_mtime;
+					read_map_file (map, map->map_data);
+				}
 			}
 			/* Plan event with jitter */
 			jitter_timeout_event (map, FALSE, TRUE);
@@ -414,6 +794,22 @@ rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 void
 rspamd_map_remove_all (struct rspamd_config *cfg)
 {
+	GList *cur;
+	struct rspamd_map *map;
+	gchar path[PATH_MAX];
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (map->shared != NULL && map->owner == getpid () &&
+			cfg->temp_dir != NULL) {
+			rspamd_map_image_path (map, path, sizeof (path), FALSE);
+			unlink (path);
+			rspamd_map_image_path (map, path, sizeof (path), TRUE);
+			unlink (path);
+		}
+	}
+
 	g_list_free (cfg->maps);
 	cfg->maps = NULL;
 	if (cfg->map_pool != NULL) {
@@ -487,6 +883,24 @@ rspamd_map_add (struct rspamd_config *cfg,
 	new_map->locked =
 		rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
 
+	/* Maps of common types are compiled by one process and shared */
+	if (read_callback == rspamd_radix_read) {
+		new_map->load_callback = (map_load_cb_t)radix_create_compressed_image;
+		new_map->free_callback = (GDestroyNotify)radix_destroy_compressed;
+	}
+	else if (read_callback == rspamd_hosts_read ||
+		read_callback == rspamd_kv_list_read) {
+		new_map->load_callback = (map_load_cb_t)rspamd_phash_new;
+		new_map->free_callback = (GDestroyNotify)rspamd_phash_destroy;
+		new_map->delta_callback = (map_delta_cb_t)rspamd_phash_attach_delta;
+	}
+
+	if (new_map->load_callback != NULL) {
+		new_map->shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+				sizeof (struct rspamd_map_shared));
+		new_map->owner = getpid ();
+	}
+
 	if (proto == MAP_PROTO_FILE) {
 		new_map->uri = rspamd_mempool_strdup (cfg->cfg_pool, def);
 		def = new_map->uri;
@@ -819,12 +1233,196 @@ rspamd_hosts_read (rspamd_mempool_t * pool,
 			   (insert_func) g_hash_table_insert);
 }
 
+struct rspamd_map_phash_diff {
+	GHashTable *tbl;
+	GHashTable *added;
+	GHashTable *deleted;
+};
+
+static void
+rspamd_map_phash_deleted_cb (const gchar *key, const gchar *value,
+	gpointer ud)
+{
+	struct rspamd_map_phash_diff *diff = ud;
+
+	if (g_hash_table_lookup (diff->tbl, key) == NULL) {
+		g_hash_table_insert (diff->deleted, (gpointer)key, (gpointer)key);
+	}
+}
+
+/*
+ * Find keys of the new list that differ from the base image
+ */
+static void
+rspamd_map_phash_diff (rspamd_phash_t *base, struct rspamd_map_phash_diff *diff)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	const gchar *old;
+
+	rspamd_phash_foreach (base, rspamd_map_phash_deleted_cb, diff);
+
+	g_hash_table_iter_init (&it, diff->tbl);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		old = rspamd_phash_lookup_base (base, k);
+
+		if (old == NULL || strcmp (old, v != NULL ? v : "") != 0) {
+			g_hash_table_insert (diff->added, k, v);
+		}
+	}
+}
+
+static void
+rspamd_map_phash_delta_cb (const gchar *key, const gchar *value, gpointer ud)
+{
+	struct rspamd_map_phash_diff *diff = ud;
+
+	if (value == NULL) {
+		g_hash_table_insert (diff->deleted, (gpointer)key, (gpointer)key);
+	}
+	else {
+		g_hash_table_insert (diff->added, (gpointer)key, (gpointer)value);
+	}
+}
+
+/*
+ * Apply lines like `+key value` and `-key` sent by server to the changes
+ * of the base image
+ */
+static void
+rspamd_map_phash_merge (rspamd_phash_t *base,
+	struct rspamd_map_phash_diff *diff)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	const gchar *key, *old;
+
+	rspamd_phash_foreach (rspamd_phash_get_delta (base),
+		rspamd_map_phash_delta_cb, diff);
+
+	g_hash_table_iter_init (&it, diff->tbl);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		key = k;
+
+		if (*key == '+') {
+			key++;
+			g_hash_table_remove (diff->deleted, key);
+			old = rspamd_phash_lookup_base (base, key);
+
+			if (old != NULL && strcmp (old, v != NULL ? v : "") == 0) {
+				g_hash_table_remove (diff->added, key);
+			}
+			else {
+				g_hash_table_replace (diff->added, (gpointer)key, v);
+			}
+		}
+		else if (*key == '-') {
+			key++;
+			g_hash_table_remove (diff->added, key);
+
+			if (rspamd_phash_lookup_base (base, key) != NULL) {
+				g_hash_table_replace (diff->deleted, (gpointer)key,
+					(gpointer)key);
+			}
+		}
+		else {
+			msg_warn ("invalid line in delta of map: %s", key);
+		}
+	}
+}
+
+static void
+rspamd_map_phash_full_cb (const gchar *key, const gchar *value, gpointer ud)
+{
+	struct rspamd_map_phash_diff *diff = ud;
+
+	if (g_hash_table_lookup (diff->deleted, key) == NULL) {
+		g_hash_table_insert (diff->tbl, (gpointer)key, (gpointer)value);
+	}
+}
+
+/**
+ * Compile parsed list to perfect hash
+ */
+static void
+rspamd_map_phash_fin (struct map_cb_data *data)
+{
+	struct rspamd_map_phash_diff diff;
+	rspamd_phash_t *prev = data->prev_data;
+	GHashTable *parsed = data->cur_data, *tbl;
+	GHashTableIter it;
+	GByteArray *image;
+	gpointer k, v;
+	guint changes;
+
+	if (parsed == NULL) {
+		parsed = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	}
+
+	tbl = parsed;
+	diff.tbl = parsed;
+	diff.added = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	diff.deleted = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	data->cur_data = NULL;
+
+	if (prev != NULL) {
+		if (data->delta) {
+			rspamd_map_phash_merge (prev, &diff);
+		}
+		else {
+			rspamd_map_phash_diff (prev, &diff);
+		}
+
+		changes = g_hash_table_size (diff.added) +
+			g_hash_table_size (diff.deleted);
+
+		/* Small changes are attached to the current image */
+		if (changes * MAP_DELTA_RATIO <= rspamd_phash_size (prev) &&
+			(image = rspamd_phash_build_delta (prev, diff.added,
+			diff.deleted)) != NULL &&
+			rspamd_map_publish_delta (data->map, prev, image)) {
+			data->cur_data = prev;
+		}
+		else if (data->delta) {
+			/* Restore the full list from the base image and changes */
+			tbl = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+			diff.tbl = tbl;
+			rspamd_phash_foreach (prev, rspamd_map_phash_full_cb, &diff);
+			g_hash_table_iter_init (&it, diff.added);
+			while (g_hash_table_iter_next (&it, &k, &v)) {
+				g_hash_table_replace (tbl, k, v);
+			}
+		}
+	}
+
+	if (data->cur_data == NULL) {
+		image = rspamd_phash_build (tbl);
+
+		if (image != NULL) {
+			data->cur_data = rspamd_map_publish_image (data->map, image);
+		}
+
+		if (data->cur_data == NULL) {
+			/* Keep the previous version of map */
+			data->cur_data = prev;
+		}
+		else if (prev != NULL) {
+			rspamd_phash_destroy (prev);
+		}
+	}
+
+	if (tbl != parsed) {
+		g_hash_table_destroy (tbl);
+	}
+	g_hash_table_destroy (parsed);
+	g_hash_table_destroy (diff.added);
+	g_hash_table_destroy (diff.deleted);
+}
+
 void
 rspamd_hosts_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
-	if (data->prev_data) {
-		g_hash_table_destroy (data->prev_data);
-	}
+	rspamd_map_phash_fin (data);
 }
 
 gchar *
@@ -847,9 +1445,7 @@ rspamd_kv_list_read (rspamd_mempool_t * pool,
 void
 rspamd_kv_list_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
-	if (data->prev_data) {
-		g_hash_table_destroy (data->prev_data);
-	}
+	rspamd_map_phash_fin (data);
 }
 
 gchar *
@@ -871,7 +1467,21 @@ rspamd_radix_read (rspamd_mempool_t * pool,
 void
 rspamd_radix_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
-	if (data->prev_data) {
+	radix_compressed_t *tree = data->cur_data;
+
+	if (tree == NULL) {
+		tree = radix_create_compressed ();
+	}
+
+	data->cur_data = rspamd_map_publish_image (data->map,
+			radix_compressed_serialize (tree));
+	radix_destroy_compressed (tree);
+
+	if (data->cur_data == NULL) {
+		/* Keep the previous version of map */
+		data->cur_data = data->prev_data;
+	}
+	else if (data->prev_data) {
 		radix_destroy_compressed (data->prev_data);
 	}
 }
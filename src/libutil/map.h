@@ -4,6 +4,7 @@
 #include "config.h"
 #include "mem_pool.h"
 #include "radix.h"
+#include "phash.h"
 
 /**
  * Maps API is designed to load lists data from different dynamic sources.
@@ -23,6 +24,30 @@ struct map_cb_data;
 typedef gchar * (*map_cb_t)(rspamd_mempool_t *pool, gchar *chunk, gint len,
 	struct map_cb_data *data);
 typedef void (*map_fin_cb_t)(rspamd_mempool_t *pool, struct map_cb_data *data);
+typedef void * (*map_load_cb_t)(gpointer image, gsize len, gboolean mapped);
+typedef gboolean (*map_delta_cb_t)(gpointer data, gpointer image, gsize len,
+	gboolean mapped);
+
+/**
+ * Maps of common types (radix, hosts and kv lists) are parsed by one process
+ * only: it compiles map to an image without pointers and writes it to the
+ * temporary directory. Other processes just map the current image, they find
+ * out that map has been changed by the generation in the shared memory.
+ * Small changes of hosts and kv lists are written as a delta image that is
+ * attached to the current base image, so processes do not reload the whole
+ * map on each change. HTTP maps send `Map-Delta: 1` header with requests and
+ * server may reply with the same header and lines `+key [value]` and `-key`
+ * describing changes since `If-Modified-Since` date.
+ */
+struct rspamd_map_shared {
+	gint generation;
+	/* Generation of the last full image */
+	gint base_generation;
+	/* Delta image is published for the base image */
+	gboolean delta;
+	/* Time of the source the current image has been built from */
+	time_t mtime;
+};
 
 /**
  * Common map object
@@ -45,6 +70,15 @@ struct rspamd_map {
 	guint32 checksum;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	/* Compiled images support */
+	map_load_cb_t load_callback;
+	GDestroyNotify free_callback;
+	map_delta_cb_t delta_callback;
+	struct rspamd_map_shared *shared;
+	gint generation;
+	gint base_generation;
+	time_t source_mtime;
+	pid_t owner;
 };
 
 /**
@@ -55,6 +89,8 @@ struct map_cb_data {
 	gint state;
 	void *prev_data;
 	void *cur_data;
+	/* Source has sent only changes of the current data */
+	gboolean delta;
 };
 
 
@@ -85,6 +121,26 @@ void rspamd_map_remove_all (struct rspamd_config *cfg);
 typedef void (*insert_func) (gpointer st, gconstpointer key,
 	gconstpointer value);
 
+/**
+ * Write compiled image of map to the temporary directory and make it current
+ * for all processes, should be called from fin callbacks of maps with images
+ * @param map map object
+ * @param image compiled image (freed by this function)
+ * @return map data created from image by load callback of map
+ */
+gpointer rspamd_map_publish_image (struct rspamd_map *map, GByteArray *image);
+
+/**
+ * Write delta image of map and attach it to the current map data of all
+ * processes
+ * @param map map object
+ * @param data current map data built from the shared base image
+ * @param image compiled delta (freed by this function)
+ * @return TRUE if delta has been attached to data
+ */
+gboolean rspamd_map_publish_delta (struct rspamd_map *map, gpointer data,
+	GByteArray *image);
+
 /**
  * Common callbacks for frequent types of lists
  */
@@ -99,7 +155,7 @@ gchar * rspamd_radix_read (rspamd_mempool_t *pool,
 void rspamd_radix_fin (rspamd_mempool_t *pool, struct map_cb_data *data);
 
 /**
- * Host list is an ordinal list of hosts or domains
+ * Host list is an ordinal list of hosts or domains, map data is rspamd_phash_t
  */
 gchar * rspamd_hosts_read (rspamd_mempool_t *pool,
 	gchar *chunk,
@@ -108,7 +164,8 @@ gchar * rspamd_hosts_read (rspamd_mempool_t *pool,
 void rspamd_hosts_fin (rspamd_mempool_t *pool, struct map_cb_data *data);
 
 /**
- * Kv list is an ordinal list of keys and values separated by whitespace
+ * Kv list is an ordinal list of keys and values separated by whitespace, map
+ * data is rspamd_phash_t
  */
 gchar * rspamd_kv_list_read (rspamd_mempool_t *pool,
 	gchar *chunk,
@@ -0,0 +1,468 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "msgpack.h"
+
+#define MSGPACK_MAX_DEPTH 64
+
+#define MSGPACK_ERROR rspamd_msgpack_error_quark ()
+static GQuark
+rspamd_msgpack_error_quark (void)
+{
+	return g_quark_from_static_string ("msgpack-error");
+}
+
+static inline void
+rspamd_msgpack_write_tag16 (GString *buf, guchar tag, guint16 val)
+{
+	guint16 be = GUINT16_TO_BE (val);
+
+	g_string_append_c (buf, tag);
+	g_string_append_len (buf, (const gchar *)&be, sizeof (be));
+}
+
+static inline void
+rspamd_msgpack_write_tag32 (GString *buf, guchar tag, guint32 val)
+{
+	guint32 be = GUINT32_TO_BE (val);
+
+	g_string_append_c (buf, tag);
+	g_string_append_len (buf, (const gchar *)&be, sizeof (be));
+}
+
+static inline void
+rspamd_msgpack_write_tag64 (GString *buf, guchar tag, guint64 val)
+{
+	guint64 be = GUINT64_TO_BE (val);
+
+	g_string_append_c (buf, tag);
+	g_string_append_len (buf, (const gchar *)&be, sizeof (be));
+}
+
+void
+rspamd_msgpack_write_map (GString *buf, guint32 n)
+{
+	if (n < 16) {
+		g_string_append_c (buf, 0x80 | n);
+	}
+	else if (n <= G_MAXUINT16) {
+		rspamd_msgpack_write_tag16 (buf, 0xde, n);
+	}
+	else {
+		rspamd_msgpack_write_tag32 (buf, 0xdf, n);
+	}
+}
+
+void
+rspamd_msgpack_write_array (GString *buf, guint32 n)
+{
+	if (n < 16) {
+		g_string_append_c (buf, 0x90 | n);
+	}
+	else if (n <= G_MAXUINT16) {
+		rspamd_msgpack_write_tag16 (buf, 0xdc, n);
+	}
+	else {
+		rspamd_msgpack_write_tag32 (buf, 0xdd, n);
+	}
+}
+
+void
+rspamd_msgpack_write_lstring (GString *buf, const gchar *str, gsize len)
+{
+	if (len < 32) {
+		g_string_append_c (buf, 0xa0 | len);
+	}
+	else if (len <= G_MAXUINT8) {
+		g_string_append_c (buf, 0xd9);
+		g_string_append_c (buf, len);
+	}
+	else if (len <= G_MAXUINT16) {
+		rspamd_msgpack_write_tag16 (buf, 0xda, len);
+	}
+	else {
+		rspamd_msgpack_write_tag32 (buf, 0xdb, len);
+	}
+
+	g_string_append_len (buf, str, len);
+}
+
+void
+rspamd_msgpack_write_string (GString *buf, const gchar *str)
+{
+	if (str == NULL) {
+		rspamd_msgpack_write_nil (buf);
+	}
+	else {
+		rspamd_msgpack_write_lstring (buf, str, strlen (str));
+	}
+}
+
+void
+rspamd_msgpack_write_int (GString *buf, gint64 val)
+{
+	if (val >= 0) {
+		if (val < 128) {
+			g_string_append_c (buf, val);
+		}
+		else if (val <= G_MAXUINT8) {
+			g_string_append_c (buf, 0xcc);
+			g_string_append_c (buf, val);
+		}
+		else if (val <= G_MAXUINT16) {
+			rspamd_msgpack_write_tag16 (buf, 0xcd, val);
+		}
+		else if (val <= G_MAXUINT32) {
+			rspamd_msgpack_write_tag32 (buf, 0xce, val);
+		}
+		else {
+			rspamd_msgpack_write_tag64 (buf, 0xcf, val);
+		}
+	}
+	else {
+		if (val >= -32) {
+			g_string_append_c (buf, (gint8)val);
+		}
+		else if (val >= G_MININT8) {
+			g_string_append_c (buf, 0xd0);
+			g_string_append_c (buf, (gint8)val);
+		}
+		else if (val >= G_MININT16) {
+			rspamd_msgpack_write_tag16 (buf, 0xd1, (guint16)(gint16)val);
+		}
+		else if (val >= G_MININT32) {
+			rspamd_msgpack_write_tag32 (buf, 0xd2, (guint32)(gint32)val);
+		}
+		else {
+			rspamd_msgpack_write_tag64 (buf, 0xd3, (guint64)val);
+		}
+	}
+}
+
+void
+rspamd_msgpack_write_double (GString *buf, gdouble val)
+{
+	union {
+		gdouble d;
+		guint64 i;
+	} u;
+
+	u.d = val;
+	rspamd_msgpack_write_tag64 (buf, 0xcb, u.i);
+}
+
+void
+rspamd_msgpack_write_bool (GString *buf, gboolean val)
+{
+	g_string_append_c (buf, val ? 0xc3 : 0xc2);
+}
+
+void
+rspamd_msgpack_write_nil (GString *buf)
+{
+	g_string_append_c (buf, 0xc0);
+}
+
+/*
+ * Decoder part
+ */
+struct rspamd_msgpack_parser {
+	const guchar *p;
+	const guchar *end;
+	guint depth;
+	GError **err;
+};
+
+static ucl_object_t * rspamd_msgpack_parse_elt (
+	struct rspamd_msgpack_parser *parser);
+
+static gboolean
+rspamd_msgpack_read_be (struct rspamd_msgpack_parser *parser, guint nbytes,
+	guint64 *res)
+{
+	guint i;
+
+	if ((gsize)(parser->end - parser->p) < nbytes) {
+		g_set_error (parser->err, MSGPACK_ERROR, EINVAL,
+			"truncated input: need %u bytes", nbytes);
+		return FALSE;
+	}
+
+	*res = 0;
+	for (i = 0; i < nbytes; i++) {
+		*res = (*res << 8) | *parser->p++;
+	}
+
+	return TRUE;
+}
+
+static ucl_object_t *
+rspamd_msgpack_parse_string (struct rspamd_msgpack_parser *parser, gsize len)
+{
+	ucl_object_t *obj;
+
+	if ((gsize)(parser->end - parser->p) < len) {
+		g_set_error (parser->err, MSGPACK_ERROR, EINVAL,
+			"truncated string of length %" G_GSIZE_FORMAT, len);
+		return NULL;
+	}
+
+	obj = ucl_object_fromlstring ((const gchar *)parser->p, len);
+	parser->p += len;
+
+	return obj;
+}
+
+static ucl_object_t *
+rspamd_msgpack_parse_array (struct rspamd_msgpack_parser *parser, gsize n)
+{
+	ucl_object_t *top, *elt;
+	gsize i;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < n; i++) {
+		elt = rspamd_msgpack_parse_elt (parser);
+		if (elt == NULL) {
+			ucl_object_unref (top);
+			return NULL;
+		}
+		ucl_array_append (top, elt);
+	}
+
+	return top;
+}
+
+static ucl_object_t *
+rspamd_msgpack_parse_map (struct rspamd_msgpack_parser *parser, gsize n)
+{
+	ucl_object_t *top, *key, *elt;
+	gsize i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < n; i++) {
+		key = rspamd_msgpack_parse_elt (parser);
+		if (key == NULL) {
+			ucl_object_unref (top);
+			return NULL;
+		}
+		if (key->type != UCL_STRING) {
+			g_set_error (parser->err, MSGPACK_ERROR, EINVAL,
+				"non-string keys are not supported");
+			ucl_object_unref (key);
+			ucl_object_unref (top);
+			return NULL;
+		}
+		elt = rspamd_msgpack_parse_elt (parser);
+		if (elt == NULL) {
+			ucl_object_unref (key);
+			ucl_object_unref (top);
+			return NULL;
+		}
+		ucl_object_insert_key (top, elt, ucl_object_tostring (key), key->len,
+			true);
+		ucl_object_unref (key);
+	}
+
+	return top;
+}
+
+static ucl_object_t *
+rspamd_msgpack_parse_elt (struct rspamd_msgpack_parser *parser)
+{
+	ucl_object_t *res = NULL;
+	guchar tag;
+	guint64 val;
+	union {
+		gdouble d;
+		guint64 i;
+	} u;
+	union {
+		gfloat f;
+		guint32 i;
+	} uf;
+
+	if (parser->p >= parser->end) {
+		g_set_error (parser->err, MSGPACK_ERROR, EINVAL, "unexpected end of input");
+		return NULL;
+	}
+
+	if (++parser->depth > MSGPACK_MAX_DEPTH) {
+		g_set_error (parser->err, MSGPACK_ERROR, E2BIG, "nesting is too deep");
+		return NULL;
+	}
+
+	tag = *parser->p++;
+
+	if (tag <= 0x7f) {
+		res = ucl_object_fromint (tag);
+	}
+	else if (tag >= 0xe0) {
+		res = ucl_object_fromint ((gint8)tag);
+	}
+	else if ((tag & 0xf0) == 0x80) {
+		res = rspamd_msgpack_parse_map (parser, tag & 0x0f);
+	}
+	else if ((tag & 0xf0) == 0x90) {
+		res = rspamd_msgpack_parse_array (parser, tag & 0x0f);
+	}
+	else if ((tag & 0xe0) == 0xa0) {
+		res = rspamd_msgpack_parse_string (parser, tag & 0x1f);
+	}
+	else {
+		switch (tag) {
+		case 0xc0:
+			res = ucl_object_typed_new (UCL_NULL);
+			break;
+		case 0xc2:
+			res = ucl_object_frombool (false);
+			break;
+		case 0xc3:
+			res = ucl_object_frombool (true);
+			break;
+		case 0xc4:
+		case 0xd9:
+			if (rspamd_msgpack_read_be (parser, 1, &val)) {
+				res = rspamd_msgpack_parse_string (parser, val);
+			}
+			break;
+		case 0xc5:
+		case 0xda:
+			if (rspamd_msgpack_read_be (parser, 2, &val)) {
+				res = rspamd_msgpack_parse_string (parser, val);
+			}
+			break;
+		case 0xc6:
+		case 0xdb:
+			if (rspamd_msgpack_read_be (parser, 4, &val)) {
+				res = rspamd_msgpack_parse_string (parser, val);
+			}
+			break;
+		case 0xca:
+			if (rspamd_msgpack_read_be (parser, 4, &val)) {
+				uf.i = val;
+				res = ucl_object_fromdouble (uf.f);
+			}
+			break;
+		case 0xcb:
+			if (rspamd_msgpack_read_be (parser, 8, &val)) {
+				u.i = val;
+				res = ucl_object_fromdouble (u.d);
+			}
+			break;
+		case 0xcc:
+			if (rspamd_msgpack_read_be (parser, 1, &val)) {
+				res = ucl_object_fromint (val);
+			}
+			break;
+		case 0xcd:
+			if (rspamd_msgpack_read_be (parser, 2, &val)) {
+				res = ucl_object_fromint (val);
+			}
+			break;
+		case 0xce:
+			if (rspamd_msgpack_read_be (parser, 4, &val)) {
+				res = ucl_object_fromint (val);
+			}
+			break;
+		case 0xcf:
+			if (rspamd_msgpack_read_be (parser, 8, &val)) {
+				res = ucl_object_fromint (val);
+			}
+			break;
+		case 0xd0:
+			if (rspamd_msgpack_read_be (parser, 1, &val)) {
+				res = ucl_object_fromint ((gint8)val);
+			}
+			break;
+		case 0xd1:
+			if (rspamd_msgpack_read_be (parser, 2, &val)) {
+				res = ucl_object_fromint ((gint16)val);
+			}
+			break;
+		case 0xd2:
+			if (rspamd_msgpack_read_be (parser, 4, &val)) {
+				res = ucl_object_fromint ((gint32)val);
+			}
+			break;
+		case 0xd3:
+			if (rspamd_msgpack_read_be (parser, 8, &val)) {
+				res = ucl_object_fromint ((gint64)val);
+			}
+			break;
+		case 0xdc:
+			if (rspamd_msgpack_read_be (parser, 2, &val)) {
+				res = rspamd_msgpack_parse_array (parser, val);
+			}
+			break;
+		case 0xdd:
+			if (rspamd_msgpack_read_be (parser, 4, &val)) {
+				res = rspamd_msgpack_parse_array (parser, val);
+			}
+			break;
+		case 0xde:
+			if (rspamd_msgpack_read_be (parser, 2, &val)) {
+				res = rspamd_msgpack_parse_map (parser, val);
+			}
+			break;
+		case 0xdf:
+			if (rspamd_msgpack_read_be (parser, 4, &val)) {
+				res = rspamd_msgpack_parse_map (parser, val);
+			}
+			break;
+		default:
+			g_set_error (parser->err, MSGPACK_ERROR, EINVAL,
+				"unsupported msgpack type: 0x%x", (guint)tag);
+			break;
+		}
+	}
+
+	parser->depth--;
+
+	return res;
+}
+
+ucl_object_t *
+rspamd_msgpack_to_ucl (const guchar *data, gsize len, GError **err)
+{
+	struct rspamd_msgpack_parser parser;
+	ucl_object_t *res;
+
+	parser.p = data;
+	parser.end = data + len;
+	parser.depth = 0;
+	parser.err = err;
+
+	res = rspamd_msgpack_parse_elt (&parser);
+
+	if (res != NULL && parser.p != parser.end) {
+		g_set_error (err, MSGPACK_ERROR, EINVAL,
+			"garbage after the end of object");
+		ucl_object_unref (res);
+		res = NULL;
+	}
+
+	return res;
+}
@@ -0,0 +1,88 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef MSGPACK_H_
+#define MSGPACK_H_
+
+/**
+ * @file msgpack.h
+ * Minimal msgpack encoder that writes directly to a GString buffer and
+ * decoder to UCL objects. It is used for compact binary replies of the scan
+ * protocol.
+ */
+
+#include "config.h"
+#include "ucl.h"
+
+#define RSPAMD_MSGPACK_CTYPE "application/msgpack"
+
+/**
+ * Write map header for `n` key-value pairs
+ */
+void rspamd_msgpack_write_map (GString *buf, guint32 n);
+
+/**
+ * Write array header for `n` elements
+ */
+void rspamd_msgpack_write_array (GString *buf, guint32 n);
+
+/**
+ * Write string of the specified length
+ */
+void rspamd_msgpack_write_lstring (GString *buf, const gchar *str, gsize len);
+
+/**
+ * Write zero terminated string (or nil if `str` is NULL)
+ */
+void rspamd_msgpack_write_string (GString *buf, const gchar *str);
+
+/**
+ * Write signed integer using the shortest possible encoding
+ */
+void rspamd_msgpack_write_int (GString *buf, gint64 val);
+
+/**
+ * Write double precision float
+ */
+void rspamd_msgpack_write_double (GString *buf, gdouble val);
+
+/**
+ * Write boolean value
+ */
+void rspamd_msgpack_write_bool (GString *buf, gboolean val);
+
+/**
+ * Write nil value
+ */
+void rspamd_msgpack_write_nil (GString *buf);
+
+/**
+ * Decode msgpack encoded data to UCL object
+ * @param data input
+ * @param len length of input
+ * @param err error pointer
+ * @return new UCL object or NULL in case of error
+ */
+ucl_object_t * rspamd_msgpack_to_ucl (const guchar *data, gsize len,
+	GError **err);
+
+#endif /* MSGPACK_H_ */
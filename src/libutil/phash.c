@@ -0,0 +1,684 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "phash.h"
+#include "logger.h"
+#include "util.h"
+#include "xxhash.h"
+
+#define PHASH_MAGIC "rsphash"
+/* Images of other versions have incompatible layout */
+#define PHASH_VERSION 2
+/* Average number of keys in a bucket */
+#define PHASH_BUCKET_KEYS 4
+/* Displacements tried for a bucket before a new seed is chosen */
+#define PHASH_MAX_DISP 65536
+#define PHASH_MAX_ATTEMPTS 8
+/* Keys shorter than this are lowercased without allocations */
+#define PHASH_KEY_BUF 256
+/* Value length of keys deleted by a delta */
+#define PHASH_DELETED G_MAXUINT32
+/*
+ * Bloom filter is built for large hashes only, it is split to blocks of one
+ * cache line and all probes of a key are done in the same block
+ */
+#define PHASH_BLOOM_MIN_KEYS 1024
+#define PHASH_BLOOM_BITS_PER_KEY 10
+#define PHASH_BLOOM_BLOCK_WORDS 8
+#define PHASH_BLOOM_BLOCK_BITS (PHASH_BLOOM_BLOCK_WORDS * 64)
+#define PHASH_BLOOM_PROBES 6
+
+struct rspamd_phash_header {
+	gchar magic[8];
+	guint32 nkeys;
+	guint32 nslots;
+	guint32 nbuckets;
+	guint32 seed;
+	/* Random id of image and id of the base image for a delta */
+	guint32 id;
+	guint32 base_id;
+	guint64 strings_len;
+	/* Number of bloom filter blocks, zero if there is no filter */
+	guint32 bloom_blocks;
+	guint32 version;
+	/* Pads header to a cache line, so blocks of bloom filter are aligned */
+	guint32 reserved[4];
+	/* Bloom filter, displacements, slots and strings follow */
+};
+
+struct rspamd_phash_entry {
+	guint32 keylen;
+	guint32 vallen;
+	/* Key and value follow, both are zero terminated */
+};
+
+struct rspamd_phash_s {
+	const struct rspamd_phash_header *hdr;
+	const guint64 *bloom;
+	const guint32 *disp;
+	/* Offsets of entries in strings plus one, zero means an empty slot */
+	const guint32 *slots;
+	const guchar *strings;
+	gpointer image;
+	gsize len;
+	gboolean mapped;
+	/* Changes of the base hash */
+	rspamd_phash_t *delta;
+};
+
+struct rspamd_phash_elt {
+	gchar *key;
+	const gchar *value;
+	gsize keylen;
+	gsize vallen;
+	guint64 hash;
+	guint32 bucket;
+	guint32 slot;
+};
+
+struct rspamd_phash_bucket {
+	guint32 id;
+	guint32 start;
+	guint32 nkeys;
+};
+
+static inline guint64
+rspamd_phash_hash (const gchar *key, gsize len, guint32 seed)
+{
+	guint64 h;
+
+	h = XXH32 (key, len, seed);
+	h = (h << 32) | XXH32 (key, len, ~seed);
+
+	return h;
+}
+
+static inline guint32
+rspamd_phash_slot (guint64 h, guint32 disp, guint32 nslots)
+{
+	/* Finalizer of murmur3 */
+	h ^= disp * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	return h % nslots;
+}
+
+/*
+ * Probes are taken from the other bits of the same hash, so the filter costs
+ * no hashing and one cache line
+ */
+static inline const guint64 *
+rspamd_phash_bloom_block (const guint64 *bloom, guint32 nblocks, guint64 h,
+	guint64 *probes)
+{
+	*probes = (h >> 32) | (h << 32);
+	*probes *= 0x9E3779B97F4A7C15ULL;
+
+	return bloom + ((guint32)h % nblocks) * PHASH_BLOOM_BLOCK_WORDS;
+}
+
+static gboolean
+rspamd_phash_bloom_check (rspamd_phash_t *ph, guint64 h)
+{
+	const guint64 *block;
+	guint64 probes;
+	guint i, bit;
+
+	if (ph->hdr->bloom_blocks == 0) {
+		return TRUE;
+	}
+
+	block = rspamd_phash_bloom_block (ph->bloom, ph->hdr->bloom_blocks, h,
+			&probes);
+
+	for (i = 0; i < PHASH_BLOOM_PROBES; i++) {
+		bit = probes % PHASH_BLOOM_BLOCK_BITS;
+		probes >>= 9;
+
+		if ((block[bit / 64] & (1ULL << (bit % 64))) == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gint
+rspamd_phash_elt_cmp (const void *a, const void *b)
+{
+	const struct rspamd_phash_elt *e1 = a, *e2 = b;
+
+	if (e1->bucket < e2->bucket) {
+		return -1;
+	}
+	else if (e1->bucket > e2->bucket) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_phash_bucket_cmp (const void *a, const void *b)
+{
+	const struct rspamd_phash_bucket *b1 = a, *b2 = b;
+
+	/* Place the largest buckets first */
+	if (b1->nkeys != b2->nkeys) {
+		return b1->nkeys > b2->nkeys ? -1 : 1;
+	}
+
+	return b1->id < b2->id ? -1 : (b1->id > b2->id);
+}
+
+/*
+ * Try to find displacements for all buckets using the specified seed
+ */
+static gboolean
+rspamd_phash_place (struct rspamd_phash_elt *elts, guint32 nkeys,
+	guint32 nbuckets, guint32 nslots, guint32 seed, guint32 *disp)
+{
+	struct rspamd_phash_bucket *buckets;
+	guint8 *used;
+	guint32 i, j, k, d, nb = 0;
+	gboolean placed = TRUE;
+
+	for (i = 0; i < nkeys; i++) {
+		elts[i].hash = rspamd_phash_hash (elts[i].key, elts[i].keylen, seed);
+		elts[i].bucket = (elts[i].hash >> 32) % nbuckets;
+	}
+
+	qsort (elts, nkeys, sizeof (*elts), rspamd_phash_elt_cmp);
+
+	buckets = g_malloc0 (nbuckets * sizeof (*buckets));
+	used = g_malloc0 (nslots);
+
+	for (i = 0; i < nkeys; i++) {
+		if (i == 0 || elts[i].bucket != elts[i - 1].bucket) {
+			buckets[nb].id = elts[i].bucket;
+			buckets[nb].start = i;
+			nb++;
+		}
+		buckets[nb - 1].nkeys++;
+	}
+
+	qsort (buckets, nb, sizeof (*buckets), rspamd_phash_bucket_cmp);
+	memset (disp, 0, nbuckets * sizeof (*disp));
+
+	for (i = 0; i < nb && placed; i++) {
+		placed = FALSE;
+
+		for (d = 0; d < PHASH_MAX_DISP && !placed; d++) {
+			placed = TRUE;
+
+			for (j = 0; j < buckets[i].nkeys; j++) {
+				k = buckets[i].start + j;
+				elts[k].slot = rspamd_phash_slot (elts[k].hash, d, nslots);
+
+				if (used[elts[k].slot]) {
+					/* Release slots taken by previous keys of this bucket */
+					while (j > 0) {
+						j--;
+						used[elts[buckets[i].start + j].slot] = 0;
+					}
+					placed = FALSE;
+					break;
+				}
+
+				used[elts[k].slot] = 1;
+			}
+
+			if (placed) {
+				disp[buckets[i].id] = d;
+			}
+		}
+	}
+
+	g_free (buckets);
+	g_free (used);
+
+	return placed;
+}
+
+static GByteArray *
+rspamd_phash_build_elts (struct rspamd_phash_elt *elts, guint32 nkeys,
+	guint32 base_id)
+{
+	struct rspamd_phash_header hdr;
+	struct rspamd_phash_entry entry;
+	GByteArray *res = NULL;
+	guint64 *bloom = NULL, *block, probes;
+	guint32 nslots, nbuckets, nblocks = 0, seed = 0, *disp, *slots, i, j, bit;
+	guint64 off;
+	guint attempt;
+	static const guchar pad[sizeof (guint32)];
+
+	nslots = nkeys + nkeys / PHASH_BUCKET_KEYS + 1;
+	nbuckets = nkeys / PHASH_BUCKET_KEYS + 1;
+	disp = g_malloc0 (nbuckets * sizeof (*disp));
+	slots = g_malloc0 (nslots * sizeof (*slots));
+
+	for (attempt = 0; attempt < PHASH_MAX_ATTEMPTS; attempt++) {
+		if (rspamd_phash_place (elts, nkeys, nbuckets, nslots, seed, disp)) {
+			break;
+		}
+		seed = g_random_int ();
+	}
+
+	if (attempt == PHASH_MAX_ATTEMPTS) {
+		msg_err ("cannot build perfect hash for %ud keys", nkeys);
+	}
+	else {
+		/* Assign offsets to entries */
+		off = 0;
+
+		for (i = 0; i < nkeys; i++) {
+			slots[elts[i].slot] = off + 1;
+			off += sizeof (entry) + elts[i].keylen + elts[i].vallen + 2;
+			off = (off + sizeof (guint32) - 1) & ~(sizeof (guint32) - 1);
+		}
+
+		if (nkeys >= PHASH_BLOOM_MIN_KEYS) {
+			nblocks = ((guint64)nkeys * PHASH_BLOOM_BITS_PER_KEY +
+				PHASH_BLOOM_BLOCK_BITS - 1) / PHASH_BLOOM_BLOCK_BITS;
+			bloom = g_malloc0 (nblocks * PHASH_BLOOM_BLOCK_WORDS *
+					sizeof (*bloom));
+
+			for (i = 0; i < nkeys; i++) {
+				block = (guint64 *)rspamd_phash_bloom_block (bloom, nblocks,
+						elts[i].hash, &probes);
+
+				for (j = 0; j < PHASH_BLOOM_PROBES; j++) {
+					bit = probes % PHASH_BLOOM_BLOCK_BITS;
+					probes >>= 9;
+					block[bit / 64] |= 1ULL << (bit % 64);
+				}
+			}
+		}
+
+		if (off >= G_MAXUINT32) {
+			msg_err ("cannot build perfect hash: too much data");
+		}
+		else {
+			memset (&hdr, 0, sizeof (hdr));
+			memcpy (hdr.magic, PHASH_MAGIC, sizeof (PHASH_MAGIC));
+			hdr.nkeys = nkeys;
+			hdr.nslots = nslots;
+			hdr.nbuckets = nbuckets;
+			hdr.seed = seed;
+			hdr.id = g_random_int () | 1;
+			hdr.base_id = base_id;
+			hdr.strings_len = off;
+			hdr.bloom_blocks = nblocks;
+			hdr.version = PHASH_VERSION;
+
+			res = g_byte_array_sized_new (sizeof (hdr) +
+				nblocks * PHASH_BLOOM_BLOCK_WORDS * sizeof (guint64) +
+				(nbuckets + nslots) * sizeof (guint32) + off);
+			g_byte_array_append (res, (const guint8 *)&hdr, sizeof (hdr));
+
+			if (bloom != NULL) {
+				g_byte_array_append (res, (const guint8 *)bloom,
+					nblocks * PHASH_BLOOM_BLOCK_WORDS * sizeof (*bloom));
+			}
+
+			g_byte_array_append (res, (const guint8 *)disp,
+				nbuckets * sizeof (*disp));
+			g_byte_array_append (res, (const guint8 *)slots,
+				nslots * sizeof (*slots));
+
+			for (i = 0; i < nkeys; i++) {
+				entry.keylen = elts[i].keylen;
+				entry.vallen = elts[i].value != NULL ? elts[i].vallen :
+					PHASH_DELETED;
+				g_byte_array_append (res, (const guint8 *)&entry,
+					sizeof (entry));
+				g_byte_array_append (res, (const guint8 *)elts[i].key,
+					elts[i].keylen + 1);
+				g_byte_array_append (res, elts[i].value != NULL ?
+					(const guint8 *)elts[i].value : pad, elts[i].vallen + 1);
+				off = sizeof (entry) + elts[i].keylen + elts[i].vallen + 2;
+				off %= sizeof (guint32);
+
+				if (off != 0) {
+					g_byte_array_append (res, pad, sizeof (guint32) - off);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		g_free (elts[i].key);
+	}
+
+	g_free (elts);
+	g_free (disp);
+	g_free (slots);
+	g_free (bloom);
+
+	return res;
+}
+
+static guint32
+rspamd_phash_add_elts (struct rspamd_phash_elt *elts, GHashTable *tbl,
+	gboolean deleted)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	guint32 i = 0;
+
+	g_hash_table_iter_init (&it, tbl);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elts[i].key = g_ascii_strdown (k, -1);
+		elts[i].keylen = strlen (elts[i].key);
+
+		if (deleted) {
+			elts[i].value = NULL;
+			elts[i].vallen = 0;
+		}
+		else {
+			elts[i].value = v != NULL ? v : "";
+			elts[i].vallen = strlen (elts[i].value);
+		}
+		i++;
+	}
+
+	return i;
+}
+
+GByteArray *
+rspamd_phash_build (GHashTable *tbl)
+{
+	struct rspamd_phash_elt *elts;
+	guint32 nkeys;
+
+	nkeys = g_hash_table_size (tbl);
+	elts = g_malloc0 ((nkeys + 1) * sizeof (*elts));
+	rspamd_phash_add_elts (elts, tbl, FALSE);
+
+	return rspamd_phash_build_elts (elts, nkeys, 0);
+}
+
+GByteArray *
+rspamd_phash_build_delta (rspamd_phash_t *base, GHashTable *added,
+	GHashTable *deleted)
+{
+	struct rspamd_phash_elt *elts;
+	guint32 nkeys, n;
+
+	nkeys = g_hash_table_size (added) + g_hash_table_size (deleted);
+	elts = g_malloc0 ((nkeys + 1) * sizeof (*elts));
+	n = rspamd_phash_add_elts (elts, added, FALSE);
+	rspamd_phash_add_elts (elts + n, deleted, TRUE);
+
+	return rspamd_phash_build_elts (elts, nkeys, base->hdr->id);
+}
+
+rspamd_phash_t *
+rspamd_phash_new (gpointer image, gsize len, gboolean mapped)
+{
+	const struct rspamd_phash_header *hdr = image;
+	rspamd_phash_t *ph;
+	guint64 expected;
+
+	G_STATIC_ASSERT (sizeof (*hdr) % (PHASH_BLOOM_BLOCK_WORDS *
+		sizeof (guint64)) == 0);
+
+	if (len < sizeof (*hdr) ||
+		memcmp (hdr->magic, PHASH_MAGIC, sizeof (PHASH_MAGIC)) != 0) {
+		msg_err ("invalid perfect hash image");
+		return NULL;
+	}
+
+	if (hdr->version != PHASH_VERSION) {
+		msg_err ("invalid perfect hash image version: %ud, %d expected",
+			hdr->version, PHASH_VERSION);
+		return NULL;
+	}
+
+	expected = sizeof (*hdr) +
+		(guint64)hdr->bloom_blocks * PHASH_BLOOM_BLOCK_WORDS * sizeof (guint64) +
+		((guint64)hdr->nbuckets + hdr->nslots) * sizeof (guint32) +
+		hdr->strings_len;
+
+	if (expected != len || hdr->nbuckets == 0 || hdr->nslots == 0) {
+		msg_err ("invalid perfect hash image length: %z, %uL expected",
+			len, expected);
+		return NULL;
+	}
+
+	ph = g_slice_alloc (sizeof (*ph));
+	ph->hdr = hdr;
+	ph->bloom = (const guint64 *)((const guchar *)image + sizeof (*hdr));
+	ph->disp = (const guint32 *)(ph->bloom +
+		hdr->bloom_blocks * PHASH_BLOOM_BLOCK_WORDS);
+	ph->slots = ph->disp + hdr->nbuckets;
+	ph->strings = (const guchar *)(ph->slots + hdr->nslots);
+	ph->image = image;
+	ph->len = len;
+	ph->mapped = mapped;
+	ph->delta = NULL;
+
+	return ph;
+}
+
+gboolean
+rspamd_phash_attach_delta (rspamd_phash_t *ph, gpointer image, gsize len,
+	gboolean mapped)
+{
+	rspamd_phash_t *delta = NULL;
+
+	if (image != NULL) {
+		if ((delta = rspamd_phash_new (image, len, mapped)) == NULL) {
+			return FALSE;
+		}
+
+		if (delta->hdr->base_id != ph->hdr->id) {
+			/* Delta is built for another version of hash */
+			g_slice_free1 (sizeof (*delta), delta);
+			return FALSE;
+		}
+	}
+
+	rspamd_phash_destroy (ph->delta);
+	ph->delta = delta;
+
+	return TRUE;
+}
+
+rspamd_phash_t *
+rspamd_phash_get_delta (rspamd_phash_t *ph)
+{
+	return ph != NULL ? ph->delta : NULL;
+}
+
+/*
+ * Get entry stored in slot checking that it lies inside of image
+ */
+static const struct rspamd_phash_entry *
+rspamd_phash_slot_entry (rspamd_phash_t *ph, guint32 slot)
+{
+	const struct rspamd_phash_entry *entry;
+	guint32 off = ph->slots[slot];
+
+	if (off == 0 || off - 1 + sizeof (*entry) > ph->hdr->strings_len) {
+		return NULL;
+	}
+
+	entry = (const struct rspamd_phash_entry *)(ph->strings + off - 1);
+
+	if (off - 1 + sizeof (*entry) + entry->keylen + 2 +
+		(entry->vallen != PHASH_DELETED ? entry->vallen : 0) >
+		ph->hdr->strings_len) {
+		return NULL;
+	}
+
+	return entry;
+}
+
+static const struct rspamd_phash_entry *
+rspamd_phash_find (rspamd_phash_t *ph, const gchar *lc, gsize len)
+{
+	const struct rspamd_phash_entry *entry;
+	guint64 h;
+	guint32 slot;
+
+	if (ph->hdr->nkeys == 0) {
+		return NULL;
+	}
+
+	h = rspamd_phash_hash (lc, len, ph->hdr->seed);
+
+	/* Most of lookups are negative, so skip slots and strings for them */
+	if (!rspamd_phash_bloom_check (ph, h)) {
+		return NULL;
+	}
+
+	slot = rspamd_phash_slot (h, ph->disp[(h >> 32) % ph->hdr->nbuckets],
+			ph->hdr->nslots);
+	entry = rspamd_phash_slot_entry (ph, slot);
+
+	if (entry == NULL || entry->keylen != len ||
+		memcmp ((const gchar *)(entry + 1), lc, len) != 0) {
+		return NULL;
+	}
+
+	return entry;
+}
+
+static inline const gchar *
+rspamd_phash_entry_value (const struct rspamd_phash_entry *entry)
+{
+	if (entry->vallen == PHASH_DELETED) {
+		return NULL;
+	}
+
+	return (const gchar *)(entry + 1) + entry->keylen + 1;
+}
+
+static const gchar *
+rspamd_phash_lookup_common (rspamd_phash_t *ph, const gchar *key,
+	gboolean use_delta)
+{
+	const struct rspamd_phash_entry *entry = NULL;
+	gchar buf[PHASH_KEY_BUF], *lc;
+	const gchar *res = NULL;
+	gsize len;
+
+	if (ph == NULL) {
+		return NULL;
+	}
+
+	len = strlen (key);
+
+	if (len < sizeof (buf)) {
+		rspamd_strlcpy_tolower (buf, key, sizeof (buf));
+		lc = buf;
+	}
+	else {
+		lc = g_ascii_strdown (key, len);
+	}
+
+	if (use_delta && ph->delta != NULL) {
+		entry = rspamd_phash_find (ph->delta, lc, len);
+	}
+
+	if (entry == NULL) {
+		entry = rspamd_phash_find (ph, lc, len);
+	}
+
+	if (entry != NULL) {
+		res = rspamd_phash_entry_value (entry);
+	}
+
+	if (lc != buf) {
+		g_free (lc);
+	}
+
+	return res;
+}
+
+const gchar *
+rspamd_phash_lookup (rspamd_phash_t *ph, const gchar *key)
+{
+	return rspamd_phash_lookup_common (ph, key, TRUE);
+}
+
+const gchar *
+rspamd_phash_lookup_base (rspamd_phash_t *ph, const gchar *key)
+{
+	return rspamd_phash_lookup_common (ph, key, FALSE);
+}
+
+void
+rspamd_phash_foreach (rspamd_phash_t *ph, rspamd_phash_foreach_cb cb,
+	gpointer ud)
+{
+	const struct rspamd_phash_entry *entry;
+	guint32 i;
+
+	if (ph == NULL) {
+		return;
+	}
+
+	for (i = 0; i < ph->hdr->nslots; i++) {
+		if ((entry = rspamd_phash_slot_entry (ph, i)) != NULL) {
+			cb ((const gchar *)(entry + 1), rspamd_phash_entry_value (entry),
+				ud);
+		}
+	}
+}
+
+guint
+rspamd_phash_size (rspamd_phash_t *ph)
+{
+	if (ph == NULL) {
+		return 0;
+	}
+
+	return ph->hdr->nkeys;
+}
+
+void
+rspamd_phash_destroy (rspamd_phash_t *ph)
+{
+	if (ph == NULL) {
+		return;
+	}
+
+	rspamd_phash_destroy (ph->delta);
+
+	if (ph->mapped) {
+		munmap (ph->image, ph->len);
+	}
+	else {
+		g_free (ph->image);
+	}
+
+	g_slice_free1 (sizeof (*ph), ph);
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PHASH_H_
+#define PHASH_H_
+
+#include "config.h"
+
+/*
+ * Perfect hash is a read only case insensitive map of strings to strings. It
+ * is built once to a flat image without pointers, so the image can be written
+ * to a file and mapped by several processes. Keys are distributed between
+ * buckets and each bucket gets a displacement that places all its keys to
+ * free slots, so a lookup costs one hash and one string comparison. Large
+ * hashes also include a blocked bloom filter probed by the same hash, so
+ * negative lookups usually do not touch slots and strings at all.
+ *
+ * Small changes are stored as a delta: a separate image with added keys and
+ * deleted markers built against a specific base image. Delta is attached to
+ * the base and checked before it on lookups.
+ */
+
+typedef struct rspamd_phash_s rspamd_phash_t;
+
+/**
+ * Callback for hash iteration, value is NULL for keys deleted by a delta
+ */
+typedef void (*rspamd_phash_foreach_cb)(const gchar *key, const gchar *value,
+	gpointer ud);
+
+/**
+ * Build image of perfect hash
+ * @param tbl hash table of strings (keys are compared case insensitively)
+ * @return image or NULL if hash cannot be built
+ */
+GByteArray * rspamd_phash_build (GHashTable *tbl);
+
+/**
+ * Build image of delta for the base hash
+ * @param base base hash
+ * @param added keys added or changed since base
+ * @param deleted keys deleted since base (values are ignored)
+ * @return image or NULL if hash cannot be built
+ */
+GByteArray * rspamd_phash_build_delta (rspamd_phash_t *base, GHashTable *added,
+	GHashTable *deleted);
+
+/**
+ * Create perfect hash from image, hash owns image memory since this call
+ * @param image image data
+ * @param len length of image
+ * @param mapped if TRUE image is unmapped on destroy, otherwise it is freed
+ * by g_free
+ * @return new hash or NULL if image is invalid (memory is not owned then)
+ */
+rspamd_phash_t * rspamd_phash_new (gpointer image, gsize len, gboolean mapped);
+
+/**
+ * Attach delta image to hash replacing the previous delta
+ * @param ph base hash
+ * @param image image of delta or NULL to remove the current delta
+ * @param len length of image
+ * @param mapped if TRUE image is unmapped on destroy
+ * @return TRUE if delta is attached (hash owns image then), FALSE if image is
+ * invalid or built for another base
+ */
+gboolean rspamd_phash_attach_delta (rspamd_phash_t *ph, gpointer image,
+	gsize len, gboolean mapped);
+
+/**
+ * Get delta attached to hash
+ */
+rspamd_phash_t * rspamd_phash_get_delta (rspamd_phash_t *ph);
+
+/**
+ * Lookup value in hash
+ * @param ph hash object (may be NULL)
+ * @param key key to find
+ * @return value or NULL if key is not found
+ */
+const gchar * rspamd_phash_lookup (rspamd_phash_t *ph, const gchar *key);
+
+/**
+ * Lookup value in hash ignoring the attached delta
+ */
+const gchar * rspamd_phash_lookup_base (rspamd_phash_t *ph, const gchar *key);
+
+/**
+ * Iterate over keys of hash image (attached delta is not included)
+ */
+void rspamd_phash_foreach (rspamd_phash_t *ph, rspamd_phash_foreach_cb cb,
+	gpointer ud);
+
+/**
+ * Get number of keys in hash
+ */
+guint rspamd_phash_size (rspamd_phash_t *ph);
+
+/**
+ * Destroy hash and its image
+ */
+void rspamd_phash_destroy (rspamd_phash_t *ph);
+
+#endif /* PHASH_H_ */
@@ -46,10 +46,36 @@ struct radix_compressed_node {
 };
 
 
+#define RADIX_IMAGE_MAGIC "rspradx"
+#define RADIX_IMAGE_NONE G_MAXUINT32
+
+struct radix_image_header {
+	gchar magic[8];
+	guint32 nnodes;
+	guint32 keys_len;
+	/* Nodes and keys of skipped nodes follow */
+};
+
+struct radix_image_node {
+	guint64 value;
+	/* Indexes of children or offset and length of key for skipped nodes */
+	guint32 left;
+	guint32 right;
+	guint32 level;
+	guint32 skipped;
+};
+
 struct radix_tree_compressed {
 	struct radix_compressed_node *root;
 	rspamd_mempool_t *pool;
 	size_t size;
+	/* Read only tree created from image */
+	const struct radix_image_node *image_nodes;
+	const guint8 *image_keys;
+	guint32 image_nnodes;
+	gpointer image;
+	gsize image_len;
+	gboolean image_mapped;
 };
 
 
@@ -378,22 +404,22 @@ radix32_tree_find_addr (radix_tree_t *tree, rspamd_inet_addr_t *addr)
 #endif /* Old radix code */
 
 static gboolean
-radix_compare_compressed (struct radix_compressed_node *node,
+radix_compare_key (const guint8 *nkey, guint nkeylen, guint level,
 		guint8 *key, guint keylen, guint cur_level)
 {
-	guint8 *nk;
+	const guint8 *nk;
 	guint8 *k;
 	guint8 bit;
 	guint shift, rbits, skip;
 
-	if (node->d.s.keylen > keylen) {
+	if (nkeylen > keylen) {
 		/* Obvious case */
 		return FALSE;
 	}
 
 
 	/* Compare byte aligned levels of a compressed node */
-	shift = node->d.s.level / NBBY;
+	shift = level / NBBY;
 	/*
 	 * We know that at least of cur_level bits are the same,
 	 * se we can optimize search slightly
@@ -401,7 +427,7 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	if (shift > 0) {
 		skip = cur_level / NBBY;
 		if (shift > skip &&
-				memcmp (node->d.s.key + skip, key + skip, shift - skip) != 0) {
+				memcmp (nkey + skip, key + skip, shift - skip) != 0) {
 			return FALSE;
 		}
 		else {
@@ -410,10 +436,10 @@ radix_compare_compressed (struct radix_compressed_node *node,
 		}
 	}
 
-	rbits = node->d.s.level % NBBY;
+	rbits = level % NBBY;
 	if (rbits > 0) {
 		/* Precisely compare remaining bits */
-		nk = node->d.s.key + shift;
+		nk = nkey + shift;
 		k = key + shift;
 
 		bit = 1U << 7;
@@ -430,6 +456,66 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	return TRUE;
 }
 
+static gboolean
+radix_compare_compressed (struct radix_compressed_node *node,
+		guint8 *key, guint keylen, guint cur_level)
+{
+	return radix_compare_key (node->d.s.key, node->d.s.keylen, node->d.s.level,
+			key, keylen, cur_level);
+}
+
+static uintptr_t
+radix_find_image (radix_compressed_t *tree, guint8 *key, gsize keylen)
+{
+	const struct radix_image_node *node;
+	guint32 bit, idx;
+	gsize kremain = keylen / sizeof (guint32);
+	uintptr_t value;
+	guint32 *k = (guint32 *)key;
+	guint32 kv = ntohl (*k);
+	guint cur_level = 0;
+
+	bit = 1U << 31;
+	value = RADIX_NO_VALUE;
+	idx = tree->image_nnodes > 0 ? 0 : RADIX_IMAGE_NONE;
+
+	while (idx != RADIX_IMAGE_NONE && kremain) {
+		node = &tree->image_nodes[idx];
+
+		if (node->skipped) {
+			/* It is obviously a leaf node */
+			if (radix_compare_key (tree->image_keys + node->left, node->right,
+					node->level, key, keylen, cur_level)) {
+				return node->value;
+			}
+			else {
+				return value;
+			}
+		}
+		if (node->value != RADIX_NO_VALUE) {
+			value = node->value;
+		}
+
+		if (kv & bit) {
+			idx = node->right;
+		}
+		else {
+			idx = node->left;
+		}
+
+		bit >>= 1;
+		if (bit == 0) {
+			k ++;
+			bit = 1U << 31;
+			kv = ntohl (*k);
+			kremain --;
+		}
+		cur_level ++;
+	}
+
+	return value;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 {
@@ -441,6 +527,10 @@ radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 	guint32 kv = ntohl (*k);
 	guint cur_level = 0;
 
+	if (tree->image != NULL) {
+		return radix_find_image (tree, key, keylen);
+	}
+
 	bit = 1U << 31;
 	value = RADIX_NO_VALUE;
 	node = tree->root;
@@ -744,6 +834,11 @@ radix_insert_compressed (radix_compressed_t * tree,
 	g_assert (keybits >= masklen);
 	msg_debug ("want insert value %p with mask %z", value, masklen);
 
+	if (tree->image != NULL) {
+		msg_err ("cannot insert to a read only radix tree");
+		return RADIX_NO_VALUE;
+	}
+
 	node = tree->root;
 	next = node;
 	prev = &tree->root;
@@ -852,7 +947,7 @@ radix_create_compressed (void)
 {
 	radix_compressed_t *tree;
 
-	tree = g_slice_alloc (sizeof (*tree));
+	tree = g_slice_alloc0 (sizeof (*tree));
 	if (tree == NULL) {
 		return NULL;
 	}
@@ -867,10 +962,143 @@ radix_create_compressed (void)
 void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
-	rspamd_mempool_delete (tree->pool);
+	if (tree->pool) {
+		rspamd_mempool_delete (tree->pool);
+	}
+
+	if (tree->image) {
+		if (tree->image_mapped) {
+			munmap (tree->image, tree->image_len);
+		}
+		else {
+			g_free (tree->image);
+		}
+	}
+
 	g_slice_free1 (sizeof (*tree), tree);
 }
 
+static guint32
+radix_serialize_node (struct radix_compressed_node *node, GArray *nodes,
+		GByteArray *keys)
+{
+	struct radix_image_node inode;
+	guint32 idx, left, right;
+
+	if (node == NULL) {
+		return RADIX_IMAGE_NONE;
+	}
+
+	idx = nodes->len;
+	memset (&inode, 0, sizeof (inode));
+	inode.value = node->value;
+
+	if (node->skipped) {
+		inode.skipped = 1;
+		inode.left = keys->len;
+		inode.right = node->d.s.keylen;
+		inode.level = node->d.s.level;
+		g_byte_array_append (keys, node->d.s.key, node->d.s.keylen);
+		g_array_append_val (nodes, inode);
+	}
+	else {
+		/* Children are stored after their parent */
+		g_array_append_val (nodes, inode);
+		left = radix_serialize_node (node->d.n.left, nodes, keys);
+		right = radix_serialize_node (node->d.n.right, nodes, keys);
+		g_array_index (nodes, struct radix_image_node, idx).left = left;
+		g_array_index (nodes, struct radix_image_node, idx).right = right;
+	}
+
+	return idx;
+}
+
+GByteArray *
+radix_compressed_serialize (radix_compressed_t *tree)
+{
+	struct radix_image_header hdr;
+	GArray *nodes;
+	GByteArray *keys, *res;
+
+	if (tree->image != NULL) {
+		res = g_byte_array_sized_new (tree->image_len);
+		g_byte_array_append (res, tree->image, tree->image_len);
+
+		return res;
+	}
+
+	nodes = g_array_sized_new (FALSE, FALSE, sizeof (struct radix_image_node),
+			tree->size + 1);
+	keys = g_byte_array_new ();
+	radix_serialize_node (tree->root, nodes, keys);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RADIX_IMAGE_MAGIC, sizeof (RADIX_IMAGE_MAGIC));
+	hdr.nnodes = nodes->len;
+	hdr.keys_len = keys->len;
+
+	res = g_byte_array_sized_new (sizeof (hdr) +
+			nodes->len * sizeof (struct radix_image_node) + keys->len);
+	g_byte_array_append (res, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (res, (const guint8 *)nodes->data,
+		nodes->len * sizeof (struct radix_image_node));
+	g_byte_array_append (res, keys->data, keys->len);
+
+	g_array_free (nodes, TRUE);
+	g_byte_array_free (keys, TRUE);
+
+	return res;
+}
+
+radix_compressed_t *
+radix_create_compressed_image (gpointer image, gsize len, gboolean mapped)
+{
+	const struct radix_image_header *hdr = image;
+	const struct radix_image_node *nodes;
+	radix_compressed_t *tree;
+	guint32 i;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, RADIX_IMAGE_MAGIC,
+			sizeof (RADIX_IMAGE_MAGIC)) != 0 ||
+			len != sizeof (*hdr) + (guint64)hdr->nnodes * sizeof (*nodes) +
+			hdr->keys_len) {
+		msg_err ("invalid radix tree image");
+		return NULL;
+	}
+
+	nodes = (const struct radix_image_node *)((const guchar *)image +
+			sizeof (*hdr));
+
+	/* Check links once, so lookups do not need any checks */
+	for (i = 0; i < hdr->nnodes; i++) {
+		if (nodes[i].skipped) {
+			if ((guint64)nodes[i].left + nodes[i].right > hdr->keys_len) {
+				msg_err ("invalid radix tree image: bad key of node %ud", i);
+				return NULL;
+			}
+		}
+		else if ((nodes[i].left != RADIX_IMAGE_NONE &&
+				nodes[i].left >= hdr->nnodes) ||
+				(nodes[i].right != RADIX_IMAGE_NONE &&
+				nodes[i].right >= hdr->nnodes)) {
+			msg_err ("invalid radix tree image: bad link of node %ud", i);
+			return NULL;
+		}
+	}
+
+	tree = g_slice_alloc0 (sizeof (*tree));
+	tree->size = hdr->nnodes;
+	tree->image_nodes = nodes;
+	tree->image_keys = (const guint8 *)(nodes + hdr->nnodes);
+	tree->image_nnodes = hdr->nnodes;
+	tree->image = image;
+	tree->image_len = len;
+	tree->image_mapped = mapped;
+
+	return tree;
+}
+
 uintptr_t
 radix_find_compressed_addr (radix_compressed_t *tree, rspamd_inet_addr_t *addr)
 {
@@ -120,6 +120,25 @@ void radix_destroy_compressed (radix_compressed_t *tree);
 
 radix_compressed_t *radix_create_compressed (void);
 
+/**
+ * Serialize tree to an image without pointers, so it could be shared between
+ * processes. Values are stored as is, so they must not be pointers.
+ * @param tree tree to serialize
+ * @return new image
+ */
+GByteArray *radix_compressed_serialize (radix_compressed_t *tree);
+
+/**
+ * Create read only tree from image, tree owns image memory since this call
+ * @param image image made by @see radix_compressed_serialize
+ * @param len length of image
+ * @param mapped if TRUE image is unmapped on destroy, otherwise it is freed
+ * by g_free
+ * @return new tree or NULL if image is invalid (memory is not owned then)
+ */
+radix_compressed_t *radix_create_compressed_image (gpointer image, gsize len,
+		gboolean mapped);
+
 /**
  * Insert list of ip addresses and masks to the radix tree
  * @param list string line of addresses
@@ -0,0 +1,251 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "shm_cache.h"
+#include "logger.h"
+#include "xxhash.h"
+
+/* Slots checked for each key in a slab */
+#define SHM_CACHE_PROBES 4
+#define SHM_CACHE_MAX_KEY 255
+
+static const gsize slab_sizes[] = {256, 1024, 4096};
+
+struct rspamd_shm_cache_slot {
+	gint lock;
+	guint32 hash;
+	guint64 expire;
+	guint16 key_len;
+	guint16 data_len;
+	guint32 reserved;
+	/* Key and data follow */
+};
+
+struct rspamd_shm_cache_slab {
+	gsize slot_size;
+	guint nslots;
+	gsize offset;
+};
+
+struct rspamd_shm_cache_s {
+	gsize size;
+	struct rspamd_shm_cache_slab slabs[G_N_ELEMENTS (slab_sizes)];
+};
+
+static inline struct rspamd_shm_cache_slot *
+rspamd_shm_cache_get_slot (rspamd_shm_cache_t *cache,
+	struct rspamd_shm_cache_slab *slab, guint32 hash, guint probe)
+{
+	return (struct rspamd_shm_cache_slot *)((guchar *)cache + slab->offset +
+		((hash + probe) % slab->nslots) * slab->slot_size);
+}
+
+rspamd_shm_cache_t *
+rspamd_shm_cache_new (gsize size)
+{
+	rspamd_shm_cache_t *cache;
+	gpointer map;
+	gsize offset, per_slab;
+	guint i;
+
+	per_slab = size / G_N_ELEMENTS (slab_sizes);
+
+	if (per_slab < slab_sizes[G_N_ELEMENTS (slab_sizes) - 1]) {
+		return NULL;
+	}
+
+	size = sizeof (*cache) + per_slab * G_N_ELEMENTS (slab_sizes);
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes of shared memory: %s", size,
+			strerror (errno));
+		return NULL;
+	}
+
+	memset (map, 0, size);
+	cache = map;
+	cache->size = size;
+	offset = sizeof (*cache);
+
+	for (i = 0; i < G_N_ELEMENTS (slab_sizes); i++) {
+		cache->slabs[i].slot_size = slab_sizes[i];
+		cache->slabs[i].nslots = per_slab / slab_sizes[i];
+		cache->slabs[i].offset = offset;
+		offset += cache->slabs[i].nslots * slab_sizes[i];
+	}
+
+	return cache;
+}
+
+guchar *
+rspamd_shm_cache_lookup (rspamd_shm_cache_t *cache,
+	const gchar *key,
+	time_t now,
+	gsize *len,
+	guint *ttl)
+{
+	struct rspamd_shm_cache_slab *slab;
+	struct rspamd_shm_cache_slot *slot, hdr;
+	guchar *res = NULL, *data;
+	guint64 best_expire = 0;
+	guint32 hash;
+	gsize key_len;
+	guint i, j;
+	gint lock;
+
+	key_len = strlen (key);
+
+	if (key_len > SHM_CACHE_MAX_KEY) {
+		return NULL;
+	}
+
+	hash = XXH32 (key, key_len, 0);
+
+	for (i = 0; i < G_N_ELEMENTS (cache->slabs); i++) {
+		slab = &cache->slabs[i];
+
+		for (j = 0; j < SHM_CACHE_PROBES; j++) {
+			slot = rspamd_shm_cache_get_slot (cache, slab, hash, j);
+			lock = g_atomic_int_get (&slot->lock);
+
+			if (lock & 1 || slot->hash != hash) {
+				continue;
+			}
+
+			memcpy (&hdr, slot, sizeof (hdr));
+
+			if (hdr.expire <= (guint64)now || hdr.expire <= best_expire ||
+				hdr.key_len != key_len ||
+				sizeof (hdr) + hdr.key_len + hdr.data_len > slab->slot_size) {
+				continue;
+			}
+
+			data = g_malloc (hdr.data_len + 1);
+
+			if (memcmp ((guchar *)(slot + 1), key, key_len) != 0) {
+				g_free (data);
+				continue;
+			}
+
+			memcpy (data, (guchar *)(slot + 1) + key_len, hdr.data_len);
+
+			if (g_atomic_int_get (&slot->lock) != lock) {
+				/* Slot has been changed while we were reading it */
+				g_free (data);
+				continue;
+			}
+
+			/* Prefer the freshest value if a key is stored in several slabs */
+			g_free (res);
+			res = data;
+			res[hdr.data_len] = '\0';
+			best_expire = hdr.expire;
+			*len = hdr.data_len;
+		}
+	}
+
+	if (res != NULL && ttl != NULL) {
+		*ttl = best_expire - now;
+	}
+
+	return res;
+}
+
+gboolean
+rspamd_shm_cache_insert (rspamd_shm_cache_t *cache,
+	const gchar *key,
+	const guchar *data,
+	gsize len,
+	time_t now,
+	guint ttl)
+{
+	struct rspamd_shm_cache_slab *slab = NULL;
+	struct rspamd_shm_cache_slot *slot, *victim = NULL;
+	guint32 hash;
+	gsize key_len;
+	guint i;
+	gint lock;
+
+	key_len = strlen (key);
+
+	if (key_len > SHM_CACHE_MAX_KEY || ttl == 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (cache->slabs); i++) {
+		if (sizeof (*slot) + key_len + len <= cache->slabs[i].slot_size) {
+			slab = &cache->slabs[i];
+			break;
+		}
+	}
+
+	if (slab == NULL) {
+		/* Value is too large */
+		return FALSE;
+	}
+
+	hash = XXH32 (key, key_len, 0);
+
+	/* Prefer slot with the same key, then an expired one, then the oldest */
+	for (i = 0; i < SHM_CACHE_PROBES; i++) {
+		slot = rspamd_shm_cache_get_slot (cache, slab, hash, i);
+
+		if (slot->hash == hash && slot->key_len == key_len) {
+			victim = slot;
+			break;
+		}
+		if (victim == NULL || slot->expire < victim->expire) {
+			victim = slot;
+		}
+	}
+
+	lock = g_atomic_int_get (&victim->lock);
+
+	if (lock & 1 || !g_atomic_int_compare_and_exchange (&victim->lock,
+		lock, lock + 1)) {
+		/* Another process is writing this slot */
+		return FALSE;
+	}
+
+	victim->hash = hash;
+	victim->expire = now + ttl;
+	victim->key_len = key_len;
+	victim->data_len = len;
+	memcpy ((guchar *)(victim + 1), key, key_len);
+	memcpy ((guchar *)(victim + 1) + key_len, data, len);
+
+	g_atomic_int_set (&victim->lock, lock + 2);
+
+	return TRUE;
+}
+
+void
+rspamd_shm_cache_destroy (rspamd_shm_cache_t *cache)
+{
+	if (cache != NULL) {
+		munmap (cache, cache->size);
+	}
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHM_CACHE_H_
+#define SHM_CACHE_H_
+
+#include "config.h"
+
+/*
+ * Shared memory cache is a fixed size key-value storage allocated before
+ * forking workers, so all processes see the same data. Memory is divided into
+ * several slabs of slots with different sizes, each value is stored in the
+ * smallest slot it fits. Lookups do not take any locks: each slot is protected
+ * by a sequence counter and readers retry if a slot has been changed while
+ * it was read.
+ */
+
+typedef struct rspamd_shm_cache_s rspamd_shm_cache_t;
+
+/**
+ * Create new shared cache
+ * @param size total size of memory to use
+ * @return new cache or NULL if memory cannot be allocated
+ */
+rspamd_shm_cache_t * rspamd_shm_cache_new (gsize size);
+
+/**
+ * Lookup value in the cache
+ * @param cache cache object
+ * @param key key to find
+ * @param now current time
+ * @param len output length of value
+ * @param ttl output remaining time to live of value (may be NULL)
+ * @return copy of value that must be freed by g_free or NULL if not found
+ */
+guchar * rspamd_shm_cache_lookup (rspamd_shm_cache_t *cache,
+	const gchar *key,
+	time_t now,
+	gsize *len,
+	guint *ttl);
+
+/**
+ * Insert value to the cache, the oldest value is evicted if there is no free
+ * slot for the key
+ * @param cache cache object
+ * @param key key to insert
+ * @param data value
+ * @param len length of value
+ * @param now current time
+ * @param ttl time to live of value
+ * @return TRUE if value has been inserted
+ */
+gboolean rspamd_shm_cache_insert (rspamd_shm_cache_t *cache,
+	const gchar *key,
+	const guchar *data,
+	gsize len,
+	time_t now,
+	guint ttl);
+
+/**
+ * Destroy shared cache
+ */
+void rspamd_shm_cache_destroy (rspamd_shm_cache_t *cache);
+
+#endif /* SHM_CACHE_H_ */
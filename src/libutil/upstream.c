@@ -36,11 +36,19 @@ struct upstream_inet_addr_entry {
 	struct upstream_inet_addr_entry *next;
 };
 
+/* Allocated in shared memory */
+struct upstream_shared_stat {
+	gdouble latency;
+	gdouble max_latency;
+	guint requests;
+	guint errors;
+};
+
 struct upstream {
 	guint weight;
-	guint cur_weight;
 	guint errors;
 	gint active_idx;
+	guint inflight;
 	gchar *name;
 	struct event ev;
 	struct timeval tv;
@@ -54,17 +62,56 @@ struct upstream {
 	} addrs;
 
 	struct upstream_inet_addr_entry *new_addrs;
+	struct upstream_shared_stat *stat;
 	rspamd_mutex_t *lock;
 
 	ref_entry_t ref;
 };
 
+/*
+ * Immutable snapshot of alive upstreams: readers get it without locking,
+ * writers build a new snapshot and swap the pointer
+ */
+struct upstream_alive_snapshot {
+	guint len;
+	/* Upstreams ordered for weighted round robin */
+	guint ring_len;
+	struct upstream **ring;
+	/* Upstream with the maximum weight */
+	struct upstream *master;
+	/* Retired snapshots are freed when there are no readers */
+	struct upstream_alive_snapshot *next;
+	struct upstream *ups[];
+};
+
+#define UPSTREAM_RING_MAX 1024
+#define UPSTREAM_SLOTS 16
+
+/*
+ * Per-thread state of a list: round robin cursor and the number of readers
+ * of snapshots, threads use different slots to avoid contention on the same
+ * cache line
+ */
+struct upstream_slot {
+	guint cur;
+	gint readers;
+	/* Avoid false sharing between threads */
+	guint pad[14];
+};
+
 struct upstream_list {
 	GPtrArray *ups;
+	/* Writer side list of alive upstreams, protected by lock */
 	GPtrArray *alive;
+	struct upstream_alive_snapshot *snap;
+	struct upstream_alive_snapshot *retired;
 	rspamd_mutex_t *lock;
 	guint64 hash_seed;
 	guint cur_elt;
+	/* Set when the list is used with the latency rotation */
+	gint track_inflight;
+	gchar *name;
+	struct upstream_slot slots[UPSTREAM_SLOTS];
 };
 
 static struct rdns_resolver *res = NULL;
@@ -77,6 +124,11 @@ static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
 static guint default_max_addresses = 1024;
+/* Weight of a new sample in latency moving average */
+static gdouble default_latency_alpha = 0.2;
+/* All upstream lists of the process and pool for their shared counters */
+static GPtrArray *upstream_lists = NULL;
+static rspamd_mempool_t *upstream_stat_pool = NULL;
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg)
@@ -142,12 +194,170 @@ rspamd_upstream_addr_sort_func (gconstpointer a, gconstpointer b)
 	return w2 - w1;
 }
 
+/*
+ * Smooth weighted round robin: each upstream appears in the ring according
+ * to its weight and occurrences of the same upstream are spread
+ */
+static void
+rspamd_upstream_snapshot_build_ring (struct upstream_alive_snapshot *snap)
+{
+	guint i, step, total = 0, orig_total, *weights;
+	gint *cur, max;
+	struct upstream *up;
+
+	weights = g_new (guint, snap->len);
+
+	for (i = 0; i < snap->len; i ++) {
+		up = snap->ups[i];
+		weights[i] = MAX (up->weight, 1);
+		total += weights[i];
+
+		if (snap->master == NULL || up->weight >= snap->master->weight) {
+			snap->master = up;
+		}
+	}
+
+	if (total > UPSTREAM_RING_MAX) {
+		orig_total = total;
+		total = 0;
+
+		for (i = 0; i < snap->len; i ++) {
+			weights[i] = MAX ((guint64)weights[i] * UPSTREAM_RING_MAX /
+					orig_total, 1);
+			total += weights[i];
+		}
+	}
+
+	snap->ring_len = total;
+	snap->ring = g_new (struct upstream *, total);
+	cur = g_new0 (gint, snap->len);
+
+	for (step = 0; step < total; step ++) {
+		max = 0;
+
+		for (i = 0; i < snap->len; i ++) {
+			cur[i] += weights[i];
+
+			if (cur[i] >= cur[max]) {
+				max = i;
+			}
+		}
+
+		cur[max] -= total;
+		snap->ring[step] = snap->ups[max];
+	}
+
+	g_free (cur);
+	g_free (weights);
+}
+
+static void
+rspamd_upstream_snapshot_free (struct upstream_alive_snapshot *snap)
+{
+	g_free (snap->ring);
+	g_free (snap);
+}
+
+static inline struct upstream_slot *
+rspamd_upstream_get_slot (struct upstream_list *ls)
+{
+	guint64 tid = (guint64)(guintptr)pthread_self ();
+
+	return &ls->slots[(tid * 0x9E3779B97F4A7C15ULL >> 32) % UPSTREAM_SLOTS];
+}
+
+/*
+ * Free retired snapshots if nobody reads them, must be called with the list
+ * lock held
+ */
+static void
+rspamd_upstream_reclaim (struct upstream_list *ls)
+{
+	struct upstream_alive_snapshot *cur, *tmp;
+	guint i;
+
+	/*
+	 * Retired snapshots are not reachable from the list, so a reader that
+	 * comes after this check can get only the current snapshot
+	 */
+	for (i = 0; i < UPSTREAM_SLOTS; i ++) {
+		if (g_atomic_int_get (&ls->slots[i].readers) != 0) {
+			return;
+		}
+	}
+
+	LL_FOREACH_SAFE (ls->retired, cur, tmp) {
+		rspamd_upstream_snapshot_free (cur);
+	}
+
+	g_atomic_pointer_set (&ls->retired, NULL);
+}
+
+static inline struct upstream_alive_snapshot *
+rspamd_upstream_snapshot_acquire (struct upstream_list *ls,
+		struct upstream_slot *slot)
+{
+	g_atomic_int_inc (&slot->readers);
+
+	return g_atomic_pointer_get (&ls->snap);
+}
+
+static inline void
+rspamd_upstream_snapshot_release (struct upstream_list *ls,
+		struct upstream_slot *slot)
+{
+	if (g_atomic_int_dec_and_test (&slot->readers) &&
+			g_atomic_pointer_get (&ls->retired) != NULL) {
+		/* The last reader frees snapshots retired while it was running */
+		rspamd_mutex_lock (ls->lock);
+		rspamd_upstream_reclaim (ls);
+		rspamd_mutex_unlock (ls->lock);
+	}
+}
+
+/*
+ * Publish the current alive list for readers, must be called with the list
+ * lock held
+ */
+static void
+rspamd_upstream_publish (struct upstream_list *ls)
+{
+	struct upstream_alive_snapshot *snap, *old;
+	struct upstream *up;
+	guint i;
+
+	snap = g_malloc0 (sizeof (*snap) + sizeof (snap->ups[0]) * ls->alive->len);
+	snap->len = ls->alive->len;
+
+	for (i = 0; i < ls->alive->len; i ++) {
+		up = g_ptr_array_index (ls->alive, i);
+		up->active_idx = i;
+		snap->ups[i] = up;
+	}
+
+	if (snap->len > 0) {
+		rspamd_upstream_snapshot_build_ring (snap);
+	}
+
+	old = ls->snap;
+	g_atomic_pointer_set (&ls->snap, snap);
+
+	if (old != NULL) {
+		old->next = ls->retired;
+		g_atomic_pointer_set (&ls->retired, old);
+	}
+
+	rspamd_upstream_reclaim (ls);
+}
+
 static void
 rspamd_upstream_set_active (struct upstream_list *ls, struct upstream *up)
 {
 	rspamd_mutex_lock (ls->lock);
-	g_ptr_array_add (ls->alive, up);
-	up->active_idx = ls->alive->len - 1;
+	if (up->active_idx == -1) {
+		g_ptr_array_add (ls->alive, up);
+		rspamd_upstream_publish (ls);
+	}
 	rspamd_mutex_unlock (ls->lock);
 }
 
@@ -261,8 +471,9 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 	gdouble ntim;
 
 	rspamd_mutex_lock (ls->lock);
-	g_ptr_array_remove_index (ls->alive, up->active_idx);
+	g_ptr_array_remove (ls->alive, up);
 	up->active_idx = -1;
+	rspamd_upstream_publish (ls);
 
 	if (res != NULL) {
 		/* Resolve name of the upstream one more time */
@@ -292,6 +503,27 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 	rspamd_mutex_unlock (ls->lock);
 }
 
+/*
+ * Requests in flight are counted only for upstreams selected by
+ * `RSPAMD_UPSTREAM_LATENCY`, other rotations never increment the counter
+ */
+static void
+rspamd_upstream_dec_inflight (struct upstream *up)
+{
+	guint cur;
+
+	if (up->ls == NULL || !g_atomic_int_get (&up->ls->track_inflight)) {
+		return;
+	}
+
+	do {
+		cur = g_atomic_int_get (&up->inflight);
+		if (cur == 0) {
+			break;
+		}
+	} while (!g_atomic_int_compare_and_exchange (&up->inflight, cur, cur - 1));
+}
+
 void
 rspamd_upstream_fail (struct upstream *up)
 {
@@ -300,6 +532,9 @@ rspamd_upstream_fail (struct upstream *up)
 	gint msec_last, msec_cur;
 
 	gettimeofday (&tv, NULL);
+	rspamd_upstream_dec_inflight (up);
+	g_atomic_int_inc (&up->stat->requests);
+	g_atomic_int_inc (&up->stat->errors);
 
 	rspamd_mutex_lock (up->lock);
 	if (up->errors == 0 && up->active_idx != -1) {
@@ -333,16 +568,49 @@ rspamd_upstream_fail (struct upstream *up)
 void
 rspamd_upstream_ok (struct upstream *up)
 {
+	rspamd_upstream_dec_inflight (up);
+	g_atomic_int_inc (&up->stat->requests);
+
 	rspamd_mutex_lock (up->lock);
 	if (up->errors > 0 && up->active_idx != -1) {
 		/* We touch upstream if and only if it is active */
 		up->errors = 0;
-		rspamd_upstream_set_active (up->ls, up);
 	}
 
 	rspamd_mutex_unlock (up->lock);
 }
 
+void
+rspamd_upstream_ok_latency (struct upstream *up, gdouble latency)
+{
+	struct upstream_shared_stat *st = up->stat;
+
+	if (latency >= 0) {
+		/*
+		 * Counters are updated by several processes without locking, so
+		 * we can lose some samples but this is fine for a moving average
+		 */
+		if (st->latency == 0) {
+			st->latency = latency;
+		}
+		else {
+			st->latency = st->latency * (1.0 - default_latency_alpha) +
+					latency * default_latency_alpha;
+		}
+		if (latency > st->max_latency) {
+			st->max_latency = latency;
+		}
+	}
+
+	rspamd_upstream_ok (up);
+}
+
+void
+rspamd_upstream_release (struct upstream *up)
+{
+	rspamd_upstream_dec_inflight (up);
+}
+
 #define SEED_CONSTANT 0xa574de7df64e9b9dULL
 
 struct upstream_list*
@@ -356,10 +624,63 @@ rspamd_upstreams_create (void)
 	ls->alive = g_ptr_array_new ();
 	ls->lock = rspamd_mutex_new ();
 	ls->cur_elt = 0;
+	ls->track_inflight = 0;
+	ls->name = NULL;
+	ls->snap = NULL;
+	ls->retired = NULL;
+	memset (ls->slots, 0, sizeof (ls->slots));
+
+	rspamd_upstream_publish (ls);
+
+	if (upstream_lists == NULL) {
+		upstream_lists = g_ptr_array_new ();
+		upstream_stat_pool = rspamd_mempool_new (
+				rspamd_mempool_suggest_size ());
+	}
+
+	g_ptr_array_add (upstream_lists, ls);
 
 	return ls;
 }
 
+void
+rspamd_upstreams_set_name (struct upstream_list *ups, const gchar *name)
+{
+	g_free (ups->name);
+	ups->name = g_strdup (name);
+}
+
+void
+rspamd_upstreams_foreach_stat (rspamd_upstream_stat_cb cb, gpointer ud)
+{
+	struct upstream_list *ls;
+	struct upstream *up;
+	struct rspamd_upstream_stat st;
+	guint i, j;
+
+	if (upstream_lists == NULL) {
+		return;
+	}
+
+	for (i = 0; i < upstream_lists->len; i ++) {
+		ls = g_ptr_array_index (upstream_lists, i);
+
+		for (j = 0; j < ls->ups->len; j ++) {
+			up = g_ptr_array_index (ls->ups, j);
+
+			st.name = up->name;
+			st.latency = up->stat->latency;
+			st.max_latency = up->stat->max_latency;
+			st.requests = up->stat->requests;
+			st.errors = up->stat->errors;
+			st.inflight = g_atomic_int_get (&up->inflight);
+			st.alive = up->active_idx != -1;
+
+			cb (ls->name ? ls->name : "unnamed", &st, ud);
+		}
+	}
+}
+
 gsize
 rspamd_upstreams_count (struct upstream_list *ups)
 {
@@ -369,7 +690,13 @@ rspamd_upstreams_count (struct upstream_list *ups)
 gsize
 rspamd_upstreams_alive (struct upstream_list *ups)
 {
-	return ups->alive->len;
+	struct upstream_slot *slot = rspamd_upstream_get_slot (ups);
+	gsize len;
+
+	len = rspamd_upstream_snapshot_acquire (ups, slot)->len;
+	rspamd_upstream_snapshot_release (ups, slot);
+
+	return len;
 }
 
 static void
@@ -440,9 +767,15 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups,
 	}
 
 	g_ptr_array_add (ups->ups, up);
+	/*
+	 * Counters are allocated in shared memory, so all workers forked after
+	 * configuration share the latency of the same upstream
+	 */
+	up->stat = rspamd_mempool_alloc0_shared (upstream_stat_pool,
+			sizeof (*up->stat));
 	up->ud = data;
-	up->cur_weight = up->weight;
 	up->ls = ups;
+	up->active_idx = -1;
 	REF_INIT_RETAIN (up, rspamd_upstream_dtor);
 	up->lock = rspamd_mutex_new ();
 	qsort (up->addrs.addr, up->addrs.count, sizeof (up->addrs.addr[0]),
@@ -529,8 +862,14 @@ rspamd_upstreams_destroy (struct upstream_list *ups)
 {
 	guint i;
 	struct upstream *up;
+	struct upstream_alive_snapshot *cur, *tmp;
 
 	g_ptr_array_free (ups->alive, TRUE);
+	rspamd_upstream_snapshot_free (ups->snap);
+
+	LL_FOREACH_SAFE (ups->retired, cur, tmp) {
+		rspamd_upstream_snapshot_free (cur);
+	}
 
 	for (i = 0; i < ups->ups->len; i ++) {
 		up = g_ptr_array_index (ups->ups, i);
@@ -540,6 +879,8 @@ rspamd_upstreams_destroy (struct upstream_list *ups)
 
 	g_ptr_array_free (ups->ups, TRUE);
 	rspamd_mutex_free (ups->lock);
+	g_ptr_array_remove_fast (upstream_lists, ups);
+	g_free (ups->name);
 	g_slice_free1 (sizeof (*ups), ups);
 }
 
@@ -558,54 +899,79 @@ rspamd_upstream_restore_cb (gpointer elt, gpointer ls)
 	}
 
 	g_ptr_array_add (ups->alive, up);
-	up->active_idx = ups->alive->len - 1;
 	rspamd_mutex_unlock (up->lock);
 	/* For revive event */
 	REF_RELEASE (up);
 }
 
 static struct upstream*
-rspamd_upstream_get_random (struct upstream_list *ups)
+rspamd_upstream_get_random (struct upstream_alive_snapshot *snap)
 {
-	guint idx = ottery_rand_range (ups->alive->len - 1);
+	guint idx = ottery_rand_range (snap->len - 1);
 
-	return g_ptr_array_index (ups->alive, idx);
+	return snap->ups[idx];
 }
 
 static struct upstream*
-rspamd_upstream_get_round_robin (struct upstream_list *ups, gboolean use_cur)
+rspamd_upstream_get_round_robin (struct upstream_slot *slot,
+		struct upstream_alive_snapshot *snap)
 {
-	guint max_weight = 0;
-	struct upstream *up, *selected = NULL;
-	guint i;
+	guint cur;
 
-	/* Select upstream with the maximum cur_weight */
-	rspamd_mutex_lock (ups->lock);
-	for (i = 0; i < ups->alive->len; i ++) {
-		up = g_ptr_array_index (ups->alive, i);
-		if (use_cur) {
-			if (up->cur_weight >= max_weight) {
-				selected = up;
-				max_weight = up->cur_weight;
-			}
-		}
-		else {
-			if (up->weight >= max_weight) {
-				selected = up;
-				max_weight = up->weight;
-			}
-		}
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	cur = g_atomic_int_add (&slot->cur, 1);
+#else
+	cur = g_atomic_int_exchange_and_add ((gint *)&slot->cur, 1);
+#endif
+
+	return snap->ring[cur % snap->ring_len];
+}
+
+/*
+ * Expected time of a new request: latency multiplied by the number of
+ * requests waiting for this upstream; upstreams without samples are preferred
+ * to get their latency measured
+ */
+static inline gdouble
+rspamd_upstream_latency_cost (struct upstream *up)
+{
+	return up->stat->latency * (g_atomic_int_get (&up->inflight) + 1);
+}
+
+/*
+ * Power of two choices: select two random upstreams and use the better one,
+ * so slow upstreams get less load but are still checked from time to time
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_alive_snapshot *snap)
+{
+	struct upstream *up1, *up2, *selected;
+	guint idx1, idx2;
+
+	if (snap->len == 1) {
+		selected = snap->ups[0];
 	}
+	else {
+		idx1 = ottery_rand_range (snap->len - 1);
+		idx2 = ottery_rand_range (snap->len - 2);
+
+		if (idx2 >= idx1) {
+			idx2 ++;
+		}
+
+		up1 = snap->ups[idx1];
+		up2 = snap->ups[idx2];
 
-	if (use_cur) {
-		if (selected->cur_weight > 0) {
-			selected->cur_weight--;
+		if (rspamd_upstream_latency_cost (up1) <=
+				rspamd_upstream_latency_cost (up2)) {
+			selected = up1;
 		}
 		else {
-			selected->cur_weight = selected->weight;
+			selected = up2;
 		}
 	}
-	rspamd_mutex_unlock (ups->lock);
+
+	g_atomic_int_inc (&selected->inflight);
 
 	return selected;
 }
@@ -632,7 +998,8 @@ rspamd_consistent_hash (guint64 key, guint32 nbuckets)
 }
 
 static struct upstream*
-rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint keylen)
+rspamd_upstream_get_hashed (struct upstream_list *ups,
+		struct upstream_alive_snapshot *snap, const guint8 *key, guint keylen)
 {
 	union {
 		guint64 k64;
@@ -645,11 +1012,9 @@ rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint
 	h.k32[0] = XXH32 (key, keylen, ((guint32*)&ups->hash_seed)[0]);
 	h.k32[1] = XXH32 (key, keylen, ((guint32*)&ups->hash_seed)[1]);
 
-	rspamd_mutex_lock (ups->lock);
-	idx = rspamd_consistent_hash (h.k64, ups->alive->len);
-	rspamd_mutex_unlock (ups->lock);
+	idx = rspamd_consistent_hash (h.k64, snap->len);
 
-	return g_ptr_array_index (ups->alive, idx);
+	return snap->ups[idx];
 }
 
 struct upstream*
@@ -659,36 +1024,64 @@ rspamd_upstream_get (struct upstream_list *ups,
 	va_list ap;
 	const guint8 *key;
 	guint keylen;
+	struct upstream_alive_snapshot *snap;
+	struct upstream_slot *slot = rspamd_upstream_get_slot (ups);
+	struct upstream *up = NULL;
+
+	/* Upstreams themselves live as long as the list, only snapshots are freed */
+	snap = rspamd_upstream_snapshot_acquire (ups, slot);
+
+	if (snap->len == 0) {
+		rspamd_mutex_lock (ups->lock);
+		if (ups->alive->len == 0 && ups->ups->len > 0) {
+			/* We have no upstreams alive */
+			g_ptr_array_foreach (ups->ups, rspamd_upstream_restore_cb, ups);
+			rspamd_upstream_publish (ups);
+		}
+		snap = ups->snap;
+		rspamd_mutex_unlock (ups->lock);
 
-	rspamd_mutex_lock (ups->lock);
-	if (ups->alive->len == 0) {
-		/* We have no upstreams alive */
-		g_ptr_array_foreach (ups->ups, rspamd_upstream_restore_cb, ups);
+		if (snap->len == 0) {
+			rspamd_upstream_snapshot_release (ups, slot);
+			return NULL;
+		}
 	}
-	rspamd_mutex_unlock (ups->lock);
 
 	switch (type) {
 	case RSPAMD_UPSTREAM_RANDOM:
-		return rspamd_upstream_get_random (ups);
+		up = rspamd_upstream_get_random (snap);
+		break;
 	case RSPAMD_UPSTREAM_HASHED:
 		va_start (ap, type);
 		key = va_arg (ap, const guint8 *);
 		keylen = va_arg (ap, guint);
 		va_end (ap);
-		return rspamd_upstream_get_hashed (ups, key, keylen);
+		up = rspamd_upstream_get_hashed (ups, snap, key, keylen);
+		break;
 	case RSPAMD_UPSTREAM_ROUND_ROBIN:
-		return rspamd_upstream_get_round_robin (ups, TRUE);
+		up = rspamd_upstream_get_round_robin (slot, snap);
+		break;
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
-		return rspamd_upstream_get_round_robin (ups, FALSE);
+		up = snap->master;
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
-		if (ups->cur_elt >= ups->alive->len) {
+		/* Used by a single thread to iterate over all alive upstreams */
+		if (ups->cur_elt >= snap->len) {
 			ups->cur_elt = 0;
-			return NULL;
 		}
-
-		return g_ptr_array_index (ups->alive, ups->cur_elt ++);
+		else {
+			up = snap->ups[ups->cur_elt ++];
+		}
+		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		if (!g_atomic_int_get (&ups->track_inflight)) {
+			g_atomic_int_set (&ups->track_inflight, 1);
+		}
+		up = rspamd_upstream_get_latency (snap);
+		break;
 	}
 
-	/* Silent stupid compilers */
-	return NULL;
+	rspamd_upstream_snapshot_release (ups, slot);
+
+	return up;
 }
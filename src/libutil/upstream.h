@@ -11,9 +11,26 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_HASHED,
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
-	RSPAMD_UPSTREAM_SEQUENTIAL
+	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY
 };
 
+/*
+ * Statistics of an upstream, latency values are in seconds
+ */
+struct rspamd_upstream_stat {
+	const gchar *name;
+	gdouble latency;
+	gdouble max_latency;
+	guint requests;
+	guint errors;
+	guint inflight;
+	gboolean alive;
+};
+
+typedef void (*rspamd_upstream_stat_cb)(const gchar *list_name,
+		const struct rspamd_upstream_stat *st, gpointer ud);
+
 
 struct rspamd_config;
 /* Opaque upstream structures */
@@ -51,6 +68,20 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Increase upstream successes count and update its latency, used by
+ * `RSPAMD_UPSTREAM_LATENCY` rotation
+ * @param up upstream
+ * @param latency time of request in seconds
+ */
+void rspamd_upstream_ok_latency (struct upstream *up, gdouble latency);
+
+/**
+ * Release upstream selected by `RSPAMD_UPSTREAM_LATENCY` rotation if a request
+ * has been cancelled without neither success nor failure
+ */
+void rspamd_upstream_release (struct upstream *up);
+
 /**
  * Create new list of upstreams
  * @return
@@ -62,6 +93,22 @@ struct upstream_list* rspamd_upstreams_create (void);
  */
 void rspamd_upstreams_destroy (struct upstream_list *ups);
 
+/**
+ * Set symbolic name of upstreams list used in statistics
+ * @param ups
+ * @param name
+ */
+void rspamd_upstreams_set_name (struct upstream_list *ups, const gchar *name);
+
+/**
+ * Call `cb` for each upstream of all upstream lists existing in the process,
+ * counters and latencies are shared between processes for the lists created
+ * before fork
+ * @param cb callback
+ * @param ud opaque data for callback
+ */
+void rspamd_upstreams_foreach_stat (rspamd_upstream_stat_cb cb, gpointer ud);
+
 /**
  * Returns count of upstreams in a list
  * @param ups
@@ -136,6 +183,11 @@ const gchar* rspamd_upstream_name (struct upstream *up);
  * Get new upstream from the list
  * @param ups upstream list
  * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` it is required to specify `key` and `keylen` as arguments
+ * `RSPAMD_UPSTREAM_LATENCY` selects the best of two random upstreams by
+ * latency and number of requests in flight, selected upstream must be then
+ * passed to `rspamd_upstream_ok_latency`, `rspamd_upstream_fail` or
+ * `rspamd_upstream_release`; a list used with this rotation should not be
+ * used with other rotations as requests in flight are counted per list
  * @return
  */
 struct upstream* rspamd_upstream_get (struct upstream_list *ups,
@@ -28,6 +28,9 @@
 /* Lua module init function */
 #define MODULE_INIT_FUNC "module_init"
 
+static gboolean rspamd_lua_load_modules (struct rspamd_config *cfg,
+		lua_State *L);
+
 const luaL_reg null_reg[] = {
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -281,6 +284,27 @@ lua_add_actions_global (lua_State *L)
 	lua_setglobal (L, "rspamd_actions");
 }
 
+/*
+ * Add directory of rspamd lua libraries to `package.path`
+ */
+static void
+rspamd_lua_set_path (lua_State *L)
+{
+	const gchar *old_path;
+	gchar path_buf[PATH_MAX];
+
+	lua_getglobal (L, "package");
+	lua_getfield (L, -1, "path");
+	old_path = lua_tostring (L, -1);
+
+	rspamd_snprintf (path_buf, sizeof (path_buf), "%s/lualib/?.lua;%s",
+		RSPAMD_PLUGINSDIR, old_path ? old_path : "");
+	lua_pop (L, 1);
+	lua_pushstring (L, path_buf);
+	lua_setfield (L, -2, "path");
+	lua_pop (L, 1);
+}
+
 lua_State *
 rspamd_lua_init (struct rspamd_config *cfg)
 {
@@ -288,6 +312,7 @@ rspamd_lua_init (struct rspamd_config *cfg)
 
 	L = luaL_newstate ();
 	luaL_openlibs (L);
+	rspamd_lua_set_path (L);
 
 	luaopen_logger (L);
 	luaopen_mempool (L);
@@ -296,6 +321,7 @@ rspamd_lua_init (struct rspamd_config *cfg)
 	luaopen_hash_table (L);
 	luaopen_trie (L);
 	luaopen_task (L);
+	luaopen_task_ffi (L);
 	luaopen_textpart (L);
 	luaopen_mimepart (L);
 	luaopen_image (L);
@@ -351,14 +377,217 @@ rspamd_free_lua_locked (struct lua_locked_state *st)
 	g_slice_free1 (sizeof (struct lua_locked_state), st);
 }
 
+/*
+ * Pool of lua states with plugins loaded, states are marked as replicas, so
+ * plugins only register threaded callbacks in them and leave the
+ * configuration itself untouched
+ */
+struct rspamd_lua_state_pool {
+	GAsyncQueue *free_states;
+	GPtrArray *states;
+};
+
+struct rspamd_lua_state_pool *
+rspamd_lua_state_pool_new (struct rspamd_config *cfg, guint nstates)
+{
+	struct rspamd_lua_state_pool *pool;
+	lua_State *L;
+	guint i;
+
+	pool = g_slice_alloc (sizeof (struct rspamd_lua_state_pool));
+	pool->free_states = g_async_queue_new ();
+	pool->states = g_ptr_array_sized_new (nstates);
+
+	for (i = 0; i < nstates; i++) {
+		L = rspamd_lua_init (cfg);
+		lua_pushboolean (L, TRUE);
+		lua_setfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_REPLICA_KEY);
+
+		if (!rspamd_lua_load_modules (cfg, L)) {
+			msg_err ("cannot load lua plugins to the pooled state");
+			lua_close (L);
+			rspamd_lua_state_pool_destroy (pool);
+
+			return NULL;
+		}
+
+		g_ptr_array_add (pool->states, L);
+		g_async_queue_push (pool->free_states, L);
+	}
+
+	return pool;
+}
+
+lua_State *
+rspamd_lua_state_pool_get (struct rspamd_lua_state_pool *pool)
+{
+	return g_async_queue_pop (pool->free_states);
+}
+
+void
+rspamd_lua_state_pool_release (struct rspamd_lua_state_pool *pool,
+	lua_State *L)
+{
+	lua_settop (L, 0);
+	g_async_queue_push (pool->free_states, L);
+}
+
+void
+rspamd_lua_state_pool_destroy (struct rspamd_lua_state_pool *pool)
+{
+	guint i;
+
+	for (i = 0; i < pool->states->len; i++) {
+		lua_close (g_ptr_array_index (pool->states, i));
+	}
+
+	g_ptr_array_free (pool->states, TRUE);
+	g_async_queue_unref (pool->free_states);
+	g_slice_free1 (sizeof (struct rspamd_lua_state_pool), pool);
+}
+
 gboolean
-rspamd_init_lua_filters (struct rspamd_config *cfg)
+rspamd_lua_is_replica (lua_State *L)
+{
+	gboolean ret;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_REPLICA_KEY);
+	ret = lua_toboolean (L, -1);
+	lua_pop (L, 1);
+
+	return ret;
+}
+
+/*
+ * Coroutines started by `rspamd_lua_coroutine_run` that are waiting for async
+ * events, indexed by their states
+ */
+struct rspamd_lua_coroutine {
+	rspamd_lua_coroutine_fin_t fin;
+	gpointer ud;
+	gint ref;
+};
+
+static GHashTable *lua_coroutines = NULL;
+
+gboolean
+rspamd_lua_is_yieldable (lua_State *L)
+{
+	gboolean ret;
+
+	/* lua_pushthread returns 1 for the main thread */
+	ret = (lua_pushthread (L) == 0);
+	lua_pop (L, 1);
+
+	return ret;
+}
+
+gint
+rspamd_lua_coroutine_anchor (lua_State *co)
+{
+	lua_pushthread (co);
+
+	return luaL_ref (co, LUA_REGISTRYINDEX);
+}
+
+static void
+rspamd_lua_coroutine_finish (lua_State *co, gint status)
+{
+	struct rspamd_lua_coroutine *cr = NULL;
+
+	if (lua_coroutines != NULL) {
+		cr = g_hash_table_lookup (lua_coroutines, co);
+	}
+
+	if (cr != NULL) {
+		g_hash_table_remove (lua_coroutines, co);
+		cr->fin (co, status, cr->ud);
+		luaL_unref (co, LUA_REGISTRYINDEX, cr->ref);
+		g_slice_free1 (sizeof (struct rspamd_lua_coroutine), cr);
+	}
+	else if (status != 0) {
+		msg_info ("call to coroutine failed: %s", lua_tostring (co, -1));
+	}
+}
+
+gint
+rspamd_lua_coroutine_run (lua_State *co, gint nargs,
+	rspamd_lua_coroutine_fin_t fin, gpointer ud)
+{
+	struct rspamd_lua_coroutine *cr;
+	gint status;
+
+	status = rspamd_lua_resume (co, nargs);
+
+	if (status == LUA_YIELD) {
+		if (fin != NULL) {
+			if (lua_coroutines == NULL) {
+				lua_coroutines = g_hash_table_new (g_direct_hash,
+						g_direct_equal);
+			}
+
+			cr = g_slice_alloc (sizeof (struct rspamd_lua_coroutine));
+			cr->fin = fin;
+			cr->ud = ud;
+			cr->ref = rspamd_lua_coroutine_anchor (co);
+			g_hash_table_insert (lua_coroutines, co, cr);
+		}
+	}
+	else if (fin != NULL) {
+		fin (co, status, ud);
+	}
+	else if (status != 0) {
+		msg_info ("call to coroutine failed: %s", lua_tostring (co, -1));
+	}
+
+	return status;
+}
+
+void
+rspamd_lua_coroutine_resume (lua_State *co, gint nargs)
+{
+	gint status;
+
+	status = rspamd_lua_resume (co, nargs);
+
+	if (status != LUA_YIELD) {
+		rspamd_lua_coroutine_finish (co, status);
+	}
+}
+
+void
+rspamd_lua_coroutine_release (lua_State *co, gint ref)
+{
+	luaL_unref (co, LUA_REGISTRYINDEX, ref);
+}
+
+void
+rspamd_lua_coroutine_abandon (lua_State *co, gint ref)
+{
+	struct rspamd_lua_coroutine *cr = NULL;
+
+	if (lua_coroutines != NULL) {
+		cr = g_hash_table_lookup (lua_coroutines, co);
+	}
+
+	if (cr != NULL) {
+		g_hash_table_remove (lua_coroutines, co);
+		luaL_unref (co, LUA_REGISTRYINDEX, cr->ref);
+		g_slice_free1 (sizeof (struct rspamd_lua_coroutine), cr);
+	}
+
+	luaL_unref (co, LUA_REGISTRYINDEX, ref);
+}
+
+/*
+ * Load all lua plugins to the specified state
+ */
+static gboolean
+rspamd_lua_load_modules (struct rspamd_config *cfg, lua_State *L)
 {
 	struct rspamd_config **pcfg;
-	GList *cur, *tmp;
+	GList *cur;
 	struct script_module *module;
-	struct rspamd_statfile_config *st;
-	lua_State *L = cfg->lua_state;
 
 	cur = g_list_first (cfg->script_modules);
 	while (cur) {
@@ -395,6 +624,21 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 		}
 		cur = g_list_next (cur);
 	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_init_lua_filters (struct rspamd_config *cfg)
+{
+	GList *cur, *tmp;
+	struct rspamd_statfile_config *st;
+	lua_State *L = cfg->lua_state;
+
+	if (!rspamd_lua_load_modules (cfg, L)) {
+		return FALSE;
+	}
+
 	/* Init statfiles normalizers */
 	cur = g_list_first (cfg->statfiles);
 	while (cur) {
@@ -40,6 +40,12 @@ luaL_register (lua_State *L, const gchar *name, const struct luaL_reg *methods)
 }
 #endif
 
+#if LUA_VERSION_NUM > 501
+#define rspamd_lua_resume(L, nargs) lua_resume (L, NULL, nargs)
+#else
+#define rspamd_lua_resume(L, nargs) lua_resume (L, nargs)
+#endif
+
 /* Interface definitions */
 #define LUA_FUNCTION_DEF(class, name) static gint lua_ ## class ## _ ## name ( \
 		lua_State * L)
@@ -49,6 +55,9 @@ extern const luaL_reg null_reg[];
 
 #define RSPAMD_LUA_API_VERSION 12
 
+/* Registry key that marks pooled replicas of the main lua state */
+#define RSPAMD_LUA_REPLICA_KEY "rspamd_replica"
+
 /* Locked lua state with mutex */
 struct lua_locked_state {
 	lua_State *L;
@@ -117,6 +126,85 @@ struct lua_locked_state * rspamd_init_lua_locked (struct rspamd_config *cfg);
  */
 void rspamd_free_lua_locked (struct lua_locked_state *st);
 
+struct rspamd_lua_state_pool;
+
+/**
+ * Create pool of lua states with all lua plugins loaded
+ * @param cfg config object
+ * @param nstates number of states in the pool
+ * @return new pool or NULL if plugins cannot be loaded
+ */
+struct rspamd_lua_state_pool * rspamd_lua_state_pool_new (
+	struct rspamd_config *cfg,
+	guint nstates);
+
+/**
+ * Take a state from the pool, waits for a free state if all are busy
+ */
+lua_State * rspamd_lua_state_pool_get (struct rspamd_lua_state_pool *pool);
+
+/**
+ * Return a state taken by `rspamd_lua_state_pool_get` to the pool
+ */
+void rspamd_lua_state_pool_release (struct rspamd_lua_state_pool *pool,
+	lua_State *L);
+
+/**
+ * Destroy pool and close all its states
+ */
+void rspamd_lua_state_pool_destroy (struct rspamd_lua_state_pool *pool);
+
+/**
+ * Check whether the state is a pooled replica of the main lua state
+ */
+gboolean rspamd_lua_is_replica (lua_State *L);
+
+/**
+ * Handler called when a coroutine started by `rspamd_lua_coroutine_run` is
+ * finished, `status` is the result of the last resume and the coroutine's
+ * stack contains its results or the error message
+ */
+typedef void (*rspamd_lua_coroutine_fin_t)(lua_State *co, gint status,
+	gpointer ud);
+
+/**
+ * Check whether the current function can yield, i.e. it is called from a
+ * coroutine and not from the main thread
+ */
+gboolean rspamd_lua_is_yieldable (lua_State *L);
+
+/**
+ * Run a function and its `nargs` arguments pushed to the coroutine `co`. If
+ * the coroutine yields waiting for an async event, `fin` is called when it is
+ * finished after `rspamd_lua_coroutine_resume`, otherwise it is called
+ * immediately
+ * @return status of the first resume
+ */
+gint rspamd_lua_coroutine_run (lua_State *co, gint nargs,
+	rspamd_lua_coroutine_fin_t fin, gpointer ud);
+
+/**
+ * Keep a coroutine that yields waiting for an async event from being collected
+ * @return reference to be passed to `rspamd_lua_coroutine_release`
+ */
+gint rspamd_lua_coroutine_anchor (lua_State *co);
+
+/**
+ * Resume a coroutine with `nargs` values pushed to its stack
+ */
+void rspamd_lua_coroutine_resume (lua_State *co, gint nargs);
+
+/**
+ * Release reference obtained by `rspamd_lua_coroutine_anchor`
+ */
+void rspamd_lua_coroutine_release (lua_State *co, gint ref);
+
+/**
+ * Release reference of a coroutine that will never be resumed (e.g. its
+ * session is destroyed), its finish handler is not called
+ */
+void rspamd_lua_coroutine_abandon (lua_State *co, gint ref);
+
 /**
  * Push lua ip address
  */
@@ -150,6 +238,7 @@ struct rspamd_lua_ip {
 void rspamd_lua_add_preload (lua_State *L, const gchar *name, lua_CFunction func);
 
 void luaopen_task (lua_State *L);
+void luaopen_task_ffi (lua_State *L);
 void luaopen_config (lua_State *L);
 void luaopen_metric (lua_State *L);
 void luaopen_radix (lua_State *L);
@@ -171,6 +260,11 @@ void luaopen_mempool (lua_State * L);
 void luaopen_session (lua_State * L);
 void luaopen_io_dispatcher (lua_State * L);
 void luaopen_dns_resolver (lua_State * L);
+struct rdns_reply;
+/**
+ * Push results of DNS reply (table or nil) and error (string or nil)
+ */
+void rspamd_lua_push_dns_reply (lua_State *L, struct rdns_reply *reply);
 void luaopen_rsa (lua_State * L);
 void luaopen_ip (lua_State * L);
 
@@ -206,6 +206,31 @@ LUA_FUNCTION_DEF (config, register_virtual_symbol);
  */
 LUA_FUNCTION_DEF (config, register_callback_symbol);
 LUA_FUNCTION_DEF (config, register_callback_symbol_priority);
+/***
+ * @method rspamd_config:register_threaded_symbol(name, weight, callback)
+ * Register symbol which callback can be executed by a pool of threads (see
+ * `lua_threads` option). Each thread uses its own copy of lua plugins, so the
+ * callback must depend on the task and plugin settings only: maps, async
+ * requests and global state modified by other callbacks are not available.
+ * If threads are disabled the callback is executed as a normal symbol.
+ * @param {string} name symbol's name
+ * @param {number} weight initial weight of symbol
+ * @param {function} callback callback function to be called for a specified symbol
+ */
+LUA_FUNCTION_DEF (config, register_threaded_symbol);
+/***
+ * @method rspamd_config:set_header_symbol(name)
+ * Mark registered symbol as depending on message headers (and SMTP data) only.
+ * In streaming mode such a symbol is called as soon as the headers block is
+ * received, so its DNS requests are sent while the rest of message is being read.
+ * The callback must not access message's parts, urls or text.
+ * @param {string} name symbol's name
+ * @return {bool} `true` if symbol has been found
+ * @example
+rspamd_config:register_callback_symbol_priority('RBL', 1.0, 0, rbl_cb)
+rspamd_config:set_header_symbol('RBL')
+ */
+LUA_FUNCTION_DEF (config, set_header_symbol);
 /***
  * @method rspamd_config:register_pre_filter(callback)
  * Register function to be called prior to symbols processing.
@@ -290,6 +315,8 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, register_virtual_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol_priority),
+	LUA_INTERFACE_DEF (config, register_threaded_symbol),
+	LUA_INTERFACE_DEF (config, set_header_symbol),
 	LUA_INTERFACE_DEF (config, register_module_option),
 	LUA_INTERFACE_DEF (config, register_pre_filter),
 	LUA_INTERFACE_DEF (config, register_post_filter),
@@ -337,6 +364,19 @@ static const struct luaL_reg trielib_f[] = {
 	{NULL, NULL}
 };
 
+/* Registry table of threaded symbols callbacks in pooled states */
+#define LUA_THREADED_SYMBOLS_KEY "rspamd_threaded_symbols"
+
+/*
+ * Pooled replicas of the main state share configuration with it, so they
+ * must not modify it
+ */
+#define LUA_CONFIG_SKIP_REPLICA(L) do { \
+		if (rspamd_lua_is_replica (L)) { \
+			return 0; \
+		} \
+} while (0)
+
 static struct rspamd_config *
 lua_check_config (lua_State * L)
 {
@@ -353,12 +393,12 @@ lua_check_radix (lua_State * L)
 	return ud ? **((radix_compressed_t ***)ud) : NULL;
 }
 
-static GHashTable *
+static rspamd_phash_t *
 lua_check_hash_table (lua_State * L)
 {
 	void *ud = luaL_checkudata (L, 1, "rspamd{hash_table}");
 	luaL_argcheck (L, ud != NULL, 1, "'hash_table' expected");
-	return ud ? **((GHashTable ***)ud) : NULL;
+	return ud ? **((rspamd_phash_t ***)ud) : NULL;
 }
 
 static rspamd_trie_t *
@@ -548,6 +588,8 @@ lua_config_register_function (lua_State *L)
 	gchar *name;
 	struct lua_callback_data *cd;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		name = rspamd_mempool_strdup (cfg->cfg_pool, luaL_checkstring (L, 2));
 		cd =
@@ -620,6 +662,8 @@ lua_config_register_post_filter (lua_State *L)
 	struct rspamd_config *cfg = lua_check_config (L);
 	struct lua_callback_data *cd;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		cd =
 			rspamd_mempool_alloc (cfg->cfg_pool,
@@ -680,6 +724,8 @@ lua_config_register_pre_filter (lua_State *L)
 	struct rspamd_config *cfg = lua_check_config (L);
 	struct lua_callback_data *cd;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		cd =
 			rspamd_mempool_alloc (cfg->cfg_pool,
@@ -711,6 +757,8 @@ lua_config_add_radix_map (lua_State *L)
 	const gchar *map_line, *description;
 	radix_compressed_t **r, ***ud;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
@@ -735,29 +783,40 @@ lua_config_add_radix_map (lua_State *L)
 
 }
 
+static void
+lua_config_hash_map_dtor (gpointer p)
+{
+	rspamd_phash_t **r = p;
+
+	if (*r != NULL) {
+		rspamd_phash_destroy (*r);
+	}
+}
+
 static gint
 lua_config_add_hash_map (lua_State *L)
 {
 	struct rspamd_config *cfg = lua_check_config (L);
 	const gchar *map_line, *description;
-	GHashTable **r, ***ud;
+	rspamd_phash_t **r, ***ud;
+
+	LUA_CONFIG_SKIP_REPLICA (L);
 
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
-		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (GHashTable *));
-		*r = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (rspamd_phash_t *));
+		*r = NULL;
 		if (!rspamd_map_add (cfg, map_line, description, rspamd_hosts_read, rspamd_hosts_fin,
 			(void **)r)) {
 			msg_warn ("invalid hash map %s", map_line);
-			g_hash_table_destroy (*r);
 			lua_pushnil (L);
 			return 1;
 		}
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
-			(rspamd_mempool_destruct_t)g_hash_table_destroy,
-			*r);
-		ud = lua_newuserdata (L, sizeof (GHashTable *));
+			lua_config_hash_map_dtor,
+			r);
+		ud = lua_newuserdata (L, sizeof (rspamd_phash_t *));
 		*ud = r;
 		rspamd_lua_setclass (L, "rspamd{hash_table}", -1);
 
@@ -774,24 +833,25 @@ lua_config_add_kv_map (lua_State *L)
 {
 	struct rspamd_config *cfg = lua_check_config (L);
 	const gchar *map_line, *description;
-	GHashTable **r, ***ud;
+	rspamd_phash_t **r, ***ud;
+
+	LUA_CONFIG_SKIP_REPLICA (L);
 
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
-		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (GHashTable *));
-		*r = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (rspamd_phash_t *));
+		*r = NULL;
 		if (!rspamd_map_add (cfg, map_line, description, rspamd_kv_list_read, rspamd_kv_list_fin,
 			(void **)r)) {
 			msg_warn ("invalid hash map %s", map_line);
-			g_hash_table_destroy (*r);
 			lua_pushnil (L);
 			return 1;
 		}
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
-			(rspamd_mempool_destruct_t)g_hash_table_destroy,
-			*r);
-		ud = lua_newuserdata (L, sizeof (GHashTable *));
+			lua_config_hash_map_dtor,
+			r);
+		ud = lua_newuserdata (L, sizeof (rspamd_phash_t *));
 		*ud = r;
 		rspamd_lua_setclass (L, "rspamd{hash_table}", -1);
 
@@ -828,30 +888,19 @@ lua_config_get_key (lua_State *L)
 	return 1;
 }
 
+/*
+ * Insert result returned by symbol callback, `level` is the stack top before
+ * the callback has been called
+ */
 static void
-lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+lua_metric_symbol_results (struct rspamd_task *task,
+	lua_State *L,
+	gint level,
+	const gchar *symbol)
 {
-	struct lua_callback_data *cd = ud;
-	struct rspamd_task **ptask;
-	gint level = lua_gettop (cd->L), nresults;
-
-	if (cd->cb_is_ref) {
-		lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->callback.ref);
-	}
-	else {
-		lua_getglobal (cd->L, cd->callback.name);
-	}
-	ptask = lua_newuserdata (cd->L, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (cd->L, "rspamd{task}", -1);
-	*ptask = task;
-
-	if (lua_pcall (cd->L, 1, LUA_MULTRET, 0) != 0) {
-		msg_info ("call to (%s)%s failed: %s", cd->symbol,
-			cd->cb_is_ref ? "local function" : cd->callback.name,
-			lua_tostring (cd->L, -1));
-	}
+	gint nresults;
 
-	nresults = lua_gettop (cd->L) - level;
+	nresults = lua_gettop (L) - level;
 	if (nresults >= 1) {
 		/* Function returned boolean, so maybe we need to insert result? */
 		gboolean res;
@@ -859,32 +908,227 @@ lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 		gint i;
 		gdouble flag = 1.0;
 
-		if (lua_type (cd->L, level + 1) == LUA_TBOOLEAN) {
-			res = lua_toboolean (cd->L, level + 1);
+		if (lua_type (L, level + 1) == LUA_TBOOLEAN) {
+			res = lua_toboolean (L, level + 1);
 			if (res) {
 				gint first_opt = 2;
 
-				if (lua_type (cd->L, level + 2) == LUA_TNUMBER) {
-					flag = lua_tonumber (cd->L, level + 2);
+				if (lua_type (L, level + 2) == LUA_TNUMBER) {
+					flag = lua_tonumber (L, level + 2);
 					/* Shift opt index */
 					first_opt = 3;
 				}
 
-				for (i = lua_gettop (cd->L); i >= level + first_opt; i --) {
-					if (lua_type (cd->L, i) == LUA_TSTRING) {
-						const char *opt = lua_tostring (cd->L, i);
+				for (i = lua_gettop (L); i >= level + first_opt; i --) {
+					if (lua_type (L, i) == LUA_TSTRING) {
+						const char *opt = lua_tostring (L, i);
 
 						opts = g_list_prepend (opts,
 							rspamd_mempool_strdup (task->task_pool, opt));
 					}
 				}
-				rspamd_task_insert_result (task, cd->symbol, flag, opts);
+
+				rspamd_task_insert_result (task, symbol, flag, opts);
 			}
 		}
-		lua_pop (cd->L, nresults);
+		lua_pop (L, nresults);
+	}
+}
+
+/*
+ * Call symbol callback that is on the top of the stack and insert its result
+ */
+static void
+lua_metric_symbol_call (struct rspamd_task *task,
+	lua_State *L,
+	gint level,
+	const gchar *symbol,
+	const gchar *cbname)
+{
+	struct rspamd_task **ptask;
+
+	ptask = lua_newuserdata (L, sizeof (struct rspamd_task *));
+	rspamd_lua_setclass (L, "rspamd{task}", -1);
+	*ptask = task;
+
+	if (lua_pcall (L, 1, LUA_MULTRET, 0) != 0) {
+		msg_info ("call to (%s)%s failed: %s", symbol, cbname,
+			lua_tostring (L, -1));
+		lua_pop (L, 1);
+		return;
+	}
+
+	lua_metric_symbol_results (task, L, level, symbol);
+}
+
+struct lua_metric_coroutine_cbdata {
+	struct lua_callback_data *cd;
+	struct rspamd_task *task;
+};
+
+static void
+lua_metric_symbol_fin (lua_State *co, gint status, gpointer ud)
+{
+	struct lua_metric_coroutine_cbdata *cbd = ud;
+	struct lua_callback_data *cd = cbd->cd;
+
+	if (status != 0) {
+		msg_info ("call to (%s)%s failed: %s", cd->symbol,
+			cd->cb_is_ref ? "local function" : cd->callback.name,
+			lua_tostring (co, -1));
+		lua_settop (co, 0);
+	}
+	else {
+		lua_metric_symbol_results (cbd->task, co, 0, cd->symbol);
 	}
 }
 
+/*
+ * Symbols callbacks are executed as coroutines, so they can call async
+ * methods, such as task:resolve_a(), that yield until their results are ready
+ */
+static void
+lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_callback_data *cd = ud;
+	struct lua_metric_coroutine_cbdata *cbd;
+	struct rspamd_task **ptask;
+	lua_State *co;
+
+	co = lua_newthread (cd->L);
+
+	if (cd->cb_is_ref) {
+		lua_rawgeti (co, LUA_REGISTRYINDEX, cd->callback.ref);
+	}
+	else {
+		lua_getglobal (co, cd->callback.name);
+	}
+
+	ptask = lua_newuserdata (co, sizeof (struct rspamd_task *));
+	rspamd_lua_setclass (co, "rspamd{task}", -1);
+	*ptask = task;
+
+	cbd = rspamd_mempool_alloc (task->task_pool,
+			sizeof (struct lua_metric_coroutine_cbdata));
+	cbd->cd = cd;
+	cbd->task = task;
+
+	rspamd_lua_coroutine_run (co, 1, lua_metric_symbol_fin, cbd);
+	/* Suspended coroutine is anchored until it is finished */
+	lua_pop (cd->L, 1);
+}
+
+/*
+ * Threaded symbols are executed by a pool of threads, each thread takes one
+ * of pooled lua states that have all plugins loaded
+ */
+struct lua_threaded_job {
+	struct lua_callback_data *cd;
+	struct rspamd_task *task;
+	struct rspamd_async_watcher *w;
+};
+
+static GThreadPool *lua_threads_pool = NULL;
+static struct rspamd_lua_state_pool *lua_states_pool = NULL;
+static gboolean lua_threads_failed = FALSE;
+
+static void
+lua_threaded_symbol_process (gpointer data, gpointer user_data)
+{
+	struct lua_threaded_job *job = data;
+	lua_State *L;
+
+	L = rspamd_lua_state_pool_get (lua_states_pool);
+	lua_getfield (L, LUA_REGISTRYINDEX, LUA_THREADED_SYMBOLS_KEY);
+
+	if (lua_istable (L, -1)) {
+		lua_getfield (L, -1, job->cd->symbol);
+		lua_remove (L, -2);
+
+		if (lua_isfunction (L, -1)) {
+			lua_metric_symbol_call (job->task, L, 0, job->cd->symbol,
+				"threaded function");
+		}
+		else {
+			msg_err ("threaded symbol %s is not registered in pooled state",
+				job->cd->symbol);
+		}
+	}
+
+	rspamd_lua_state_pool_release (lua_states_pool, L);
+	remove_async_thread (job->task->s, job->w);
+}
+
+static gboolean
+lua_threaded_symbols_init (struct rspamd_config *cfg)
+{
+	GError *err = NULL;
+
+	lua_states_pool = rspamd_lua_state_pool_new (cfg, cfg->lua_threads);
+
+	if (lua_states_pool == NULL) {
+		return FALSE;
+	}
+
+	lua_threads_pool = g_thread_pool_new (lua_threaded_symbol_process,
+			NULL,
+			cfg->lua_threads,
+			TRUE,
+			&err);
+
+	if (err != NULL) {
+		msg_err ("lua thread pool creation failed: %s", err->message);
+		g_error_free (err);
+		rspamd_lua_state_pool_destroy (lua_states_pool);
+		lua_states_pool = NULL;
+		lua_threads_pool = NULL;
+
+		return FALSE;
+	}
+
+	msg_info ("created pool of %d lua states for threaded symbols",
+		cfg->lua_threads);
+
+	return TRUE;
+}
+
+static void
+lua_threaded_symbol_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_callback_data *cd = ud;
+	struct lua_threaded_job *job;
+	GError *err = NULL;
+
+	if (lua_threads_pool == NULL && !lua_threads_failed &&
+		task->cfg->lua_threads > 1) {
+		/* Pool is created on demand in the worker process */
+		lua_threads_failed = !lua_threaded_symbols_init (task->cfg);
+	}
+
+	if (lua_threads_pool != NULL) {
+		job = rspamd_mempool_alloc (task->task_pool,
+				sizeof (struct lua_threaded_job));
+		job->cd = cd;
+		job->task = task;
+
+		/* Symbol is finished for its watcher when the job is done */
+		job->w = register_async_thread (task->s);
+		g_thread_pool_push (lua_threads_pool, job, &err);
+
+		if (err == NULL) {
+			return;
+		}
+
+		msg_err ("error pushing task to the lua thread pool: %s",
+			err->message);
+		g_error_free (err);
+		remove_async_thread (task->s, job->w);
+	}
+
+	/* Threads are disabled, call symbol in the main state */
+	lua_metric_symbol_callback (task, cd);
+}
+
 static void
 rspamd_register_symbol_fromlua (lua_State *L,
 		struct rspamd_config *cfg,
@@ -924,6 +1168,8 @@ lua_config_register_symbol (lua_State * L)
 	gchar *name;
 	double weight;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		name = rspamd_mempool_strdup (cfg->cfg_pool, luaL_checkstring (L, 2));
 		weight = luaL_checknumber (L, 3);
@@ -956,6 +1202,8 @@ lua_config_register_symbols (lua_State *L)
 	gchar *sym;
 	gdouble weight = 1.0;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (lua_gettop (L) < 3) {
 		msg_err ("not enough arguments to register a function");
 		return 0;
@@ -1015,6 +1263,8 @@ lua_config_register_virtual_symbol (lua_State * L)
 	gchar *name;
 	double weight;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		name = rspamd_mempool_strdup (cfg->cfg_pool, luaL_checkstring (L, 2));
 		weight = luaL_checknumber (L, 3);
@@ -1025,6 +1275,74 @@ lua_config_register_virtual_symbol (lua_State * L)
 	return 0;
 }
 
+static gint
+lua_config_register_threaded_symbol (lua_State * L)
+{
+	struct rspamd_config *cfg = lua_check_config (L);
+	struct lua_callback_data *cd;
+	gchar *name;
+	double weight;
+
+	if (cfg) {
+		luaL_checktype (L, 4, LUA_TFUNCTION);
+
+		if (rspamd_lua_is_replica (L)) {
+			/* Save callback to be found by pool threads */
+			lua_getfield (L, LUA_REGISTRYINDEX, LUA_THREADED_SYMBOLS_KEY);
+			if (!lua_istable (L, -1)) {
+				lua_pop (L, 1);
+				lua_newtable (L);
+				lua_pushvalue (L, -1);
+				lua_setfield (L, LUA_REGISTRYINDEX, LUA_THREADED_SYMBOLS_KEY);
+			}
+			lua_pushvalue (L, 4);
+			lua_setfield (L, -2, luaL_checkstring (L, 2));
+			lua_pop (L, 1);
+
+			return 0;
+		}
+
+		name = rspamd_mempool_strdup (cfg->cfg_pool, luaL_checkstring (L, 2));
+		weight = luaL_checknumber (L, 3);
+
+		cd = rspamd_mempool_alloc0 (cfg->cfg_pool,
+				sizeof (struct lua_callback_data));
+		lua_pushvalue (L, 4);
+		cd->callback.ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		cd->cb_is_ref = TRUE;
+		cd->L = L;
+		cd->symbol = name;
+
+		register_symbol (&cfg->cache, name, weight,
+			lua_threaded_symbol_callback, cd);
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)lua_destroy_cfg_symbol,
+			cd);
+	}
+
+	return 0;
+}
+
+static gint
+lua_config_set_header_symbol (lua_State * L)
+{
+	struct rspamd_config *cfg = lua_check_config (L);
+	const gchar *name;
+
+	LUA_CONFIG_SKIP_REPLICA (L);
+
+	if (cfg) {
+		name = luaL_checkstring (L, 2);
+		if (name) {
+			lua_pushboolean (L, set_header_symbol (cfg->cache, name));
+			return 1;
+		}
+	}
+
+	lua_pushboolean (L, FALSE);
+	return 1;
+}
+
 static gint
 lua_config_register_callback_symbol (lua_State * L)
 {
@@ -1032,6 +1350,8 @@ lua_config_register_callback_symbol (lua_State * L)
 	gchar *name;
 	double weight;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		name = rspamd_mempool_strdup (cfg->cfg_pool, luaL_checkstring (L, 2));
 		weight = luaL_checknumber (L, 3);
@@ -1064,6 +1384,8 @@ lua_config_register_callback_symbol_priority (lua_State * L)
 	double weight;
 	gint priority;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		name = rspamd_mempool_strdup (cfg->cfg_pool, luaL_checkstring (L, 2));
 		weight = luaL_checknumber (L, 3);
@@ -1096,6 +1418,8 @@ lua_config_newindex (lua_State *L)
 	struct rspamd_config *cfg = lua_check_config (L);
 	const gchar *name;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	name = luaL_checkstring (L, 2);
 
 	if (name != NULL && lua_gettop (L) > 2) {
@@ -1258,6 +1582,8 @@ lua_config_add_map (lua_State *L)
 	struct lua_map_callback_data *cbdata, **pcbdata;
 	int cbidx;
 
+	LUA_CONFIG_SKIP_REPLICA (L);
+
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 
@@ -1324,13 +1650,13 @@ lua_radix_get_key (lua_State * L)
 static gint
 lua_hash_table_get_key (lua_State * L)
 {
-	GHashTable *tbl = lua_check_hash_table (L);
+	rspamd_phash_t *tbl = lua_check_hash_table (L);
 	const gchar *key, *value;
 
 	if (tbl) {
 		key = luaL_checkstring (L, 2);
 
-		if ((value = g_hash_table_lookup (tbl, key)) != NULL) {
+		if ((value = rspamd_phash_lookup (tbl, key)) != NULL) {
 			lua_pushstring (L, value);
 			return 1;
 		}
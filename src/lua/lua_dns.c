@@ -84,27 +84,18 @@ lua_dns_get_type (lua_State *L, int argno)
 	return type;
 }
 
-static void
-lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+void
+rspamd_lua_push_dns_reply (lua_State *L, struct rdns_reply *reply)
 {
-	struct lua_dns_cbdata *cd = arg;
 	gint i = 0;
-	struct rspamd_dns_resolver **presolver;
 	struct rdns_reply_entry *elt;
 	rspamd_inet_addr_t addr;
 
-	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
-	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
-	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
-
-	*presolver = cd->resolver;
-	lua_pushstring (cd->L, cd->to_resolve);
-
 	/*
 	 * XXX: rework to handle different request types
 	 */
 	if (reply->code == RDNS_RC_NOERROR) {
-		lua_newtable (cd->L);
+		lua_newtable (L);
 		LL_FOREACH (reply->entries, elt)
 		{
 			switch (elt->type) {
@@ -113,44 +104,60 @@ lua_dns_callback (struct rdns_reply *reply, gpointer arg)
 				addr.slen = sizeof (addr.addr.s4);
 				memcpy (&addr.addr.s4.sin_addr, &elt->content.a.addr,
 					sizeof (addr.addr.s4.sin_addr));
-				rspamd_lua_ip_push (cd->L, &addr);
-				lua_rawseti (cd->L, -2, ++i);
+				rspamd_lua_ip_push (L, &addr);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_AAAA:
 				addr.af = AF_INET6;
 				addr.slen = sizeof (addr.addr.s6);
 				memcpy (&addr.addr.s6.sin6_addr, &elt->content.aaa.addr,
 					sizeof (addr.addr.s6.sin6_addr));
-				rspamd_lua_ip_push (cd->L, &addr);
-				lua_rawseti (cd->L, -2, ++i);
+				rspamd_lua_ip_push (L, &addr);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_PTR:
-				lua_pushstring (cd->L, elt->content.ptr.name);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.ptr.name);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_TXT:
 			case RDNS_REQUEST_SPF:
-				lua_pushstring (cd->L, elt->content.txt.data);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.txt.data);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_MX:
 				/* mx['name'], mx['priority'] */
-				lua_newtable (cd->L);
-				rspamd_lua_table_set (cd->L, "name", elt->content.mx.name);
-				lua_pushstring (cd->L, "priority");
-				lua_pushnumber (cd->L, elt->content.mx.priority);
-				lua_settable (cd->L, -3);
+				lua_newtable (L);
+				rspamd_lua_table_set (L, "name", elt->content.mx.name);
+				lua_pushstring (L, "priority");
+				lua_pushnumber (L, elt->content.mx.priority);
+				lua_settable (L, -3);
 
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			}
 		}
-		lua_pushnil (cd->L);
+		lua_pushnil (L);
 	}
 	else {
-		lua_pushnil (cd->L);
-		lua_pushstring (cd->L, rdns_strerror (reply->code));
+		lua_pushnil (L);
+		lua_pushstring (L, rdns_strerror (reply->code));
 	}
+}
+
+static void
+lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_dns_cbdata *cd = arg;
+	struct rspamd_dns_resolver **presolver;
+
+	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
+	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
+	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
+
+	*presolver = cd->resolver;
+	lua_pushstring (cd->L, cd->to_resolve);
+
+	rspamd_lua_push_dns_reply (cd->L, reply);
 
 	if (cd->user_str != NULL) {
 		lua_pushstring (cd->L, cd->user_str);
@@ -40,27 +40,48 @@
  */
 
 LUA_FUNCTION_DEF (redis, make_request);
+LUA_FUNCTION_DEF (redis, request);
 
 static const struct luaL_reg redislib_m[] = {
 	LUA_INTERFACE_DEF (redis, make_request),
+	LUA_INTERFACE_DEF (redis, request),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
 
+/* Maximum number of idle connections kept per server */
+#define LUA_REDIS_MAX_IDLE 16
+
+/**
+ * Persistent connection to a redis server
+ */
+struct lua_redis_connection {
+	redisAsyncContext *ctx;
+	const gchar *key;
+};
+
+/* Idle connections indexed by `server:port:event_base` */
+static GHashTable *lua_redis_idle = NULL;
+
 /**
  * Struct for userdata representation
  */
 struct lua_redis_userdata {
-	redisAsyncContext *ctx;
+	struct lua_redis_connection *conn;
 	lua_State *L;
+	lua_State *co;
 	struct rspamd_task *task;
 	gint cbref;
+	gint co_ref;
 	gchar *server;
+	gchar *key;
 	struct in_addr ina;
 	gchar *reqline;
 	guint16 port;
 	rspamd_fstring_t *args;
 	guint args_num;
+	gboolean terminated;
+	gboolean replied;
 };
 
 /**
@@ -76,13 +97,132 @@ lua_check_task (lua_State * L)
 	return ud ? *((struct rspamd_task **)ud) : NULL;
 }
 
+static void
+lua_redis_disconnect_callback (const redisAsyncContext *c, gint status)
+{
+	struct lua_redis_connection *conn = c->data;
+	GQueue *idle;
+
+	/* Only idle connections have data attached */
+	if (conn != NULL) {
+		idle = g_hash_table_lookup (lua_redis_idle, conn->key);
+
+		if (idle != NULL) {
+			g_queue_remove (idle, conn);
+		}
+
+		g_slice_free1 (sizeof (struct lua_redis_connection), conn);
+	}
+}
+
+static struct lua_redis_connection *
+lua_redis_connection_get (const gchar *key)
+{
+	GQueue *idle;
+	struct lua_redis_connection *conn = NULL;
+
+	if (lua_redis_idle != NULL) {
+		idle = g_hash_table_lookup (lua_redis_idle, key);
+
+		if (idle != NULL) {
+			conn = g_queue_pop_head (idle);
+		}
+	}
+
+	if (conn != NULL) {
+		conn->ctx->data = NULL;
+	}
+
+	return conn;
+}
+
+static struct lua_redis_connection *
+lua_redis_connection_new (struct lua_redis_userdata *ud)
+{
+	struct lua_redis_connection *conn;
+	redisAsyncContext *ctx;
+	gpointer key;
+	GQueue *idle;
+
+	ctx = redisAsyncConnect (inet_ntoa (ud->ina), ud->port);
+
+	if (ctx == NULL || ctx->err) {
+		if (ctx != NULL) {
+			msg_info ("cannot connect to redis server %s: %s", ud->server,
+				ctx->errstr);
+			redisAsyncFree (ctx);
+		}
+
+		return NULL;
+	}
+
+	if (lua_redis_idle == NULL) {
+		lua_redis_idle = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, NULL);
+	}
+
+	if (!g_hash_table_lookup_extended (lua_redis_idle, ud->key, &key,
+		(gpointer *)&idle)) {
+		key = g_strdup (ud->key);
+		g_hash_table_insert (lua_redis_idle, key, g_queue_new ());
+	}
+
+	conn = g_slice_alloc (sizeof (struct lua_redis_connection));
+	conn->ctx = ctx;
+	conn->key = key;
+	ctx->data = NULL;
+	redisLibeventAttach (ctx, ud->task->ev_base);
+	redisAsyncSetDisconnectCallback (ctx, lua_redis_disconnect_callback);
+
+	return conn;
+}
+
+/**
+ * Return a healthy connection to the idle pool or close it if the pool is full
+ */
+static void
+lua_redis_connection_release (struct lua_redis_connection *conn)
+{
+	GQueue *idle;
+
+	idle = g_hash_table_lookup (lua_redis_idle, conn->key);
+
+	if (idle != NULL && g_queue_get_length (idle) < LUA_REDIS_MAX_IDLE) {
+		conn->ctx->data = conn;
+		g_queue_push_tail (idle, conn);
+	}
+	else {
+		redisAsyncFree (conn->ctx);
+		g_slice_free1 (sizeof (struct lua_redis_connection), conn);
+	}
+}
+
 static void
 lua_redis_fin (void *arg)
 {
 	struct lua_redis_userdata *ud = arg;
 
-	if (ud->ctx) {
-		redisAsyncFree (ud->ctx);
+	ud->terminated = TRUE;
+
+	if (ud->conn) {
+		/* Connection is still busy, so it cannot be reused */
+		if (ud->conn->ctx) {
+			redisAsyncFree (ud->conn->ctx);
+		}
+
+		g_slice_free1 (sizeof (struct lua_redis_connection), ud->conn);
+		ud->conn = NULL;
+	}
+
+	if (ud->co) {
+		if (ud->replied) {
+			rspamd_lua_coroutine_release (ud->co, ud->co_ref);
+		}
+		else {
+			rspamd_lua_coroutine_abandon (ud->co, ud->co_ref);
+		}
+	}
+	else {
 		luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
 	}
 }
@@ -94,29 +234,56 @@ lua_redis_fin (void *arg)
  */
 static void
 lua_redis_push_error (const gchar *err,
-	struct lua_redis_userdata *ud,
-	gboolean connected)
+	struct lua_redis_userdata *ud)
 {
 	struct rspamd_task **ptask;
 
-	/* Push error */
-	lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
-	ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (ud->L, "rspamd{task}", -1);
+	ud->replied = TRUE;
 
-	*ptask = ud->task;
-	/* String of error */
-	lua_pushstring (ud->L, err);
-	/* Data is nil */
-	lua_pushnil (ud->L);
-	if (lua_pcall (ud->L, 3, 0, 0) != 0) {
-		msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
+	if (ud->co) {
+		/* Resume coroutine with error and no data */
+		lua_pushstring (ud->co, err);
+		lua_pushnil (ud->co);
+		rspamd_lua_coroutine_resume (ud->co, 2);
 	}
+	else {
+		/* Push error */
+		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+		ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
+		rspamd_lua_setclass (ud->L, "rspamd{task}", -1);
 
-	if (connected) {
-		remove_normal_event (ud->task->s, lua_redis_fin, ud);
+		*ptask = ud->task;
+		/* String of error */
+		lua_pushstring (ud->L, err);
+		/* Data is nil */
+		lua_pushnil (ud->L);
+		if (lua_pcall (ud->L, 3, 0, 0) != 0) {
+			msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
+		}
 	}
 
+	remove_normal_event (ud->task->s, lua_redis_fin, ud);
+}
+
+static void
+lua_redis_push_reply (lua_State *L, const redisReply *r)
+{
+	if (r->type == REDIS_REPLY_STRING) {
+		lua_pushlstring (L, r->str, r->len);
+	}
+	else if (r->type == REDIS_REPLY_INTEGER) {
+		lua_pushnumber (L, r->integer);
+	}
+	else if (r->type == REDIS_REPLY_STATUS) {
+		lua_pushlstring (L, r->str, r->len);
+	}
+	else if (r->type == REDIS_REPLY_NIL) {
+		lua_pushnil (L);
+	}
+	else {
+		msg_info ("bad type is passed: %d", r->type);
+		lua_pushnil (L);
+	}
 }
 
 /**
@@ -129,34 +296,28 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_userdata *ud)
 {
 	struct rspamd_task **ptask;
 
-	/* Push error */
-	lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
-	ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (ud->L, "rspamd{task}", -1);
+	ud->replied = TRUE;
 
-	*ptask = ud->task;
-	/* Error is nil */
-	lua_pushnil (ud->L);
-	/* Data */
-	if (r->type == REDIS_REPLY_STRING) {
-		lua_pushlstring (ud->L, r->str, r->len);
-	}
-	else if (r->type == REDIS_REPLY_INTEGER) {
-		lua_pushnumber (ud->L, r->integer);
-	}
-	else if (r->type == REDIS_REPLY_STATUS) {
-		lua_pushlstring (ud->L, r->str, r->len);
-	}
-	else if (r->type == REDIS_REPLY_NIL) {
-		lua_pushnil (ud->L);
+	if (ud->co) {
+		/* Resume coroutine with no error and data */
+		lua_pushnil (ud->co);
+		lua_redis_push_reply (ud->co, r);
+		rspamd_lua_coroutine_resume (ud->co, 2);
 	}
 	else {
-		msg_info ("bad type is passed: %d", r->type);
+		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+		ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
+		rspamd_lua_setclass (ud->L, "rspamd{task}", -1);
+
+		*ptask = ud->task;
+		/* Error is nil */
 		lua_pushnil (ud->L);
-	}
+		/* Data */
+		lua_redis_push_reply (ud->L, r);
 
-	if (lua_pcall (ud->L, 3, 0, 0) != 0) {
-		msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
+		if (lua_pcall (ud->L, 3, 0, 0) != 0) {
+			msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
+		}
 	}
 
 	remove_normal_event (ud->task->s, lua_redis_fin, ud);
@@ -174,57 +335,58 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	redisReply *reply = r;
 	struct lua_redis_userdata *ud = priv;
 
+	if (ud->terminated) {
+		/* Session has been destroyed and connection is being freed */
+		return;
+	}
+
 	if (c->err == 0) {
 		if (r != NULL) {
+			/* Connection is still usable, so return it to the pool */
+			lua_redis_connection_release (ud->conn);
+			ud->conn = NULL;
+
 			if (reply->type != REDIS_REPLY_ERROR) {
 				lua_redis_push_data (reply, ud);
 			}
 			else {
-				lua_redis_push_error (reply->str, ud, TRUE);
+				lua_redis_push_error (reply->str, ud);
 			}
 		}
 		else {
-			lua_redis_push_error ("received no data from server", ud, FALSE);
+			/* Context is freed by hiredis */
+			ud->conn->ctx = NULL;
+			lua_redis_push_error ("received no data from server", ud);
 		}
 	}
 	else {
+		/* Context is freed by hiredis after disconnection */
+		ud->conn->ctx = NULL;
+
 		if (c->err == REDIS_ERR_IO) {
-			lua_redis_push_error (strerror (errno), ud, TRUE);
+			lua_redis_push_error (strerror (errno), ud);
 		}
 		else {
-			lua_redis_push_error (c->errstr, ud, TRUE);
+			lua_redis_push_error (c->errstr, ud);
 		}
 	}
 }
+
 /**
- * Make a real request to redis server and attach it to libevent cycle
+ * Send request using the connection of userdata object
  * @param ud userdata object
- * @return
  */
-static gboolean
-lua_redis_make_request_real (struct lua_redis_userdata *ud)
+static void
+lua_redis_send_command (struct lua_redis_userdata *ud)
 {
-	ud->ctx = redisAsyncConnect (inet_ntoa (ud->ina), ud->port);
-	if (ud->ctx == NULL || ud->ctx->err) {
-		lua_redis_push_error (ud->ctx ? ud->ctx->errstr : "unknown error",
-			ud,
-			FALSE);
-		return FALSE;
-	}
-	else {
-		register_async_event (ud->task->s,
-			lua_redis_fin,
-			ud,
-			g_quark_from_static_string ("lua redis"));
-	}
-	redisLibeventAttach (ud->ctx, ud->task->ev_base);
-	/* Make a request now */
+	redisAsyncContext *ctx = ud->conn->ctx;
+
 	switch (ud->args_num) {
 	case 0:
-		redisAsyncCommand (ud->ctx, lua_redis_callback, ud, ud->reqline);
+		redisAsyncCommand (ctx, lua_redis_callback, ud, ud->reqline);
 		break;
 	case 1:
-		redisAsyncCommand (ud->ctx,
+		redisAsyncCommand (ctx,
 			lua_redis_callback,
 			ud,
 			ud->reqline,
@@ -232,7 +394,7 @@ lua_redis_make_request_real (struct lua_redis_userdata *ud)
 			ud->args[0].len);
 		break;
 	case 2:
-		redisAsyncCommand (ud->ctx,
+		redisAsyncCommand (ctx,
 			lua_redis_callback,
 			ud,
 			ud->reqline,
@@ -243,7 +405,7 @@ lua_redis_make_request_real (struct lua_redis_userdata *ud)
 		break;
 	default:
 		/* XXX: cannot handle more than 3 arguments */
-		redisAsyncCommand (ud->ctx,
+		redisAsyncCommand (ctx,
 			lua_redis_callback,
 			ud,
 			ud->reqline,
@@ -255,6 +417,23 @@ lua_redis_make_request_real (struct lua_redis_userdata *ud)
 			ud->args[2].len);
 		break;
 	}
+}
+
+/**
+ * Connect to redis server and send request
+ * @param ud userdata object
+ * @return
+ */
+static gboolean
+lua_redis_make_request_real (struct lua_redis_userdata *ud)
+{
+	ud->conn = lua_redis_connection_new (ud);
+
+	if (ud->conn == NULL) {
+		return FALSE;
+	}
+
+	lua_redis_send_command (ud);
 
 	return TRUE;
 }
@@ -270,19 +449,102 @@ lua_redis_dns_callback (struct rdns_reply *reply, gpointer arg)
 	struct lua_redis_userdata *ud = arg;
 	struct rdns_reply_entry *elt;
 
-
 	if (reply->code != RDNS_RC_NOERROR) {
-		lua_redis_push_error (rdns_strerror (reply->code), ud, FALSE);
-		return;
+		lua_redis_push_error (rdns_strerror (reply->code), ud);
 	}
 	else {
 		elt = reply->entries;
 		memcpy (&ud->ina, &elt->content.a.addr, sizeof (struct in_addr));
 		/* Make real request */
-		lua_redis_make_request_real (ud);
+		if (!lua_redis_make_request_real (ud)) {
+			lua_redis_push_error ("cannot connect to redis server", ud);
+		}
 	}
 }
 
+/**
+ * Parse arguments common for all requests and start a request
+ * @param L lua stack
+ * @param task task object
+ * @param ud userdata object with callback or coroutine set
+ * @param pos position of request line in lua stack
+ * @return TRUE if a request has been started
+ */
+static gboolean
+lua_redis_start_request (lua_State *L, struct rspamd_task *task,
+	struct lua_redis_userdata *ud, gint pos)
+{
+	const gchar *tmp;
+	gsize keylen;
+	guint i;
+
+	ud->reqline = rspamd_mempool_strdup (task->task_pool,
+			luaL_checkstring (L, pos));
+	/* Now get remaining args */
+	ud->args_num = lua_gettop (L) - pos;
+	ud->args = rspamd_mempool_alloc (task->task_pool,
+			ud->args_num * sizeof (rspamd_fstring_t));
+	for (i = 0; i < ud->args_num; i++) {
+		tmp = lua_tolstring (L, i + pos + 1, &ud->args[i].len);
+		/* Make a copy of argument */
+		ud->args[i].begin = rspamd_mempool_alloc (task->task_pool,
+				ud->args[i].len);
+		memcpy (ud->args[i].begin, tmp, ud->args[i].len);
+	}
+
+	/* Connections are bound to the event base of a worker */
+	keylen = strlen (ud->server) + sizeof (":65535:0x") + sizeof (gpointer) * 2;
+	ud->key = rspamd_mempool_alloc (task->task_pool, keylen);
+	rspamd_snprintf (ud->key, keylen, "%s:%d:%p", ud->server, (gint)ud->port,
+		task->ev_base);
+
+	/* Reuse idle connection if we have one */
+	ud->conn = lua_redis_connection_get (ud->key);
+
+	if (ud->conn != NULL) {
+		lua_redis_send_command (ud);
+	}
+	else if (inet_aton (ud->server, &ud->ina) == 0) {
+		/* Need to make dns request */
+		/* Resolve hostname */
+		if (make_dns_request (task->resolver, task->s, task->task_pool,
+			lua_redis_dns_callback, ud,
+			RDNS_REQUEST_A, ud->server)) {
+			task->dns_requests++;
+		}
+		else {
+			msg_info ("failed to resolve %s", ud->server);
+			return FALSE;
+		}
+	}
+	else if (!lua_redis_make_request_real (ud)) {
+		return FALSE;
+	}
+
+	register_async_event (task->s,
+		lua_redis_fin,
+		ud,
+		g_quark_from_static_string ("lua redis"));
+
+	return TRUE;
+}
+
+static struct lua_redis_userdata *
+lua_redis_userdata_new (lua_State *L, struct rspamd_task *task,
+	const gchar *server, guint port)
+{
+	struct lua_redis_userdata *ud;
+
+	ud = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct lua_redis_userdata));
+	ud->server = rspamd_mempool_strdup (task->task_pool, server);
+	ud->port = port;
+	ud->task = task;
+	ud->L = L;
+
+	return ud;
+}
+
 /**
  * Make request to redis server
  * @param task worker task object
@@ -298,8 +560,8 @@ lua_redis_make_request (lua_State *L)
 {
 	struct rspamd_task *task;
 	struct lua_redis_userdata *ud;
-	const gchar *server, *tmp;
-	guint port, i;
+	const gchar *server;
+	guint port;
 
 	if ((task = lua_check_task (L)) != NULL) {
 		server = luaL_checkstring (L, 2);
@@ -308,53 +570,18 @@ lua_redis_make_request (lua_State *L)
 		if (lua_isfunction (L,
 			4) && server != NULL && port > 0 && port < G_MAXUINT16) {
 			/* Create userdata */
-			ud =
-				rspamd_mempool_alloc (task->task_pool,
-					sizeof (struct lua_redis_userdata));
-			ud->server = rspamd_mempool_strdup (task->task_pool, server);
-			ud->port = port;
-			ud->task = task;
-			ud->L = L;
-			ud->ctx = NULL;
+			ud = lua_redis_userdata_new (L, task, server, port);
 			/* Pop other arguments */
 			lua_pushvalue (L, 4);
 			/* Get a reference */
 			ud->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
-			ud->reqline = rspamd_mempool_strdup (task->task_pool,
-					luaL_checkstring (L, 5));
-			/* Now get remaining args */
-			ud->args_num = lua_gettop (L) - 5;
-			ud->args = rspamd_mempool_alloc (task->task_pool,
-					ud->args_num * sizeof (rspamd_fstring_t));
-			for (i = 0; i < ud->args_num; i++) {
-				tmp = lua_tolstring (L, i + 6, &ud->args[i].len);
-				/* Make a copy of argument */
-				ud->args[i].begin = rspamd_mempool_alloc (task->task_pool,
-						ud->args[i].len);
-				memcpy (ud->args[i].begin, tmp, ud->args[i].len);
-			}
-			/* Now check whether we need to perform DNS request */
-			if (inet_aton (ud->server, &ud->ina) == 0) {
-				/* Need to make dns request */
-				/* Resolve hostname */
-				if (make_dns_request (task->resolver, task->s, task->task_pool,
-					lua_redis_dns_callback, ud,
-					RDNS_REQUEST_A, ud->server)) {
-					task->dns_requests++;
-					lua_pushboolean (L, TRUE);
-				}
-				else {
-					msg_info ("failed to resolve %s", ud->server);
-					lua_pushboolean (L, FALSE);
-				}
+
+			if (lua_redis_start_request (L, task, ud, 5)) {
+				lua_pushboolean (L, TRUE);
 			}
 			else {
-				if (!lua_redis_make_request_real (ud)) {
-					lua_pushboolean (L, FALSE);
-				}
-				else {
-					lua_pushboolean (L, TRUE);
-				}
+				luaL_unref (L, LUA_REGISTRYINDEX, ud->cbref);
+				lua_pushboolean (L, FALSE);
 			}
 		}
 		else {
@@ -366,6 +593,59 @@ lua_redis_make_request (lua_State *L)
 	return 1;
 }
 
+/**
+ * Make request to redis server from a coroutine, e.g. from a symbol callback,
+ * and wait for the reply
+ * @param task worker task object
+ * @param server server to check
+ * @param port port of redis server
+ * @param request request line
+ * @param args list of arguments
+ * @return error string or nil and data of reply
+ */
+static int
+lua_redis_request (lua_State *L)
+{
+	struct rspamd_task *task;
+	struct lua_redis_userdata *ud;
+	const gchar *server;
+	guint port;
+
+	if ((task = lua_check_task (L)) != NULL) {
+		server = luaL_checkstring (L, 2);
+		port = luaL_checkint (L, 3);
+
+		if (!rspamd_lua_is_yieldable (L)) {
+			return luaL_error (L, "redis request must be called from "
+					   "a coroutine");
+		}
+
+		if (server == NULL || port == 0 || port >= G_MAXUINT16) {
+			lua_pushstring (L, "invalid redis server");
+			lua_pushnil (L);
+			return 2;
+		}
+
+		ud = lua_redis_userdata_new (L, task, server, port);
+		ud->co = L;
+
+		if (!lua_redis_start_request (L, task, ud, 4)) {
+			lua_pushstring (L, "cannot make redis request");
+			lua_pushnil (L);
+			return 2;
+		}
+
+		ud->co_ref = rspamd_lua_coroutine_anchor (L);
+
+		return lua_yield (L, 0);
+	}
+
+	lua_pushstring (L, "invalid task");
+	lua_pushnil (L);
+
+	return 2;
+}
+
 static gint
 lua_load_redis (lua_State * L)
 {
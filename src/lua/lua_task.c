@@ -257,6 +257,44 @@ local function task_cb(task)
 end
  */
 LUA_FUNCTION_DEF (task, get_resolver);
+/***
+ * @method task:resolve_a(name)
+ * Resolve A record of `name` using the task's session. This method must be
+ * called from a coroutine, e.g. from a symbol callback: it yields until the
+ * reply is received and returns its results directly.
+ * @param {string} name host to resolve
+ * @return {list of ip, string} list of addresses or nil and error message
+ * @example
+local function task_cb(task)
+	local results, err = task:resolve_a('example.com')
+	if results then
+		return true
+	end
+	return false
+end
+ */
+LUA_FUNCTION_DEF (task, resolve_a);
+/***
+ * @method task:resolve_ptr(ip)
+ * Resolve PTR record of `ip` from a coroutine, see `task:resolve_a()`.
+ * @param {string} ip address to resolve
+ * @return {list of strings, string} list of names or nil and error message
+ */
+LUA_FUNCTION_DEF (task, resolve_ptr);
+/***
+ * @method task:resolve_txt(name)
+ * Resolve TXT record of `name` from a coroutine, see `task:resolve_a()`.
+ * @param {string} name name to resolve
+ * @return {list of strings, string} list of records or nil and error message
+ */
+LUA_FUNCTION_DEF (task, resolve_txt);
+/***
+ * @method task:resolve_mx(name)
+ * Resolve MX record of `name` from a coroutine, see `task:resolve_a()`.
+ * @param {string} name name to resolve
+ * @return {list of tables, string} list of mx (`name` and `priority`) or nil and error message
+ */
+LUA_FUNCTION_DEF (task, resolve_mx);
 /***
  * @method task:inc_dns_req()
  * Increment number of DNS requests for the task. Is used just for logging purposes.
@@ -445,6 +483,10 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, get_header_full),
 	LUA_INTERFACE_DEF (task, get_received_headers),
 	LUA_INTERFACE_DEF (task, get_resolver),
+	LUA_INTERFACE_DEF (task, resolve_a),
+	LUA_INTERFACE_DEF (task, resolve_ptr),
+	LUA_INTERFACE_DEF (task, resolve_txt),
+	LUA_INTERFACE_DEF (task, resolve_mx),
 	LUA_INTERFACE_DEF (task, inc_dns_req),
 	LUA_INTERFACE_DEF (task, call_rspamd_function),
 	LUA_INTERFACE_DEF (task, get_recipients),
@@ -1199,6 +1241,121 @@ lua_task_get_resolver (lua_State *L)
 	return 1;
 }
 
+/*
+ * Coroutine suspended by an async task method
+ */
+struct lua_task_coroutine_cbdata {
+	lua_State *co;
+	gint ref;
+	struct rspamd_task *task;
+	gboolean resumed;
+};
+
+static void
+lua_task_coroutine_fin (gpointer arg)
+{
+	struct lua_task_coroutine_cbdata *cbd = arg;
+
+	if (cbd->resumed) {
+		rspamd_lua_coroutine_release (cbd->co, cbd->ref);
+	}
+	else {
+		/* Session is destroyed before reply */
+		rspamd_lua_coroutine_abandon (cbd->co, cbd->ref);
+	}
+}
+
+static void
+lua_task_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_task_coroutine_cbdata *cbd = arg;
+
+	cbd->resumed = TRUE;
+	rspamd_lua_push_dns_reply (cbd->co, reply);
+	rspamd_lua_coroutine_resume (cbd->co, 2);
+	remove_normal_event (cbd->task->s, lua_task_coroutine_fin, cbd);
+}
+
+static gint
+lua_task_resolve_common (lua_State *L, enum rdns_request_type type)
+{
+	struct rspamd_task *task = lua_check_task (L);
+	struct lua_task_coroutine_cbdata *cbd;
+	const gchar *to_resolve;
+	gchar *ptr_str = NULL;
+
+	if (task == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	to_resolve = luaL_checkstring (L, 2);
+
+	if (!rspamd_lua_is_yieldable (L)) {
+		return luaL_error (L, "async task methods must be called from "
+				   "a coroutine");
+	}
+
+	if (type == RDNS_REQUEST_PTR) {
+		ptr_str = rdns_generate_ptr_from_str (to_resolve);
+
+		if (ptr_str == NULL) {
+			lua_pushnil (L);
+			lua_pushstring (L, "invalid address to resolve");
+			return 2;
+		}
+
+		to_resolve = rspamd_mempool_strdup (task->task_pool, ptr_str);
+		free (ptr_str);
+	}
+
+	cbd = rspamd_mempool_alloc (task->task_pool,
+			sizeof (struct lua_task_coroutine_cbdata));
+	cbd->co = L;
+	cbd->task = task;
+	cbd->resumed = FALSE;
+
+	if (!make_dns_request (task->resolver, task->s, task->task_pool,
+		lua_task_dns_callback, cbd, type, to_resolve)) {
+		lua_pushnil (L);
+		lua_pushstring (L, "cannot make DNS request");
+		return 2;
+	}
+
+	task->dns_requests++;
+	cbd->ref = rspamd_lua_coroutine_anchor (L);
+	register_async_event (task->s,
+		lua_task_coroutine_fin,
+		cbd,
+		g_quark_from_static_string ("lua coroutine"));
+
+	return lua_yield (L, 0);
+}
+
+static gint
+lua_task_resolve_a (lua_State *L)
+{
+	return lua_task_resolve_common (L, RDNS_REQUEST_A);
+}
+
+static gint
+lua_task_resolve_ptr (lua_State *L)
+{
+	return lua_task_resolve_common (L, RDNS_REQUEST_PTR);
+}
+
+static gint
+lua_task_resolve_txt (lua_State *L)
+{
+	return lua_task_resolve_common (L, RDNS_REQUEST_TXT);
+}
+
+static gint
+lua_task_resolve_mx (lua_State *L)
+{
+	return lua_task_resolve_common (L, RDNS_REQUEST_MX);
+}
+
 static gint
 lua_task_inc_dns_req (lua_State *L)
 {
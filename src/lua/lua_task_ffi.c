@@ -0,0 +1,267 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lua_common.h"
+#include "lua_task_ffi.h"
+#include "message.h"
+#include "url.h"
+
+/*
+ * Flat accessors of task data for LuaJIT FFI. Unlike the methods of
+ * `rspamd{task}`, they do not create lua tables or strings, so plugins can
+ * iterate over urls and headers without materializing them. Pointers to these
+ * functions are exported via `rspamd_task_ffi_api` module and used by
+ * `rspamd_task_ffi` lua library when LuaJIT is available.
+ */
+
+static inline struct rspamd_task *
+rspamd_lua_ffi_task (void *ud)
+{
+	if (ud == NULL) {
+		return NULL;
+	}
+
+	return *((struct rspamd_task **)ud);
+}
+
+static gboolean
+rspamd_lua_ffi_header_match (struct raw_header *rh, const gchar *name,
+	gint strong)
+{
+	if (rh->name == NULL) {
+		return FALSE;
+	}
+
+	return !strong || strcmp (rh->name, name) == 0;
+}
+
+const gchar *
+rspamd_lua_ffi_task_get_header (void *ud, const gchar *name,
+	gint strong, gint raw)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+	struct raw_header *rh;
+
+	if (task == NULL || name == NULL) {
+		return NULL;
+	}
+
+	rh = g_hash_table_lookup (task->raw_headers, name);
+
+	while (rh) {
+		if (rspamd_lua_ffi_header_match (rh, name, strong)) {
+			return raw ? rh->decoded : rh->value;
+		}
+		rh = rh->next;
+	}
+
+	return NULL;
+}
+
+guint
+rspamd_lua_ffi_task_get_headers (void *ud, const gchar *name,
+	gint strong, struct rspamd_lua_ffi_header *out, guint max)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+	struct raw_header *rh;
+	guint i = 0;
+
+	if (task == NULL || name == NULL) {
+		return 0;
+	}
+
+	rh = g_hash_table_lookup (task->raw_headers, name);
+
+	while (rh) {
+		if (rspamd_lua_ffi_header_match (rh, name, strong)) {
+			if (i < max) {
+				out[i].name = rh->name;
+				out[i].value = rh->value;
+				out[i].decoded = rh->decoded;
+				out[i].separator = rh->separator;
+				out[i].tab_separated = rh->tab_separated;
+				out[i].empty_separator = rh->empty_separator;
+			}
+			i++;
+		}
+		rh = rh->next;
+	}
+
+	return i;
+}
+
+guint
+rspamd_lua_ffi_task_urls_count (void *ud)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+
+	if (task == NULL || task->urls == NULL) {
+		return 0;
+	}
+
+	return g_tree_nnodes (task->urls);
+}
+
+struct rspamd_lua_ffi_urls_cbdata {
+	struct rspamd_lua_ffi_url *out;
+	guint max;
+	guint cur;
+};
+
+static gboolean
+rspamd_lua_ffi_url_callback (gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_lua_ffi_urls_cbdata *cbd = ud;
+	struct rspamd_lua_ffi_url *elt;
+	struct uri *url = value;
+
+	if (cbd->cur >= cbd->max) {
+		/* Stop traversing */
+		return TRUE;
+	}
+
+	elt = &cbd->out[cbd->cur++];
+	elt->string = struri (url);
+	elt->host = url->host;
+	elt->hostlen = url->hostlen;
+	elt->user = url->user;
+	elt->userlen = url->userlen;
+	elt->data = url->data;
+	elt->datalen = url->datalen;
+	elt->protocol = url->protocol;
+	elt->is_phished = url->is_phished;
+
+	return FALSE;
+}
+
+guint
+rspamd_lua_ffi_task_get_urls (void *ud, struct rspamd_lua_ffi_url *out,
+	guint max)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+	struct rspamd_lua_ffi_urls_cbdata cbd;
+
+	if (task == NULL || task->urls == NULL || out == NULL) {
+		return 0;
+	}
+
+	cbd.out = out;
+	cbd.max = max;
+	cbd.cur = 0;
+	g_tree_foreach (task->urls, rspamd_lua_ffi_url_callback, &cbd);
+
+	return cbd.cur;
+}
+
+guint
+rspamd_lua_ffi_task_text_parts_count (void *ud)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+
+	if (task == NULL) {
+		return 0;
+	}
+
+	return g_list_length (task->text_parts);
+}
+
+guint
+rspamd_lua_ffi_task_get_text_parts (void *ud,
+	struct rspamd_lua_ffi_text_part *out, guint max)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+	struct mime_text_part *part;
+	GList *cur;
+	guint i = 0;
+
+	if (task == NULL || out == NULL) {
+		return 0;
+	}
+
+	cur = task->text_parts;
+
+	while (cur && i < max) {
+		part = cur->data;
+
+		if (part->content != NULL) {
+			out[i].content = (const gchar *)part->content->data;
+			out[i].len = part->content->len;
+		}
+		else {
+			out[i].content = NULL;
+			out[i].len = 0;
+		}
+
+		out[i].lang = part->lang_code;
+		out[i].is_html = part->is_html;
+		out[i].is_empty = part->is_empty;
+		out[i].is_utf = part->is_utf;
+		i++;
+		cur = g_list_next (cur);
+	}
+
+	return i;
+}
+
+gint
+rspamd_lua_ffi_task_get_from_ip (void *ud, gchar *buf, gsize buflen)
+{
+	struct rspamd_task *task = rspamd_lua_ffi_task (ud);
+
+	if (task == NULL || !rspamd_ip_is_valid (&task->from_addr)) {
+		return 0;
+	}
+
+	rspamd_strlcpy (buf, rspamd_inet_address_to_string (&task->from_addr),
+		buflen);
+
+	return task->from_addr.af;
+}
+
+#define LUA_TASK_FFI_EXPORT(name) do { \
+		lua_pushstring (L, #name); \
+		lua_pushlightuserdata (L, (void *)rspamd_lua_ffi_task_ ## name); \
+		lua_settable (L, -3); \
+} while (0)
+
+static gint
+lua_load_task_ffi_api (lua_State *L)
+{
+	lua_newtable (L);
+
+	LUA_TASK_FFI_EXPORT (get_header);
+	LUA_TASK_FFI_EXPORT (get_headers);
+	LUA_TASK_FFI_EXPORT (urls_count);
+	LUA_TASK_FFI_EXPORT (get_urls);
+	LUA_TASK_FFI_EXPORT (text_parts_count);
+	LUA_TASK_FFI_EXPORT (get_text_parts);
+	LUA_TASK_FFI_EXPORT (get_from_ip);
+
+	return 1;
+}
+
+void
+luaopen_task_ffi (lua_State *L)
+{
+	rspamd_lua_add_preload (L, "rspamd_task_ffi_api", lua_load_task_ffi_api);
+}
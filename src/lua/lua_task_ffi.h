@@ -0,0 +1,115 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LUA_TASK_FFI_H_
+#define LUA_TASK_FFI_H_
+
+#include "config.h"
+
+/*
+ * Flat accessors of task data intended to be called from LuaJIT FFI. All
+ * functions accept a pointer to the payload of `rspamd{task}` userdata, which
+ * is what LuaJIT passes for a userdata argument declared as `void *`.
+ *
+ * Layouts of these structures are duplicated in `rspamd_task_ffi.lua` and
+ * must be changed in both places.
+ */
+
+struct rspamd_lua_ffi_header {
+	const gchar *name;
+	const gchar *value;
+	const gchar *decoded;
+	const gchar *separator;
+	gint tab_separated;
+	gint empty_separator;
+};
+
+struct rspamd_lua_ffi_url {
+	const gchar *string;
+	const gchar *host;
+	const gchar *user;
+	const gchar *data;
+	guint hostlen;
+	guint userlen;
+	guint datalen;
+	gint protocol;
+	gint is_phished;
+};
+
+struct rspamd_lua_ffi_text_part {
+	const gchar *content;
+	gsize len;
+	const gchar *lang;
+	gint is_html;
+	gint is_empty;
+	gint is_utf;
+};
+
+/**
+ * Returns value of the first header `name` or NULL
+ * @param ud task userdata
+ * @param name name of header
+ * @param strong use case sensitive match
+ * @param raw return undecoded value
+ */
+const gchar * rspamd_lua_ffi_task_get_header (void *ud, const gchar *name,
+	gint strong, gint raw);
+
+/**
+ * Fills `out` with up to `max` headers named `name`
+ * @return total number of such headers, which can be larger than `max`
+ */
+guint rspamd_lua_ffi_task_get_headers (void *ud, const gchar *name,
+	gint strong, struct rspamd_lua_ffi_header *out, guint max);
+
+/**
+ * Returns number of urls found in a task
+ */
+guint rspamd_lua_ffi_task_urls_count (void *ud);
+
+/**
+ * Fills `out` with up to `max` urls of a task
+ * @return number of urls filled
+ */
+guint rspamd_lua_ffi_task_get_urls (void *ud, struct rspamd_lua_ffi_url *out,
+	guint max);
+
+/**
+ * Returns number of text parts of a task
+ */
+guint rspamd_lua_ffi_task_text_parts_count (void *ud);
+
+/**
+ * Fills `out` with up to `max` text parts of a task
+ * @return number of parts filled
+ */
+guint rspamd_lua_ffi_task_get_text_parts (void *ud,
+	struct rspamd_lua_ffi_text_part *out, guint max);
+
+/**
+ * Writes string representation of sender's address to `buf`
+ * @return address family or 0 if address is not valid
+ */
+gint rspamd_lua_ffi_task_get_from_ip (void *ud, gchar *buf, gsize buflen);
+
+#endif /* LUA_TASK_FFI_H_ */
@@ -36,12 +36,14 @@ LUA_FUNCTION_DEF (upstream_list, destroy);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_by_hash);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_round_robin);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_master_slave);
+LUA_FUNCTION_DEF (upstream_list, get_upstream_latency);
 
 static const struct luaL_reg upstream_list_m[] = {
 
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_hash),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_round_robin),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_master_slave),
+	LUA_INTERFACE_DEF (upstream_list, get_upstream_latency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_upstream_list_destroy},
 	{NULL, NULL}
@@ -113,7 +115,8 @@ lua_upstream_fail (lua_State *L)
 }
 
 /**
- * Make upstream success, the second argument is time, if absent the current time is used
+ * Make upstream success, the optional second argument is the latency of
+ * request in seconds used by `get_upstream_latency`
  * @param L
  * @return
  */
@@ -123,7 +126,12 @@ lua_upstream_ok (lua_State *L)
 	struct upstream *up = lua_check_upstream (L);
 
 	if (up) {
-		rspamd_upstream_ok (up);
+		if (lua_isnumber (L, 2)) {
+			rspamd_upstream_ok_latency (up, lua_tonumber (L, 2));
+		}
+		else {
+			rspamd_upstream_ok (up);
+		}
 	}
 
 	return 0;
@@ -308,6 +316,39 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 	return 1;
 }
 
+/**
+ * Get the best of two random upstreams by latency and number of requests
+ * in flight, the result of request should be reported by `ok` with the latency
+ * or by `fail`
+ * @param L
+ * @return
+ */
+static gint
+lua_upstream_list_get_upstream_latency (lua_State *L)
+{
+	struct upstream_list *upl;
+	struct upstream *selected, **pselected;
+
+	upl = lua_check_upstream_list (L);
+	if (upl) {
+
+		selected = rspamd_upstream_get (upl, RSPAMD_UPSTREAM_LATENCY);
+		if (selected) {
+			pselected = lua_newuserdata (L, sizeof (struct upstream *));
+			rspamd_lua_setclass (L, "rspamd{upstream}", -1);
+			*pselected = selected;
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_upstream_list (lua_State * L)
 {
@@ -30,6 +30,7 @@
 #include "fuzzy_storage.h"
 #include "kvstorage_server.h"
 #include "libserver/symbols_cache.h"
+#include "libserver/dns.h"
 #include "lua/lua_common.h"
 #include "ottery.h"
 #include "xxhash.h"
@@ -486,6 +487,9 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 		bzero (cur, sizeof (struct rspamd_worker));
 		cur->srv = rspamd;
 		cur->type = cf->type;
+		cur->metrics = rspamd_metrics_acquire (rspamd->metrics,
+				cf->worker->name);
+		cur->history = rspamd_roll_history_acquire (rspamd->history);
 		cur->pid = fork ();
 		cur->cf = g_malloc (sizeof (struct rspamd_worker_conf));
 		memcpy (cur->cf, cf, sizeof (struct rspamd_worker_conf));
@@ -495,6 +499,7 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 		case 0:
 			/* Update pid for logging */
 			rspamd_log_update_pid (cf->type, rspamd->logger);
+			rspamd_metrics_set_local (cur->metrics);
 			/* Lock statfile pool if possible */
 			statfile_pool_lockall (rspamd->statfile_pool);
 			/* Init PRNG after fork */
@@ -1149,6 +1154,34 @@ rspamd_init_cfg (struct rspamd_config *cfg)
 		rspamd_str_equal);
 }
 
+/*
+ * Returns number of history shards: workers being terminated on reload still
+ * own their shards while new workers are started, so reserve twice more
+ */
+static guint
+rspamd_history_shards (struct rspamd_config *cfg)
+{
+	struct rspamd_worker_conf *cf;
+	GList *cur;
+	guint nworkers = 0;
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+
+		if (cf->worker == NULL) {
+			continue;
+		}
+		if (cf->worker->unique || cf->worker->threaded) {
+			nworkers++;
+		}
+		else {
+			nworkers += cf->count;
+		}
+	}
+
+	return MAX (nworkers, 1) * 2;
+}
+
 static void
 rspamd_init_main (struct rspamd_main *rspamd)
 {
@@ -1156,8 +1189,6 @@ rspamd_init_main (struct rspamd_main *rspamd)
 		rspamd_mempool_suggest_size ());
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 		sizeof (struct rspamd_stat));
-	/* Create rolling history */
-	rspamd_main->history = rspamd_roll_history_new (rspamd_main->server_pool);
 }
 
 static void
@@ -1389,12 +1420,27 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Preload all statfiles */
 	preload_statfiles (rspamd_main);
 
+	/* Create rolling history, each worker writes to its own shard */
+	rspamd_main->history = rspamd_roll_history_new (
+		rspamd_history_shards (rspamd_main->cfg),
+		rspamd_main->cfg->history_rows);
+
 	/* Maybe read roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_load (rspamd_main->history,
 			rspamd_main->cfg->history_file);
 	}
 
+	/* Create DNS cache shared by all workers */
+	rspamd_main->dns_cache = rspamd_dns_cache_new (rspamd_main->cfg);
+	/* Create metrics slots shared by all workers */
+	rspamd_main->metrics = rspamd_metrics_new ();
+
+	/* Start asynchronous log writer if needed */
+	rspamd_log_async_start (rspamd_main->logger,
+		rspamd_main->workers_uid,
+		rspamd_main->workers_gid);
+
 	/* Spawn workers */
 	rspamd_main->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
 	spawn_workers (rspamd_main);
@@ -1429,6 +1475,8 @@ main (gint argc, gchar **argv, gchar **env)
 
 				g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (
 						wrk));
+				rspamd_metrics_release (cur->metrics);
+				rspamd_roll_history_release (cur->history);
 
 				if (WIFEXITED (res) && WEXITSTATUS (res) == 0) {
 					/* Normal worker termination, do not fork one more */
@@ -1513,6 +1561,7 @@ main (gint argc, gchar **argv, gchar **env)
 
 	statfile_pool_delete (rspamd_main->statfile_pool);
 
+	rspamd_log_async_stop (rspamd_main->logger);
 	rspamd_log_close (rspamd_main->logger);
 
 	rspamd_config_free (rspamd_main->cfg);
@@ -19,6 +19,7 @@
 #include "libserver/buffer.h"
 #include "libserver/events.h"
 #include "libserver/roll_history.h"
+#include "libserver/metrics.h"
 #include "libserver/task.h"
 #include "libserver/worker_util.h"
 #include "libmime/filter.h"
@@ -58,6 +59,8 @@ struct rspamd_worker {
 	GList *accept_events;                                       /**< socket events									*/
 	struct rspamd_worker_conf *cf;                                      /**< worker config data								*/
 	gpointer ctx;                                               /**< worker's specific data							*/
+	struct rspamd_worker_metrics *metrics;                      /**< slot of worker's metrics						*/
+	struct roll_history_shard *history;                         /**< shard of rolling history						*/
 };
 
 struct rspamd_worker_signal_handler {
@@ -117,6 +120,8 @@ struct rspamd_main {
 	gid_t workers_gid;                                          /**< worker's gid running to						*/
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	struct roll_history *history;                               /**< rolling history								*/
+	struct rspamd_dns_cache *dns_cache;                         /**< DNS answers cache shared by workers			*/
+	struct rspamd_metrics *metrics;                             /**< per-worker metrics								*/
 };
 
 /**
@@ -35,6 +35,8 @@
  * - time_jitter (number): jitter in seconds to allow time diff while checking
  * - trusted_only (flag): check signatures only for domains in 'domains' map
  * - skip_mutli (flag): skip messages with multiply dkim signatures
+ * - max_sigs (number): maximum number of signatures to check (default: 5)
+ * - shared_cache_size (size): size of keys cache shared between workers (default: 1M)
  */
 
 #include "config.h"
@@ -43,6 +45,7 @@
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "main.h"
 
 #define DEFAULT_SYMBOL_REJECT "R_DKIM_REJECT"
@@ -51,6 +54,8 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
 #define DEFAULT_TIME_JITTER 60
+#define DEFAULT_SHARED_CACHE_SIZE (1024 * 1024)
+#define DEFAULT_MAX_SIGS 5
 
 struct dkim_ctx {
 	gint (*filter) (struct rspamd_task * task);
@@ -60,17 +65,32 @@ struct dkim_ctx {
 
 	rspamd_mempool_t *dkim_pool;
 	radix_compressed_t *whitelist_ip;
-	GHashTable *dkim_domains;
+	rspamd_phash_t *dkim_domains;
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
+	rspamd_shm_cache_t *shared;
 	gboolean trusted_only;
 	gboolean skip_multi;
+	guint max_sigs;
+};
+
+/*
+ * Check delayed till the body is received, the key obtained while headers
+ * have been processed is kept, as it can be evicted from the cache meanwhile
+ */
+struct dkim_check_data {
+	rspamd_dkim_context_t *ctx;
+	guchar *keydata;
+	gsize keylen;
+	guint ttl;
 };
 
 static struct dkim_ctx *dkim_module_ctx = NULL;
 
 static void dkim_symbol_callback (struct rspamd_task *task, void *unused);
+static void dkim_module_lookup_key (struct rspamd_task *task,
+	rspamd_dkim_context_t *ctx);
 
 /* Initialization */
 gint dkim_module_init (struct rspamd_config *cfg, struct module_ctx **ctx);
@@ -104,6 +124,7 @@ dkim_module_config (struct rspamd_config *cfg)
 	const ucl_object_t *value;
 	gint res = TRUE;
 	guint cache_size, cache_expire;
+	gsize shared_size;
 	gboolean got_trusted = FALSE;
 
 	dkim_module_ctx->whitelist_ip = radix_create_compressed ();
@@ -146,6 +167,14 @@ dkim_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim",
+		"shared_cache_size")) != NULL) {
+		shared_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_size = DEFAULT_SHARED_CACHE_SIZE;
+	}
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "dkim", "time_jitter")) != NULL) {
 		dkim_module_ctx->time_jitter = ucl_obj_todouble (value);
@@ -196,6 +225,13 @@ dkim_module_config (struct rspamd_config *cfg)
 	else {
 		dkim_module_ctx->skip_multi = FALSE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim", "max_sigs")) != NULL) {
+		dkim_module_ctx->max_sigs = ucl_obj_toint (value);
+	}
+	else {
+		dkim_module_ctx->max_sigs = DEFAULT_MAX_SIGS;
+	}
 
 	if (dkim_module_ctx->trusted_only && !got_trusted) {
 		msg_err (
@@ -213,6 +249,8 @@ dkim_module_config (struct rspamd_config *cfg)
 		register_virtual_symbol (&cfg->cache,
 			dkim_module_ctx->symbol_allow,
 			1);
+		/* Keys could be requested before the message's body is received */
+		set_header_symbol (cfg->cache, dkim_module_ctx->symbol_reject);
 
 		dkim_module_ctx->dkim_hash = rspamd_lru_hash_new (
 				cache_size,
@@ -220,6 +258,10 @@ dkim_module_config (struct rspamd_config *cfg)
 				g_free,
 				(GDestroyNotify)rspamd_dkim_key_free);
 
+		/* Keys are shared between workers and preserved on reconfig */
+		if (dkim_module_ctx->shared == NULL && shared_size > 0) {
+			dkim_module_ctx->shared = rspamd_shm_cache_new (shared_size);
+		}
 
 #ifndef HAVE_OPENSSL
 		msg_warn (
@@ -233,12 +275,15 @@ dkim_module_config (struct rspamd_config *cfg)
 gint
 dkim_module_reconfig (struct rspamd_config *cfg)
 {
+	rspamd_shm_cache_t *shared = dkim_module_ctx->shared;
+
 	rspamd_mempool_delete (dkim_module_ctx->dkim_pool);
 	radix_destroy_compressed (dkim_module_ctx->whitelist_ip);
 	if (dkim_module_ctx->dkim_domains) {
-		g_hash_table_destroy (dkim_module_ctx->dkim_domains);
+		rspamd_phash_destroy (dkim_module_ctx->dkim_domains);
 	}
 	memset (dkim_module_ctx, 0, sizeof (*dkim_module_ctx));
+	dkim_module_ctx->shared = shared;
 	dkim_module_ctx->dkim_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
 
@@ -268,6 +313,45 @@ dkim_module_parse_strict (const gchar *value, gint *allow, gint *deny)
 	return FALSE;
 }
 
+static void dkim_module_check (struct rspamd_task *task,
+	rspamd_dkim_context_t *ctx,
+	rspamd_dkim_key_t *key);
+
+static void
+dkim_module_check_delayed (struct rspamd_task *task, gpointer ud)
+{
+	struct dkim_check_data *cd = ud;
+	rspamd_dkim_key_t *key;
+	GError *err = NULL;
+
+	key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
+			cd->ctx->dns_key,
+			task->tv.tv_sec);
+
+	if (key == NULL) {
+		/* Key has been evicted, restore it without another DNS request */
+		key = rspamd_dkim_make_key_der (cd->keydata, cd->keylen, cd->ttl,
+				&err);
+
+		if (key == NULL) {
+			msg_info ("cannot restore key for %s: %s", cd->ctx->dns_key,
+				err ? err->message : "unknown error");
+			if (err) {
+				g_error_free (err);
+			}
+
+			dkim_module_lookup_key (task, cd->ctx);
+			return;
+		}
+
+		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+			g_strdup (cd->ctx->dns_key),
+			key, task->tv.tv_sec, cd->ttl);
+	}
+
+	dkim_module_check (task, cd->ctx, key);
+}
+
 static void
 dkim_module_check (struct rspamd_task *task,
 	rspamd_dkim_context_t *ctx,
@@ -275,6 +359,21 @@ dkim_module_check (struct rspamd_task *task,
 {
 	gint res, score_allow = 1, score_deny = 1;
 	const gchar *strict_value;
+	struct dkim_check_data *cd;
+
+	if (task->msg == NULL) {
+		/* Message's body is not received yet */
+		msg_debug ("delay dkim check for %s domain till the body is received",
+			ctx->domain);
+		cd = rspamd_mempool_alloc (task->task_pool, sizeof (*cd));
+		cd->ctx = ctx;
+		cd->keylen = key->decoded_len;
+		cd->keydata = rspamd_mempool_alloc (task->task_pool, cd->keylen);
+		memcpy (cd->keydata, key->keydata, cd->keylen);
+		cd->ttl = key->ttl;
+		rspamd_task_add_body_callback (task, dkim_module_check_delayed, cd);
+		return;
+	}
 
 	msg_debug ("check dkim signature for %s domain from %s",
 		ctx->domain,
@@ -284,7 +383,7 @@ dkim_module_check (struct rspamd_task *task,
 	if (dkim_module_ctx->dkim_domains != NULL) {
 		/* Perform strict check */
 		if ((strict_value =
-			g_hash_table_lookup (dkim_module_ctx->dkim_domains,
+			rspamd_phash_lookup (dkim_module_ctx->dkim_domains,
 			ctx->domain)) != NULL) {
 			if (!dkim_module_parse_strict (strict_value, &score_allow,
 				&score_deny)) {
@@ -305,14 +404,18 @@ dkim_module_check (struct rspamd_task *task,
 		}
 	}
 
+	/* Several signatures insert the same symbols, so their scores are not summed */
 	if (res == DKIM_REJECT) {
-		rspamd_task_insert_result (task, dkim_module_ctx->symbol_reject, score_deny, NULL);
+		rspamd_task_insert_result_single (task, dkim_module_ctx->symbol_reject,
+			score_deny, NULL);
 	}
 	else if (res == DKIM_TRYAGAIN) {
-		rspamd_task_insert_result (task, dkim_module_ctx->symbol_tempfail, 1, NULL);
+		rspamd_task_insert_result_single (task,
+			dkim_module_ctx->symbol_tempfail, 1, NULL);
 	}
 	else if (res == DKIM_CONTINUE) {
-		rspamd_task_insert_result (task, dkim_module_ctx->symbol_allow, score_allow, NULL);
+		rspamd_task_insert_result_single (task, dkim_module_ctx->symbol_allow,
+			score_allow, NULL);
 	}
 }
 
@@ -331,19 +434,28 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
 			g_strdup (ctx->dns_key),
 			key, task->tv.tv_sec, key->ttl);
+
+		if (dkim_module_ctx->shared != NULL) {
+			rspamd_shm_cache_insert (dkim_module_ctx->shared,
+				ctx->dns_key, key->keydata, key->decoded_len,
+				task->tv.tv_sec, key->ttl);
+		}
+
 		dkim_module_check (task, ctx, key);
 	}
 	else {
 		/* Insert tempfail symbol */
 		msg_info ("cannot get key for domain %s", ctx->dns_key);
 		if (err != NULL) {
-			rspamd_task_insert_result (task, dkim_module_ctx->symbol_tempfail, 1,
+			rspamd_task_insert_result_single (task,
+				dkim_module_ctx->symbol_tempfail, 1,
 				g_list_prepend (NULL,
 				rspamd_mempool_strdup (task->task_pool, err->message)));
 
 		}
 		else {
-			rspamd_task_insert_result (task, dkim_module_ctx->symbol_tempfail, 1, NULL);
+			rspamd_task_insert_result_single (task,
+				dkim_module_ctx->symbol_tempfail, 1, NULL);
 		}
 	}
 
@@ -355,11 +467,11 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 static void
 dkim_symbol_callback (struct rspamd_task *task, void *unused)
 {
-	GList *hlist;
+	GList *hlist, *cur;
 	rspamd_dkim_context_t *ctx;
-	rspamd_dkim_key_t *key;
 	GError *err = NULL;
 	struct raw_header *rh;
+	guint nsigs = 0;
 	/* First check if a message has its signature */
 
 	hlist = message_get_header (task,
@@ -370,12 +482,6 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 		msg_debug ("dkim signature found");
 		if (radix_find_compressed_addr (dkim_module_ctx->whitelist_ip,
 				&task->from_addr) == RADIX_NO_VALUE) {
-			/* Parse signature */
-			msg_debug ("create dkim signature");
-			/*
-			 * Check only last signature as there is no way to check embeded signatures after
-			 * resend or something like this
-			 */
 			if (dkim_module_ctx->skip_multi) {
 				if (hlist->next != NULL) {
 					msg_info (
@@ -384,42 +490,106 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 					return;
 				}
 			}
-			hlist = g_list_last (hlist);
-			rh = (struct raw_header *)hlist->data;
-			ctx = rspamd_create_dkim_context (rh->decoded,
-					task->task_pool,
-					dkim_module_ctx->time_jitter,
-					&err);
-			if (ctx == NULL) {
-				msg_info ("cannot parse DKIM context: %s", err->message);
-				g_error_free (err);
-			}
-			else {
+			/*
+			 * Check signatures starting from the last one, signatures with
+			 * the same body canonicalization share the body hash
+			 */
+			for (cur = g_list_last (hlist); cur != NULL &&
+				nsigs < dkim_module_ctx->max_sigs; cur = g_list_previous (cur)) {
+				/* Parse signature */
+				msg_debug ("create dkim signature");
+				rh = (struct raw_header *)cur->data;
+				ctx = rspamd_create_dkim_context (rh->decoded,
+						task->task_pool,
+						dkim_module_ctx->time_jitter,
+						&err);
+				if (ctx == NULL) {
+					msg_info ("cannot parse DKIM context: %s", err->message);
+					g_error_free (err);
+					err = NULL;
+					continue;
+				}
 				/* Get key */
 				if (dkim_module_ctx->trusted_only &&
 					(dkim_module_ctx->dkim_domains == NULL ||
-					g_hash_table_lookup (dkim_module_ctx->dkim_domains,
+					rspamd_phash_lookup (dkim_module_ctx->dkim_domains,
 					ctx->domain) == NULL)) {
 					msg_debug ("skip dkim check for %s domain", ctx->domain);
-					return;
-				}
-				key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
-						ctx->dns_key,
-						task->tv.tv_sec);
-				if (key != NULL) {
-					debug_task ("found key for %s in cache", ctx->dns_key);
-					dkim_module_check (task, ctx, key);
-				}
-				else {
-					debug_task ("request key for %s from DNS", ctx->dns_key);
-					task->dns_requests++;
-					rspamd_get_dkim_key (ctx,
-						task->resolver,
-						task->s,
-						dkim_module_key_handler,
-						task);
+					continue;
 				}
+				nsigs++;
+				dkim_module_lookup_key (task, ctx);
+			}
+		}
+	}
+}
+
+/*
+ * Try to get key obtained by another worker
+ */
+static rspamd_dkim_key_t *
+dkim_module_shared_lookup (struct rspamd_task *task,
+	rspamd_dkim_context_t *ctx)
+{
+	rspamd_dkim_key_t *key = NULL;
+	guchar *data;
+	gsize len;
+	guint ttl;
+	GError *err = NULL;
+
+	if (dkim_module_ctx->shared == NULL) {
+		return NULL;
+	}
+
+	data = rspamd_shm_cache_lookup (dkim_module_ctx->shared, ctx->dns_key,
+			task->tv.tv_sec, &len, &ttl);
+
+	if (data != NULL) {
+		key = rspamd_dkim_make_key_der (data, len, ttl, &err);
+		g_free (data);
+
+		if (key != NULL) {
+			rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+				g_strdup (ctx->dns_key),
+				key, task->tv.tv_sec, ttl);
+		}
+		else {
+			msg_info ("cannot load shared key for %s: %s", ctx->dns_key,
+				err ? err->message : "unknown error");
+			if (err) {
+				g_error_free (err);
 			}
 		}
 	}
+
+	return key;
+}
+
+static void
+dkim_module_lookup_key (struct rspamd_task *task, rspamd_dkim_context_t *ctx)
+{
+	rspamd_dkim_key_t *key;
+	gsize dlen;
+
+	key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
+			ctx->dns_key,
+			task->tv.tv_sec);
+	if (key == NULL) {
+		key = dkim_module_shared_lookup (task, ctx);
+	}
+	if (key != NULL) {
+		debug_task ("found key for %s in cache", ctx->dns_key);
+		dkim_module_check (task, ctx, key);
+	}
+	else {
+		debug_task ("request key for %s from DNS", ctx->dns_key);
+		task->dns_requests++;
+		rspamd_get_dkim_key (ctx,
+			task->resolver,
+			task->s,
+			dkim_module_key_handler,
+			task);
+		/* Hash body while the key request is in flight */
+		rspamd_dkim_prepare_body (ctx, task, &dlen);
+	}
 }
@@ -99,9 +99,11 @@ struct fuzzy_ctx {
 
 struct fuzzy_client_session {
 	gint state;
+	gboolean replied;
 	GPtrArray *commands;
 	struct event ev;
 	struct timeval tv;
+	struct timeval start;
 	struct rspamd_task *task;
 	struct upstream *server;
 	struct fuzzy_rule *rule;
@@ -355,6 +357,7 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj)
 				(rspamd_mempool_destruct_t)rspamd_upstreams_destroy,
 				rule->servers);
 		rspamd_upstreams_from_ucl (rule->servers, value, DEFAULT_PORT, NULL);
+		rspamd_upstreams_set_name (rule->servers, rule->symbol);
 	}
 	if ((value = ucl_object_find_key (obj, "fuzzy_map")) != NULL) {
 		it = NULL;
@@ -527,6 +530,10 @@ fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
 
+	if (!session->replied) {
+		/* Task has been finished before we got any reply */
+		rspamd_upstream_release (session->server);
+	}
 	if (session->commands) {
 		g_ptr_array_free (session->commands, TRUE);
 	}
@@ -785,6 +792,7 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 	gint r;
 	double nval;
 	gint ret = -1;
+	struct timeval now;
 
 	if (what == EV_WRITE) {
 		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
@@ -820,7 +828,10 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 					symbol = map->symbol;
 				}
 
+				rspamd_metrics_inc (RSPAMD_METRIC_FUZZY_CHECKS, 1);
+
 				if (rep->prob > 0.5) {
+					rspamd_metrics_inc (RSPAMD_METRIC_FUZZY_HITS, 1);
 					nval = fuzzy_normalize (rep->value, session->rule->max_score);
 					nval *= rep->prob;
 					msg_info (
@@ -862,11 +873,20 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 			rspamd_upstream_name (session->server),
 			errno,
 			strerror (errno));
-		rspamd_upstream_fail (session->server);
+		if (!session->replied) {
+			session->replied = TRUE;
+			rspamd_upstream_fail (session->server);
+		}
 		remove_normal_event (session->task->s, fuzzy_io_fin, session);
 	}
 	else {
-		rspamd_upstream_ok (session->server);
+		if (!session->replied) {
+			session->replied = TRUE;
+			gettimeofday (&now, NULL);
+			rspamd_upstream_ok_latency (session->server,
+				tv_to_msec (&now) / 1000. -
+				tv_to_msec (&session->start) / 1000.);
+		}
 		if (session->commands->len == 0) {
 			remove_normal_event (session->task->s, fuzzy_io_fin, session);
 		}
@@ -1132,7 +1152,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	gint sock;
 
 	/* Get upstream */
-	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN);
+	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_LATENCY);
 	if (selected) {
 		if ((sock = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
 				SOCK_DGRAM, TRUE)) == -1) {
@@ -1140,6 +1160,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				rspamd_upstream_name (selected),
 				errno,
 				strerror (errno));
+			rspamd_upstream_fail (selected);
 		}
 		else {
 			/* Create session for a socket */
@@ -1150,6 +1171,8 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				session);
 			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
 			session->state = 0;
+			session->replied = FALSE;
+			gettimeofday (&session->start, NULL);
 			session->commands = commands;
 			session->task = task;
 			session->fd = sock;
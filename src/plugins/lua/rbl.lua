@@ -159,3 +159,7 @@ for key,rbl in pairs(opts['rbls']) do
 	rbls[key] = rbl
 end
 rspamd_config:register_callback_symbol_priority('RBL', 1.0, 0, rbl_cb)
+-- RBL checks need only SMTP data and received headers
+if type(rspamd_config.set_header_symbol) ~= 'nil' then
+	rspamd_config:set_header_symbol('RBL')
+end
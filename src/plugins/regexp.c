@@ -62,7 +62,6 @@ static const struct luaL_reg regexplib_m[] = {
 };
 
 static struct regexp_ctx *regexp_module_ctx = NULL;
-static GMutex *workers_mtx = NULL;
 
 static void process_regexp_item_threaded (gpointer data, gpointer user_data);
 static gboolean rspamd_regexp_match_number (struct rspamd_task *task,
@@ -1060,6 +1059,7 @@ rspamd_lua_call_expression_func (struct ucl_lua_funcdata *lua_data,
 struct regexp_threaded_ud {
 	struct regexp_module_item *item;
 	struct rspamd_task *task;
+	struct rspamd_async_watcher *w;
 };
 
 static void
@@ -1071,11 +1071,9 @@ process_regexp_item_threaded (gpointer data, gpointer user_data)
 	/* Process expression */
 	if (process_regexp_expression (ud->item->expr, ud->item->symbol, ud->task,
 		NULL, nL)) {
-		g_mutex_lock (workers_mtx);
 		rspamd_task_insert_result (ud->task, ud->item->symbol, 1, NULL);
-		g_mutex_unlock (workers_mtx);
 	}
-	remove_async_thread (ud->task->s);
+	remove_async_thread (ud->task->s, ud->w);
 }
 
 static void
@@ -1098,11 +1096,6 @@ process_regexp_item (struct rspamd_task *task, void *user_data)
 # else
 			g_thread_init (NULL);
 # endif
-			workers_mtx = g_mutex_new ();
-#else
-			workers_mtx = rspamd_mempool_alloc (regexp_module_ctx->regexp_pool,
-					sizeof (GMutex));
-			g_mutex_init (workers_mtx);
 #endif
 			nL = rspamd_init_lua_locked (task->cfg);
 			luaopen_regexp (nL->L);
@@ -1125,12 +1118,12 @@ process_regexp_item (struct rspamd_task *task, void *user_data)
 		thr_ud->task = task;
 
 
-		register_async_thread (task->s);
+		thr_ud->w = register_async_thread (task->s);
 		g_thread_pool_push (regexp_module_ctx->workers, thr_ud, &err);
 		if (err != NULL) {
 			msg_err ("error pushing task to the regexp thread pool: %s",
 				err->message);
-			remove_async_thread (task->s);
+			remove_async_thread (task->s, thr_ud->w);
 		}
 	}
 	else {
@@ -30,6 +30,7 @@
  * - symbol_fail (string): symbol to insert (default: 'R_SPF_FAIL')
  * - symbol_softfail (string): symbol to insert (default: 'R_SPF_SOFTFAIL')
  * - whitelist (map): map of whitelisted networks
+ * - shared_cache_size (size): size of cache shared between workers (default: 4M)
  */
 
 #include "config.h"
@@ -38,6 +39,7 @@
 #include "libserver/spf.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "main.h"
 
 #define DEFAULT_SYMBOL_FAIL "R_SPF_FAIL"
@@ -46,6 +48,7 @@
 #define DEFAULT_SYMBOL_ALLOW "R_SPF_ALLOW"
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
+#define DEFAULT_SHARED_CACHE_SIZE (4 * 1024 * 1024)
 
 struct spf_ctx {
 	gint (*filter) (struct rspamd_task * task);
@@ -57,13 +60,43 @@ struct spf_ctx {
 	rspamd_mempool_t *spf_pool;
 	radix_compressed_t *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	rspamd_shm_cache_t *shared;
 };
 
 static struct spf_ctx *spf_module_ctx = NULL;
 
+/*
+ * Resolved SPF record compiled to radix trees: each tree maps addresses to
+ * the first matching element of the record
+ */
+struct spf_compiled_elt {
+	spf_mech_t mech;
+	gboolean ipv6;
+	gboolean addr_any;
+	guint mask;
+	guint8 addr[16];
+	gchar *spf_string;
+};
+
+struct spf_compiled_prefix {
+	guint mask;
+	guint8 addr[16];
+};
+
+struct spf_compiled_record {
+	GArray *elts;
+	radix_compressed_t *tree4;
+	radix_compressed_t *tree6;
+	/* The first element that matches any address, used for non IP sources */
+	struct spf_compiled_elt *addr_any;
+};
+
 static void spf_symbol_callback (struct rspamd_task *task, void *unused);
-static GList * spf_record_copy (GList *addrs);
-static void spf_record_destroy (gpointer list);
+static struct spf_compiled_record * spf_record_compile (GList *addrs);
+static void spf_record_destroy (gpointer data);
+static GByteArray * spf_record_serialize (struct spf_compiled_record *rec);
+static struct spf_compiled_record * spf_record_deserialize (
+	const guchar *data, gsize len);
 
 /* Initialization */
 gint spf_module_init (struct rspamd_config *cfg, struct module_ctx **ctx);
@@ -81,7 +114,7 @@ module_t spf_module = {
 gint
 spf_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 {
-	spf_module_ctx = g_malloc (sizeof (struct spf_ctx));
+	spf_module_ctx = g_malloc0 (sizeof (struct spf_ctx));
 
 	spf_module_ctx->spf_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
@@ -98,6 +131,7 @@ spf_module_config (struct rspamd_config *cfg)
 	const ucl_object_t *value;
 	gint res = TRUE;
 	guint cache_size, cache_expire;
+	gsize shared_size;
 
 	spf_module_ctx->whitelist_ip = radix_create_compressed ();
 
@@ -144,6 +178,14 @@ spf_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"shared_cache_size")) != NULL) {
+		shared_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_size = DEFAULT_SHARED_CACHE_SIZE;
+	}
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "spf", "whitelist")) != NULL) {
 		if (!rspamd_map_add (cfg, ucl_obj_tostring (value),
@@ -162,6 +204,8 @@ spf_module_config (struct rspamd_config *cfg)
 	register_virtual_symbol (&cfg->cache, spf_module_ctx->symbol_softfail, 1);
 	register_virtual_symbol (&cfg->cache, spf_module_ctx->symbol_neutral,  1);
 	register_virtual_symbol (&cfg->cache, spf_module_ctx->symbol_allow,	   1);
+	/* SPF needs only sender and IP, so it can be checked before the body */
+	set_header_symbol (cfg->cache, spf_module_ctx->symbol_fail);
 
 	spf_module_ctx->spf_hash = rspamd_lru_hash_new (
 			cache_size,
@@ -169,143 +213,89 @@ spf_module_config (struct rspamd_config *cfg)
 			g_free,
 			spf_record_destroy);
 
+	/*
+	 * Shared cache is allocated once in the main process and is kept on
+	 * reconfig, so workers can use records resolved by their siblings
+	 */
+	if (spf_module_ctx->shared == NULL && shared_size > 0) {
+		spf_module_ctx->shared = rspamd_shm_cache_new (shared_size);
+	}
+
 	return res;
 }
 
 gint
 spf_module_reconfig (struct rspamd_config *cfg)
 {
+	rspamd_shm_cache_t *shared = spf_module_ctx->shared;
+
 	rspamd_mempool_delete (spf_module_ctx->spf_pool);
 	radix_destroy_compressed (spf_module_ctx->whitelist_ip);
 	memset (spf_module_ctx, 0, sizeof (*spf_module_ctx));
+	spf_module_ctx->shared = shared;
 	spf_module_ctx->spf_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
 
 	return spf_module_config (cfg);
 }
 
-static gboolean
-spf_check_element (struct spf_addr *addr, struct rspamd_task *task)
+static void
+spf_insert_result (struct spf_compiled_elt *elt, struct rspamd_task *task)
 {
-	gboolean res = FALSE;
-	guint8 *s, *d, t;
 	gchar *spf_result;
 	const gchar *spf_message, *spf_symbol;
-	guint nbits, addrlen;
-	struct in_addr in4s, in4d;
-	struct in6_addr in6s, in6d;
 	GList *opts = NULL;
 
-	/* Basic comparing algorithm */
-	if ((addr->data.normal.ipv6 && task->from_addr.af == AF_INET6) ||
-		(!addr->data.normal.ipv6 && task->from_addr.af == AF_INET)) {
-		if (addr->data.normal.ipv6) {
-			addrlen = sizeof (struct in6_addr);
-			memcpy (&in6s, &addr->data.normal.d.in6,
-				sizeof (struct in6_addr));
-			memcpy (&in6d, &task->from_addr.addr.s6.sin6_addr,
-				sizeof (struct in6_addr));
-			s = (guint8 *)&in6s;
-			d = (guint8 *)&in6d;
-		}
-		else {
-			addrlen = sizeof (struct in_addr);
-			memcpy (&in4s, &addr->data.normal.d.in4,
-				sizeof (struct in_addr));
-			memcpy (&in4d, &task->from_addr.addr.s4.sin_addr,
-				sizeof (struct in_addr));
-			s = (guint8 *)&in4s;
-			d = (guint8 *)&in4d;
-		}
-		/* Move pointers to the less significant byte */
-		t = 0x1;
-		s += addrlen - 1;
-		d += addrlen - 1;
-		/* TODO: improve this cycle by masking by words */
-		for (nbits = 0;
-			nbits < addrlen * CHAR_BIT - addr->data.normal.mask;
-			nbits++) {
-			/* Skip bits from the beginning as we know that data is in network byte order */
-			if (nbits != 0 && nbits % 8 == 0) {
-				/* Move pointer to the next byte */
-				s--;
-				d--;
-				t = 0x1;
-			}
-			*s |= t;
-			*d |= t;
-			t <<= 1;
-		}
-		if (addr->data.normal.ipv6) {
-			res = memcmp (&in6d, &in6s, sizeof (struct in6_addr)) == 0;
-		}
-		else {
-			res = memcmp (&in4d, &in4s, sizeof (struct in_addr)) == 0;
-		}
-	}
-	else {
-		if (addr->data.normal.addr_any) {
-			res = TRUE;
-		}
-		else {
-			res = FALSE;
-		}
+	if (elt->spf_string) {
+		spf_result = rspamd_mempool_strdup (task->task_pool, elt->spf_string);
+		opts = g_list_prepend (opts, spf_result);
 	}
 
-	if (res) {
-		spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
-		opts = g_list_prepend (opts, spf_result);
-		switch (addr->mech) {
-		case SPF_FAIL:
-			spf_symbol = spf_module_ctx->symbol_fail;
-			spf_message = "(SPF): spf fail";
-			break;
-		case SPF_SOFT_FAIL:
-			spf_symbol = spf_module_ctx->symbol_softfail;
-			spf_message = "(SPF): spf softfail";
-			break;
-		case SPF_NEUTRAL:
-			spf_symbol = spf_module_ctx->symbol_neutral;
-			spf_message = "(SPF): spf neutral";
-			break;
-		default:
-			spf_symbol = spf_module_ctx->symbol_allow;
-			spf_message = "(SPF): spf allow";
-			break;
-		}
-		rspamd_task_insert_result (task,
-				spf_symbol,
-				1,
-				opts);
-		task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
-		return TRUE;
+	switch (elt->mech) {
+	case SPF_FAIL:
+		spf_symbol = spf_module_ctx->symbol_fail;
+		spf_message = "(SPF): spf fail";
+		break;
+	case SPF_SOFT_FAIL:
+		spf_symbol = spf_module_ctx->symbol_softfail;
+		spf_message = "(SPF): spf softfail";
+		break;
+	case SPF_NEUTRAL:
+		spf_symbol = spf_module_ctx->symbol_neutral;
+		spf_message = "(SPF): spf neutral";
+		break;
+	default:
+		spf_symbol = spf_module_ctx->symbol_allow;
+		spf_message = "(SPF): spf allow";
+		break;
 	}
 
-	return FALSE;
+	rspamd_task_insert_result (task,
+		spf_symbol,
+		1,
+		opts);
+	task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
 }
 
 static gboolean
-spf_check_list (GList *list, struct rspamd_task *task)
+spf_check_record (struct spf_compiled_record *rec, struct rspamd_task *task)
 {
-	GList *cur;
-	struct spf_addr *addr;
+	uintptr_t res = RADIX_NO_VALUE;
 
-	cur = list;
+	if (task->from_addr.af == AF_INET) {
+		res = radix_find_compressed_addr (rec->tree4, &task->from_addr);
+	}
+	else if (task->from_addr.af == AF_INET6) {
+		res = radix_find_compressed_addr (rec->tree6, &task->from_addr);
+	}
+	else if (rec->addr_any != NULL) {
+		/* Unix socket or unknown address can match only `all` and alike */
+		res = (uintptr_t)rec->addr_any;
+	}
 
-	while (cur) {
-		addr = cur->data;
-		if (addr->is_list) {
-			/* Recursive call */
-			if (spf_check_list (addr->data.list, task)) {
-				return TRUE;
-			}
-		}
-		else {
-			if (spf_check_element (addr, task)) {
-				return TRUE;
-			}
-		}
-		cur = g_list_next (cur);
+	if (res != RADIX_NO_VALUE) {
+		spf_insert_result ((struct spf_compiled_elt *)res, task);
+		return TRUE;
 	}
 
 	return FALSE;
@@ -314,37 +304,78 @@ spf_check_list (GList *list, struct rspamd_task *task)
 static void
 spf_plugin_callback (struct spf_record *record, struct rspamd_task *task)
 {
-	GList *l;
+	struct spf_compiled_record *rec;
+	GByteArray *ser;
 
 	if (record && record->addrs && record->sender_domain) {
 
-		if ((l =
+		if ((rec =
 			rspamd_lru_hash_lookup (spf_module_ctx->spf_hash,
 			record->sender_domain, task->tv.tv_sec)) == NULL) {
-			l = spf_record_copy (record->addrs);
+			rec = spf_record_compile (record->addrs);
 			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
 				g_strdup (record->sender_domain),
-				l, task->tv.tv_sec, record->ttl);
+				rec, task->tv.tv_sec, record->ttl);
+
+			if (spf_module_ctx->shared != NULL) {
+				ser = spf_record_serialize (rec);
+				rspamd_shm_cache_insert (spf_module_ctx->shared,
+					record->sender_domain, ser->data, ser->len,
+					task->tv.tv_sec, record->ttl);
+				g_byte_array_free (ser, TRUE);
+			}
 		}
-		spf_check_list (l, task);
+		spf_check_record (rec, task);
 	}
 }
 
+/*
+ * Try to get record resolved by another worker
+ */
+static struct spf_compiled_record *
+spf_shared_lookup (const gchar *domain, struct rspamd_task *task)
+{
+	struct spf_compiled_record *rec = NULL;
+	guchar *data;
+	gsize len;
+	guint ttl;
+
+	if (spf_module_ctx->shared == NULL) {
+		return NULL;
+	}
+
+	data = rspamd_shm_cache_lookup (spf_module_ctx->shared, domain,
+			task->tv.tv_sec, &len, &ttl);
+
+	if (data != NULL) {
+		rec = spf_record_deserialize (data, len);
+		g_free (data);
+
+		if (rec != NULL) {
+			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
+				g_strdup (domain), rec, task->tv.tv_sec, ttl);
+		}
+	}
+
+	return rec;
+}
+
 
 static void
 spf_symbol_callback (struct rspamd_task *task, void *unused)
 {
 	gchar *domain;
-	GList *l;
+	struct spf_compiled_record *rec;
 
 	if (radix_find_compressed_addr (spf_module_ctx->whitelist_ip,
 			&task->from_addr) == RADIX_NO_VALUE) {
 		domain = get_spf_domain (task);
 		if (domain) {
-			if ((l =
+			if ((rec =
 				rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
-				task->tv.tv_sec)) != NULL) {
-				spf_check_list (l, task);
+				task->tv.tv_sec)) != NULL ||
+				(rec = spf_shared_lookup (domain, task)) != NULL) {
+				spf_check_record (rec, task);
 			}
 			else if (!resolve_spf (task, spf_plugin_callback)) {
 				msg_info ("cannot make spf request for [%s]", task->message_id);
@@ -354,60 +385,266 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 }
 
 /*
- * Make a deep copy of list, note copy is REVERSED
+ * Check whether prefix `a` contains prefix `b`
  */
-static GList *
-spf_record_copy (GList *addrs)
+static gboolean
+spf_prefix_covers (struct spf_compiled_prefix *a, struct spf_compiled_prefix *b)
 {
-	GList *cur, *newl = NULL;
-	struct spf_addr *addr, *newa;
+	guint bytes, bits;
+	guint8 m;
 
-	cur = addrs;
+	if (a->mask > b->mask) {
+		return FALSE;
+	}
 
-	while (cur) {
-		addr = cur->data;
-		newa = g_malloc (sizeof (struct spf_addr));
-		memcpy (newa, addr, sizeof (struct spf_addr));
-		if (addr->is_list) {
-			/* Recursive call */
-			newa->data.list = spf_record_copy (addr->data.list);
+	bytes = a->mask / CHAR_BIT;
+	bits = a->mask % CHAR_BIT;
+
+	if (memcmp (a->addr, b->addr, bytes) != 0) {
+		return FALSE;
+	}
+	if (bits != 0) {
+		m = 0xff << (CHAR_BIT - bits);
+		return (a->addr[bytes] & m) == (b->addr[bytes] & m);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Insert prefix to the tree unless it is shadowed by one of the previous
+ * elements, so longest prefix match in radix returns the first element that
+ * matches address just like sequential check of SPF record does
+ */
+static void
+spf_compiled_insert (radix_compressed_t *tree, GArray *inserted,
+	struct spf_compiled_prefix *prefix, gsize addrlen,
+	struct spf_compiled_elt *elt)
+{
+	struct spf_compiled_prefix *prev;
+	guint i;
+
+	prefix->mask = MIN (prefix->mask, addrlen * CHAR_BIT);
+
+	for (i = 0; i < inserted->len; i++) {
+		prev = &g_array_index (inserted, struct spf_compiled_prefix, i);
+
+		if (spf_prefix_covers (prev, prefix)) {
+			return;
+		}
+	}
+
+	radix_insert_compressed (tree, prefix->addr, addrlen,
+		addrlen * CHAR_BIT - prefix->mask, (uintptr_t)elt);
+	g_array_append_val (inserted, *prefix);
+}
+
+static void
+spf_record_build_trees (struct spf_compiled_record *rec)
+{
+	struct spf_compiled_elt *elt;
+	struct spf_compiled_prefix prefix;
+	GArray *inserted4, *inserted6;
+	guint i;
+
+	rec->tree4 = radix_create_compressed ();
+	rec->tree6 = radix_create_compressed ();
+	rec->addr_any = NULL;
+	inserted4 = g_array_new (FALSE, FALSE,
+			sizeof (struct spf_compiled_prefix));
+	inserted6 = g_array_new (FALSE, FALSE,
+			sizeof (struct spf_compiled_prefix));
+
+	for (i = 0; i < rec->elts->len; i++) {
+		elt = &g_array_index (rec->elts, struct spf_compiled_elt, i);
+		prefix.mask = elt->mask;
+		memcpy (prefix.addr, elt->addr, sizeof (prefix.addr));
+
+		if (elt->ipv6) {
+			spf_compiled_insert (rec->tree6, inserted6, &prefix,
+				sizeof (struct in6_addr), elt);
 		}
 		else {
-			if (addr->spf_string) {
-				newa->spf_string = g_strdup (addr->spf_string);
+			spf_compiled_insert (rec->tree4, inserted4, &prefix,
+				sizeof (struct in_addr), elt);
+		}
+
+		if (elt->addr_any) {
+			if (rec->addr_any == NULL) {
+				rec->addr_any = elt;
+			}
+			/*
+			 * Such elements (e.g. `all`) match any address of another family
+			 * as well, so they are inserted with zero mask to another tree
+			 */
+			memset (&prefix, 0, sizeof (prefix));
+
+			if (elt->ipv6) {
+				spf_compiled_insert (rec->tree4, inserted4, &prefix,
+					sizeof (struct in_addr), elt);
+			}
+			else {
+				spf_compiled_insert (rec->tree6, inserted6, &prefix,
+					sizeof (struct in6_addr), elt);
 			}
 		}
-		newl = g_list_prepend (newl, newa);
-		cur = g_list_next (cur);
 	}
 
-	return newl;
+	g_array_free (inserted4, TRUE);
+	g_array_free (inserted6, TRUE);
 }
 
 /*
- * Destroy allocated spf list
+ * Flatten record: parser prepends elements to lists, so we walk them from
+ * the tail to get the order of elements in the record
  */
-
-
 static void
-spf_record_destroy (gpointer list)
+spf_record_flatten (GList *addrs, GArray *elts)
 {
-	GList *cur = list;
+	GList *cur;
 	struct spf_addr *addr;
+	struct spf_compiled_elt elt;
 
-	while (cur) {
+	for (cur = g_list_last (addrs); cur != NULL; cur = g_list_previous (cur)) {
 		addr = cur->data;
+
 		if (addr->is_list) {
-			spf_record_destroy (addr->data.list);
+			spf_record_flatten (addr->data.list, elts);
+			continue;
+		}
+
+		memset (&elt, 0, sizeof (elt));
+		elt.mech = addr->mech;
+		elt.ipv6 = addr->data.normal.ipv6;
+		elt.addr_any = addr->data.normal.addr_any;
+		elt.mask = addr->data.normal.mask;
+
+		if (elt.ipv6) {
+			memcpy (elt.addr, &addr->data.normal.d.in6,
+				sizeof (struct in6_addr));
 		}
 		else {
-			if (addr->spf_string) {
-				g_free (addr->spf_string);
-			}
+			memcpy (elt.addr, &addr->data.normal.d.in4,
+				sizeof (struct in_addr));
+		}
+
+		if (addr->spf_string) {
+			elt.spf_string = g_strdup (addr->spf_string);
 		}
-		g_free (addr);
-		cur = g_list_next (cur);
+
+		g_array_append_val (elts, elt);
 	}
+}
+
+static struct spf_compiled_record *
+spf_record_compile (GList *addrs)
+{
+	struct spf_compiled_record *rec;
+
+	rec = g_slice_alloc0 (sizeof (*rec));
+	rec->elts = g_array_new (FALSE, FALSE, sizeof (struct spf_compiled_elt));
+	spf_record_flatten (addrs, rec->elts);
+	/* Elements must not be moved after this point */
+	spf_record_build_trees (rec);
+
+	return rec;
+}
+
+/*
+ * Destroy compiled spf record
+ */
+static void
+spf_record_destroy (gpointer data)
+{
+	struct spf_compiled_record *rec = data;
+	struct spf_compiled_elt *elt;
+	guint i;
+
+	for (i = 0; i < rec->elts->len; i++) {
+		elt = &g_array_index (rec->elts, struct spf_compiled_elt, i);
+		g_free (elt->spf_string);
+	}
+
+	g_array_free (rec->elts, TRUE);
+	radix_destroy_compressed (rec->tree4);
+	radix_destroy_compressed (rec->tree6);
+	g_slice_free1 (sizeof (*rec), rec);
+}
+
+/*
+ * Shared cache stores flattened list of elements in the order of checking,
+ * each element is stored as:
+ * <mech:1><ipv6:1><addr_any:1><mask:1><addr:16><string_len:2><string>
+ */
+#define SPF_SERIALIZED_ELT_LEN 22
+
+static GByteArray *
+spf_record_serialize (struct spf_compiled_record *rec)
+{
+	GByteArray *ar;
+	struct spf_compiled_elt *elt;
+	guint8 hdr[SPF_SERIALIZED_ELT_LEN];
+	guint16 slen;
+	guint i;
+
+	ar = g_byte_array_new ();
+
+	for (i = 0; i < rec->elts->len; i++) {
+		elt = &g_array_index (rec->elts, struct spf_compiled_elt, i);
+
+		hdr[0] = elt->mech;
+		hdr[1] = elt->ipv6;
+		hdr[2] = elt->addr_any;
+		hdr[3] = elt->mask;
+		memcpy (&hdr[4], elt->addr, sizeof (elt->addr));
+
+		slen = elt->spf_string ?
+			MIN (strlen (elt->spf_string), G_MAXUINT16) : 0;
+		memcpy (&hdr[20], &slen, sizeof (slen));
+		g_byte_array_append (ar, hdr, sizeof (hdr));
+
+		if (slen > 0) {
+			g_byte_array_append (ar, (const guint8 *)elt->spf_string, slen);
+		}
+	}
+
+	return ar;
+}
+
+static struct spf_compiled_record *
+spf_record_deserialize (const guchar *data, gsize len)
+{
+	struct spf_compiled_record *rec;
+	struct spf_compiled_elt elt;
+	const guchar *p = data, *end = data + len;
+	guint16 slen;
+
+	rec = g_slice_alloc0 (sizeof (*rec));
+	rec->elts = g_array_new (FALSE, FALSE, sizeof (struct spf_compiled_elt));
+
+	while (p + SPF_SERIALIZED_ELT_LEN <= end) {
+		memcpy (&slen, &p[20], sizeof (slen));
+
+		if (p + SPF_SERIALIZED_ELT_LEN + slen > end) {
+			break;
+		}
+
+		memset (&elt, 0, sizeof (elt));
+		elt.mech = p[0];
+		elt.ipv6 = p[1];
+		elt.addr_any = p[2];
+		elt.mask = p[3];
+		memcpy (elt.addr, &p[4], sizeof (elt.addr));
+
+		if (slen > 0) {
+			elt.spf_string = g_strndup ((const gchar *)&p[22], slen);
+		}
+
+		g_array_append_val (rec->elts, elt);
+		p += SPF_SERIALIZED_ELT_LEN + slen;
+	}
+
+	spf_record_build_trees (rec);
 
-	g_list_free (list);
+	return rec;
 }
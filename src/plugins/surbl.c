@@ -64,7 +64,6 @@ static void process_dns_results (struct rspamd_task *task,
 #define SURBL_ERROR surbl_error_quark ()
 #define WHITELIST_ERROR 0
 #define CONVERSION_ERROR 1
-#define DUPLICATE_ERROR 1
 GQuark
 surbl_error_quark (void)
 {
@@ -250,16 +249,14 @@ surbl_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 
 	surbl_module_ctx->redirector_hosts = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
-	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	/* Whitelist is not allocated from the pool */
+	rspamd_phash_destroy (surbl_module_ctx->whitelist);
+	surbl_module_ctx->whitelist = NULL;
 	/* Zero exceptions hashes */
 	surbl_module_ctx->exceptions = rspamd_mempool_alloc0 (
 		surbl_module_ctx->surbl_pool,
 		MAX_LEVELS * sizeof (GHashTable *));
 	/* Register destructors */
-	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		surbl_module_ctx->whitelist);
 	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_destroy,
 		surbl_module_ctx->redirector_hosts);
@@ -538,16 +535,12 @@ surbl_module_reconfig (struct rspamd_config *cfg)
 
 	surbl_module_ctx->redirector_hosts = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
-	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	surbl_module_ctx->whitelist = NULL;
 	/* Zero exceptions hashes */
 	surbl_module_ctx->exceptions = rspamd_mempool_alloc0 (
 		surbl_module_ctx->surbl_pool,
 		MAX_LEVELS * sizeof (GHashTable *));
 	/* Register destructors */
-	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		surbl_module_ctx->whitelist);
 	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_destroy,
 		surbl_module_ctx->redirector_hosts);
@@ -576,7 +569,7 @@ format_surbl_request (rspamd_mempool_t * pool,
 	gboolean append_suffix,
 	GError ** err,
 	gboolean forced,
-	GTree *tree,
+	gboolean *is_ip,
 	struct uri *url)
 {
 	GHashTable *t;
@@ -598,6 +591,10 @@ format_surbl_request (rspamd_mempool_t * pool,
 	}
 	len = hostname->len + slen + 2;
 
+	if (is_ip != NULL) {
+		*is_ip = FALSE;
+	}
+
 	p = hostname->begin;
 	while (p - hostname->begin < (gint)hostname->len && dots_num < MAX_LEVELS) {
 		if (*p == '.') {
@@ -618,6 +615,9 @@ format_surbl_request (rspamd_mempool_t * pool,
 			msg_info ("ignore request of ip url for list %s", suffix->symbol);
 			return NULL;
 		}
+		if (is_ip != NULL) {
+			*is_ip = TRUE;
+		}
 		result = rspamd_mempool_alloc (pool, len);
 		r = rspamd_snprintf (result, len, "%*s.%*s.%*s.%*s",
 				(gint)(hostname->len - (dots[2] - hostname->begin + 1)),
@@ -650,6 +650,9 @@ format_surbl_request (rspamd_mempool_t * pool,
 			return NULL;
 		}
 
+		if (is_ip != NULL) {
+			*is_ip = TRUE;
+		}
 		len = sizeof ("255.255.255.255") + slen;
 		result = rspamd_mempool_alloc (pool, len);
 		/* Hack for bugged windows resolver */
@@ -714,22 +717,8 @@ format_surbl_request (rspamd_mempool_t * pool,
 	url->surbl = result;
 	url->surbllen = r;
 
-	if (tree != NULL) {
-		if (g_tree_lookup (tree, result) != NULL) {
-			msg_debug ("url %s is already registered", result);
-			g_set_error (err, SURBL_ERROR, /* error domain */
-				DUPLICATE_ERROR,        /* error code */
-				"URL is duplicated: %s",        /* error message format string */
-				result);
-			return NULL;
-		}
-		else {
-			g_tree_insert (tree, result, result);
-		}
-	}
-
 	if (!forced &&
-		g_hash_table_lookup (surbl_module_ctx->whitelist, result) != NULL) {
+		rspamd_phash_lookup (surbl_module_ctx->whitelist, result) != NULL) {
 		msg_debug ("url %s is whitelisted", result);
 		g_set_error (err, SURBL_ERROR, /* error domain */
 			WHITELIST_ERROR,                /* error code */
@@ -753,43 +742,115 @@ format_surbl_request (rspamd_mempool_t * pool,
 	return result;
 }
 
-static void
-make_surbl_requests (struct uri *url, struct rspamd_task *task,
-	struct suffix_item *suffix, gboolean forced, GTree *tree)
+/*
+ * Add host of the url to the task stage. Hosts are normalized once per task
+ * and shared by all suffixes, so the same name is never checked twice
+ */
+static struct surbl_host *
+surbl_stage_add_url (struct surbl_task_stage *stage, struct uri *url)
 {
-	gchar *surbl_req;
+	struct rspamd_task *task = stage->task;
+	struct surbl_host *h;
 	rspamd_fstring_t f;
 	GError *err = NULL;
-	struct dns_param *param;
+	gchar *host;
+	gboolean is_ip;
+
+	if (url->hostlen <= 0) {
+		return NULL;
+	}
+
+	if (g_hash_table_size (stage->hosts) >= surbl_module_ctx->max_urls) {
+		debug_task ("too many hosts to check, skip url %s", struri (url));
+		return NULL;
+	}
 
 	f.begin = url->host;
 	f.len = url->hostlen;
 
-	if ((surbl_req = format_surbl_request (task->task_pool, &f, suffix, TRUE,
-		&err, forced, tree, url)) != NULL) {
-		param =
-			rspamd_mempool_alloc (task->task_pool, sizeof (struct dns_param));
-		param->url = url;
-		param->task = task;
-		param->suffix = suffix;
-		param->host_resolve =
-			rspamd_mempool_strdup (task->task_pool, surbl_req);
-		debug_task ("send surbl dns request %s", surbl_req);
-		if (make_dns_request (task->resolver, task->s, task->task_pool,
-			dns_callback,
-			(void *)param, RDNS_REQUEST_A, surbl_req)) {
-			task->dns_requests++;
+	host = format_surbl_request (task->task_pool, &f, NULL, FALSE, &err,
+			FALSE, &is_ip, url);
+
+	if (host == NULL) {
+		if (err != NULL) {
+			if (err->code != WHITELIST_ERROR) {
+				msg_info ("cannot format url string for surbl %s, %s",
+					struri (url), err->message);
+			}
+			g_error_free (err);
 		}
+		return NULL;
+	}
+
+	if (g_hash_table_lookup (stage->hosts, host) != NULL) {
+		debug_task ("url %s is already registered", host);
+		return NULL;
+	}
+
+	h = rspamd_mempool_alloc (task->task_pool, sizeof (struct surbl_host));
+	h->host = host;
+	h->is_ip = is_ip;
+	h->url = url;
+	g_hash_table_insert (stage->hosts, host, h);
+
+	return h;
+}
+
+static void
+surbl_send_request (struct surbl_task_stage *stage, struct surbl_host *h,
+	struct suffix_item *suffix)
+{
+	struct rspamd_task *task = stage->task;
+	struct dns_param *param;
+	gchar *surbl_req;
+	gsize len;
+
+	if (h->is_ip && (suffix->options & SURBL_OPTION_NOIP) != 0) {
+		debug_task ("ignore request of ip url for list %s", suffix->symbol);
+		return;
 	}
-	else if (err != NULL && err->code != WHITELIST_ERROR && err->code !=
-		DUPLICATE_ERROR) {
-		msg_info ("cannot format url string for surbl %s, %s", struri (
-				url), err->message);
-		g_error_free (err);
+
+	len = strlen (h->host) + strlen (suffix->suffix) + 2;
+	surbl_req = rspamd_mempool_alloc (task->task_pool, len);
+	rspamd_snprintf (surbl_req, len, "%s.%s", h->host, suffix->suffix);
+
+	if (rspamd_dns_cached_negative (task->resolver, RDNS_REQUEST_A,
+		surbl_req)) {
+		/* Negative answer is cached by some worker, skip the request */
+		debug_task ("<%s> domain [%s] is not in surbl %s (cached)",
+			task->message_id, h->host, suffix->suffix);
 		return;
 	}
-	else if (err != NULL) {
-		g_error_free (err);
+
+	param = rspamd_mempool_alloc (task->task_pool, sizeof (struct dns_param));
+	param->url = h->url;
+	param->task = task;
+	param->suffix = suffix;
+	param->host_resolve = surbl_req;
+	debug_task ("send surbl dns request %s", surbl_req);
+	if (make_dns_request (task->resolver, task->s, task->task_pool,
+		dns_callback,
+		(void *)param, RDNS_REQUEST_A, surbl_req)) {
+		task->dns_requests++;
+	}
+}
+
+/*
+ * Check host resolved after the initial burst (e.g. by a redirector) in all
+ * suffixes
+ */
+static void
+surbl_stage_check_url (struct surbl_task_stage *stage, struct uri *url)
+{
+	struct surbl_host *h;
+	GList *cur;
+
+	if ((h = surbl_stage_add_url (stage, url)) != NULL) {
+		cur = surbl_module_ctx->suffixes;
+		while (cur) {
+			surbl_send_request (stage, h, cur->data);
+			cur = g_list_next (cur);
+		}
 	}
 }
 
@@ -925,11 +986,7 @@ redirector_callback (gint fd, short what, void *arg)
 				msg_err ("read failed: %s from %s", strerror (
 						errno), rspamd_upstream_name (param->redirector));
 				rspamd_upstream_fail (param->redirector);
-				make_surbl_requests (param->url,
-					param->task,
-					param->suffix,
-					FALSE,
-					param->tree);
+				surbl_stage_check_url (param->stage, param->url);
 				remove_normal_event (param->task->s,
 					free_redirector_session,
 					param);
@@ -959,11 +1016,7 @@ redirector_callback (gint fd, short what, void *arg)
 							c), param->task->task_pool);
 					if (r == URI_ERRNO_OK || r == URI_ERRNO_NO_SLASHES || r ==
 						URI_ERRNO_NO_HOST_SLASH) {
-						make_surbl_requests (param->url,
-							param->task,
-							param->suffix,
-							FALSE,
-							param->tree);
+						surbl_stage_check_url (param->stage, param->url);
 					}
 				}
 			}
@@ -985,10 +1038,11 @@ redirector_callback (gint fd, short what, void *arg)
 }
 
 
-static void
-register_redirector_call (struct uri *url, struct rspamd_task *task,
-	struct suffix_item *suffix, const gchar *rule, GTree *tree)
+static gboolean
+register_redirector_call (struct uri *url, struct surbl_task_stage *stage,
+	const gchar *rule)
 {
+	struct rspamd_task *task = stage->task;
 	gint s = -1;
 	struct redirector_param *param;
 	struct timeval *timeout;
@@ -1006,8 +1060,7 @@ register_redirector_call (struct uri *url, struct rspamd_task *task,
 		msg_info ("<%s> cannot create tcp socket failed: %s",
 			task->message_id,
 			strerror (errno));
-		make_surbl_requests (url, task, suffix, FALSE, tree);
-		return;
+		return FALSE;
 	}
 
 	param =
@@ -1017,10 +1070,9 @@ register_redirector_call (struct uri *url, struct rspamd_task *task,
 	param->task = task;
 	param->state = STATE_CONNECT;
 	param->sock = s;
-	param->suffix = suffix;
+	param->stage = stage;
 	param->redirector = selected;
 	param->buf = g_string_sized_new (1024);
-	param->tree = tree;
 	timeout = rspamd_mempool_alloc (task->task_pool, sizeof (struct timeval));
 	double_to_tv (surbl_module_ctx->connect_timeout, timeout);
 	event_set (&param->ev, s, EV_WRITE, redirector_callback, (void *)param);
@@ -1036,20 +1088,23 @@ register_redirector_call (struct uri *url, struct rspamd_task *task,
 		struri (url),
 		rspamd_upstream_name (param->redirector),
 		rule);
+
+	return TRUE;
 }
 
 static gboolean
 surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 {
-	struct redirector_param *param = data;
+	struct surbl_task_stage *stage = data;
 	struct rspamd_task *task;
 	struct uri *url = value;
+	struct surbl_host *h;
 	gchar *red_domain;
 	const gchar *pos;
 	GRegex *re;
 	guint idx, len;
 
-	task = param->task;
+	task = stage->task;
 	debug_task ("check url %s", struri (url));
 
 	if (url->hostlen <= 0) {
@@ -1080,45 +1135,77 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 						g_regex_match (re, url->string, 0, NULL))) {
 						/* If no regexp found or founded regexp matches url string register redirector's call */
 						if (surbl_module_ctx->redirector_symbol != NULL) {
-							rspamd_task_insert_result (param->task,
+							rspamd_task_insert_result (task,
 								surbl_module_ctx->redirector_symbol,
 								1,
 								g_list_prepend (NULL, red_domain));
 						}
-						register_redirector_call (url,
-							param->task,
-							param->suffix,
-							red_domain,
-							param->tree);
-						return FALSE;
+						if (register_redirector_call (url, stage,
+							red_domain)) {
+							return FALSE;
+						}
 					}
 				}
 			}
 		}
-		make_surbl_requests (url, param->task, param->suffix, FALSE,
-			param->tree);
 	}
-	else {
-		make_surbl_requests (url, param->task, param->suffix, FALSE,
-			param->tree);
+
+	if ((h = surbl_stage_add_url (stage, url)) != NULL) {
+		g_ptr_array_add (stage->pending, h);
 	}
 
 	return FALSE;
 }
 
+/*
+ * All suffixes share a single per task stage: the first suffix callback called
+ * for a task collects and normalizes hosts of all urls once and sends requests
+ * for every enabled suffix in one burst, the rest of callbacks have nothing
+ * to do
+ */
 static void
 surbl_test_url (struct rspamd_task *task, void *user_data)
 {
-	struct redirector_param param;
-	struct suffix_item *suffix = user_data;
+	struct surbl_task_stage *stage;
+	struct surbl_host *h;
+	struct suffix_item *suffix;
+	GList *cur;
+	guint i;
+
+	if (rspamd_mempool_get_variable (task->task_pool,
+		SURBL_STAGE_VARIABLE) != NULL) {
+		return;
+	}
 
-	param.task = task;
-	param.suffix = suffix;
-	param.tree = g_tree_new ((GCompareFunc)strcmp);
+	stage = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct surbl_task_stage));
+	stage->task = task;
+	stage->hosts = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
 	rspamd_mempool_add_destructor (task->task_pool,
-		(rspamd_mempool_destruct_t)g_tree_destroy,
-		param.tree);
-	g_tree_foreach (task->urls, surbl_tree_url_callback, &param);
+		(rspamd_mempool_destruct_t)g_hash_table_destroy,
+		stage->hosts);
+	rspamd_mempool_set_variable (task->task_pool, SURBL_STAGE_VARIABLE,
+		stage, NULL);
+
+	stage->pending = g_ptr_array_new ();
+	g_tree_foreach (task->urls, surbl_tree_url_callback, stage);
+
+	cur = surbl_module_ctx->suffixes;
+	while (cur) {
+		suffix = cur->data;
+		/* Callbacks of skipped symbols are not called, so check them here */
+		if (is_symbol_enabled (task->cfg->cache, suffix->symbol)) {
+			for (i = 0; i < stage->pending->len; i++) {
+				h = g_ptr_array_index (stage->pending, i);
+				surbl_send_request (stage, h, suffix);
+			}
+		}
+		cur = g_list_next (cur);
+	}
+
+	g_ptr_array_free (stage->pending, TRUE);
+	stage->pending = NULL;
 }
 /*
  * Handlers of URLS command
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "libutil/trie.h"
+#include "libutil/phash.h"
 #include "main.h"
 
 #define DEFAULT_REDIRECTOR_PORT 8080
@@ -15,6 +16,7 @@
 #define DEFAULT_SURBL_SUFFIX "multi.surbl.org"
 #define SURBL_OPTION_NOIP 1
 #define MAX_LEVELS 10
+#define SURBL_STAGE_VARIABLE "surbl_stage"
 
 struct surbl_ctx {
 	gint (*filter)(struct rspamd_task *task);
@@ -29,7 +31,7 @@ struct surbl_ctx {
 	const gchar *whitelist_file;
 	const gchar *redirector_symbol;
 	GHashTable **exceptions;
-	GHashTable *whitelist;
+	rspamd_phash_t *whitelist;
 	GHashTable *redirector_hosts;
 	rspamd_trie_t *redirector_trie;
 	GPtrArray *redirector_ptrs;
@@ -52,6 +54,20 @@ struct dns_param {
 	struct suffix_item *suffix;
 };
 
+/* Normalized host checked in all suffixes */
+struct surbl_host {
+	gchar *host;
+	gboolean is_ip;
+	struct uri *url;
+};
+
+/* Per task state shared by all suffixes */
+struct surbl_task_stage {
+	struct rspamd_task *task;
+	GHashTable *hosts;
+	GPtrArray *pending;
+};
+
 struct redirector_param {
 	struct uri *url;
 	struct rspamd_task *task;
@@ -63,8 +79,7 @@ struct redirector_param {
 	GString *buf;
 	struct event ev;
 	gint sock;
-	GTree *tree;
-	struct suffix_item *suffix;
+	struct surbl_task_stage *stage;
 };
 
 struct surbl_bit_item {
@@ -468,26 +468,28 @@ smtp_dnsbl_cb (struct rdns_reply *reply, void *arg)
 	struct smtp_proxy_session *session = arg;
 	const gchar *p;
 	gint dots = 0;
-	const struct rdns_request_name *req_name;
+	const gchar *req_name;
 
 	session->rbl_requests--;
 
-	req_name = rdns_request_get_name (reply->request, NULL);
+	req_name = rspamd_dns_reply_name (reply);
 
-	msg_debug ("got reply for %s: %s", req_name[0].name,
+	msg_debug ("got reply for %s: %s", req_name,
 		rdns_strerror (reply->code));
 
 	if (session->state != SMTP_PROXY_STATE_REJECT) {
 
-		if (reply->code == RDNS_RC_NOERROR) {
+		if (reply->code == RDNS_RC_NOERROR && req_name != NULL) {
 			/* This means that address is in dnsbl */
-			p = req_name[0].name;
+			p = req_name;
 			while (*p) {
 				if (*p == '.') {
 					dots++;
 				}
 				if (dots == 4) {
-					session->dnsbl_applied = (gchar *)p + 1;
+					/* Name is not valid after this callback */
+					session->dnsbl_applied = rspamd_mempool_strdup (session->pool,
+							p + 1);
 					break;
 				}
 				p++;
@@ -30,6 +30,8 @@
 #include "libutil/util.h"
 #include "libutil/map.h"
 #include "libutil/upstream.h"
+#include "libutil/msgpack.h"
+#include "libserver/tasklog.h"
 #include "libserver/protocol.h"
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
@@ -45,6 +47,8 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+/* Messages of a batch processed simultaneously */
+#define DEFAULT_BATCH_CONCURRENCY 16
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -74,6 +78,10 @@ struct rspamd_worker_ctx {
 	gboolean is_json;
 	/* Allow learning throught worker				*/
 	gboolean allow_learn;
+	/* Start processing before the whole body is received */
+	gboolean streaming;
+	/* Maximum number of batch messages processed simultaneously */
+	guint32 batch_concurrency;
 	/* DNS resolver */
 	struct rspamd_dns_resolver *resolver;
 	/* Current tasks */
@@ -86,6 +94,8 @@ struct rspamd_worker_ctx {
 	GThreadPool *classify_pool;
 	/* Events base */
 	struct event_base *ev_base;
+	/* Binary log of tasks timings */
+	rspamd_tasklog_t *tasklog;
 };
 
 /*
@@ -99,26 +109,402 @@ reduce_tasks_count (gpointer arg)
 	(*tasks)--;
 }
 
-static gint
-rspamd_worker_body_handler (struct rspamd_http_connection *conn,
-	struct rspamd_http_message *msg,
-	const gchar *chunk, gsize len)
+static gboolean
+rspamd_worker_handle_request (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
 {
-	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
-	struct rspamd_worker_ctx *ctx;
-
-	ctx = task->worker->ctx;
-
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		task->state = WRITE_REPLY;
-		return 0;
+		return FALSE;
 	}
 
 	if (task->cmd == CMD_PING) {
 		task->state = WRITE_REPLY;
-		return 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Batch processing: the body of a request consists of several messages
+ * each of them is prefixed with its length in decimal form followed by a
+ * newline. Messages are processed concurrently within the worker and each
+ * result is written back as a separate HTTP chunk as soon as it is ready.
+ * Every chunk starts with a line `<index> <length>` followed by the reply
+ * for the message with that index.
+ */
+struct rspamd_worker_batch_item {
+	const gchar *begin;
+	gsize len;
+};
+
+struct rspamd_worker_batch {
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+	struct rspamd_worker_ctx *ctx;
+	GArray *items;
+	guint next;
+	guint running;
+	GList *running_tasks;
+	GList *finished_tasks;
+	gboolean started;
+	gboolean done;
+	struct event process_ev;
+};
+
+struct rspamd_worker_batch_entry {
+	struct rspamd_worker_batch *batch;
+	struct rspamd_task *task;
+	guint idx;
+	gboolean replied;
+	struct event timeout_ev;
+};
+
+static gboolean
+rspamd_worker_batch_parse (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_worker_batch_item item;
+	const gchar *p, *end;
+	gchar *err_str;
+	gulong len;
+
+	p = batch->msg->body->str;
+	end = p + batch->msg->body->len;
+
+	while (p < end) {
+		if (g_ascii_isspace (*p)) {
+			p++;
+			continue;
+		}
+
+		errno = 0;
+		len = strtoul (p, &err_str, 10);
+		if (err_str == p || errno != 0) {
+			return FALSE;
+		}
+
+		p = err_str;
+		if (p < end && *p == '\r') {
+			p++;
+		}
+		if (p >= end || *p != '\n') {
+			return FALSE;
+		}
+		p++;
+
+		if (len == 0 || len > (gulong)(end - p)) {
+			return FALSE;
+		}
+
+		item.begin = p;
+		item.len = len;
+		g_array_append_val (batch->items, item);
+		p += len;
+	}
+
+	return batch->items->len > 0;
+}
+
+static void rspamd_worker_batch_schedule (struct rspamd_worker_batch *batch);
+
+static void
+rspamd_worker_batch_task_reply (struct rspamd_worker_batch_entry *entry)
+{
+	struct rspamd_worker_batch *batch = entry->batch;
+	struct rspamd_task *task = entry->task;
+	struct rspamd_http_message *msg;
+	ucl_object_t *top;
+	GString *chunk;
+
+	if (entry->replied) {
+		/* Timed out task that has finished afterwards */
+		return;
+	}
+
+	entry->replied = TRUE;
+	if (event_pending (&entry->timeout_ev, EV_TIMEOUT, NULL)) {
+		event_del (&entry->timeout_ev);
+	}
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+
+	if (task->error_code != 0) {
+		msg->body = g_string_sized_new (128);
+		if (task->is_msgpack) {
+			rspamd_msgpack_write_map (msg->body, 1);
+			rspamd_msgpack_write_string (msg->body, "error");
+			rspamd_msgpack_write_string (msg->body, task->last_error);
+		}
+		else {
+			top = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (top,
+				ucl_object_fromstring (task->last_error),
+				"error", 0, false);
+			rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, msg->body);
+			ucl_object_unref (top);
+		}
+	}
+	else {
+		rspamd_protocol_http_reply (msg, task);
+	}
+
+	chunk = g_string_sized_new (msg->body->len + 32);
+	rspamd_printf_gstring (chunk, "%ud %z\n", entry->idx, msg->body->len);
+	g_string_append_len (chunk, msg->body->str, msg->body->len);
+	rspamd_http_connection_write_chunk (batch->task->http_conn,
+		chunk->str, chunk->len);
+	g_string_free (chunk, TRUE);
+	rspamd_http_message_free (msg);
+
+	/* Task itself is destroyed on the next loop iteration */
+	batch->running--;
+	batch->running_tasks = g_list_remove (batch->running_tasks, task);
+	batch->finished_tasks = g_list_prepend (batch->finished_tasks, task);
+	rspamd_worker_batch_schedule (batch);
+}
+
+static gboolean
+rspamd_worker_batch_task_fin (void *arg)
+{
+	struct rspamd_worker_batch_entry *entry = arg;
+
+	rspamd_worker_batch_task_reply (entry);
+
+	return TRUE;
+}
+
+/*
+ * A message that is not processed in time is replied with an error, so that
+ * it cannot stall the whole batch
+ */
+static void
+rspamd_worker_batch_task_timeout (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_batch_entry *entry = ud;
+	struct rspamd_task *task = entry->task;
+
+	msg_info ("processing of message %ud from batch of %s has timed out",
+		entry->idx,
+		rspamd_inet_address_to_string (&task->client_addr));
+	task->error_code = RSPAMD_FILTER_ERROR;
+	task->last_error = "processing timed out";
+	rspamd_worker_batch_task_reply (entry);
+}
+
+static void
+rspamd_worker_batch_entry_dtor (gpointer ud)
+{
+	struct rspamd_worker_batch_entry *entry = ud;
+
+	if (event_pending (&entry->timeout_ev, EV_TIMEOUT, NULL)) {
+		event_del (&entry->timeout_ev);
+	}
+}
+
+static void
+rspamd_worker_batch_start_task (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_worker_batch_item *item;
+	struct rspamd_worker_batch_entry *entry;
+	struct rspamd_worker_ctx *ctx = batch->ctx;
+	struct rspamd_task *task;
+	struct rspamd_http_message submsg;
+	GString *body;
+
+	item = &g_array_index (batch->items, struct rspamd_worker_batch_item,
+			batch->next);
+
+	task = rspamd_task_new (batch->task->worker);
+	task->cmd = CMD_SYMBOLS;
+	task->is_mime = batch->task->is_mime;
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+	memcpy (&task->client_addr, &batch->task->client_addr,
+		sizeof (task->client_addr));
+	ctx->tasks++;
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t)reduce_tasks_count, &ctx->tasks);
+
+	entry = rspamd_mempool_alloc0 (task->task_pool, sizeof (*entry));
+	entry->batch = batch;
+	entry->task = task;
+	entry->idx = batch->next++;
+	evtimer_set (&entry->timeout_ev, rspamd_worker_batch_task_timeout, entry);
+	event_base_set (ctx->ev_base, &entry->timeout_ev);
+	event_add (&entry->timeout_ev, &ctx->io_tv);
+	rspamd_mempool_add_destructor (task->task_pool,
+		rspamd_worker_batch_entry_dtor, entry);
+
+	/* Message must be zero terminated, so copy it to the task's pool */
+	body = rspamd_mempool_alloc (task->task_pool, sizeof (GString));
+	body->str = rspamd_mempool_alloc (task->task_pool, item->len + 1);
+	memcpy (body->str, item->begin, item->len);
+	body->str[item->len] = '\0';
+	body->len = item->len;
+	body->allocated_len = item->len + 1;
+
+	task->s = new_async_session (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, rspamd_task_free_hard, task);
+	task->fin_callback = rspamd_worker_batch_task_fin;
+	task->fin_arg = entry;
+	rspamd_tasklog_task_start (ctx->tasklog, task);
+
+	batch->running++;
+	batch->running_tasks = g_list_prepend (batch->running_tasks, task);
+
+	/* All messages share the headers of the batch request */
+	memcpy (&submsg, batch->msg, sizeof (submsg));
+	submsg.body = body;
+
+	if (!rspamd_task_process (task, &submsg, ctx->classify_pool, TRUE)) {
+		if (task->error_code == 0) {
+			task->error_code = RSPAMD_FILTER_ERROR;
+		}
+		rspamd_worker_batch_task_reply (entry);
+	}
+	else {
+		check_session_pending (task->s);
+	}
+}
+
+static void
+rspamd_worker_batch_process (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+	struct rspamd_worker_ctx *ctx = batch->ctx;
+	struct rspamd_http_message *msg;
+	struct rspamd_task *task;
+	GList *cur;
+	gchar ctype[64];
+
+	if (!batch->started) {
+		/* Results are sent as chunks of a single reply */
+		batch->started = TRUE;
+		msg = rspamd_http_new_message (HTTP_RESPONSE);
+		msg->code = 200;
+		msg->date = time (NULL);
+		rspamd_snprintf (ctype, sizeof (ctype), "%s; format=%s",
+			RSPAMD_BATCH_CTYPE,
+			batch->task->is_msgpack ? "msgpack" : "json");
+		rspamd_http_connection_write_chunked (batch->task->http_conn, msg,
+			ctype, batch->task, batch->task->sock, &ctx->io_tv, ctx->ev_base);
+		rspamd_http_message_free (msg);
+	}
+
+	/* Free finished tasks */
+	cur = batch->finished_tasks;
+	batch->finished_tasks = NULL;
+	while (cur) {
+		task = cur->data;
+		destroy_session (task->s);
+		cur = g_list_delete_link (cur, cur);
+	}
+
+	/* Start new tasks up to the concurrency limit */
+	while (batch->next < batch->items->len &&
+		(ctx->batch_concurrency == 0 ||
+		batch->running < ctx->batch_concurrency)) {
+		rspamd_worker_batch_start_task (batch);
 	}
 
+	if (batch->finished_tasks != NULL) {
+		/* Some tasks have finished synchronously */
+		rspamd_worker_batch_schedule (batch);
+	}
+	else if (batch->running == 0 && batch->next >= batch->items->len &&
+		!batch->done) {
+		batch->done = TRUE;
+		/* Connection is closed once the last chunk is written */
+		batch->task->state = CLOSING_CONNECTION;
+		rspamd_http_connection_write_chunk (batch->task->http_conn, NULL, 0);
+	}
+}
+
+static void
+rspamd_worker_batch_schedule (struct rspamd_worker_batch *batch)
+{
+	struct timeval tv = {0, 0};
+
+	if (!event_pending (&batch->process_ev, EV_TIMEOUT, NULL)) {
+		event_add (&batch->process_ev, &tv);
+	}
+}
+
+static void
+rspamd_worker_batch_dtor (gpointer ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+	struct rspamd_task *task;
+	GList *cur;
+
+	event_del (&batch->process_ev);
+
+	/* Terminate all tasks that are still in progress */
+	cur = batch->running_tasks;
+	batch->running_tasks = NULL;
+	while (cur) {
+		task = cur->data;
+		destroy_session (task->s);
+		cur = g_list_delete_link (cur, cur);
+	}
+
+	cur = batch->finished_tasks;
+	batch->finished_tasks = NULL;
+	while (cur) {
+		task = cur->data;
+		destroy_session (task->s);
+		cur = g_list_delete_link (cur, cur);
+	}
+
+	g_array_free (batch->items, TRUE);
+}
+
+static void
+rspamd_worker_batch_start (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_worker_batch *batch;
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
+
+	batch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*batch));
+	batch->task = task;
+	batch->msg = msg;
+	batch->ctx = ctx;
+	batch->items = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_worker_batch_item));
+	event_set (&batch->process_ev, -1, EV_TIMEOUT, rspamd_worker_batch_process,
+		batch);
+	event_base_set (ctx->ev_base, &batch->process_ev);
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_worker_batch_dtor,
+		batch);
+
+	if (!rspamd_worker_batch_parse (batch)) {
+		msg_err ("got invalid batch request from %s",
+			rspamd_inet_address_to_string (&task->client_addr));
+		task->last_error = "invalid batch request";
+		task->error_code = 400;
+		task->state = WRITE_REPLY;
+		return;
+	}
+
+	msg_info ("got batch of %ud messages from %s", batch->items->len,
+		rspamd_inet_address_to_string (&task->client_addr));
+	/* Timings are logged for each message of the batch */
+	task->tasklog = NULL;
+
+	task->state = WAIT_FILTER;
+	rspamd_worker_batch_schedule (batch);
+}
+
+static gint
+rspamd_worker_process_body (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_worker_ctx *ctx;
+
+	ctx = task->worker->ctx;
+
 	if (msg->body->len == 0) {
 		msg_err ("got zero length body, cannot continue");
 		task->last_error = "message's body is empty";
@@ -127,6 +513,11 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 
+	if (task->cmd == CMD_BATCH) {
+		rspamd_worker_batch_start (task, msg);
+		return 0;
+	}
+
 	if (!rspamd_task_process (task, msg, ctx->classify_pool, TRUE)) {
 		task->state = WRITE_REPLY;
 	}
@@ -134,6 +525,52 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+static gint
+rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+
+	if (!rspamd_worker_handle_request (task, msg)) {
+		return 0;
+	}
+
+	return rspamd_worker_process_body (task, msg);
+}
+
+/*
+ * Called for each portion of body in the streaming mode: as soon as the
+ * headers block is here we can start checks that depend on headers only
+ * (and mostly wait for DNS) while the rest of the message is being received
+ */
+static gint
+rspamd_worker_stream_body_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+
+	if (task->state != READ_MESSAGE) {
+		/* Just read the rest of message */
+		return 0;
+	}
+
+	if (msg->body->len == len) {
+		/* The first portion of body */
+		if (!rspamd_worker_handle_request (task, msg)) {
+			return 0;
+		}
+	}
+
+	if (task->cmd != CMD_SKIP && task->cmd != CMD_OTHER &&
+		task->cmd != CMD_BATCH) {
+		rspamd_task_process_headers (task, msg, len);
+	}
+
+	return 0;
+}
+
 static void
 rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
@@ -151,6 +588,22 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 
+	if (task->state == READ_MESSAGE &&
+		(conn->opts & RSPAMD_HTTP_BODY_PARTIAL)) {
+		/* Streaming mode: the whole message has been received */
+		if (msg->body->len == 0) {
+			rspamd_worker_body_handler (conn, msg, NULL, 0);
+		}
+		else {
+			rspamd_worker_process_body (task, msg);
+		}
+	}
+
+	if (task->cmd == CMD_BATCH && task->state == WAIT_FILTER) {
+		/* Batch replies are written by the batch itself */
+		return 0;
+	}
+
 	if (task->state == CLOSING_CONNECTION || task->state == WRITING_REPLY) {
 		/* We are done here */
 		msg_debug ("normally closing connection from: %s",
@@ -226,12 +679,22 @@ accept_socket (gint fd, short what, void *arg)
 	worker->srv->stat->connections_count++;
 	new_task->resolver = ctx->resolver;
 
-	new_task->http_conn = rspamd_http_connection_new (
-		rspamd_worker_body_handler,
-		rspamd_worker_error_handler,
-		rspamd_worker_finish_handler,
-		0,
-		RSPAMD_HTTP_SERVER);
+	if (ctx->streaming) {
+		new_task->http_conn = rspamd_http_connection_new (
+			rspamd_worker_stream_body_handler,
+			rspamd_worker_error_handler,
+			rspamd_worker_finish_handler,
+			RSPAMD_HTTP_BODY_PARTIAL,
+			RSPAMD_HTTP_SERVER);
+	}
+	else {
+		new_task->http_conn = rspamd_http_connection_new (
+			rspamd_worker_body_handler,
+			rspamd_worker_error_handler,
+			rspamd_worker_finish_handler,
+			0,
+			RSPAMD_HTTP_SERVER);
+	}
 	new_task->ev_base = ctx->ev_base;
 	ctx->tasks++;
 	rspamd_mempool_add_destructor (new_task->task_pool,
@@ -242,6 +705,7 @@ accept_socket (gint fd, short what, void *arg)
 			rspamd_task_restore, rspamd_task_free_hard, new_task);
 
 	new_task->classify_pool = ctx->classify_pool;
+	rspamd_tasklog_task_start (ctx->tasklog, new_task);
 
 	rspamd_http_connection_read_message (new_task->http_conn,
 		new_task,
@@ -263,6 +727,7 @@ init_worker (struct rspamd_config *cfg)
 	ctx->is_mime = TRUE;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->classify_threads = 1;
+	ctx->batch_concurrency = DEFAULT_BATCH_CONCURRENCY;
 
 	rspamd_rcl_register_worker_option (cfg, type, "mime",
 		rspamd_rcl_parse_struct_boolean, ctx,
@@ -280,6 +745,15 @@ init_worker (struct rspamd_config *cfg)
 		rspamd_rcl_parse_struct_boolean, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx, allow_learn), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "streaming",
+		rspamd_rcl_parse_struct_boolean, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx, streaming), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "batch_concurrency",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		batch_concurrency), RSPAMD_CL_FLAG_INT_32);
+
 	rspamd_rcl_register_worker_option (cfg, type, "timeout",
 		rspamd_rcl_parse_struct_time, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
@@ -336,8 +810,14 @@ start_worker (struct rspamd_worker *worker)
 		}
 	}
 
+	if (worker->srv->cfg->task_log != NULL) {
+		ctx->tasklog = rspamd_tasklog_open (worker->srv->cfg->task_log,
+				worker->srv->cfg->task_log_size);
+	}
+
 	event_base_loop (ctx->ev_base, 0);
 
+	rspamd_tasklog_close (ctx->tasklog);
 	g_mime_shutdown ();
 	rspamd_log_close (rspamd_main->logger);
 	exit (EXIT_SUCCESS);
@@ -91,3 +91,64 @@ rspamd_dkim_test_func ()
 
 	event_base_loop (base, 0);
 }
+
+static const gchar test_dkim_msg[] = "From: test@highsecure.ru\r\n"
+		"To: test@example.com\r\n"
+		"Subject: test\r\n"
+		"\r\n"
+		"Hello world\r\n";
+
+static const gchar test_dkim_body[] = "Hello world\r\n";
+
+/* Signatures differ in domain and selector, the last one in body canon */
+static const gchar *test_dkim_body_sigs[] = {
+	"v=1; a=rsa-sha256; c=relaxed/relaxed; d=highsecure.ru; s=dkim; "
+	"bh=guFoWYHWVzFRqVyAQebnvPcdm7bUQo7pRHt/uIHD7gs=; h=From:To:Subject; "
+	"b=PCiECkOaPFb99DW+gApgfmdlTUo6XN6YXjnj52Cxoz2FoA857B0ZHFgeQe4JAKHu;",
+	"v=1; a=rsa-sha256; c=relaxed/relaxed; d=example.com; s=mail; "
+	"bh=guFoWYHWVzFRqVyAQebnvPcdm7bUQo7pRHt/uIHD7gs=; h=From:Subject; "
+	"b=PCiECkOaPFb99DW+gApgfmdlTUo6XN6YXjnj52Cxoz2FoA857B0ZHFgeQe4JAKHu;",
+	"v=1; a=rsa-sha256; c=relaxed/simple; d=example.com; s=mail; "
+	"bh=guFoWYHWVzFRqVyAQebnvPcdm7bUQo7pRHt/uIHD7gs=; h=From:Subject; "
+	"b=PCiECkOaPFb99DW+gApgfmdlTUo6XN6YXjnj52Cxoz2FoA857B0ZHFgeQe4JAKHu;"
+};
+
+void
+rspamd_dkim_body_hash_test_func ()
+{
+	rspamd_dkim_context_t *ctx[G_N_ELEMENTS (test_dkim_body_sigs)];
+	const guint8 *bh[G_N_ELEMENTS (test_dkim_body_sigs)];
+	struct rspamd_task task;
+	guint8 expected[32];
+	gsize dlen, elen = sizeof (expected);
+	GChecksum *ck;
+	GError *err = NULL;
+	guint i;
+
+	memset (&task, 0, sizeof (task));
+	task.task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	task.msg = g_string_new (test_dkim_msg);
+
+	ck = g_checksum_new (G_CHECKSUM_SHA256);
+	g_checksum_update (ck, test_dkim_body, sizeof (test_dkim_body) - 1);
+	g_checksum_get_digest (ck, expected, &elen);
+	g_checksum_free (ck);
+
+	for (i = 0; i < G_N_ELEMENTS (test_dkim_body_sigs); i++) {
+		ctx[i] = rspamd_create_dkim_context (test_dkim_body_sigs[i],
+				task.task_pool, 0, &err);
+		g_assert (ctx[i] != NULL);
+
+		bh[i] = rspamd_dkim_prepare_body (ctx[i], &task, &dlen);
+		g_assert (bh[i] != NULL);
+		g_assert (dlen == elen);
+		g_assert (memcmp (bh[i], expected, dlen) == 0);
+	}
+
+	/* The same body canonicalization shares a single hash */
+	g_assert (bh[0] == bh[1]);
+	g_assert (bh[0] != bh[2]);
+
+	g_string_free (task.msg, TRUE);
+	rspamd_mempool_delete (task.task_pool);
+}
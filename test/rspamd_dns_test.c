@@ -27,11 +27,10 @@ static void
 test_dns_cb (struct rdns_reply *reply, gpointer arg)
 {
 	struct rdns_reply_entry *cur;
-	const struct rdns_request_name *name =
-			rdns_request_get_name (reply->request, NULL);
+	const gchar *name = rspamd_dns_reply_name (reply);
 
 	msg_debug ("got reply with code %s for request %s",
-			rdns_strerror (reply->code), name->name);
+			rdns_strerror (reply->code), name);
 	if (reply->code == RDNS_RC_NOERROR) {
 		cur = reply->entries;
 		while (cur) {
@@ -86,6 +85,10 @@ rspamd_dns_test_func ()
 
 	requests ++;
 	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_A, "google.com"));
+	/* Identical request must be attached to the pending one */
+	requests ++;
+	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_A, "google.com"));
+	g_assert (g_hash_table_size (resolver->inflight) == 1);
 	requests ++;
 	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_PTR, "81.19.70.3"));
 	requests ++;
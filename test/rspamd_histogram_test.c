@@ -0,0 +1,73 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "histogram.h"
+
+void
+rspamd_histogram_test_func (void)
+{
+	struct rspamd_histogram h;
+	guint32 v, p;
+	guint i;
+
+	memset (&h, 0, sizeof (h));
+	g_assert (rspamd_histogram_percentile (&h, 50) == 0);
+
+	/* Bounds of buckets are strictly increasing and cover all values */
+	for (i = 1; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		g_assert (rspamd_histogram_bucket_bound (i - 1) <
+			rspamd_histogram_bucket_bound (i));
+	}
+	g_assert (rspamd_histogram_bucket_bound (RSPAMD_HISTOGRAM_BUCKETS - 1) ==
+		G_MAXUINT32);
+
+	for (i = 1; i <= 100; i ++) {
+		rspamd_histogram_add (&h, i);
+	}
+
+	g_assert (h.count == 100);
+	g_assert (h.sum == 5050);
+	g_assert (h.max == 100);
+	p = rspamd_histogram_percentile (&h, 50);
+	g_assert (p >= 50 && p <= 50 + 50 / 8);
+	p = rspamd_histogram_percentile (&h, 90);
+	g_assert (p >= 90 && p <= 90 + 90 / 8);
+	/* The highest percentile is limited by the maximum value */
+	g_assert (rspamd_histogram_percentile (&h, 100) == 100);
+
+	rspamd_histogram_reset (&h);
+	g_assert (h.count == 0 && h.max == 0);
+	g_assert (rspamd_histogram_percentile (&h, 50) == 0);
+
+	/* Relative error of a bucket is less than 1/8 */
+	for (v = 1; v < G_MAXUINT32 / 3; v = v * 3 + 1) {
+		rspamd_histogram_reset (&h);
+		rspamd_histogram_add (&h, v);
+		rspamd_histogram_add (&h, G_MAXUINT32);
+		p = rspamd_histogram_percentile (&h, 50);
+		g_assert (p >= v);
+		g_assert (p - v <= v / 8);
+	}
+}
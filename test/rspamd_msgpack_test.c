@@ -0,0 +1,92 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "msgpack.h"
+
+void
+rspamd_msgpack_test_func (void)
+{
+	GString *buf;
+	ucl_object_t *top;
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	GError *err = NULL;
+	gchar longstr[300];
+	gint64 ints[] = {0, 1, 127, 128, 255, 256, 65535, 65536, G_MAXUINT32,
+		(gint64)G_MAXUINT32 + 1, -1, -32, -33, -128, -129, -32768, -32769,
+		G_MININT32, (gint64)G_MININT32 - 1};
+	guint i;
+
+	memset (longstr, 'a', sizeof (longstr) - 1);
+	longstr[sizeof (longstr) - 1] = '\0';
+
+	buf = g_string_new (NULL);
+	rspamd_msgpack_write_map (buf, 5);
+	rspamd_msgpack_write_string (buf, "ints");
+	rspamd_msgpack_write_array (buf, G_N_ELEMENTS (ints));
+	for (i = 0; i < G_N_ELEMENTS (ints); i ++) {
+		rspamd_msgpack_write_int (buf, ints[i]);
+	}
+	rspamd_msgpack_write_string (buf, "score");
+	rspamd_msgpack_write_double (buf, 5.5);
+	rspamd_msgpack_write_string (buf, "is_spam");
+	rspamd_msgpack_write_bool (buf, TRUE);
+	rspamd_msgpack_write_string (buf, "long");
+	rspamd_msgpack_write_string (buf, longstr);
+	rspamd_msgpack_write_string (buf, "nil");
+	rspamd_msgpack_write_nil (buf);
+
+	top = rspamd_msgpack_to_ucl ((const guchar *)buf->str, buf->len, &err);
+	g_assert (top != NULL);
+	g_assert (err == NULL);
+
+	elt = ucl_object_find_key (top, "ints");
+	g_assert (elt != NULL && elt->type == UCL_ARRAY);
+	i = 0;
+	while ((cur = ucl_iterate_object (elt, &it, true)) != NULL) {
+		g_assert (i < G_N_ELEMENTS (ints));
+		g_assert (ucl_object_toint (cur) == ints[i]);
+		i ++;
+	}
+	g_assert (i == G_N_ELEMENTS (ints));
+	elt = ucl_object_find_key (top, "score");
+	g_assert (elt != NULL && ucl_object_todouble (elt) == 5.5);
+	elt = ucl_object_find_key (top, "is_spam");
+	g_assert (elt != NULL && ucl_object_toboolean (elt));
+	elt = ucl_object_find_key (top, "long");
+	g_assert (elt != NULL);
+	g_assert (strcmp (ucl_object_tostring (elt), longstr) == 0);
+	elt = ucl_object_find_key (top, "nil");
+	g_assert (elt != NULL && elt->type == UCL_NULL);
+	ucl_object_unref (top);
+
+	/* Truncated input must be rejected */
+	top = rspamd_msgpack_to_ucl ((const guchar *)buf->str, buf->len - 1, &err);
+	g_assert (top == NULL);
+	g_assert (err != NULL);
+	g_error_free (err);
+
+	g_string_free (buf, TRUE);
+}
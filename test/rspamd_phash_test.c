@@ -0,0 +1,132 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "phash.h"
+
+static rspamd_phash_t *
+rspamd_phash_test_new (GByteArray *image)
+{
+	rspamd_phash_t *ph;
+	gsize len;
+
+	g_assert (image != NULL);
+	len = image->len;
+	ph = rspamd_phash_new (g_byte_array_free (image, FALSE), len, FALSE);
+	g_assert (ph != NULL);
+
+	return ph;
+}
+
+static void
+rspamd_phash_test_count (const gchar *key, const gchar *value, gpointer ud)
+{
+	guint *cnt = ud;
+
+	g_assert (value != NULL);
+	(*cnt) ++;
+}
+
+void
+rspamd_phash_test_func (void)
+{
+	rspamd_phash_t *ph, *other;
+	GHashTable *tbl, *added, *deleted;
+	GByteArray *image;
+	gchar key[32], val[32];
+	guint i, cnt = 0;
+
+	tbl = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	g_hash_table_insert (tbl, g_strdup ("Example.com"), g_strdup ("1"));
+	g_hash_table_insert (tbl, g_strdup ("test.org"), g_strdup (""));
+	ph = rspamd_phash_test_new (rspamd_phash_build (tbl));
+
+	/* Keys are case insensitive */
+	g_assert (rspamd_phash_size (ph) == 2);
+	g_assert_cmpstr (rspamd_phash_lookup (ph, "EXAMPLE.COM"), ==, "1");
+	g_assert_cmpstr (rspamd_phash_lookup (ph, "test.org"), ==, "");
+	g_assert (rspamd_phash_lookup (ph, "missing.net") == NULL);
+	rspamd_phash_foreach (ph, rspamd_phash_test_count, &cnt);
+	g_assert (cnt == 2);
+
+	/* Delta overrides base */
+	added = g_hash_table_new (g_str_hash, g_str_equal);
+	deleted = g_hash_table_new (g_str_hash, g_str_equal);
+	g_hash_table_insert (added, "new.com", "2");
+	g_hash_table_insert (added, "example.com", "3");
+	g_hash_table_insert (deleted, "test.org", NULL);
+	image = rspamd_phash_build_delta (ph, added, deleted);
+	g_assert (image != NULL);
+	g_assert (rspamd_phash_attach_delta (ph, image->data, image->len, FALSE));
+	g_byte_array_free (image, FALSE);
+	g_assert (rspamd_phash_get_delta (ph) != NULL);
+
+	g_assert_cmpstr (rspamd_phash_lookup (ph, "new.com"), ==, "2");
+	g_assert_cmpstr (rspamd_phash_lookup (ph, "example.com"), ==, "3");
+	g_assert (rspamd_phash_lookup (ph, "test.org") == NULL);
+	g_assert_cmpstr (rspamd_phash_lookup_base (ph, "test.org"), ==, "");
+	g_assert (rspamd_phash_lookup_base (ph, "new.com") == NULL);
+
+	/* Delta built for another base is rejected */
+	other = rspamd_phash_test_new (rspamd_phash_build (tbl));
+	image = rspamd_phash_build_delta (other, added, deleted);
+	g_assert (image != NULL);
+	g_assert (!rspamd_phash_attach_delta (ph, image->data, image->len, FALSE));
+	g_byte_array_free (image, TRUE);
+	g_assert_cmpstr (rspamd_phash_lookup (ph, "new.com"), ==, "2");
+	rspamd_phash_destroy (other);
+
+	/* Delete delta */
+	g_assert (rspamd_phash_attach_delta (ph, NULL, 0, FALSE));
+	g_assert (rspamd_phash_get_delta (ph) == NULL);
+	g_assert_cmpstr (rspamd_phash_lookup (ph, "test.org"), ==, "");
+	g_assert (rspamd_phash_lookup (ph, "new.com") == NULL);
+	rspamd_phash_destroy (ph);
+	g_hash_table_unref (added);
+	g_hash_table_unref (deleted);
+
+	/* Large hash uses bloom filter that must not reject existing keys */
+	g_hash_table_remove_all (tbl);
+	for (i = 0; i < 5000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud.com", i);
+		rspamd_snprintf (val, sizeof (val), "%ud", i);
+		g_hash_table_insert (tbl, g_strdup (key), g_strdup (val));
+	}
+	ph = rspamd_phash_test_new (rspamd_phash_build (tbl));
+	g_assert (rspamd_phash_size (ph) == 5000);
+
+	for (i = 0; i < 5000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud.com", i);
+		rspamd_snprintf (val, sizeof (val), "%ud", i);
+		g_assert_cmpstr (rspamd_phash_lookup (ph, key), ==, val);
+		rspamd_snprintf (key, sizeof (key), "nokey%ud.com", i);
+		g_assert (rspamd_phash_lookup (ph, key) == NULL);
+	}
+	rspamd_phash_destroy (ph);
+	g_hash_table_unref (tbl);
+
+	/* Invalid images */
+	memset (key, 0, sizeof (key));
+	g_assert (rspamd_phash_new (key, sizeof (key), FALSE) == NULL);
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "shm_cache.h"
+
+void
+rspamd_shm_cache_test_func (void)
+{
+	rspamd_shm_cache_t *cache;
+	guchar *data, big[2000];
+	gchar key[32];
+	gsize len;
+	guint ttl, i, hits = 0;
+
+	memset (big, 'x', sizeof (big));
+	cache = rspamd_shm_cache_new (64 * 1024);
+	g_assert (cache != NULL);
+
+	/* Small and large values are stored in different slabs */
+	g_assert (rspamd_shm_cache_insert (cache, "example.com",
+		(const guchar *)"value", 5, 100, 10));
+	g_assert (rspamd_shm_cache_insert (cache, "example.net",
+		big, sizeof (big), 100, 10));
+
+	data = rspamd_shm_cache_lookup (cache, "example.com", 105, &len, &ttl);
+	g_assert (data != NULL);
+	g_assert (len == 5 && ttl == 5);
+	g_assert (memcmp (data, "value", len) == 0);
+	g_free (data);
+
+	data = rspamd_shm_cache_lookup (cache, "example.net", 105, &len, &ttl);
+	g_assert (data != NULL);
+	g_assert (len == sizeof (big));
+	g_free (data);
+
+	/* Expired and unknown keys */
+	g_assert (rspamd_shm_cache_lookup (cache, "example.com", 110, &len,
+		NULL) == NULL);
+	g_assert (rspamd_shm_cache_lookup (cache, "example.org", 100, &len,
+		NULL) == NULL);
+
+	/* Fresher value should win if a key has moved to another slab */
+	g_assert (rspamd_shm_cache_insert (cache, "example.com",
+		big, 1000, 100, 50));
+	data = rspamd_shm_cache_lookup (cache, "example.com", 105, &len, &ttl);
+	g_assert (data != NULL);
+	g_assert (len == 1000 && ttl == 45);
+	g_free (data);
+
+	/* Overflow cache: values must be evicted but never mixed */
+	for (i = 0; i < 10000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud.com", i);
+		rspamd_shm_cache_insert (cache, key, (const guchar *)key, strlen (key),
+			100, 100);
+	}
+	for (i = 0; i < 10000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud.com", i);
+		data = rspamd_shm_cache_lookup (cache, key, 101, &len, NULL);
+
+		if (data != NULL) {
+			g_assert (len == strlen (key));
+			g_assert (memcmp (data, key, len) == 0);
+			g_free (data);
+			hits ++;
+		}
+	}
+	g_assert (hits > 0);
+
+	rspamd_shm_cache_destroy (cache);
+}
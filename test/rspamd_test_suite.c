@@ -52,9 +52,14 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/dns", rspamd_dns_test_func);
 	g_test_add_func ("/rspamd/aio", rspamd_async_test_func);
 	g_test_add_func ("/rspamd/dkim", rspamd_dkim_test_func);
+	g_test_add_func ("/rspamd/dkim_body_hash", rspamd_dkim_body_hash_test_func);
 	g_test_add_func ("/rspamd/rrd", rspamd_rrd_test_func);
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
+	g_test_add_func ("/rspamd/msgpack", rspamd_msgpack_test_func);
+	g_test_add_func ("/rspamd/shm_cache", rspamd_shm_cache_test_func);
+	g_test_add_func ("/rspamd/histogram", rspamd_histogram_test_func);
+	g_test_add_func ("/rspamd/phash", rspamd_phash_test_func);
 
 	g_test_run ();
 
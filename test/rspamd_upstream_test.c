@@ -51,6 +51,33 @@ rspamd_upstream_test_method (struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_test_distribution (struct upstream_list *ls, gint rounds,
+		gint expected_ms, gint expected_google, gint expected_kernel)
+{
+	struct upstream *up;
+	gint i, ms = 0, google = 0, kernel = 0;
+
+	for (i = 0; i < rounds; i ++) {
+		up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_ROUND_ROBIN);
+		g_assert (up != NULL);
+
+		if (strcmp (rspamd_upstream_name (up), "microsoft.com") == 0) {
+			ms ++;
+		}
+		else if (strcmp (rspamd_upstream_name (up), "google.com") == 0) {
+			google ++;
+		}
+		else {
+			kernel ++;
+		}
+	}
+
+	g_assert (ms == expected_ms);
+	g_assert (google == expected_google);
+	g_assert (kernel == expected_kernel);
+}
+
 static void
 rspamd_upstream_timeout_handler (int fd, short what, void *arg)
 {
@@ -103,6 +130,8 @@ rspamd_upstream_test_func (void)
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "microsoft.com");
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "google.com");
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "kernel.org");
+	/* Each full round must follow weights exactly */
+	rspamd_upstream_test_distribution (ls, 600, 100, 200, 300);
 
 	/* Test stable hashing */
 	nls = rspamd_upstreams_create ();
@@ -153,6 +182,45 @@ rspamd_upstream_test_func (void)
 	}
 	rspamd_upstreams_destroy (nls);
 
+	/*
+	 * Test latency rotation: the fast upstream should be preferred unless it
+	 * has too many requests in flight
+	 */
+	nls = rspamd_upstreams_create ();
+	g_assert (rspamd_upstreams_add_upstream (nls, "127.0.0.1", 0, NULL));
+	g_assert (rspamd_upstreams_add_upstream (nls, "127.0.0.2", 0, NULL));
+	success = 0;
+
+	for (i = 0; i < 1000; i ++) {
+		up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY);
+		g_assert (up != NULL);
+
+		if (strcmp (rspamd_upstream_name (up), "127.0.0.1") == 0) {
+			rspamd_upstream_ok_latency (up, 0.001);
+			success ++;
+		}
+		else {
+			rspamd_upstream_ok_latency (up, 1.0);
+		}
+	}
+
+	/* Slow upstream can be selected only until it gets its latency sample */
+	g_assert (success >= 998);
+
+	for (i = 0; i < 2000; i ++) {
+		up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY);
+		g_assert (up != NULL);
+
+		if (strcmp (rspamd_upstream_name (up), "127.0.0.2") == 0) {
+			rspamd_upstream_release (up);
+			break;
+		}
+	}
+
+	/* Fast upstream costs more than the slow one with ~1000 requests in flight */
+	g_assert (i > 900 && i < 1100);
+	rspamd_upstreams_destroy (nls);
+
 	/* Upstream fail test */
 	evtimer_set (&ev, rspamd_upstream_timeout_handler, resolver);
 	event_base_set (ev_base, &ev);
@@ -160,6 +228,8 @@ rspamd_upstream_test_func (void)
 	up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_MASTER_SLAVE);
 	rspamd_upstream_fail (up);
 	g_assert (rspamd_upstreams_alive (ls) == 2);
+	/* Round robin should skip the failed upstream */
+	rspamd_upstream_test_distribution (ls, 30, 10, 20, 0);
 
 	tv.tv_sec = 2;
 	tv.tv_usec = 0;
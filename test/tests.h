@@ -32,6 +32,8 @@ void rspamd_async_test_func (void);
 /* DKIM test */
 void rspamd_dkim_test_func (void);
 
+void rspamd_dkim_body_hash_test_func (void);
+
 /* RRD test */
 void rspamd_rrd_test_func (void);
 
@@ -39,4 +41,12 @@ void rspamd_upstream_test_func (void);
 
 void rspamd_shingles_test_func (void);
 
+void rspamd_msgpack_test_func (void);
+
+void rspamd_shm_cache_test_func (void);
+
+void rspamd_histogram_test_func (void);
+
+void rspamd_phash_test_func (void);
+
 #endif
@@ -0,0 +1,171 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark of kvstorage expire policies: replays a Zipfian trace of keys with
+ * periodic scans of cold keys against LRU and W-TinyLFU storages and prints
+ * hit ratio and operations per second. Each miss inserts the key.
+ *
+ * It is not built by default, use `make kvstorage-bench` to build it.
+ *
+ * Usage: kvstorage_bench [-k keys] [-c capacity] [-n operations] [-s skew]
+ *                        [-S scan_every]
+ */
+
+#include "config.h"
+#include "kvstorage.h"
+#include "main.h"
+#include <math.h>
+
+static guint nkeys = 100000;
+static guint capacity = 10000;
+static guint nops = 2000000;
+static gdouble skew = 0.99;
+static guint scan_every = 100000;
+
+static GOptionEntry entries[] = {
+	{ "keys", 'k', 0, G_OPTION_ARG_INT, &nkeys,
+	  "Number of distinct keys in trace", NULL },
+	{ "capacity", 'c', 0, G_OPTION_ARG_INT, &capacity,
+	  "Maximum number of elements in storage", NULL },
+	{ "operations", 'n', 0, G_OPTION_ARG_INT, &nops,
+	  "Number of operations", NULL },
+	{ "skew", 's', 0, G_OPTION_ARG_DOUBLE, &skew,
+	  "Skew of Zipfian distribution", NULL },
+	{ "scan", 'S', 0, G_OPTION_ARG_INT, &scan_every,
+	  "Make a scan of capacity cold keys every N operations (0 to disable)",
+	  NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+/*
+ * Generate trace of key numbers, numbers above nkeys are cold keys of scans
+ */
+static guint *
+generate_trace (void)
+{
+	gdouble *cdf, sum = 0, r;
+	guint *trace, i, lo, hi, mid, scan_key = nkeys;
+
+	cdf = g_malloc (nkeys * sizeof (gdouble));
+	for (i = 0; i < nkeys; i++) {
+		sum += 1.0 / pow (i + 1, skew);
+		cdf[i] = sum;
+	}
+
+	trace = g_malloc (nops * sizeof (guint));
+	for (i = 0; i < nops; i++) {
+		if (scan_every > 0 && i % scan_every >= scan_every - capacity) {
+			/* One-off keys */
+			trace[i] = scan_key++;
+			continue;
+		}
+
+		r = g_random_double () * sum;
+		lo = 0;
+		hi = nkeys - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (cdf[mid] < r) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		trace[i] = lo;
+	}
+
+	g_free (cdf);
+
+	return trace;
+}
+
+static void
+run_trace (const gchar *name, expire_create expire_new, guint *trace)
+{
+	struct rspamd_kv_storage *storage;
+	struct rspamd_kv_element *elt;
+	gchar key[32];
+	guint i, keylen, hits = 0;
+	struct timespec ts1, ts2;
+	gdouble elapsed;
+	time_t now = time (NULL);
+
+	storage = rspamd_kv_storage_new (0, name, rspamd_kv_hash_new, NULL,
+			expire_new, 1, capacity, 0, FALSE);
+
+	clock_gettime (CLOCK_MONOTONIC, &ts1);
+	for (i = 0; i < nops; i++) {
+		keylen = rspamd_snprintf (key, sizeof (key), "key%ud", trace[i]);
+		elt = rspamd_kv_storage_lookup (storage, key, keylen, now);
+		rspamd_kv_storage_release (storage, key, keylen);
+
+		if (elt != NULL) {
+			hits++;
+		}
+		else {
+			rspamd_kv_storage_insert (storage, key, keylen, "value",
+				sizeof ("value") - 1, 0, 0);
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &ts2);
+
+	elapsed = (ts2.tv_sec - ts1.tv_sec) +
+		(ts2.tv_nsec - ts1.tv_nsec) / 1000000000.;
+	rspamd_printf ("%s: hit ratio %.4f, %.0f ops/sec\n", name,
+		(gdouble)hits / nops, nops / elapsed);
+
+	rspamd_kv_storage_destroy (storage);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	guint *trace;
+
+	context = g_option_context_new ("- benchmark kvstorage expire policies");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (nkeys == 0 || capacity == 0 || nops == 0) {
+		rspamd_fprintf (stderr, "invalid parameters\n");
+		exit (EXIT_FAILURE);
+	}
+
+	trace = generate_trace ();
+	rspamd_printf ("keys: %ud, capacity: %ud, operations: %ud, skew: %.2f\n",
+		nkeys, capacity, nops, skew);
+	run_trace ("lru", rspamd_lru_expire_new, trace);
+	run_trace ("tinylfu", rspamd_tinylfu_expire_new, trace);
+
+	g_free (trace);
+
+	return 0;
+}
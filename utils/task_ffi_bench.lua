@@ -0,0 +1,95 @@
+-- Benchmark of task accessors: compares classic task methods with the FFI
+-- based accessors from `rspamd_task_ffi` library.
+--
+-- Load this file as a lua module in rspamd configuration:
+--
+-- modules {
+--   path = "/path/to/task_ffi_bench.lua";
+-- }
+--
+-- and scan some messages. For each task, every accessor is called
+-- `iterations` times using both paths and accumulated timings are written to
+-- the log every `report` tasks.
+
+local rspamd_logger = require "rspamd_logger"
+local task_ffi = require "rspamd_task_ffi"
+
+local iterations = 100
+local report = 100
+local headers = {'Received', 'Subject', 'From', 'X-Mailer'}
+
+local timings = {}
+local ntasks = 0
+
+local tests = {
+	get_header = function(impl, task)
+		for _,h in ipairs(headers) do
+			impl.get_header(task, h, false)
+		end
+	end,
+	headers = function(impl, task)
+		for _,h in ipairs(headers) do
+			for name, value in impl.headers(task, h, false) do
+				local _ = #value
+			end
+		end
+	end,
+	urls = function(impl, task)
+		for host in impl.urls(task) do
+			local _ = #host
+		end
+	end,
+	text_parts = function(impl, task)
+		for content, is_html in impl.text_parts(task) do
+			local _ = #content
+		end
+	end,
+	get_from_ip = function(impl, task)
+		impl.get_from_ip(task)
+	end,
+}
+
+local function bench(name, impl, test, task)
+	local start = os.clock()
+
+	for i = 1, iterations do
+		test(impl, task)
+	end
+
+	timings[name] = (timings[name] or 0) + os.clock() - start
+end
+
+local function print_report()
+	for name,_ in pairs(tests) do
+		local classic = timings['classic:' .. name] or 0
+		local fast = timings['ffi:' .. name] or 0
+		local ratio = 0
+
+		if fast > 0 then
+			ratio = classic / fast
+		end
+
+		rspamd_logger.info(string.format(
+			'%s: classic %.3f s, ffi %.3f s, speedup %.2f (%d tasks)',
+			name, classic, fast, ratio, ntasks))
+	end
+end
+
+local function bench_task(task)
+	for name,test in pairs(tests) do
+		bench('classic:' .. name, task_ffi.classic, test, task)
+		bench('ffi:' .. name, task_ffi, test, task)
+	end
+
+	ntasks = ntasks + 1
+
+	if ntasks % report == 0 then
+		print_report()
+	end
+end
+
+if not task_ffi.ffi then
+	rspamd_logger.info('LuaJIT FFI is not available, both paths are classic')
+end
+
+rspamd_config:register_symbol('TASK_FFI_BENCH', 0.0, bench_task)
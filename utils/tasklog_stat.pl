@@ -0,0 +1,165 @@
+#!/usr/bin/perl
+
+# Aggregate binary task logs written by rspamd workers (see `task_log` option)
+# and print percentiles of processing phases, CPU time and symbols timings.
+#
+# Usage: tasklog_stat.pl [-s <symbols>] [-p <percentiles>] file ...
+
+use warnings;
+use strict;
+
+use Getopt::Std;
+
+my $magic = "rsptlog\0";
+my @phases = qw(read mime filters events classify reply);
+my $file_header_len = 24;
+my $record_header_len = 8;
+my $task_len = 56;
+
+my %opts;
+getopts('s:p:h', \%opts);
+
+if ($opts{'h'} || !@ARGV) {
+	print STDERR "Usage: $0 [-s <symbols>] [-p <percentiles>] file ...\n";
+	print STDERR "  -s  number of the slowest symbols to show (default: 20)\n";
+	print STDERR "  -p  comma separated list of percentiles (default: 50,90,99)\n";
+	exit(1);
+}
+
+my $nsymbols = defined($opts{'s'}) ? $opts{'s'} : 20;
+my @percentiles = split(/,/, $opts{'p'} || '50,90,99');
+
+my %timings;
+my %symbols;
+my $tasks = 0;
+
+sub add_timing {
+	my ($name, $value) = @_;
+
+	push(@{ $timings{$name} }, $value);
+}
+
+sub read_file {
+	my ($file) = @_;
+	my $data;
+	my %names;
+
+	open(my $fh, '<', $file) or die "cannot open $file: $!";
+	binmode($fh);
+	local $/;
+	$data = <$fh>;
+	close($fh);
+
+	if (length($data) < $file_header_len ||
+		substr($data, 0, 8) ne $magic) {
+		warn "$file is not a task log, skipping\n";
+		return;
+	}
+
+	my $pos = $file_header_len;
+
+	while ($pos + $record_header_len <= length($data)) {
+		my ($type, undef, $len) = unpack('S S L',
+			substr($data, $pos, $record_header_len));
+
+		last if $len == 0 || $pos + $len > length($data);
+
+		my $body = substr($data, $pos + $record_header_len,
+			$len - $record_header_len);
+
+		if ($type == 1) {
+			my ($id, $name) = unpack('L Z*', $body);
+			$names{$id} = $name;
+		}
+		elsif ($type == 2) {
+			my ($start, @fields) = unpack('Q L6 L L L L l f', $body);
+			my @marks = @fields[0 .. 5];
+			my ($cpu, $bytes, $dns, $nsyms) = @fields[6 .. 9];
+			my $prev = 0;
+
+			for (my $i = 0; $i < @phases; $i++) {
+				next unless $marks[$i];
+				add_timing($phases[$i], $marks[$i] - $prev);
+				$prev = $marks[$i];
+			}
+
+			add_timing('total', $prev) if $prev;
+			add_timing('cpu', $cpu);
+			add_timing('bytes', $bytes);
+			add_timing('dns_requests', $dns);
+
+			for (my $i = 0; $i < $nsyms; $i++) {
+				my ($id, $usec) = unpack('L L',
+					substr($body, $task_len + $i * 8, 8));
+				my $name = $names{$id} || "unknown($id)";
+				push(@{ $symbols{$name} }, $usec);
+			}
+
+			$tasks++;
+		}
+
+		$pos += $len;
+	}
+}
+
+sub percentile {
+	my ($sorted, $p) = @_;
+	my $idx = int($p / 100.0 * (@$sorted - 1) + 0.5);
+
+	return $sorted->[$idx];
+}
+
+sub print_row {
+	my ($name, $values) = @_;
+	my @sorted = sort { $a <=> $b } @$values;
+
+	printf("%-24s %8d", $name, scalar(@sorted));
+	foreach my $p (@percentiles) {
+		printf(" %10d", percentile(\@sorted, $p));
+	}
+	printf(" %10d\n", $sorted[-1]);
+}
+
+sub print_header {
+	my ($title) = @_;
+
+	printf("%-24s %8s", $title, 'count');
+	foreach my $p (@percentiles) {
+		printf(" %10s", "p$p");
+	}
+	printf(" %10s\n", 'max');
+}
+
+foreach my $file (@ARGV) {
+	read_file($file);
+}
+
+print "Tasks: $tasks\n\n";
+exit(0) unless $tasks;
+
+print_header('phase (usec)');
+foreach my $name (@phases, 'total', 'cpu') {
+	print_row($name, $timings{$name}) if $timings{$name};
+}
+print "\n";
+print_header('task');
+foreach my $name ('bytes', 'dns_requests') {
+	print_row($name, $timings{$name}) if $timings{$name};
+}
+
+if ($nsymbols > 0 && %symbols) {
+	my %p99;
+
+	foreach my $name (keys %symbols) {
+		my @sorted = sort { $a <=> $b } @{ $symbols{$name} };
+		$p99{$name} = percentile(\@sorted, 99);
+	}
+
+	print "\n";
+	print_header('symbol (usec)');
+	my @slowest = sort { $p99{$b} <=> $p99{$a} } keys %p99;
+	splice(@slowest, $nsymbols) if @slowest > $nsymbols;
+	foreach my $name (@slowest) {
+		print_row($name, $symbols{$name});
+	}
+}